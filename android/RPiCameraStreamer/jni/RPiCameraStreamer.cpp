@@ -43,9 +43,14 @@ static jmethodID set_message_method_id;
 static jmethodID set_error_method_id;
 static jmethodID notify_state_method_id;
 static jmethodID on_gstreamer_initialized_method_id;
+static jmethodID on_frame_method_id; /* optional */
 
 static unsigned char rpi_ip[4];
 static unsigned int rpi_port;
+static int rpi_tcp; /* camera_server connects to us and sends RTP over TCP */
+static int srtp_on; /* the server takes a secret, its stream is SRTP */
+static unsigned char srtp_master[28]; /* key and salt from the handshake */
+static int srtp_have_key;
 /*
  * Private methods
  */
@@ -189,6 +194,35 @@ static void check_initialization_complete (CustomData *data) {
   }
 }
 
+/* The RTP timestamp of each frame as its last packet goes into the depayloader, for the telemetry sampled with it */
+static GstPadProbeReturn frame_probe (GstPad *pad, GstPadProbeInfo *info, gpointer userdata) {
+  CustomData *data = (CustomData *)userdata;
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstMapInfo map;
+
+  if (!buf || !gst_buffer_map (buf, &map, GST_MAP_READ)) return GST_PAD_PROBE_OK;
+  /* marker bit, timestamp at 4 */
+  if (map.size >= 12 && (map.data[1] & 0x80)) {
+    jint ts = map.data[4] << 24 | map.data[5] << 16 | map.data[6] << 8 | map.data[7];
+    JNIEnv *env = get_jni_env ();
+    (*env).CallVoidMethod (data->app, on_frame_method_id, ts);
+    if ((*env).ExceptionCheck ()) (*env).ExceptionClear ();
+  }
+  gst_buffer_unmap (buf, &map);
+  return GST_PAD_PROBE_OK;
+}
+
+/* srtpdec asks for each new SSRC: the layers and after a reconnection */
+static GstCaps *request_key (GstElement *srtpdec, guint ssrc, gpointer userdata) {
+  if (!srtp_have_key) return NULL; /* dropped until the handshake is done */
+  GstBuffer *key = gst_buffer_new_wrapped (g_memdup (srtp_master, sizeof (srtp_master)), sizeof (srtp_master));
+  GstCaps *caps = gst_caps_new_simple ("application/x-srtp", "srtp-key", GST_TYPE_BUFFER, key,
+    "srtp-cipher", G_TYPE_STRING, "aes-128-gcm", "srtp-auth", G_TYPE_STRING, "aes-128-gcm",
+    "srtcp-cipher", G_TYPE_STRING, "aes-128-gcm", "srtcp-auth", G_TYPE_STRING, "aes-128-gcm", NULL);
+  gst_buffer_unref (key);
+  return caps;
+}
+
 /* Main method for the native code. This is executed on its own thread. */
 static void *app_function (void *userdata) {
   JavaVMAttachArgs args;
@@ -205,9 +239,13 @@ static void *app_function (void *userdata) {
 
   /* Build pipeline */
 
-  char pipeline[256];
-  //sprintf(pipeline,"tcpserversrc host=%i.%i.%i.%i port=%i ! gdpdepay ! rtph264depay ! avdec_h264 ! videoconvert ! autovideosink\0",rpi_ip[0],rpi_ip[1],rpi_ip[2],rpi_ip[3],rpi_port);
-  sprintf(pipeline,"udpsrc address=%i.%i.%i.%i port=%i ! gdpdepay ! rtph264depay  ! avdec_h264 ! videoconvert ! autovideosink sync=false\0",rpi_ip[0],rpi_ip[1],rpi_ip[2],rpi_ip[3],rpi_port);
+  char pipeline[640];
+  const char *rtp = srtp_on ? "srtp" : "rtp", *dec = srtp_on ? "srtpdec name=srtp ! " : "";
+  /* camera_server sends plain RTP, one packet per slice: NAL alignment lets avdec_h264 start on a slice before the frame is complete */
+  if (rpi_tcp) /* each packet length prefixed (RFC 4571); the server keeps latency bounded by dropping frames */
+    sprintf(pipeline,"tcpserversrc host=%i.%i.%i.%i port=%i ! application/x-%s-stream,media=video,clock-rate=90000,encoding-name=H264,payload=96 ! rtpstreamdepay ! %srtph264depay name=depay ! video/x-h264,alignment=nal ! avdec_h264 ! videoconvert ! autovideosink sync=false\0",rpi_ip[0],rpi_ip[1],rpi_ip[2],rpi_ip[3],rpi_port,rtp,dec);
+  else
+    sprintf(pipeline,"udpsrc address=%i.%i.%i.%i port=%i caps=\"application/x-%s,media=video,clock-rate=90000,encoding-name=H264,payload=96\" ! %srtph264depay name=depay ! video/x-h264,alignment=nal ! avdec_h264 ! videoconvert ! autovideosink sync=false\0",rpi_ip[0],rpi_ip[1],rpi_ip[2],rpi_ip[3],rpi_port,rtp,dec);
 
   GST_DEBUG("PIPELINE : %s",pipeline);
 
@@ -221,6 +259,20 @@ static void *app_function (void *userdata) {
     return NULL;
   }
 
+  if (srtp_on) {
+    GstElement *srtp = gst_bin_get_by_name (GST_BIN (data->pipeline), "srtp");
+    g_signal_connect (srtp, "request-key", G_CALLBACK (request_key), NULL);
+    gst_object_unref (srtp);
+  }
+
+  if (on_frame_method_id) {
+    GstElement *depay = gst_bin_get_by_name (GST_BIN (data->pipeline), "depay");
+    GstPad *pad = gst_element_get_static_pad (depay, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, frame_probe, data, NULL);
+    gst_object_unref (pad);
+    gst_object_unref (depay);
+  }
+
   /* Set the pipeline to READY, so it can already accept a window handle, if we have one */
   gst_element_set_state(data->pipeline, GST_STATE_READY);
 
@@ -276,6 +328,30 @@ static void gst_native_config (JNIEnv* env, jobject thiz, jbyteArray arr, jint p
 	(*env).ReleaseByteArrayElements(arr, body, 0);
 }
 
+static void gst_native_transport (JNIEnv* env, jobject thiz, jboolean tcp) {
+	rpi_tcp = tcp;
+}
+
+static void gst_native_srtp (JNIEnv* env, jobject thiz, jboolean on) {
+	srtp_on = on;
+	srtp_have_key = 0;
+}
+
+/* Each handshake gives new keys, srtpdec forgets the old ones and asks again */
+static void gst_native_key (JNIEnv* env, jobject thiz, jbyteArray arr) {
+	CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+	if ((*env).GetArrayLength(arr) != sizeof(srtp_master)) return;
+	(*env).GetByteArrayRegion(arr, 0, sizeof(srtp_master), (jbyte *)srtp_master);
+	srtp_have_key = 1;
+	if (data && data->pipeline) {
+		GstElement *srtp = gst_bin_get_by_name (GST_BIN (data->pipeline), "srtp");
+		if (srtp) {
+			g_signal_emit_by_name (srtp, "clear-keys");
+			gst_object_unref (srtp);
+		}
+	}
+}
+
 /* Instruct the native code to create its internal data structure, pipeline and thread */
 static void gst_native_init (JNIEnv* env, jobject thiz) {
   CustomData *data = g_new0 (CustomData, 1);
@@ -332,6 +408,8 @@ static jboolean gst_native_class_init (JNIEnv* env, jclass klass) {
   set_error_method_id = (*env).GetMethodID ( klass, "setError", "(ILjava/lang/String;)V");
   notify_state_method_id = (*env).GetMethodID ( klass, "notifyState", "(I)V");
   on_gstreamer_initialized_method_id = (*env).GetMethodID ( klass, "onGStreamerInitialized", "()V");
+  on_frame_method_id = (*env).GetMethodID ( klass, "onFrame", "(I)V");
+  if (!on_frame_method_id) (*env).ExceptionClear (); /* the app doesn't match telemetry to frames */
 
   if (!custom_data_field_id) {
 	  __android_log_print (ANDROID_LOG_ERROR, "RPiCameraStreamer", "The calling class does not implement native_custom_data");
@@ -405,6 +483,9 @@ static void gst_native_surface_finalize (JNIEnv *env, jobject thiz) {
 static JNINativeMethod native_methods[] = {
   { "nativeInit", "()V", (void *) gst_native_init},
   { "nativeConfig", "([BI)V", (void *) gst_native_config},
+  { "nativeTransport", "(Z)V", (void *) gst_native_transport},
+  { "nativeSrtp", "(Z)V", (void *) gst_native_srtp},
+  { "nativeKey", "([B)V", (void *) gst_native_key},
   { "nativeFinalize", "()V", (void *) gst_native_finalize},
   { "nativeStart", "()V", (void *) gst_native_start},
   { "nativeStop", "()V", (void *) gst_native_stop},
@@ -2,4 +2,10 @@ package com.rpicopter.rpicamerastreamer;
 
 public interface Callback {
 	public void notify(int status, String msg);
+	/* the server streams to a multicast group instead of to us */
+	public void group(byte []ip, int port);
+	/* reply to RPiComm.snapshot(), null if the server couldn't take one */
+	public void snapshot(byte []jpeg);
+	/* SRTP master key and salt, 28 bytes, once the server took our secret */
+	public void keys(byte []master);
 }
@@ -1,18 +1,23 @@
 package com.rpicopter.rpicamerastreamer;
 
+import java.io.File;
+import java.io.FileOutputStream;
 import java.net.InetAddress;
 
 import org.freedesktop.gstreamer.GStreamer;
 
 import com.rpicopter.rpicamerastreamer.util.RPiComm;
 import com.rpicopter.rpicamerastreamer.util.SystemUiHider;
+import com.rpicopter.rpicamerastreamer.util.Telemetry;
 import com.rpicopter.rpicamerastreamer.util.Utils;
 
 import android.annotation.TargetApi;
 import android.app.Activity;
+import android.content.Context;
 import android.content.Intent;
 import android.content.SharedPreferences;
 import android.content.SharedPreferences.Editor;
+import android.net.wifi.WifiManager;
 import android.os.Build;
 import android.os.Bundle;
 import android.os.Handler;
@@ -36,6 +41,9 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
 	private String message;
     private native void nativeInit();     // Initialize native code, build pipeline, etc
     private native void nativeConfig(byte[] ip, int port);
+    private native void nativeTransport(boolean tcp);
+    private native void nativeSrtp(boolean on);
+    private native void nativeKey(byte[] master);
     private native void nativeFinalize(); // Destroy pipeline and shutdown native code
     private native void nativeStart();     // Constructs PIPELINE
     private native void nativeStop();     // Destroys PIPELINE
@@ -48,8 +56,15 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
     
     private boolean pipeline_started;
     private boolean is_running;
+    private int layer;
+    private byte [] my_ip;
+    private int my_port;
+    private WifiManager.MulticastLock mcast_lock; //held while receiving from a multicast group
+    private boolean restart_pending; //pipeline must be rebuilt for a new address once it started
     
     private RPiComm rpi;
+    private Telemetry telemetry;
+    private volatile byte [] frame_telemetry; //what was sampled with the frame being shown
 	/**
 	 * Whether or not the system UI should be auto-hidden after
 	 * {@link #AUTO_HIDE_DELAY_MILLIS} milliseconds.
@@ -167,6 +182,8 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
 		if (sharedPrefs.getString("rpi_port", "")=="")
 			editor.putString("rpi_port", "1045");
 
+		layer = sharedPrefs.getInt("layer", 0);
+
 		editor.commit();
 		
 		initializePlayer();
@@ -206,8 +223,19 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
 		  if (pipeline_started) nativeStop();
 		  rpi.stop();
 		  is_running = false;
+		  if (mcast_lock != null && mcast_lock.isHeld()) {
+			  mcast_lock.release();
+			  nativeConfig(my_ip,my_port); //back to unicast for the next start
+		  }
 	}
 	
+	public void clickLayer(View v) {
+		layer = 1 - layer;
+		PreferenceManager.getDefaultSharedPreferences(this).edit().putInt("layer", layer).commit();
+		if (rpi != null) rpi.setLayer(layer);
+		_updateUI();
+	}
+
 	public void clickStart(View v) {
 		message = "";
 		if (rpi == null) {
@@ -237,12 +265,20 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
     	updateUI();
     }
     
+    // Called from native code for each frame with its RTP timestamp, from a streaming thread
+    private void onFrame(int ts) {
+    	if (telemetry!=null) frame_telemetry = telemetry.frame(ts);
+    }
+
     private void notifyState(final int _state) {
     	Log.d("STATE","STATE "+_state);
     	switch (_state) {
     		case 0: is_running = false; pipeline_started = false; break;
     		case 1: is_running = false; break;
     		case 4: pipeline_started = true;
+    			if (restart_pending) runOnUiThread (new Runnable() {
+    				public void run() { restartPipeline(); }
+    			});
     	}
     	updateUI();
     }
@@ -269,9 +305,24 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
     		Log.d("initializePlayer","initializePlayer"+ex);
     		return;
     	}
+    	boolean tcp = sharedPrefs.getBoolean("tcp", false);
+    	this.my_ip = my_ip;
+    	this.my_port = my_p;
     	nativeConfig(my_ip,my_p);
+    	String secret = sharedPrefs.getString("secret", "");
+    	nativeTransport(tcp);
+    	nativeSrtp(secret.length() > 0);
     	if (rpi!=null) rpi.stop();
-    	rpi = new RPiComm(this,rpi_ip,rpi_p,my_ip,my_p);
+    	rpi = new RPiComm(this,rpi_ip,rpi_p,my_ip,my_p,layer,tcp);
+    	if (secret.length() > 0) rpi.setSecret(secret.getBytes());
+    	if (telemetry!=null) telemetry.close();
+    	try {
+    		telemetry = new Telemetry(my_p+2);
+    		rpi.setTelemetry(my_p+2);
+    	} catch (Exception ex) {
+    		telemetry = null; //the stream works without
+    		Log.d("initializePlayer","telemetry "+ex);
+    	}
     }
         
     @Override
@@ -332,6 +383,7 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
     
     protected void onDestroy() {
     	rpi._stop();
+    	if (telemetry!=null) telemetry.close();
         nativeFinalize();
         Log.d("RPI","RPI onDestroy");
         super.onDestroy();
@@ -383,6 +435,9 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
   		if (is_running)
   			mButton.setText("Stop");
   		else mButton.setText("Start");
+
+  		final Button lButton=(Button) this.findViewById(R.id.layer_button);
+  		lButton.setText(layer == 0 ? R.string.layer_high : R.string.layer_low);
     }
     
     private void updateUI() {
@@ -391,6 +446,54 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback, Ca
             public void run() { _updateUI(); }
           });
     }
+	@Override
+	public void group(final byte []ip, final int port) {
+		runOnUiThread (new Runnable() {
+			public void run() {
+				if (!is_running) return;
+				if (mcast_lock == null) {
+					WifiManager wifi = (WifiManager) getSystemService(Context.WIFI_SERVICE);
+					mcast_lock = wifi.createMulticastLock("RPiCameraStreamer");
+				}
+				if (!mcast_lock.isHeld()) mcast_lock.acquire();
+				//udpsrc joins the group when its address is a multicast one
+				nativeConfig(ip,port);
+				if (pipeline_started) restartPipeline();
+				else restart_pending = true;
+			}
+		});
+	}
+
+	private void restartPipeline() {
+		restart_pending = false;
+		if (!is_running) return;
+		nativeStop();
+		nativeStart();
+	}
+
+	@Override
+	public void snapshot(byte []jpeg) {
+		if (jpeg == null) {
+			notify(0, "No snapshot, the camera has no raw frames");
+			return;
+		}
+		try {
+			File f = new File(getExternalFilesDir(null), "snapshot-" + System.currentTimeMillis() + ".jpg");
+			FileOutputStream out = new FileOutputStream(f);
+			out.write(jpeg);
+			out.close();
+			notify(0, "Saved " + f.getName());
+		} catch (Exception ex) {
+			notify(0, ex.toString());
+		}
+	}
+
+	@Override
+	public void keys(byte []master) {
+		nativeKey(master);
+		if (telemetry!=null) telemetry.setKey(master);
+	}
+
 	@Override
 	public void notify(int status, String msg) {
 		message = msg;
@@ -1,15 +1,22 @@
 package com.rpicopter.rpicamerastreamer.util;
 
+import java.io.DataInputStream;
 import java.io.DataOutputStream;
 import java.net.InetAddress;
 import java.net.InetSocketAddress;
 import java.net.Socket;
 import java.nio.ByteBuffer;
+import java.security.MessageDigest;
+import java.security.SecureRandom;
+import java.util.Arrays;
 import java.util.Timer;
 import java.util.TimerTask;
 
 import com.rpicopter.rpicamerastreamer.Callback;
 
+import javax.crypto.Mac;
+import javax.crypto.spec.SecretKeySpec;
+
 import android.util.Log;
 
 public class RPiComm {
@@ -19,11 +26,18 @@ public class RPiComm {
 	private InetSocketAddress addr;
 	private byte [] my_ip;
 	private int my_port;
+	private int layer;
+	private boolean tcp;
+	private int telem_port; //0 - no telemetry
+	private byte [] secret; //null - the server doesn't ask for one
 	private DataOutputStream out;
 	private Callback context;
+	private Timer timer;
 	
-	public RPiComm(Callback c, byte []rpi_ip, int rpi_port, byte []my_ip, int my_port) {
+	public RPiComm(Callback c, byte []rpi_ip, int rpi_port, byte []my_ip, int my_port, int layer, boolean tcp) {
 		context = c;
+		this.layer = layer;
+		this.tcp = tcp;
 		try {
 			InetAddress rpi = InetAddress.getByAddress(rpi_ip);
 			addr = new InetSocketAddress(rpi,rpi_port);
@@ -35,9 +49,12 @@ public class RPiComm {
 			status = -1;
 			context.notify(0, error);
 		}
-		
-		//Timer timer = new Timer();
-		//timer.schedule(new Ping(), 0, 1000);
+	}
+	
+	/* messages come from several threads, each must go out whole */
+	private synchronized void send(byte [] buf) throws Exception {
+		out.write(buf);
+		out.flush();
 	}
 	
 	private void _start() {
@@ -45,27 +62,115 @@ public class RPiComm {
 			sock = new Socket();
 			sock.connect(addr,2500);
 			out=new DataOutputStream(sock.getOutputStream());
+			if (secret != null) _auth();
 			
 			//len 4
 			//type 1
 			//ip 4
 			//port 4
-			byte [] buf = new byte[13];
+			//layer 1
+			//transport 1
+			byte [] buf = new byte[15];
 			ByteBuffer b = ByteBuffer.wrap(buf);
-			b.putInt(13);
+			b.putInt(15);
 			b.put((byte)0);
 			b.put(my_ip);
 			b.putInt(my_port);
-			out.write(buf);
-			out.flush();
+			b.put((byte)layer);
+			b.put((byte)(tcp ? 1 : 0));
+			send(buf);
+			if (telem_port != 0) _telemetry();
 			//sock.close();
+			timer = new Timer();
+			timer.schedule(new Ping(), 1000, 1000);
+			_read();
 		} catch (Exception ex) {
+			if (sock.isClosed()) return; //stopped
 			error = ex.toString();
 			status = -1;
 			context.notify(0, error);
 		}
 	}
 	
+	private static byte [] prove(byte [] secret, String label, byte [] cn, byte [] sn) throws Exception {
+		Mac mac = Mac.getInstance("HmacSHA256");
+		mac.init(new SecretKeySpec(secret, "HmacSHA256"));
+		mac.update(label.getBytes("US-ASCII"));
+		mac.update(cn);
+		return mac.doFinal(sn);
+	}
+
+	/* both sides prove they know the secret, then each derives the SRTP keys from it and the two nonces */
+	private void _auth() throws Exception {
+		DataInputStream in = new DataInputStream(sock.getInputStream());
+		byte [] cn = new byte[16];
+		new SecureRandom().nextBytes(cn);
+		//len 4
+		//type 1
+		//client nonce 16
+		byte [] buf = new byte[21];
+		ByteBuffer b = ByteBuffer.wrap(buf);
+		b.putInt(21);
+		b.put((byte)11);
+		b.put(cn);
+		send(buf);
+
+		//len 4
+		//type 1
+		//server nonce 16
+		//server proof 32
+		if (in.readInt() != 53 || in.readByte() != 11) throw new Exception("Server doesn't take a secret");
+		byte [] sn = new byte[16], proof = new byte[32];
+		in.readFully(sn);
+		in.readFully(proof);
+		if (!MessageDigest.isEqual(proof, prove(secret, "server", cn, sn))) throw new Exception("Server doesn't know the secret");
+
+		//len 4
+		//type 1
+		//client proof 32
+		buf = new byte[37];
+		b = ByteBuffer.wrap(buf);
+		b.putInt(37);
+		b.put((byte)11);
+		b.put(prove(secret, "client", cn, sn));
+		send(buf);
+
+		//len 4
+		//type 1
+		if (in.readInt() != 5 || in.readByte() != 11) throw new Exception("Wrong secret");
+		context.keys(Arrays.copyOf(prove(secret, "srtp", cn, sn), 28));
+	}
+
+	/* replies, until the connection is closed */
+	private void _read() throws Exception {
+		DataInputStream in = new DataInputStream(sock.getInputStream());
+		while (true) {
+			//len 4
+			//type 1
+			int len = in.readInt();
+			if (len < 5 || len > 16*1024*1024) throw new Exception("Invalid message from server"); //a snapshot is a whole JPEG
+			byte [] buf = new byte[len - 4];
+			in.readFully(buf);
+			if (buf[0] == 4 && len >= 13) {
+				//group 4
+				//port 4
+				byte [] ip = new byte[4];
+				ByteBuffer b = ByteBuffer.wrap(buf, 1, 8);
+				b.get(ip);
+				context.group(ip, b.getInt());
+			}
+			if (buf[0] == 9) {
+				//jpeg, empty if there's none
+				byte [] jpeg = null;
+				if (len > 5) {
+					jpeg = new byte[len - 5];
+					System.arraycopy(buf, 1, jpeg, 0, len - 5);
+				}
+				context.snapshot(jpeg);
+			}
+		}
+	}
+	
 	public void start() {
 		new Thread(new Runnable(){
 		    @Override
@@ -77,6 +182,7 @@ public class RPiComm {
 	}
 	
 	public void _stop() {
+		if (timer!=null) timer.cancel();
 		if (sock==null) return;
 		if (!sock.isConnected()) return;
 		try {
@@ -86,8 +192,7 @@ public class RPiComm {
 			ByteBuffer b = ByteBuffer.wrap(buf);
 			b.putInt(5);
 			b.put((byte)1);
-			out.write(buf);
-			out.flush();
+			send(buf);
 			
 			sock.close();
 		} catch (Exception ex) {
@@ -96,6 +201,123 @@ public class RPiComm {
 		}
 	}
 	
+	private void _setLayer() {
+		if (sock==null) return;
+		if (!sock.isConnected()) return;
+		try {
+			//len 4
+			//type 1
+			//layer 1
+			byte [] buf = new byte[6];
+			ByteBuffer b = ByteBuffer.wrap(buf);
+			b.putInt(6);
+			b.put((byte)2);
+			b.put((byte)layer);
+			send(buf);
+		} catch (Exception ex) {
+			error = ex.toString();
+			status = -1;
+			context.notify(0, error);
+		}
+	}
+
+	/* 0 - high, 1 - low resolution; the server switches at the next keyframe */
+	public void setLayer(int l) {
+		layer = l;
+		new Thread(new Runnable(){
+		    @Override
+		    public void run() {
+		    	_setLayer();
+		    }
+		}).start();
+	}
+
+	private void _telemetry() throws Exception {
+		//len 4
+		//type 1
+		//port 4
+		byte [] buf = new byte[9];
+		ByteBuffer b = ByteBuffer.wrap(buf);
+		b.putInt(9);
+		b.put((byte)10);
+		b.putInt(telem_port);
+		send(buf);
+	}
+
+	/* the secret camera_server was started with (-A); the stream is then SRTP, call before start() */
+	public void setSecret(byte [] s) {
+		secret = s;
+	}
+
+	/* the server sends telemetry records to that port of ours, see Telemetry; call before start() */
+	public void setTelemetry(int port) {
+		telem_port = port;
+	}
+
+	private void _snapshot() {
+		if (sock==null) return;
+		if (!sock.isConnected()) return;
+		try {
+			//len 4
+			//type 1
+			byte [] buf = new byte[5];
+			ByteBuffer b = ByteBuffer.wrap(buf);
+			b.putInt(5);
+			b.put((byte)9);
+			send(buf);
+		} catch (Exception ex) {
+			error = ex.toString();
+			status = -1;
+			context.notify(0, error);
+		}
+	}
+
+	/* a still of the next frame while the stream goes on, Callback.snapshot() gets the JPEG */
+	public void snapshot() {
+		new Thread(new Runnable(){
+		    @Override
+		    public void run() {
+		    	_snapshot();
+		    }
+		}).start();
+	}
+
+	private void _setRoi(int x, int y, int w, int h) {
+		if (sock==null) return;
+		if (!sock.isConnected()) return;
+		try {
+			//len 4
+			//type 1
+			//x, y, width, height 2 each, in 1/10000 of the frame
+			byte [] buf = new byte[13];
+			ByteBuffer b = ByteBuffer.wrap(buf);
+			b.putInt(13);
+			b.put((byte)8);
+			b.putShort((short)x);
+			b.putShort((short)y);
+			b.putShort((short)w);
+			b.putShort((short)h);
+			send(buf);
+		} catch (Exception ex) {
+			error = ex.toString();
+			status = -1;
+			context.notify(0, error);
+		}
+	}
+
+	/* the part of the frame the user zoomed into, as fractions; the server crops before encoding
+	 * so it gets the whole stream, 0, 0, 1, 1 goes back to the full view; up to 4x */
+	public void setRoi(float x, float y, float w, float h) {
+		final int rx = Math.round(x * 10000), ry = Math.round(y * 10000);
+		final int rw = Math.round(w * 10000), rh = Math.round(h * 10000);
+		new Thread(new Runnable(){
+		    @Override
+		    public void run() {
+		    	_setRoi(rx, ry, rw, rh);
+		    }
+		}).start();
+	}
+
 	public void stop() {
 		new Thread(new Runnable(){
 		    @Override
@@ -106,18 +328,28 @@ public class RPiComm {
 
 	}
 	
-/*
+	/* heartbeat: without it the server takes us for gone after its liveness timeout */
 	private void ping() {
-		
+		if (sock==null) return;
+		if (!sock.isConnected() || sock.isClosed()) return;
+		try {
+			//len 4
+			//type 1
+			byte [] buf = new byte[5];
+			ByteBuffer b = ByteBuffer.wrap(buf);
+			b.putInt(5);
+			b.put((byte)7);
+			send(buf);
+		} catch (Exception ex) {
+			//the reading thread notices the connection is gone
+		}
 	}
 
 
 	class Ping extends TimerTask {
 	    public void run() {
-	    	
-	       System.out.println("Hello World!"); 
+	    	ping();
 	    }
 	 }
-*/
 
 }
@@ -0,0 +1,143 @@
+package com.rpicopter.rpicamerastreamer.util;
+
+import java.net.DatagramPacket;
+import java.net.DatagramSocket;
+import java.util.Arrays;
+
+import javax.crypto.Cipher;
+import javax.crypto.spec.IvParameterSpec;
+import javax.crypto.spec.SecretKeySpec;
+
+import android.util.Log;
+
+/* Telemetry records from the server, RTP on the video's clock: frame() gives the one that goes with a frame */
+public class Telemetry {
+	public static final int PT = 100;
+	private static final int KEEP = 64; //about 2 s of records at 30 a second
+
+	private DatagramSocket sock;
+	private int [] ts = new int[KEEP];
+	private byte [][] records = new byte[KEEP][];
+	private int count = 0; //received so far, the last KEEP are kept
+	private volatile byte [][] keys; //SRTP session key and salt, null while it's plain RTP
+	private byte [][] used; //the keys roc and seq go with
+	private int roc, seq = -1;
+
+	public Telemetry(int port) throws Exception {
+		sock = new DatagramSocket(port);
+		new Thread(new Runnable(){
+		    @Override
+		    public void run() {
+		    	_read();
+		    }
+		}).start();
+	}
+
+	private void _read() {
+		byte [] buf = new byte[2048];
+		DatagramPacket p = new DatagramPacket(buf, buf.length);
+		while (true) {
+			try {
+				sock.receive(p);
+			} catch (Exception ex) {
+				return; //closed
+			}
+			//version 2, payload type, timestamp at 4
+			int len = p.getLength();
+			byte [][] k = keys;
+			if (k != null) {
+				if (k != used) { //a new session
+					used = k;
+					roc = 0;
+					seq = -1;
+				}
+				len = unprotect(k, buf, len);
+			}
+			if (len < 12 || (buf[0] & 0xc0) != 0x80 || (buf[1] & 0x7f) != PT) continue;
+			int t = (buf[4] & 0xff) << 24 | (buf[5] & 0xff) << 16 | (buf[6] & 0xff) << 8 | (buf[7] & 0xff);
+			byte [] r = new byte[len - 12];
+			System.arraycopy(buf, 12, r, 0, len - 12);
+			synchronized (this) {
+				ts[count % KEEP] = t;
+				records[count % KEEP] = r;
+				count++;
+			}
+		}
+	}
+
+	/* RFC 3711 4.3.3, a key derivation rate of 0: one AES block of the salt with the label in byte 7 */
+	private static byte [] derive(Cipher ecb, byte [] master, int label, int len) throws Exception {
+		byte [] block = new byte[16];
+		System.arraycopy(master, 16, block, 0, 12);
+		block[7] ^= label;
+		return Arrays.copyOf(ecb.doFinal(block), len);
+	}
+
+	/* the SRTP master key and salt from the handshake, records are AES-128-GCM from then on */
+	public void setKey(byte [] master) {
+		try {
+			Cipher ecb = Cipher.getInstance("AES/ECB/NoPadding");
+			ecb.init(Cipher.ENCRYPT_MODE, new SecretKeySpec(master, 0, 16, "AES"));
+			keys = new byte [][] { derive(ecb, master, 0, 16), derive(ecb, master, 2, 12) };
+		} catch (Exception ex) {
+			Log.d("RPI", "Telemetry: " + ex);
+		}
+	}
+
+	/* decrypts in place as rpi/srtp.c does, the RTP length or -1 if it isn't authentic */
+	private int unprotect(byte [][] k, byte [] buf, int len) {
+		int h = 12 + (buf[0] & 0x0f) * 4;
+		if (len < h + 16) return -1;
+		int s = (buf[2] & 0xff) << 8 | (buf[3] & 0xff), r = roc;
+		if (seq >= 0 && seq < 0x8000 && s - seq > 0x8000) r--; //the ROC that puts it closest to the last one
+		else if (seq >= 0x8000 && seq - 0x8000 > s) r++;
+		//RFC 7714 8.1: 00 00, SSRC, ROC, sequence number, XOR the salt
+		byte [] iv = new byte[12];
+		System.arraycopy(buf, 8, iv, 2, 4);
+		iv[6] = (byte)(r >> 24);
+		iv[7] = (byte)(r >> 16);
+		iv[8] = (byte)(r >> 8);
+		iv[9] = (byte)r;
+		iv[10] = buf[2];
+		iv[11] = buf[3];
+		for (int i = 0; i < 12; i++) iv[i] ^= k[1][i];
+		try {
+			Cipher gcm = Cipher.getInstance("AES/GCM/NoPadding"); //a 128 bit tag
+			gcm.init(Cipher.DECRYPT_MODE, new SecretKeySpec(k[0], "AES"), new IvParameterSpec(iv));
+			gcm.updateAAD(buf, 0, h);
+			len = h + gcm.doFinal(buf, h, len - h, buf, h);
+		} catch (Exception ex) {
+			return -1;
+		}
+		if (seq < 0 || r > roc || (r == roc && s > seq)) {
+			roc = r;
+			seq = s;
+		}
+		return len;
+	}
+
+	/* the last record sampled at or before the frame with that RTP timestamp, null if there's none
+	 * that recent; the clock wraps, so it's compared by difference */
+	public synchronized byte [] frame(int frame_ts) {
+		byte [] best = null;
+		int best_diff = 0;
+		for (int i = Math.max(0, count - KEEP); i < count; i++) {
+			int diff = frame_ts - ts[i % KEEP];
+			if (diff >= 0 && (best == null || diff < best_diff)) {
+				best = records[i % KEEP];
+				best_diff = diff;
+			}
+		}
+		return best;
+	}
+
+	/* the newest record, null before the first */
+	public synchronized byte [] current() {
+		return count > 0 ? records[(count - 1) % KEEP] : null;
+	}
+
+	public void close() {
+		sock.close();
+		Log.d("RPI", "Telemetry: " + count + " records");
+	}
+}
@@ -150,9 +150,10 @@ static void state_changed_cb (GstBus *bus, GstMessage *msg, GStreamerBackend *se
     g_main_context_push_thread_default(context);
     
     /* Build pipeline */
-    char pipeline_str[256];
+    char pipeline_str[512];
 
-    sprintf(pipeline_str,"udpsrc address=%i.%i.%i.%i port=%i ! gdpdepay ! rtph264depay  ! avdec_h264 ! videoconvert ! autovideosink sync=false",my_ip[0],my_ip[1],my_ip[2],my_ip[3],my_port);
+    /* plain RTP from camera_server, NAL alignment lets the decoder start on each slice as it arrives */
+    sprintf(pipeline_str,"udpsrc address=%i.%i.%i.%i port=%i caps=\"application/x-rtp,media=video,clock-rate=90000,encoding-name=H264,payload=96\" ! rtph264depay ! video/x-h264,alignment=nal ! avdec_h264 ! videoconvert ! autovideosink sync=false",my_ip[0],my_ip[1],my_ip[2],my_ip[3],my_port);
     
     GST_DEBUG("PIPELINE : %s",pipeline_str);
     
@@ -5,31 +5,355 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <sys/time.h>
 #include <getopt.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <strings.h>
 #include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <netdb.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 #include <stdio.h>
 
+#include "h264.h"
+#include "rtp.h"
+#include "sendq.h"
+#include "dvr.h"
+#include "record.h"
+#include "rtsp.h"
+#include "hls.h"
+#include "shm.h"
+#include "vcap.h"
+#include "rt.h"
+#include "motion.h"
+#include "snap.h"
+#include "srtp.h"
+
 #define CAM_CMD "/usr/local/bin/camera_streamer.sh"
 
-#define BUF_SIZE 1024 //receiving buffer
+#define BUF_SIZE 2048 //receiving buffer, holds an RTSP request
+#define CAM_BUF_SIZE 256*1024 //encoded stream buffer, grows for bigger NALs
+#define NAL_FLUSH_US 2000 //encoder idle time after which the pending NAL is taken as complete
+#define PARAM_SIZE 256 //max cached SPS/PPS size
+#define AU_SIZE 1024*1024 //max access unit size kept for the recorders
+#define STATS_PERIOD 10 //seconds between stream statistics in verbose mode
+#define MAX_LAYERS 2 //high and low resolution
+#define MAX_CAMERAS 4 //each has its own camera process and MAX_LAYERS layers
+#define MAX_VIEWERS 64 //a relay serves many, a Pi runs out of uplink long before
+#define MAX_SENDERS (MAX_VIEWERS + MAX_CAMERAS * MAX_LAYERS) //viewers, then a multicast group per layer
+#define RELAY_BATCH 32 //packets taken from the upstream socket per call
+#define RELAY_RCVBUF 1024*1024
+#define KEY_RETRY_US 1000000 //a keyframe request upstream is repeated if nothing came within that
+#define CONNECT_RETRY_US 1000000 //TCP viewers we couldn't connect to, or lost
+#define HLS_IDLE_US 10000000 //HLS players are only seen through their requests, the camera stops that long after the last one
+#define RAW_MAX 512*1024 //largest raw frame, the pipe must hold a whole one
+#define RAW_POLL_US 2000 //while part of a raw frame is in the pipe
+#define CAM_START_US 5000000 //a camera is given that long for its first frame
+#define CAM_STALL_US 1000000 //then it's taken as stalled after that long without one,
+#define CAM_STALL_FRAMES 10 //or that many frame intervals if that's longer
+#define CAM_KILL_US 1000000 //a camera process that ignores SIGTERM that long gets SIGKILL
+#define MOTION_THRESHOLD 3.0 //default mean thumbnail difference, in luma levels, taken as motion
+#define CAM_BACKOFF_MIN_US 250000 //a failed camera is started again after that, doubling with each failure in a row
+#define CAM_BACKOFF_MAX_US 30000000
+#define CAM_HEALTHY_US 10000000 //running that long clears its failures
+#define ROI_SETTLE_US 300000 //a pinch sends a burst of regions, the pipeline is rebuilt once they stop
+#define SNAP_QUALITY 90 //JPEG
+#define SNAP_TIMEOUT_US 2000000 //a snapshot nobody got a frame for is answered empty
+#define TELEM_SIZE 1024 //largest telemetry record
+#define TELEM_PT 100 //RTP payload type of the telemetry flow
+#define ROI_MIN 2500 //of 10000, a 4x zoom: a 640 pixel stream then takes the Pi camera's full 2592 pixels
+
+//control messages: [len 4][type 1][payload]
+#define MSG_START 0 //[ip 4][port 4][layer 1, optional][transport 1, optional: 1 = TCP, we connect to ip:port][camera 1, optional]
+#define MSG_STOP 1
+#define MSG_LAYER 2 //[layer 1] of the viewer's camera, switches at the layer's next keyframe
+#define MSG_DVR 3 //dump the pre-event recorder to record_dir
+#define MSG_GROUP 4 //reply to MSG_START/MSG_LAYER in multicast mode: [group 4][port 4] carrying the layer
+#define MSG_KEYFRAME 5 //asks for a starting point on the viewer's layer
+#define MSG_STATUS 6 //to the viewers of a camera that failed or recovered: [camera 1][state 1: 0 = streaming, 1 = restarting][ms to the next attempt 4]
+#define MSG_PING 7 //heartbeat, echoed; a viewer that sends them is dropped once they stop for the liveness timeout
+#define MSG_ROI 8 //[x 2][y 2][width 2][height 2] of the viewer's camera frame in 1/10000, [encoded width 2][height 2, optional]
+#define MSG_SNAPSHOT 9 //a JPEG of the next raw frame of the viewer's camera, answered with [JPEG], empty if there's none
+#define MSG_TELEMETRY 10 //[port 4]: telemetry records as RTP to that UDP port of the viewer, 0 stops them
+#define MSG_AUTH 11 //handshake with -A: [client nonce 16], reply [server nonce 16][server proof 32], then [client proof 32], reply empty; without -A the first reply is empty
+
+#define AUTH_NONE 0
+#define AUTH_CHALLENGED 1 //we sent our nonce and proof
+#define AUTH_DONE 2
+
 int portno = 1035;
 
-char cmd[256];
+//a camera pipeline, its encoder settings are passed to cam_cmd
+struct camera {
+	char name[16]; //in RTSP URLs, MSG_START takes the index
+	const char *source;
+	const char *encoder_dev; //memory-to-memory encoder for a V4L2 source that gives raw frames
+	int width, height, fps, bitrate, gop, slices;
+	int refresh; //cyclic intra refresh instead of periodic IDRs
+	int low_width, low_height, low_bitrate; //second, low resolution layer; 0 = disabled
+	int active;
+	pid_t pid; //0 once it exited
+	pid_t pgid; //its pipeline's, what's left of it may outlive it
+	int nlayers;
+	struct vcap vcap;
+	struct rt_sched sched; //of the camera process: capture and encoding
+
+	//motion gate: a still scene is encoded at static_fps and static_bitrate, every frame again as soon as it moves
+	double motion_threshold; //0 = every frame is encoded
+	int static_fps, static_bitrate;
+	struct motion motion;
+	int still; //frames in a row below the threshold
+	int gated;
+	unsigned long gated_frames; //of the frames the gate saw while the scene was still
+	struct timeval last_encoded;
+
+	//watchdog
+	int got_frame; //since it was started
+	int restarting; //failed, the watchdog starts it again
+	int failures; //in a row
+	long backoff_us;
+	struct timeval started, last_frame, failed_at, down_at; //down_at: the first failure in a row
+
+	//region of interest: cropped before encoding, the whole bitrate goes to what the viewer zoomed into
+	int roi_x, roi_y, roi_w, roi_h; //in 1/10000 of the frame, roi_w = 0: the whole frame
+	int roi_width, roi_height; //encoded size while cropped
+	int roi_pending; //changed, the pipeline is rebuilt once it settles
+	struct timeval roi_at;
+};
+
+//-C starts the next one, with the settings of the one before
+struct camera cameras[MAX_CAMERAS] = { { "main", "rpi", NULL, 640, 480, 20, 500000, 20, 1 } };
+int ncameras = 1;
+
+//send queue settings
+int queue_budget = 64*1024; //bytes
+int queue_deadline = 250; //ms a packet may wait before it's too late to send
+int link_rate = 0; //kbit/s, 0 = unpaced
+int queue_fifo = 0; //tail drop instead of dropping by priority
+int tcp_sndbuf = 8*1024; //bytes, small so a slow link backs up into the send queue, where frames can be dropped
+
+//viewer liveness: heartbeats on the control connection, ICMP errors for UDP destinations
+int live_timeout = 5; //seconds, 0 = viewers are only dropped when they disconnect
+unsigned long pruned;
+
+//multicast, viewers share a group per layer instead of getting a copy each
+struct in_addr mcast_group;
+int mcast_port = 0; //layer n is sent to port + 2n; 0 = unicast
+int mcast_ttl = 1;
+struct in_addr mcast_if; //interface address, INADDR_ANY = routing table's choice
+
+//relay: re-serves another camera_server's stream instead of running a camera
+char *relay_host = NULL;
+int relay_port = 0;
+int up_sock = -1; //control connection, we're a viewer of the upstream server
+int up_udp = -1; //its RTP stream
+struct pkt_buf *relay_bufs[RELAY_BATCH]; //received into, then handed to the queues as they are
+int relay_prio; //of the NAL being forwarded
+int key_pending = 0; //a keyframe request is on its way upstream
+struct timeval key_sent;
+int key_wanted = 0; //a viewer asked for one
+unsigned long relay_pkts, relay_key_requests;
+
+//RTSP endpoint, sessions are viewers of the same layers
+int rtsp_port = 0; //0 = disabled
+int rtsp_sock = -1;
+int udp_port; //what udp_sock sends from, the RTSP server_port
+
+//low-latency HLS of the main layer, from memory
+int hls_port = 0; //0 = disabled
+int hls_part_ms = 200;
+int hls_segment_ms = 2000;
+
+//shared memory ring of the main layer's access units for local consumers, keeps the camera running while any are attached
+const char *shm_name = NULL; //NULL = disabled
+long shm_bytes = 8*1024*1024;
+int raw_width = 0; //raw I420 frames the camera process also writes into the ring, 0 = none
+int raw_height = 0;
+int raw_fd = -1;
+int raw_partial = 0; //part of a frame is in the pipe
+
+//telemetry: datagrams on a Unix socket, [CLOCK_MONOTONIC us 8, 0 = when it arrives][record], each stamped on the
+//video's RTP clock and passed on to the viewers that asked for it
+const char *telem_path = NULL; //NULL = disabled
+int telem_sock = -1;
+struct rtp_stream telem_rtp;
+unsigned long telem_in, telem_sent, telem_dropped;
+double telem_age_us, telem_age_max_us; //from the sample to sending it
+
+//-A: viewers prove they know the secret before anything else, their media goes out as SRTP keyed from the handshake
+unsigned char auth_secret[256];
+int auth_len = 0; //0 = open to everyone, plain RTP
+
+//pre-event recorder, keeps the camera running without viewers
+int dvr_seconds = 0; //0 = disabled
+int dvr_bytes = 8*1024*1024; //memory budget
+const char *record_dir = "/tmp";
+const char *cam_cmd = CAM_CMD;
+
+//segmented recording to record_dir, keeps the camera running without viewers
+int rec_seconds = 0; //segment length, 0 = disabled
+int rec_keep = 60; //segments kept, 0 = all
+int rec_queue = 4*1024*1024; //bytes the disk may fall behind before frames are dropped
+
 int verbose = 1;
 int background = 0;
 int stop = 0;
+volatile sig_atomic_t child_exited = 0;
+
+//the event loop's scheduling: control connections, sending and V4L2 capture all run in it
+struct rt_sched loop_sched;
+int lock_memory = 0;
+unsigned long loop_wakeups; //select() timeouts, and how late they came: what scheduling costs the stream
+long loop_late_us, loop_late_max_us;
+
+//one encoded stream from a camera process
+struct layer {
+	struct camera *cam;
+	int width, height, bitrate;
+	int fd;
+	struct timeval last_read;
+	struct nal_scanner scanner;
+	struct rtp_stream rtp;
+	unsigned int au_ts; //RTP timestamp of the current access unit
+	int au_slices; //slices sent in the current access unit, -1 before the first one
+	int enc_slices; //slices per picture the encoder actually gave last time, 0 before the first picture
+	int params_sent; //bit 0: SPS, bit 1: PPS already sent in the current access unit
+	unsigned char sps[PARAM_SIZE], pps[PARAM_SIZE];
+	int sps_len, pps_len;
+	int frames; //pictures since the stream started
+	int enc_recovery; //encoder writes its own recovery point SEIs
+	int key_request; //a viewer asked for a starting point
+
+	//access unit as start-coded NALs for the recorders, au is NULL if nothing records the layer
+	unsigned char *au;
+	int au_len; //-1 if it didn't fit
+	int au_key; //AU_IDR or AU_RECOVERY
+	int au_params; //bit 0: SPS, bit 1: PPS in the access unit
+	int au_broken; //a frame was lost, skip until the next keyframe
+	struct timeval au_time;
+
+	//bitrate and burst statistics, to compare IDR and intra refresh streams
+	struct timeval stat_start;
+	long stat_sec_bytes; //bytes sent in the current second
+	double stat_sum, stat_sum2; //per second kbit/s, sum and sum of squares
+	int stat_secs;
+	int stat_frame_pkts, stat_frame_bytes; //current frame
+	int stat_peak_pkts, stat_peak_bytes; //largest frame in the period
+	int stat_frames; //pictures at the start of the period
+	double stat_cam_cpu; //CPU seconds used by the camera process at the start of the period
+};
 
-int cam_active = 0;
+//a control connection, and where and what it streams to
+struct viewer {
+	int sock; //0 if the slot is free
+	unsigned char buf[BUF_SIZE];
+	int buf_c;
+	int msgSize;
+	int active; //asked for the stream
+	int mcast; //served by the multicast group of the layer it wants
+	int rtsp; //an RTSP client rather than our protocol
+	char session[20]; //RTSP session id, empty before SETUP
+	int rtsp_port; //client_port of a UDP session
+	int rtsp_camera, rtsp_layer;
+	int tcp; //RTP on a stream socket: interleaved on the RTSP connection, or one we opened to the viewer
+	int out_sock; //that socket, 0 if there's none (yet)
+	int channel; //-1 without RTSP, packets are just length prefixed (RFC 4571)
+	int connecting;
+	struct timeval retry; //last connection attempt
+	int blocked; //connection full, wait until it's writable
+	struct sockaddr_in dest;
+	int camera;
+	int layer; //index in layers being sent, -1 until the viewer reached a keyframe
+	int want; //requested layer, switched to at its next keyframe
+	struct sendq q;
+	struct timeval heard; //last message, RTSP request or interleaved RTCP
+	unsigned long heard_bytes; //q.total_bytes then
+	int pings; //sends heartbeats, silence means it's gone
+	int unreachable; //ICMP errors for dest since it was last heard
+	struct timeval unreachable_since;
+	int snap_wait; //asked for a snapshot
+	int telem_port; //telemetry goes to it, 0 = none
+	int auth; //AUTH_NONE, AUTH_CHALLENGED or AUTH_DONE; nothing else is taken before it's done with -A
+	unsigned char nonces[2 * SRTP_NONCE]; //the client's, then ours
+	struct srtp srtp; //its media keys once authenticated
+	unsigned char *ctl_out; //control messages the socket had no room for, a snapshot takes a while to go out
+	int ctl_len, ctl_sent;
+};
+
+struct layer layers[MAX_CAMERAS * MAX_LAYERS]; //camera n's layers start at n * MAX_LAYERS, the main layer is the first camera's first
+struct viewer viewers[MAX_SENDERS];
+struct viewer *groups = viewers + MAX_VIEWERS; //multicast senders, no control connection
+
+struct dvr dvr;
+struct recorder rec;
+struct hls hls;
+struct shm shm;
+struct snap snap; //started with the first snapshot
+int snap_camera = -1; //a snapshot of its next raw frame is being taken
+struct timeval snap_at; //asked for
+
+int udp_sock = -1;
+int send_blocked = 0; //socket buffer full, wait until it's writable
+unsigned int nal_id = 0;
+unsigned long enc_frames, enc_bytes; //from all cameras, for the statistics
 
 void print_usage() {
 	printf("-d run in background\n");
 	printf("-p [port] port to listen on (defaults to %i)\n",portno);
+	printf("-C [name] start the settings of another camera, -s to -i after it apply to that one (the first is named %s)\n",cameras[0].name);
+	printf("-s [source] camera source: rpi, test or a V4L2 device like /dev/video0, read without camera_streamer.sh (defaults to %s)\n",cameras[0].source);
+	printf("-e [command] run that instead of %s for the camera pipelines, with the same arguments (loop_bench runs fake_cam)\n",CAM_CMD);
+	printf("-E [device] V4L2 encoder for a source device that gives raw frames, e.g. /dev/video11 on the Pi\n");
+	printf("-w [width] video width (defaults to %i)\n",cameras[0].width);
+	printf("-h [height] video height (defaults to %i)\n",cameras[0].height);
+	printf("-f [fps] frames per second (defaults to %i)\n",cameras[0].fps);
+	printf("-b [bitrate] bitrate in bits/s (defaults to %i)\n",cameras[0].bitrate);
+	printf("-g [gop] keyframe interval in frames (defaults to %i)\n",cameras[0].gop);
+	printf("-n [slices] slices per frame, each is sent as soon as encoded (defaults to %i); raspivid and omxh264enc\n",cameras[0].slices);
+	printf("   encode one, so it's always 1 with -s rpi\n");
+	printf("-L [width]x[height]:[bitrate] also encode a low resolution layer viewers can switch to\n");
+	printf("-D [seconds] keep the last seconds of the stream in memory, dumped to disk on request\n");
+	printf("-m [bytes] memory budget of the recorder (defaults to %i)\n",dvr_bytes);
+	printf("-S [seconds] record to rolling MPEG-TS segments of that length\n");
+	printf("-K [segments] segments kept on disk, 0 keeps all (defaults to %i)\n",rec_keep);
+	printf("-o [dir] where recordings are written (defaults to %s)\n",record_dir);
+	printf("-i use cyclic intra refresh instead of periodic IDRs, -g sets the refresh period\n");
+	printf("-q [bytes] send queue budget, least important data is dropped beyond it (defaults to %i)\n",queue_budget);
+	printf("-l [ms] send queue deadline, older packets are dropped (defaults to %i, 0 disables)\n",queue_deadline);
+	printf("-r [kbit/s] pace sending to the link rate (defaults to unpaced)\n");
+	printf("-B [bytes] socket send buffer of TCP viewers (defaults to %i)\n",tcp_sndbuf);
+	printf("-t [seconds] drop viewers whose heartbeats stopped or whose UDP port is unreachable that long, 0 disables (defaults to %i)\n",live_timeout);
+	printf("-F drop the newest packets when the send queue is full instead of by priority\n");
+	printf("-M [group]:[port] send to a multicast group instead of each viewer, layer n goes to port + 2n\n");
+	printf("-T [ttl] multicast TTL (defaults to %i)\n",mcast_ttl);
+	printf("-I [address] address of the interface multicast is sent from (defaults to the routing table's choice)\n");
+	printf("-P [port] also serve RTSP on that port, rtsp://[host]:[port]/[camera]/ (/low for the low resolution layer)\n");
+	printf("-H [port][:part ms[:segment ms]] also serve low-latency HLS on that port, http://[host]:[port]/stream.m3u8 (defaults to %i ms parts, %i ms segments)\n",hls_part_ms,hls_segment_ms);
+	printf("-x [name][:bytes] also publish access units to local processes in the shared memory ring /dev/shm/[name] (defaults to %li bytes)\n",shm_bytes);
+	printf("-X [width]x[height] also publish raw I420 frames of that size in the ring\n");
+	printf("-Z [stage]:[policy]:[priority][:cpus] schedule a stage: server (control, sending, V4L2 capture) or camera (camera_streamer.sh capture and\n");
+	printf("   encoding, of the camera -C set up); policy is other, batch, idle, fifo or rr, cpus a list like 1,2 or 0-3\n");
+	printf("-G [threshold][:fps[:bitrate]] encode a still scene at fps (defaults to 1) and bitrate (defaults to the same bits per frame),\n");
+	printf("   every frame again as soon as the mean luma difference reaches threshold (defaults to %.1f); needs -s [device] -E [device]\n",MOTION_THRESHOLD);
+	printf("-Y [path] take telemetry records from local processes on that Unix datagram socket: [sample time 8][record], the time in CLOCK_MONOTONIC\n");
+	printf("   microseconds (0 = when it arrives); viewers asking with MSG_TELEMETRY get them as RTP on the video's clock\n");
+	printf("-A [file] viewers must prove they know the secret in that file (MSG_AUTH) before anything else, their stream\n");
+	printf("   and telemetry are then sent as SRTP (AES-128-GCM) with keys from the handshake; not with -P, -M or -H\n");
+	printf("-k lock the server's memory, the stream never waits for a page fault\n");
+	printf("-R [host]:[port] relay the stream of the camera_server at host:port instead of running a camera\n");
 }
 
 void catch_signal(int sig)
@@ -38,6 +362,11 @@ void catch_signal(int sig)
 	stop = 1;
 }
 
+//select() is interrupted, a dead camera process is noticed right away
+void catch_child(int sig) {
+	child_exited = 1;
+}
+
 int getMsgSize(unsigned char *b) {
 	int tmp;
 	memcpy(&tmp,b,4);
@@ -46,36 +375,1304 @@ int getMsgSize(unsigned char *b) {
 	return ret;
 }
 
-void startCam(unsigned char ip[4],int port) {
-	if (cam_active) {
-		if (verbose) printf("Camera is already streaming!\n");
+//CPU seconds used so far by us (pid 0) or the camera process. Of the processes a camera_streamer.sh
+//pipeline runs only those that exited are counted, raspivid and gst-launch alone are exec'd.
+double cpuSeconds(pid_t pid) {
+	struct rusage ru;
+	unsigned long ut = 0, st = 0;
+	long cut = 0, cst = 0;
+	char path[32], buf[512], *p;
+	FILE *f;
+
+	if (!pid) {
+		getrusage(RUSAGE_SELF, &ru);
+		return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+	}
+	sprintf(path, "/proc/%i/stat", pid);
+	f = fopen(path, "r");
+	if (!f) return 0;
+	p = fgets(buf, sizeof(buf), f) ? strrchr(buf, ')') : NULL; //the command name may hold anything
+	if (p) sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld", &ut, &st, &cut, &cst);
+	fclose(f);
+	return (ut + st + cut + cst) / (double)sysconf(_SC_CLK_TCK);
+}
+
+long usSince(struct timeval *t) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - t->tv_sec) * 1000000L + (now.tv_usec - t->tv_usec);
+}
+
+//a reference to the packet for every viewer currently on the layer
+void forwardPacket(struct layer *l, struct pkt_buf *b, int prio, unsigned int nal) {
+	int idx = l - layers;
+
+	l->stat_sec_bytes += b->len;
+	l->stat_frame_pkts++;
+	l->stat_frame_bytes += b->len;
+	for (int i = 0; i < MAX_SENDERS; i++)
+		if (viewers[i].active && viewers[i].layer == idx)
+			sendq_push(&viewers[i].q, b, prio, nal);
+}
+
+//where rtp_send_nal()'s packets go
+struct fanout {
+	struct layer *l;
+	int prio;
+};
+
+//One copy of the packet, the queues share it
+void queuePacket(const unsigned char *pkt, int len, void *arg) {
+	struct fanout *f = (struct fanout *)arg;
+	struct pkt_buf *b = pkt_alloc();
+
+	memcpy(b->data, pkt, len);
+	b->len = len;
+	forwardPacket(f->l, b, f->prio, nal_id);
+	pkt_unref(b);
+}
+
+int nalPrio(const unsigned char *nal, int len) {
+	switch (NAL_TYPE(nal)) {
+		case NAL_SPS:
+		case NAL_PPS: return PRIO_PARAMS;
+		case NAL_SEI: return h264_sei_recovery(nal, len) ? PRIO_PARAMS : PRIO_DISPOSABLE;
+		case NAL_IDR: return PRIO_IDR;
+	}
+	return NAL_REF_IDC(nal) ? PRIO_REF : PRIO_DISPOSABLE;
+}
+
+//the camera is a V4L2 device we read ourselves rather than camera_streamer.sh
+int v4l2Source(struct camera *c) {
+	return !strncmp(c->source, "/dev/", 5);
+}
+
+//the camera keeps running without viewers while something records it
+int recording() {
+	return dvr_seconds || rec_seconds;
+}
+
+//the main layer's consumers keep the first camera running
+int wanted(struct camera *c) {
+	for (int i = 0; i < MAX_VIEWERS; i++)
+		if (viewers[i].active && viewers[i].camera == c - cameras) return 1;
+	return c == cameras && (recording() || (hls_port && hls_idle(&hls) < HLS_IDLE_US) || (shm_name && shm_consumers(&shm)));
+}
+
+int layerViewers(struct layer *l) {
+	int n = 0;
+	for (int i = 0; i < MAX_SENDERS; i++)
+		if (viewers[i].active && viewers[i].layer == l - layers) n++;
+	return n;
+}
+
+void sendNal(struct layer *l, const unsigned char *nal, int len, int marker) {
+	struct fanout f = { l, nalPrio(nal, len) };
+	if (!layerViewers(l)) return;
+	nal_id++;
+	rtp_send_nal(&l->rtp, nal, len, l->au_ts, marker, queuePacket, &f);
+}
+
+void sendParams(struct layer *l) {
+	if (!l->sps_len || !l->pps_len) return;
+	sendNal(l, l->sps, l->sps_len, 0);
+	sendNal(l, l->pps, l->pps_len, 0);
+	l->params_sent = 3;
+}
+
+//Without IDRs a decoder can only start at a recovery point, add one if the encoder doesn't
+void sendRecovery(struct layer *l) {
+	unsigned char sei[32];
+	sendParams(l);
+	sendNal(l, sei, h264_make_recovery_sei(sei, l->cam->gop), 0);
+}
+
+void keepNal(struct layer *l, const unsigned char *nal, int len) {
+	static const unsigned char start_code[4] = { 0, 0, 0, 1 };
+
+	if (l->au_len < 0) return;
+	if (!l->au_len) gettimeofday(&l->au_time, NULL);
+	if (l->au_len + 4 + len > AU_SIZE) {
+		l->au_len = -1;
 		return;
 	}
+	memcpy(l->au + l->au_len, start_code, 4);
+	memcpy(l->au + l->au_len + 4, nal, len);
+	l->au_len += 4 + len;
+	if (NAL_TYPE(nal) == NAL_SPS) l->au_params |= 1;
+	if (NAL_TYPE(nal) == NAL_PPS) l->au_params |= 2;
+}
+
+//Recordings may be cut at any keyframe, so each one carries what a decoder needs to start there
+void keepKey(struct layer *l, int key, int sei) {
+	unsigned char buf[32];
+
+	if (!(l->au_params & 1) && l->sps_len) keepNal(l, l->sps, l->sps_len);
+	if (!(l->au_params & 2) && l->pps_len) keepNal(l, l->pps, l->pps_len);
+	if (sei) keepNal(l, buf, h264_make_recovery_sei(buf, l->cam->gop));
+	if (l->au_key != AU_IDR) l->au_key = key;
+}
+
+//Hands the finished access unit to the recorders
+void commitAu(struct layer *l) {
+	if (l->au_len < 0) l->au_broken = 1;
+	else if (l->au_key) l->au_broken = 0;
+	if (l->au_len > 0 && !l->au_broken) {
+		if (dvr_seconds) dvr_add(&dvr, l->au, l->au_len, l->au_key, &l->au_time);
+		if (rec_seconds) rec_add(&rec, l->au, l->au_len, l->au_key, &l->au_time);
+		if (hls_port) hls_add(&hls, l->au, l->au_len, l->au_key, &l->au_time);
+		if (shm_name) shm_put(&shm, SHM_AU, l->au_key, l->au, l->au_len, &l->au_time);
+	}
+	l->au_len = 0;
+	l->au_key = 0;
+	l->au_params = 0;
+}
+
+//Interleaved RTSP shares the socket with the media: a reply only goes between two packets
+int controlWaits(struct viewer *v) {
+	return v->rtsp && v->tcp && v->q.busy;
+}
+
+//Control messages go out whole and in order: what the socket has no room for waits for flushControl()
+void controlSend(struct viewer *v, const unsigned char *buf, int len) {
+	int ret = 0;
+	unsigned char *p;
+
+	if (!v->ctl_len && !controlWaits(v)) {
+		ret = send(v->sock, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) ret = 0; //a lost connection is noticed reading
+		if (ret == len) return;
+	}
+	p = (unsigned char *)realloc(v->ctl_out, v->ctl_len + len - ret);
+	if (!p) return;
+	v->ctl_out = p;
+	memcpy(v->ctl_out + v->ctl_len, buf + ret, len - ret);
+	v->ctl_len += len - ret;
+}
+
+void flushControl(struct viewer *v) {
 	int ret;
-	memset(cmd, '\0', 256);
-	sprintf(cmd, "%s start %i.%i.%i.%i %i",CAM_CMD, ip[0],ip[1],ip[2],ip[3],port);
-	if (verbose) printf("Executing: %s\n",cmd);
-	ret=system(cmd);
-	
-	if (ret==0) cam_active = 1;
 
-	if (verbose) printf("Starting camera_streamer returned: %i\n",ret);
+	if (controlWaits(v)) return;
+	ret = send(v->sock, v->ctl_out + v->ctl_sent, v->ctl_len - v->ctl_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret > 0) v->ctl_sent += ret;
+	if (v->ctl_sent < v->ctl_len) return;
+	free(v->ctl_out);
+	v->ctl_out = NULL;
+	v->ctl_len = v->ctl_sent = 0;
+}
+
+//Tells the camera's viewers that it failed, or is back
+void sendStatus(struct camera *c, int state, long retry_ms) {
+	unsigned char msg[11];
+	int tmp;
+
+	tmp = htonl(11);
+	memcpy(msg, &tmp, 4);
+	msg[4] = MSG_STATUS;
+	msg[5] = c - cameras;
+	msg[6] = state;
+	tmp = htonl(retry_ms);
+	memcpy(msg + 7, &tmp, 4);
+	for (int i = 0; i < MAX_VIEWERS; i++) {
+		struct viewer *v = &viewers[i];
+		if (v->sock && v->active && !v->rtsp && v->camera == c - cameras) controlSend(v, msg, 11);
+	}
+}
+
+//A picture on the camera's main layer, the watchdog's sign of life
+void camFrame(struct camera *c) {
+	gettimeofday(&c->last_frame, NULL);
+	c->got_frame = 1;
+	if (!c->restarting) return;
+	c->restarting = 0;
+	if (verbose) printf("Camera %s recovered: first frame %.0f ms after the failure, %.0f ms after the restart\n",
+		c->name, usSince(&c->down_at) / 1000.0, usSince(&c->started) / 1000.0);
+	sendStatus(c, 0, 0);
+}
+
+//Viewers joining or switching to the layer start at an IDR or, in intra refresh mode, at any picture;
+//through a relay at the SPS the upstream server puts in front of either
+int joinLayer(struct layer *l, int type) {
+	int idx = l - layers;
+	int joined = 0;
+
+	if (!relay_host && (!l->sps_len || !l->pps_len)) return 0;
+	for (int i = 0; i < MAX_SENDERS; i++) {
+		struct viewer *v = &viewers[i];
+		if (!v->active || v->mcast || v->want != idx || v->layer == idx) continue;
+		if (verbose) printf("%s %i %s %s layer %i at %s\n", i < MAX_VIEWERS ? "Viewer" : "Group", i < MAX_VIEWERS ? i : i - MAX_VIEWERS, v->layer < 0 ? "joined" : "switched to", l->cam->name, idx % MAX_LAYERS, type == NAL_IDR ? "IDR" : type == NAL_SPS ? "keyframe" : "intra refresh");
+		v->layer = idx;
+		joined = 1;
+	}
+	return joined;
+}
+
+//When the frame was captured if the camera says, else when it got here; telemetry is matched to frames by it
+unsigned int frameStamp(struct camera *c) {
+	struct vcap *vc = &c->vcap;
+	if (v4l2Source(c) && vc->monotonic && vc->stamp.tv_sec) return rtp_timestamp_us(vc->stamp.tv_sec * 1000000ULL + vc->stamp.tv_usec);
+	return rtp_timestamp();
+}
+
+void endFrame(struct layer *l) {
+	if (l->stat_frame_pkts > l->stat_peak_pkts) l->stat_peak_pkts = l->stat_frame_pkts;
+	if (l->stat_frame_bytes > l->stat_peak_bytes) l->stat_peak_bytes = l->stat_frame_bytes;
+	l->stat_frame_pkts = l->stat_frame_bytes = 0;
+}
+
+void onNal(const unsigned char *nal, int len, void *arg) {
+	struct layer *l = (struct layer *)arg;
+	int type = NAL_TYPE(nal);
+	int picture, recovery;
+
+	if (l->au_slices < 0 || (l->au_slices > 0 && (!NAL_IS_SLICE(type) || NAL_FIRST_MB_ZERO(nal)))) {
+		if (l->au_slices > 0) l->enc_slices = l->au_slices;
+		if (l->au) commitAu(l);
+		l->au_ts = frameStamp(l->cam);
+		l->au_slices = 0;
+		l->params_sent = 0;
+		endFrame(l);
+	}
+	picture = NAL_IS_SLICE(type) && !l->au_slices;
+
+	switch (type) {
+		case NAL_AUD: return; //RTP marks access units itself
+		case NAL_SPS:
+			if (len <= PARAM_SIZE) { memcpy(l->sps, nal, len); l->sps_len = len; }
+			l->params_sent |= 1;
+			break;
+		case NAL_PPS:
+			if (len <= PARAM_SIZE) { memcpy(l->pps, nal, len); l->pps_len = len; }
+			l->params_sent |= 2;
+			break;
+		case NAL_SEI:
+			if (h264_sei_recovery(nal, len)) l->enc_recovery = 1;
+			break;
+	}
+
+	if (picture) l->frames++;
+	if (picture) enc_frames++;
+	if (picture && l == &layers[(l->cam - cameras) * MAX_LAYERS]) camFrame(l->cam);
+	enc_bytes += len;
+	//intra refresh: a recovery point every period, or right away when asked for one
+	recovery = picture && l->cam->refresh && (l->key_request || (!l->enc_recovery && !(l->frames % l->cam->gop)));
+	if (recovery || (picture && type == NAL_IDR)) l->key_request = 0; //an IDR can't be forced, it comes every gop
+
+	if (l->au) {
+		if (picture && type == NAL_IDR) keepKey(l, AU_IDR, 0);
+		else if (type == NAL_SEI && h264_sei_recovery(nal, len)) keepKey(l, AU_RECOVERY, 0);
+		else if (recovery) keepKey(l, AU_RECOVERY, 1);
+		keepNal(l, nal, len);
+	}
+
+	if (picture && (type == NAL_IDR || l->cam->refresh) && joinLayer(l, type)) {
+		if (type == NAL_IDR) sendParams(l);
+		else sendRecovery(l);
+	} else if (picture && type == NAL_IDR && l->params_sent != 3) {
+		sendParams(l); //every IDR must be decodable on its own (what config-interval=1 did)
+	} else if (recovery) {
+		sendRecovery(l);
+	}
+
+	if (NAL_IS_SLICE(type)) {
+		//the marker goes on the slice that ends the picture, known before the next one only from how many
+		//there are: what was asked for until the encoder showed how many it really gives
+		l->au_slices++;
+		sendNal(l, nal, len, l->au_slices == (l->enc_slices ? l->enc_slices : l->cam->slices));
+	} else sendNal(l, nal, len, 0);
 }
 
-void stopCam() {
-	if (!cam_active) {
+//Relay mode: joins the upstream server as one of its viewers instead of starting the camera
+void startRelay() {
+	struct addrinfo hints, *ai;
+	struct sockaddr_in a;
+	socklen_t alen = sizeof(a);
+	unsigned char msg[14];
+	char port[8];
+	int tmp, size = RELAY_RCVBUF;
+	struct layer *l = &layers[0];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(port, "%i", relay_port);
+	if ((tmp = getaddrinfo(relay_host, port, &hints, &ai))) {
+		fprintf(stderr, "%s: %s\n", relay_host, gai_strerror(tmp));
 		return;
 	}
-	int ret;
-	memset(cmd, '\0', 256);
-	sprintf(cmd, "%s stop",CAM_CMD);
-	if (verbose) printf("Executing: %s\n",cmd);
-	ret = system(cmd);
-	if (ret==0) cam_active = 0;
-	if (verbose) printf("Stoping camera_streamer returned: %i\n",ret);
+	up_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (up_sock < 0 || connect(up_sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+		perror("Connecting upstream");
+		freeaddrinfo(ai);
+		if (up_sock >= 0) close(up_sock);
+		up_sock = -1;
+		return;
+	}
+	freeaddrinfo(ai);
+
+	//the stream comes back to the address the upstream server sees us at
+	up_udp = socket(AF_INET, SOCK_DGRAM, 0);
+	getsockname(up_sock, (struct sockaddr *)&a, &alen);
+	a.sin_port = 0;
+	if (up_udp < 0 || bind(up_udp, (struct sockaddr *)&a, sizeof(a)) < 0 || getsockname(up_udp, (struct sockaddr *)&a, &alen) < 0) {
+		perror("Relay socket");
+		close(up_sock);
+		if (up_udp >= 0) close(up_udp);
+		up_sock = up_udp = -1;
+		return;
+	}
+	fcntl(up_udp, F_SETFL, O_NONBLOCK);
+	setsockopt(up_udp, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	tmp = htonl(14);
+	memcpy(msg, &tmp, 4);
+	msg[4] = MSG_START;
+	memcpy(msg + 5, &a.sin_addr.s_addr, 4);
+	tmp = htonl(ntohs(a.sin_port));
+	memcpy(msg + 9, &tmp, 4);
+	msg[13] = 0; //main layer
+	if (send(up_sock, msg, 14, MSG_NOSIGNAL) < 0) perror("Starting upstream");
+	if (verbose) printf("Relaying %s:%i, receiving on port %i\n", relay_host, relay_port, ntohs(a.sin_port));
+
+	cameras[0].nlayers = 1;
+	memset(l, 0, sizeof(*l));
+	l->cam = &cameras[0];
+	l->fd = -1;
+	gettimeofday(&l->stat_start, NULL);
+	key_pending = 0;
+	cameras[0].active = 1;
+}
+
+//One request upstream covers every viewer waiting for a starting point
+void relayKeyframe() {
+	unsigned char msg[5];
+	int tmp, waiting = key_wanted;
+
+	for (int i = 0; i < MAX_SENDERS; i++)
+		if (viewers[i].active && !viewers[i].mcast && viewers[i].layer < 0) waiting = 1;
+	if (!waiting) return;
+	if (key_pending && usSince(&key_sent) < KEY_RETRY_US) return;
+
+	tmp = htonl(5);
+	memcpy(msg, &tmp, 4);
+	msg[4] = MSG_KEYFRAME;
+	if (send(up_sock, msg, 5, MSG_NOSIGNAL) < 0) return;
+	key_pending = 1;
+	key_wanted = 0;
+	gettimeofday(&key_sent, NULL);
+	relay_key_requests++;
+}
+
+//Packets are received into shared buffers and queued for every viewer as they are
+void readRelay() {
+	struct mmsghdr msgs[RELAY_BATCH];
+	struct iovec iov[RELAY_BATCH];
+	struct layer *l = &layers[0];
+	unsigned char hdr;
+	int i, n, off, start;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RELAY_BATCH; i++) {
+		if (!relay_bufs[i]) relay_bufs[i] = pkt_alloc();
+		iov[i].iov_base = relay_bufs[i]->data;
+		iov[i].iov_len = RTP_MTU;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(up_udp, msgs, RELAY_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) perror("Reading upstream");
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct pkt_buf *b = relay_bufs[i];
+		relay_bufs[i] = NULL;
+		b->len = msgs[i].msg_len;
+		relay_pkts++;
+		off = msgs[i].msg_hdr.msg_flags & MSG_TRUNC ? -1 : rtp_parse(b->data, b->len, &hdr, &start);
+		if (off >= 0) {
+			if (start) {
+				nal_id++;
+				//FU-A SEIs can't be looked into, recovery points are small enough not to need fragmenting
+				relay_prio = (b->data[off] & 0x1f) == 28 ? nalPrio(&hdr, 1) : nalPrio(b->data + off, b->len - off);
+				if (NAL_TYPE(&hdr) == NAL_SPS && joinLayer(l, NAL_SPS)) key_pending = 0;
+			}
+			forwardPacket(l, b, relay_prio, nal_id);
+			if (b->data[1] & 0x80) endFrame(l); //marker
+		}
+		pkt_unref(b);
+	}
+}
+
+//What the camera encodes: -w by -h, or the size asked for with its region of interest
+int camWidth(struct camera *c) {
+	return c->roi_w ? c->roi_width : c->width;
+}
+
+int camHeight(struct camera *c) {
+	return c->roi_w ? c->roi_height : c->height;
+}
+
+//Layer i of the camera reading the encoder's byte-stream from fd, -1 if its NALs come some other way
+void initLayer(struct camera *c, int i, int fd) {
+	struct layer *l = &layers[(c - cameras) * MAX_LAYERS + i];
+
+	memset(l, 0, sizeof(*l));
+	l->cam = c;
+	l->fd = fd;
+	if (fd >= 0) {
+		fcntl(l->fd, F_SETFL, O_NONBLOCK);
+		nal_scanner_init(&l->scanner, CAM_BUF_SIZE);
+	}
+	l->width = i ? c->low_width : camWidth(c);
+	l->height = i ? c->low_height : camHeight(c);
+	l->bitrate = i ? c->low_bitrate : c->bitrate;
+	gettimeofday(&l->last_read, NULL);
+	rtp_init(&l->rtp);
+	l->au_slices = -1;
+	l->enc_slices = 0;
+	if (l == layers && (recording() || hls_port || shm_name)) l->au = (unsigned char *)malloc(AU_SIZE); //the recorders, HLS and the ring take the main layer
+	gettimeofday(&l->stat_start, NULL);
+}
+
+//Viewers waiting for a keyframe of the camera's layers
+int keyWaiting(struct camera *c) {
+	for (int i = 0; i < MAX_SENDERS; i++)
+		if (viewers[i].active && viewers[i].want >= 0 && viewers[i].want / MAX_LAYERS == c - cameras && viewers[i].layer != viewers[i].want) return 1;
+	return 0;
+}
+
+//The motion gate sees each raw frame before the encoder: once the scene stayed still for a second the frame rate and
+//bitrate drop, the first frame that differs enough from the last one encoded restores both
+int gateFrame(const unsigned char *luma, void *arg) {
+	struct camera *c = (struct camera *)arg;
+	double activity = motion_compare(&c->motion, luma, c->vcap.stride);
+
+	if (activity >= c->motion_threshold) {
+		c->still = 0;
+		if (c->gated) {
+			c->gated = 0;
+			vcap_set_bitrate(&c->vcap, c->bitrate);
+			if (verbose) printf("%s: motion (%.1f), %i frames/s\n", c->name, activity, c->fps);
+		}
+	} else if (!c->gated && ++c->still >= c->fps) {
+		c->gated = 1;
+		vcap_set_bitrate(&c->vcap, c->static_bitrate);
+		if (verbose) printf("%s: still, %i frames/s\n", c->name, c->static_fps);
+	}
+	if (c->gated) {
+		c->gated_frames++;
+		if (usSince(&c->last_encoded) < 1000000L / c->static_fps && !keyWaiting(c)) {
+			gettimeofday(&c->last_frame, NULL); //the camera is fine, the watchdog mustn't restart it
+			return 0;
+		}
+		if (keyWaiting(c)) vcap_force_keyframe(&c->vcap); //the GOP counts encoded frames, it'd take minutes
+	}
+	gettimeofday(&c->last_encoded, NULL);
+	motion_keep(&c->motion);
+	return 1;
+}
+
+//The encoder's buffers are parsed where the driver put them, no camera process and no pipe
+void startV4l2(struct camera *c) {
+	if (verbose) printf("Capturing %s from %s%s%s\n", c->name, c->source, c->encoder_dev ? ", encoding with " : "", c->encoder_dev ? c->encoder_dev : "");
+	if (vcap_open(&c->vcap, c->source, c->encoder_dev, c->width, c->height, c->fps, c->bitrate, c->gop, c->slices) < 0) return;
+	if (verbose && (c->vcap.width != c->width || c->vcap.height != c->height)) printf("%s gives %ix%i frames\n", c->source, c->vcap.width, c->vcap.height);
+	if (c->motion_threshold > 0) {
+		if (motion_init(&c->motion, c->vcap.width, c->vcap.height) < 0) {
+			perror("motion gate");
+			vcap_close(&c->vcap);
+			return;
+		}
+		c->vcap.gate = gateFrame;
+		c->vcap.gate_arg = c;
+		c->still = c->gated = 0;
+	}
+	c->nlayers = 1;
+	initLayer(c, 0, -1);
+	c->active = 1;
+}
+
+void startCam(struct camera *c) {
+	if (c->active) {
+		if (verbose) printf("Camera %s is already streaming!\n", c->name);
+		return;
+	}
+	if (c->restarting && usSince(&c->failed_at) < c->backoff_us) return; //the watchdog starts it once the backoff is over
+	gettimeofday(&c->started, NULL);
+	c->last_frame = c->started;
+	c->got_frame = 0;
+	if (relay_host) {
+		startRelay();
+		return;
+	}
+	if (hls_port && c == cameras) hls_size(&hls, camWidth(c), camHeight(c)); //an ROI may have changed it
+	if (v4l2Source(c)) {
+		startV4l2(c);
+		return;
+	}
+	int fd[MAX_LAYERS][2], raw[2];
+	char a[13][24];
+	int i, nlayers = c->low_width ? 2 : 1;
+	int raw_frames = raw_width && c == cameras; //they go into the main layer's ring
+
+	sprintf(a[0], "%i", camWidth(c));
+	sprintf(a[1], "%i", camHeight(c));
+	sprintf(a[2], "%i", c->fps);
+	sprintf(a[3], "%i", c->bitrate);
+	sprintf(a[4], "%i", c->gop);
+	sprintf(a[5], "%i", c->slices);
+	sprintf(a[6], "%s", c->refresh ? "cyclic" : "idr");
+	sprintf(a[7], "%i", c->low_width);
+	sprintf(a[8], "%i", c->low_height);
+	sprintf(a[9], "%i", c->low_bitrate);
+	sprintf(a[10], "%i", raw_frames ? raw_width : 0);
+	sprintf(a[11], "%i", raw_frames ? raw_height : 0);
+	if (c->roi_w) sprintf(a[12], "%i,%i,%i,%i", c->roi_x, c->roi_y, c->roi_w, c->roi_h);
+	else strcpy(a[12], "0,0,10000,10000");
+	if (verbose) printf("Executing: %s capture %s %s %s %s %s %s %s %s %s %s %s %s %s %s\n",cam_cmd,c->source,a[0],a[1],a[2],a[3],a[4],a[5],a[6],a[7],a[8],a[9],a[10],a[11],a[12]);
+
+	for (i = 0; i < nlayers; i++) {
+		if (pipe(fd[i]) < 0) {
+			perror("pipe");
+			while (i--) { close(fd[i][0]); close(fd[i][1]); }
+			return;
+		}
+	}
+	if (raw_frames && pipe(raw) < 0) {
+		perror("pipe");
+		for (i = 0; i < nlayers; i++) { close(fd[i][0]); close(fd[i][1]); }
+		return;
+	}
+	c->pid = fork();
+	if (c->pid < 0) {
+		perror("fork");
+		for (i = 0; i < nlayers; i++) { close(fd[i][0]); close(fd[i][1]); }
+		if (raw_frames) { close(raw[0]); close(raw[1]); }
+		return;
+	}
+	if (c->pid == 0) { //encoder writes the H.264 byte-streams to our pipes: high on stdout, low on fd 3; raw frames on fd 4
+		setpgid(0, 0); //cam_cmd may run a shell pipeline, stopCam() signals the whole group
+		rt_apply(&c->sched, 0, 0); //inherited by the whole pipeline
+		dup2(fd[0][1], 1);
+		if (nlayers > 1) dup2(fd[1][1], 3);
+		if (raw_frames) dup2(raw[1], 4);
+		for (i = 3; i < 1024; i++)
+			if (!(i == 3 && nlayers > 1) && !(i == 4 && raw_frames)) close(i);
+		execl(cam_cmd, cam_cmd, "capture", c->source, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], (char *)NULL);
+		perror("exec");
+		_exit(127);
+	}
+	setpgid(c->pid, c->pid);
+	c->pgid = c->pid;
+
+	c->nlayers = nlayers;
+	for (i = 0; i < nlayers; i++) {
+		close(fd[i][1]);
+		initLayer(c, i, fd[i][0]);
+	}
+	if (raw_frames) {
+		close(raw[1]);
+		raw_fd = raw[0];
+		raw_partial = 0;
+		fcntl(raw_fd, F_SETFL, O_NONBLOCK);
+		if (fcntl(raw_fd, F_SETPIPE_SZ, 2 * raw_width * raw_height * 3 / 2) < 0) { //a frame must fit to be taken whole
+			perror("raw frame pipe");
+			close(raw_fd);
+			raw_fd = -1;
+		}
+	}
+	c->active = 1;
+}
+
+//Reaps what of a camera's pipeline exited, we're its subreaper so that includes what outlived the process; returns
+//1 once all of it did
+int reapGroup(struct camera *c, int *status, int options) {
+	pid_t pid;
+	int st;
+
+	while ((pid = waitpid(-c->pgid, &st, options)) > 0)
+		if (pid == c->pid) {
+			*status = st;
+			c->pid = 0;
+		}
+	return pid < 0;
+}
+
+void stopCam(struct camera *c) {
+	struct layer *l = &layers[(c - cameras) * MAX_LAYERS];
+
+	if (!c->active) {
+		return;
+	}
+	for (int i = 0; i < MAX_SENDERS; i++)
+		if (viewers[i].layer / MAX_LAYERS == c - cameras) viewers[i].layer = -1; //must start from a keyframe again
+	c->active = 0;
+	if (relay_host) {
+		if (verbose) printf("Stopping relay\n");
+		close(up_sock); //upstream takes that as our MSG_STOP
+		close(up_udp);
+		up_sock = up_udp = -1;
+		return;
+	}
+
+	int status = 0, i;
+	if (hls_port && c == cameras) hls_stop(&hls);
+	if (v4l2Source(c)) {
+		if (verbose) printf("Stopping capture of %s\n", c->name);
+		vcap_close(&c->vcap);
+		motion_free(&c->motion);
+	} else if (c->pgid > 0) { //the whole group, the process may have exited and left the rest of its pipeline running
+		if (verbose) printf("Stopping camera %s (pid %i)\n", c->name, c->pgid);
+		kill(-c->pgid, SIGTERM);
+		for (i = 0; !reapGroup(c, &status, WNOHANG) && i < CAM_KILL_US / 10000; i++) usleep(10000);
+		if (i == CAM_KILL_US / 10000) { //hung
+			kill(-c->pgid, SIGKILL);
+			reapGroup(c, &status, 0);
+		}
+		c->pid = c->pgid = 0;
+		if (verbose) printf("Camera process exited with: %i\n",status);
+	}
+	for (int i = 0; i < c->nlayers; i++) {
+		if (l[i].fd >= 0) close(l[i].fd);
+		l[i].fd = -1;
+		nal_scanner_free(&l[i].scanner);
+		free(l[i].au);
+		l[i].au = NULL;
+	}
+	if (c == cameras && raw_fd >= 0) {
+		close(raw_fd);
+		raw_fd = -1;
+	}
+}
+
+//The watchdog takes a failed camera down, and starts it again after a pause that doubles with each failure in a row
+void camFailed(struct camera *c, const char *why) {
+	c->failures++;
+	c->backoff_us = CAM_BACKOFF_MIN_US << (c->failures < 8 ? c->failures - 1 : 7);
+	if (c->backoff_us > CAM_BACKOFF_MAX_US) c->backoff_us = CAM_BACKOFF_MAX_US;
+	if (verbose) printf("Camera %s %s, %.0f ms after its last frame; failure %i, restarting in %li ms\n",
+		c->name, why, usSince(&c->last_frame) / 1000.0, c->failures, c->backoff_us / 1000);
+	gettimeofday(&c->failed_at, NULL);
+	if (!c->restarting) c->down_at = c->failed_at;
+	c->restarting = 1;
+	sendStatus(c, 1, c->backoff_us / 1000);
+	stopCam(c); //may wait for a hung process, the backoff counts from the failure
+}
+
+//Camera processes that exited, found on SIGCHLD rather than when their pipes run dry
+void reapCams() {
+	char why[64];
+	int status;
+
+	if (!child_exited) return;
+	child_exited = 0;
+	for (int i = 0; i < ncameras; i++) {
+		struct camera *c = &cameras[i];
+		if (!c->active || c->pid <= 0 || waitpid(c->pid, &status, WNOHANG) != c->pid) continue;
+		c->pid = 0;
+		if (WIFSIGNALED(status)) snprintf(why, sizeof(why), "process was killed by signal %i", WTERMSIG(status));
+		else snprintf(why, sizeof(why), "process exited with %i", WEXITSTATUS(status));
+		camFailed(c, why);
+	}
+}
+
+//The watchdog: a camera that stopped giving frames is restarted, one that failed is started again once its backoff
+//is over. Returns how soon it needs to look again.
+long watchCam(struct camera *c) {
+	long limit, left;
+
+	if (relay_host) return 1000000L; //the upstream server watches its camera
+	if (c->active) {
+		limit = c->fps > 0 ? CAM_STALL_FRAMES * 1000000L / c->fps : 0;
+		if (limit < CAM_STALL_US) limit = CAM_STALL_US;
+		left = (c->got_frame ? limit : CAM_START_US) - usSince(&c->last_frame);
+		if (left > 0) {
+			if (c->failures && !c->restarting && usSince(&c->started) >= CAM_HEALTHY_US) c->failures = 0;
+			return left;
+		}
+		camFailed(c, c->got_frame ? "stalled" : "didn't give a frame");
+	}
+	if (!c->restarting) return 1000000L;
+	if (!wanted(c)) { //nobody waits for it anymore
+		c->restarting = 0;
+		c->failures = 0;
+		return 1000000L;
+	}
+	left = c->backoff_us - usSince(&c->failed_at);
+	if (left > 0) return left;
+	if (verbose) printf("Restarting camera %s\n", c->name);
+	startCam(c);
+	if (!c->active) camFailed(c, "didn't start");
+	return c->active ? CAM_START_US : c->backoff_us;
+}
+
+//A viewer zoomed: the region is taken once the burst of them settled
+void setRoi(struct camera *c, unsigned char *buf, int len) {
+	unsigned short f[6] = { 0 };
+
+	if (relay_host || v4l2Source(c)) { //no pipeline here to crop in
+		if (verbose) printf("Camera %s can't crop, the region of interest is ignored\n", c->name);
+		return;
+	}
+	for (int i = 0; i < 6 && 2 * i + 2 <= len; i++) f[i] = buf[2 * i] << 8 | buf[2 * i + 1];
+	if (f[2] < ROI_MIN || f[3] < ROI_MIN || f[0] + f[2] > 10000 || f[1] + f[3] > 10000 || f[4] % 2 || f[5] % 2 ||
+		(f[4] && (f[4] < 64 || f[4] > 1920 || f[5] < 64 || f[5] > 1080))) {
+		if (verbose) printf("Bad region of interest %i,%i %ix%i, %ix%i\n", f[0], f[1], f[2], f[3], f[4], f[5]);
+		return;
+	}
+	if (f[2] == 10000 && f[3] == 10000 && !f[4]) f[2] = 0; //back to the whole frame
+	if (!f[4]) {
+		f[4] = c->width;
+		f[5] = c->height;
+	}
+	if (f[2] == c->roi_w && (!f[2] || (f[0] == c->roi_x && f[1] == c->roi_y && f[3] == c->roi_h && f[4] == c->roi_width && f[5] == c->roi_height))) return;
+	c->roi_x = f[0];
+	c->roi_y = f[1];
+	c->roi_w = f[2];
+	c->roi_h = f[3];
+	c->roi_width = f[4];
+	c->roi_height = f[5];
+	c->roi_pending = 1;
+	gettimeofday(&c->roi_at, NULL);
+}
+
+//Rebuilds the pipeline with the new region, the viewers stay and pick it up at its first IDR.
+//Returns how soon it needs to look again.
+long applyRoi(struct camera *c) {
+	long left;
+
+	if (!c->roi_pending) return 1000000L;
+	left = ROI_SETTLE_US - usSince(&c->roi_at);
+	if (left > 0) return left;
+	c->roi_pending = 0;
+	if (verbose) {
+		if (c->roi_w) printf("Camera %s: region of interest %.2f,%.2f %.2fx%.2f encoded at %ix%i\n", c->name,
+			c->roi_x / 10000.0, c->roi_y / 10000.0, c->roi_w / 10000.0, c->roi_h / 10000.0, c->roi_width, c->roi_height);
+		else printf("Camera %s: whole frame\n", c->name);
+	}
+	if (!c->active) return 1000000L; //taken when it starts
+	stopCam(c);
+	startCam(c);
+	if (!c->active) camFailed(c, "didn't start");
+	return 1000000L;
+}
+
+//Replies from upstream aren't needed, a closed connection means the stream is gone
+void readUpstream() {
+	unsigned char buf[BUF_SIZE];
+	int ret = read(up_sock, buf, sizeof(buf));
+	if (ret > 0 || (ret < 0 && errno == EINTR)) return;
+	if (verbose) printf("Lost connection to the upstream server.\n");
+	stopCam(&cameras[0]);
+}
+
+//A layer's group is sent to while a multicast viewer wants the layer
+void updateGroups() {
+	for (int i = 0; i < MAX_CAMERAS * MAX_LAYERS; i++) {
+		struct viewer *g = &groups[i];
+		int members = 0;
+
+		for (int j = 0; j < MAX_VIEWERS; j++)
+			if (viewers[j].active && viewers[j].mcast && viewers[j].want == i) members++;
+		if (members && !g->active) {
+			bzero((char *) &g->dest, sizeof(g->dest));
+			g->dest.sin_family = AF_INET;
+			g->dest.sin_addr = mcast_group;
+			g->dest.sin_port = htons(mcast_port + 2 * i);
+			g->layer = -1;
+			g->want = i;
+			sendq_init(&g->q, queue_budget, queue_deadline * 1000L, link_rate * 1000L / 8, queue_fifo, 0);
+			g->active = 1;
+			if (verbose) printf("Group %i streaming to %s:%i\n", i, inet_ntoa(mcast_group), mcast_port + 2 * i);
+		} else if (!members && g->active) {
+			g->active = 0;
+			g->layer = -1;
+			sendq_free(&g->q);
+			if (verbose) printf("Group %i stopped\n", i);
+		}
+	}
+}
+
+//Tells a multicast viewer which group carries the layer it wants
+int groupMsg(struct viewer *v, unsigned char *buf) {
+	int tmp;
+
+	tmp = htonl(13);
+	memcpy(buf, &tmp, 4);
+	buf[4] = MSG_GROUP;
+	memcpy(buf + 5, &mcast_group.s_addr, 4);
+	tmp = htonl(mcast_port + 2 * v->want);
+	memcpy(buf + 9, &tmp, 4);
+	return 13;
+}
+
+void startViewer(struct viewer *v, unsigned char ip[4], int port, int camera, int layer) {
+	struct camera *c = &cameras[camera];
+	int i = v - viewers;
+
+	if (v->active) {
+		if (verbose) printf("Viewer %i is already streaming!\n", i);
+		return;
+	}
+	bzero((char *) &v->dest, sizeof(v->dest));
+	v->dest.sin_family = AF_INET;
+	memcpy(&v->dest.sin_addr.s_addr, ip, 4);
+	v->dest.sin_port = htons(port);
+	v->camera = camera;
+	v->layer = -1;
+	sendq_init(&v->q, queue_budget, queue_deadline * 1000L, link_rate * 1000L / 8, queue_fifo, v->tcp);
+	if (v->auth == AUTH_DONE) v->q.srtp = &v->srtp;
+	v->heard_bytes = 0;
+	v->unreachable = 0;
+	v->active = 1;
+	if (verbose) printf("Viewer %i streaming %s to %i.%i.%i.%i:%i%s\n",i,c->name,ip[0],ip[1],ip[2],ip[3],port,v->tcp ? " over TCP" : "");
+
+	startCam(c);
+	v->want = camera * MAX_LAYERS + (layer < c->nlayers ? layer : c->nlayers - 1);
+	if (mcast_port && !v->tcp) {
+		v->mcast = 1;
+		updateGroups();
+	}
+}
+
+void disconnectViewer(struct viewer *v) {
+	close(v->out_sock);
+	v->out_sock = 0;
+	v->connecting = 0;
+	v->blocked = 0;
+	v->layer = -1; //what's queued is dropped as too late, the stream resumes at a keyframe
+}
+
+//TCP viewers listen for the stream (tcpserversrc), we connect to them
+void connectViewer(struct viewer *v) {
+	int one = 1;
+
+	gettimeofday(&v->retry, NULL);
+	v->out_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (v->out_sock < 0) {
+		perror("socket");
+		v->out_sock = 0;
+		return;
+	}
+	setsockopt(v->out_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(v->out_sock, SOL_SOCKET, SO_SNDBUF, &tcp_sndbuf, sizeof(tcp_sndbuf));
+	fcntl(v->out_sock, F_SETFL, O_NONBLOCK);
+	if (connect(v->out_sock, (struct sockaddr *)&v->dest, sizeof(v->dest)) < 0 && errno != EINPROGRESS) {
+		disconnectViewer(v);
+		return;
+	}
+	v->connecting = 1;
+}
+
+//Our own stream connection: connected, or gone
+void checkConnection(struct viewer *v, fd_set *readfds, fd_set *writefds) {
+	unsigned char buf[64];
+	int err = 0, ret;
+	socklen_t len = sizeof(err);
+
+	if (v->connecting && FD_ISSET(v->out_sock, writefds)) {
+		getsockopt(v->out_sock, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			disconnectViewer(v);
+			return;
+		}
+		v->connecting = 0;
+		if (verbose) printf("Viewer %i connected\n", (int)(v - viewers));
+	}
+	if (!FD_ISSET(v->out_sock, readfds)) return;
+	ret = recv(v->out_sock, buf, sizeof(buf), MSG_DONTWAIT); //viewers don't send anything
+	if (!ret || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+		if (verbose) printf("Viewer %i closed the stream connection\n", (int)(v - viewers));
+		disconnectViewer(v);
+	}
+}
+
+void stopViewer(struct viewer *v) {
+	if (!v->active) return;
+	if (v->tcp && !v->rtsp) {
+		if (v->out_sock) disconnectViewer(v);
+		v->tcp = 0;
+	}
+	v->active = 0;
+	v->layer = -1;
+	v->blocked = 0;
+	v->telem_port = 0;
+	sendq_free(&v->q);
+	if (verbose) printf("Viewer %i stopped\n", (int)(v - viewers));
+	if (v->mcast) {
+		v->mcast = 0;
+		updateGroups();
+	}
+
+	if (!wanted(&cameras[v->camera])) stopCam(&cameras[v->camera]); //nobody is watching
+}
+
+void dumpDvr() {
+	char path[256];
+	time_t now = time(NULL);
+
+	if (!dvr_seconds || !cameras[0].active) return;
+	strftime(path + snprintf(path, 192, "%s/", record_dir), 64, "dvr-%Y%m%d-%H%M%S.h264", localtime(&now));
+	if (dvr_dump(&dvr, path) < 0) {
+		if (verbose) printf("Recorder dump not started\n");
+		return;
+	}
+	if (verbose) printf("Dumping %i seconds of video to %s\n", dvr_seconds, path);
+}
+
+//The layer whose statistics also cover what the cameras share: the first running camera's main layer
+struct layer *statsLayer() {
+	for (int i = 0; i < ncameras; i++)
+		if (cameras[i].active) return &layers[i * MAX_LAYERS];
+	return layers;
 }
 
-void processMsg(unsigned char *buf, int len, unsigned char *bufout, int *bufout_len) {	
+void updateStats(struct layer *l) {
+	struct rec_stats rs;
+	struct layer *first = statsLayer();
+	double kbit, mean, var;
+	double link = 0;
+	static double relay_cpu = 0, all_cpu = 0, all_cam_cpu = 0;
+	double cpu, cam_cpu, copies;
+	int frames, running;
+	struct vcap *vc = &l->cam->vcap;
+
+	if (usSince(&l->stat_start) < 1000000L) return;
+	gettimeofday(&l->stat_start, NULL);
+	kbit = l->stat_sec_bytes * 8 / 1000.0;
+	l->stat_sum += kbit;
+	l->stat_sum2 += kbit * kbit;
+	l->stat_sec_bytes = 0;
+	if (++l->stat_secs < STATS_PERIOD) return;
+
+	mean = l->stat_sum / l->stat_secs;
+	var = l->stat_sum2 / l->stat_secs - mean * mean;
+	if (verbose) printf("%s layer %i: %.0f kbit/s, stddev %.0f kbit/s, peak frame %i bytes in %i packets\n", l->cam->name, (int)(l - layers) % MAX_LAYERS,
+		mean, var > 0 ? sqrt(var) : 0, l->stat_peak_bytes, l->stat_peak_pkts);
+	if (verbose && dvr_seconds && l == layers) printf("Recorder: %i frames, %i of %i bytes, %.1f us per frame\n",
+		dvr.count, dvr_used(&dvr), dvr.size, dvr.commits ? dvr.commit_us / dvr.commits : 0);
+	if (rec_seconds && l == layers) {
+		rec_stats(&rec, &rs);
+		if (verbose) printf("Segments: %lu frames written, %lu dropped, %lu new segments, %lu errors, %.0f KB/s, "
+			"write %.1f ms avg %.1f ms max, disk %.0f KB/s, %i bytes queued\n", rs.frames, rs.dropped, rs.segments, rs.errors,
+			rs.kbyte_s, rs.write_us / 1000, rs.write_max_us / 1000, rs.disk_kbyte_s, rs.queued);
+	}
+	if (hls_port && l == layers) {
+		if (verbose) printf("HLS: %lu requests, %lu held until ready, %lu parts sent %.0f ms after their first frame\n",
+			hls.requests, hls.held, hls.served_parts, hls.served_parts ? hls.latency_ms / hls.served_parts : 0);
+		hls.served_parts = 0;
+		hls.latency_ms = 0;
+	}
+	if (verbose && shm_name && l == layers) {
+		uint64_t lag, overruns;
+		printf("Shared memory: %lu entries, %.0f KB/s, %i consumers\n", shm.entries, shm.bytes / 1024.0 / l->stat_secs, shm_consumers(&shm));
+		for (int i = 0; i < SHM_CONSUMERS; i++)
+			if (!shm_lag(&shm, i, &lag, &overruns)) printf("Consumer %i (pid %i): %llu entries behind, overrun %llu times\n",
+				i, shm.h->pid[i], (unsigned long long)lag, (unsigned long long)overruns);
+		shm.bytes = 0;
+	}
+	for (int i = 0; verbose && l == first && i < MAX_SENDERS; i++) {
+		struct sendq *q = &viewers[i].q;
+		if (!viewers[i].active) continue;
+		link += q->sent_bytes;
+		q->sent_bytes = 0;
+		if (viewers[i].mcast) continue; //on the group's queue
+		printf("%s %i send queue: %lu sent, dropped %lu params %lu IDR %lu ref %lu disposable NALs, %lu NALs past deadline, %lu skips to a keyframe\n",
+			i < MAX_VIEWERS ? "Viewer" : "Group", i < MAX_VIEWERS ? i : i - MAX_VIEWERS, q->sent, q->dropped[PRIO_PARAMS], q->dropped[PRIO_IDR], q->dropped[PRIO_REF], q->dropped[PRIO_DISPOSABLE], q->expired, q->skips);
+	}
+	if (verbose && l == first) printf("Sent %.0f kbit/s in total\n", link * 8 / 1000.0 / l->stat_secs); //what all viewers cost the link
+	if (verbose && l == first && loop_wakeups) printf("Loop: %lu timeouts, woke %.3f ms late on average, %.3f ms at most\n",
+		loop_wakeups, loop_late_us / 1000.0 / loop_wakeups, loop_late_max_us / 1000.0);
+	if (l == first) loop_wakeups = loop_late_us = loop_late_max_us = 0;
+	if (verbose && l == first && telem_in) printf("Telemetry: %lu records, %lu sent, %lu dropped, sent %.2f ms after the sample on average, %.2f ms at most\n",
+		telem_in, telem_sent, telem_dropped, telem_age_us / 1000 / telem_in, telem_age_max_us / 1000);
+	if (l == first) {
+		telem_in = telem_sent = telem_dropped = 0;
+		telem_age_us = telem_age_max_us = 0;
+	}
+	if (!relay_host && !((l - layers) % MAX_LAYERS)) {
+		//what getting the frames costs: from a pipe every byte is copied into it and out again, and part of it once more
+		//when the scanner makes room; V4L2 buffers are parsed in place
+		frames = l->frames - l->stat_frames;
+		cam_cpu = v4l2Source(l->cam) ? 0 : cpuSeconds(l->cam->pid);
+		copies = l->scanner.in ? 2 + (double)l->scanner.moved / l->scanner.in : 0;
+		if (verbose && frames && v4l2Source(l->cam)) printf("%s capture: %.1f frames/s, %lu KB, %.2f copies per frame\n",
+			l->cam->name, (double)frames / l->stat_secs, vc->bytes / 1024, copies);
+		if (verbose && frames + vc->skipped && l->cam->motion_threshold > 0) printf("%s motion gate: %s, still %.0f%% of the time, %lu frames skipped\n",
+			l->cam->name, l->cam->gated ? "still" : "moving", 100.0 * l->cam->gated_frames / (frames + vc->skipped), vc->skipped);
+		else if (verbose && frames) printf("%s capture: %.1f frames/s, %lu KB, %.2f copies per frame, %.2f ms in the camera process\n",
+			l->cam->name, (double)frames / l->stat_secs, l->scanner.in / 1024, copies, (cam_cpu - l->stat_cam_cpu) * 1000 / frames);
+		l->stat_frames = l->frames;
+		l->stat_cam_cpu = cam_cpu;
+		l->scanner.in = l->scanner.moved = 0;
+		vc->bytes = 0;
+		vc->skipped = 0;
+		l->cam->gated_frames = 0;
+	}
+	if (!relay_host && l == first) {
+		//what the cameras cost together, here and in their processes; a stopped camera's process no longer counts
+		cpu = cpuSeconds(0);
+		cam_cpu = 0;
+		running = 0;
+		for (int i = 0; i < ncameras; i++) {
+			if (!cameras[i].active) continue;
+			running++;
+			if (!v4l2Source(&cameras[i])) cam_cpu += cpuSeconds(cameras[i].pid);
+		}
+		if (verbose && enc_frames) printf("Capture: %i cameras, %.1f frames/s, %.0f kbit/s encoded, %.2f ms CPU per frame, %.1f%% CPU, %.1f%% in camera processes\n",
+			running, (double)enc_frames / l->stat_secs, enc_bytes * 8 / 1000.0 / l->stat_secs, (cpu - all_cpu) * 1000 / enc_frames,
+			(cpu - all_cpu) * 100 / l->stat_secs, cam_cpu > all_cam_cpu ? (cam_cpu - all_cam_cpu) * 100 / l->stat_secs : 0);
+		all_cpu = cpu;
+		all_cam_cpu = cam_cpu;
+		enc_frames = enc_bytes = 0;
+	}
+	if (relay_host) {
+		cpu = cpuSeconds(0);
+		if (verbose) printf("Relay: %lu packets in, %lu keyframe requests upstream, %.1f%% CPU\n",
+			relay_pkts, relay_key_requests, (cpu - relay_cpu) * 100 / l->stat_secs);
+		relay_cpu = cpu;
+		relay_pkts = relay_key_requests = 0;
+	}
+	l->stat_sum = l->stat_sum2 = 0;
+	l->stat_secs = 0;
+	l->stat_peak_pkts = l->stat_peak_bytes = 0;
+}
+
+void readCam(struct layer *l) {
+	int ret = nal_scanner_read(&l->scanner, l->fd, onNal, l);
+	if (ret > 0) {
+		gettimeofday(&l->last_read, NULL);
+		return;
+	}
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (ret < 0) perror("Reading camera");
+	camFailed(l->cam, "stream ended");
+}
+
+//Raw frames to take a snapshot of: a V4L2 capture before its encoder, the first camera's -X frames
+int snapSource(struct camera *c) {
+	return v4l2Source(c) ? c->encoder_dev != NULL : c == cameras && raw_width;
+}
+
+//The snapshot of the camera to its viewers who asked for it, jpeg NULL if there's none
+void replySnapshot(int camera, unsigned char *jpeg, unsigned long len) {
+	unsigned char hdr[5];
+	int tmp = htonl(5 + len);
+
+	memcpy(hdr, &tmp, 4);
+	hdr[4] = MSG_SNAPSHOT;
+	for (int i = 0; i < MAX_VIEWERS; i++) {
+		struct viewer *v = &viewers[i];
+		if (!v->sock || !v->snap_wait || v->camera != camera) continue;
+		v->snap_wait = 0;
+		controlSend(v, hdr, 5);
+		if (len) controlSend(v, jpeg, len);
+	}
+	if (camera == snap_camera) snap_camera = -1;
+}
+
+void nextSnapshot();
+
+void takeSnapshot(struct camera *c, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width, int height,
+	int ystride, int cstride, int cstep) {
+	if (snap_frame(&snap, y, u, v, width, height, ystride, cstride, cstep) < 0) {
+		if (verbose) printf("No snapshot of %s, out of memory\n", c->name);
+		replySnapshot(c - cameras, NULL, 0);
+		nextSnapshot();
+	}
+}
+
+void tapFrame(const unsigned char *y, const unsigned char *u, const unsigned char *v, int ystride, int cstride, int cstep, void *arg) {
+	struct camera *c = (struct camera *)arg;
+	takeSnapshot(c, y, u, v, c->vcap.width, c->vcap.height, ystride, cstride, cstep);
+}
+
+//Takes the snapshots asked for, one camera at a time
+void nextSnapshot() {
+	struct camera *c;
+
+	for (int i = 0; snap_camera < 0 && i < MAX_VIEWERS; i++) {
+		if (!viewers[i].sock || !viewers[i].snap_wait) continue;
+		c = &cameras[viewers[i].camera];
+		if (!c->active || !snapSource(c) || (!snap.running && snap_init(&snap, SNAP_QUALITY) < 0)) {
+			if (verbose) printf("No snapshot of %s, it %s\n", c->name, !c->active ? "isn't running" : snapSource(c) ? "failed" :
+				"has no raw frames (-E, or -X for camera_streamer.sh)");
+			replySnapshot(viewers[i].camera, NULL, 0);
+			continue;
+		}
+		snap_camera = viewers[i].camera;
+		gettimeofday(&snap_at, NULL);
+		if (v4l2Source(c)) {
+			c->vcap.tap = tapFrame;
+			c->vcap.tap_arg = c;
+		}
+	}
+}
+
+//A finished JPEG, or a snapshot that got no frame in time. Returns how soon it needs to look again.
+long checkSnapshot(fd_set *readfds) {
+	unsigned char *jpeg;
+	unsigned long len;
+	long left;
+
+	if (snap_camera < 0) return 1000000L;
+	if (snap.busy) {
+		if (!readfds || !snap_take(&snap, readfds, &jpeg, &len)) return 1000000L;
+		if (verbose) printf("Snapshot of %s: %lu KB, %.1f ms after it was asked for, %.1f ms encoding\n",
+			cameras[snap_camera].name, len / 1024, usSince(&snap_at) / 1000.0, snap.encode_ms);
+		replySnapshot(snap_camera, jpeg, len);
+		free(jpeg);
+		nextSnapshot();
+		return 1000000L;
+	}
+	left = SNAP_TIMEOUT_US - usSince(&snap_at);
+	if (left > 0) return left;
+	if (verbose) printf("No snapshot of %s, no frame came\n", cameras[snap_camera].name);
+	cameras[snap_camera].vcap.tap = NULL;
+	replySnapshot(snap_camera, NULL, 0);
+	nextSnapshot();
+	return 1000000L;
+}
+
+int openTelemetry() {
+	struct sockaddr_un a;
+
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	strncpy(a.sun_path, telem_path, sizeof(a.sun_path) - 1);
+	telem_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(telem_path); //left over from a run that didn't end cleanly
+	if (telem_sock < 0 || bind(telem_sock, (struct sockaddr *)&a, sizeof(a)) < 0) return -1;
+	rtp_init(&telem_rtp);
+	return 0;
+}
+
+//Each record goes out as soon as it's read, straight to the socket: it's small, and behind a frame in a send queue it'd be late
+void readTelemetry() {
+	unsigned char buf[8 + TELEM_SIZE + 1], pkt[RTP_HDR + TELEM_SIZE], sealed[RTP_HDR + TELEM_SIZE + SRTP_TAG], *out;
+	struct sockaddr_in dest;
+	struct timespec now;
+	unsigned long long sample = 0, now_us;
+	int n, len, out_len;
+
+	while ((n = recv(telem_sock, buf, sizeof(buf), 0)) >= 0) {
+		telem_in++;
+		if (n < 8 || n > 8 + TELEM_SIZE) {
+			telem_dropped++;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+		for (int i = 0; i < 8; i++) sample = sample << 8 | buf[i];
+		if (!sample || sample > now_us) sample = now_us;
+		len = rtp_packet(&telem_rtp, pkt, TELEM_PT, rtp_timestamp_us(sample), buf + 8, n - 8);
+		for (int i = 0; i < MAX_VIEWERS; i++) {
+			struct viewer *v = &viewers[i];
+			if (!v->active || !v->telem_port) continue;
+			dest = v->dest;
+			dest.sin_port = htons(v->telem_port);
+			out = pkt;
+			out_len = len;
+			if (v->auth == AUTH_DONE) {
+				out = sealed;
+				out_len = srtp_protect(&v->srtp, pkt, len, sealed);
+			}
+			if (out_len > 0 && sendq_sendto(udp_sock, out, out_len, &dest) == out_len) telem_sent++;
+			else telem_dropped++;
+		}
+		telem_age_us += now_us - sample;
+		if (now_us - sample > telem_age_max_us) telem_age_max_us = now_us - sample;
+		sample = 0;
+	}
+}
+
+//Raw frames are read straight into the ring, and only whole, so the pipe stays aligned to frames
+void readRaw(int readable) {
+	int frame = raw_width * raw_height * 3 / 2, n = 0, got, ret;
+	struct timeval t;
+	unsigned char *p;
+
+	if (ioctl(raw_fd, FIONREAD, &n) < 0) n = 0;
+	raw_partial = n > 0 && n < frame;
+	if (n >= frame) {
+		gettimeofday(&t, NULL);
+		p = shm_reserve(&shm, frame);
+		for (got = 0; got < frame; got += ret) {
+			ret = read(raw_fd, p + got, frame - got);
+			if (ret < 0 && errno == EINTR) ret = 0;
+			else if (ret <= 0) break; //can't be, the pipe held the frame
+		}
+		if (got < frame) { //never committed, consumers don't see the torn frame and the space is reserved again
+			if (verbose) printf("Raw frames ended in the middle of one.\n");
+			close(raw_fd);
+			raw_fd = -1;
+			return;
+		}
+		if (snap_camera == 0 && !snap.busy)
+			takeSnapshot(cameras, p, p + raw_width * raw_height, p + raw_width * raw_height * 5 / 4, raw_width, raw_height, raw_width, raw_width / 2, 1);
+		shm_commit(&shm, SHM_RAW, 0, frame, &t);
+	} else if (!n && readable) { //the branch writing raw frames is gone
+		if (verbose) printf("Raw frames ended.\n");
+		close(raw_fd);
+		raw_fd = -1;
+	}
+}
+
+void closeViewer(struct viewer *v);
+
+//Both sides prove they know the secret with HMACs over both nonces, which also give the SRTP master key: it never
+//goes over the network. A failed proof closes the connection.
+void authViewer(struct viewer *v, unsigned char *buf, int len, unsigned char *bufout, int *bufout_len) {
+	unsigned char proof[SRTP_PROOF], master[SRTP_PROOF];
+	int i = v - viewers, tmp;
+
+	if (!auth_len || v->auth == AUTH_DONE) { //nothing to prove, the empty reply says so
+		tmp = htonl(5);
+		memcpy(bufout, &tmp, 4);
+		bufout[4] = MSG_AUTH;
+		*bufout_len = 5;
+		return;
+	}
+	if (v->auth == AUTH_NONE && len >= 1 + SRTP_NONCE) {
+		memcpy(v->nonces, buf + 1, SRTP_NONCE);
+		if (RAND_bytes(v->nonces + SRTP_NONCE, SRTP_NONCE) != 1) {
+			fprintf(stderr, "No random numbers for viewer %i\n", i);
+			closeViewer(v);
+			return;
+		}
+		tmp = htonl(5 + SRTP_NONCE + SRTP_PROOF);
+		memcpy(bufout, &tmp, 4);
+		bufout[4] = MSG_AUTH;
+		memcpy(bufout + 5, v->nonces + SRTP_NONCE, SRTP_NONCE);
+		srtp_prove(auth_secret, auth_len, "server", v->nonces, v->nonces + SRTP_NONCE, bufout + 5 + SRTP_NONCE);
+		*bufout_len = 5 + SRTP_NONCE + SRTP_PROOF;
+		v->auth = AUTH_CHALLENGED;
+		return;
+	}
+	if (v->auth == AUTH_CHALLENGED && len >= 1 + SRTP_PROOF) {
+		srtp_prove(auth_secret, auth_len, "client", v->nonces, v->nonces + SRTP_NONCE, proof);
+		if (!CRYPTO_memcmp(proof, buf + 1, SRTP_PROOF)) {
+			srtp_prove(auth_secret, auth_len, "srtp", v->nonces, v->nonces + SRTP_NONCE, master);
+			if (srtp_init(&v->srtp, master) == 0) {
+				v->auth = AUTH_DONE;
+				OPENSSL_cleanse(master, sizeof(master));
+				if (verbose) printf("Viewer %i authenticated\n", i);
+				tmp = htonl(5);
+				memcpy(bufout, &tmp, 4);
+				bufout[4] = MSG_AUTH;
+				*bufout_len = 5;
+				return;
+			}
+		}
+	}
+	if (verbose) printf("Viewer %i failed to authenticate\n", i);
+	closeViewer(v);
+}
+
+void processMsg(struct viewer *v, unsigned char *buf, int len, unsigned char *bufout, int *bufout_len) {	
 	unsigned char ip[4];
 	int port;
 	int tmp;
@@ -85,54 +1682,552 @@ void processMsg(unsigned char *buf, int len, unsigned char *bufout, int *bufout_
 	type = buf[0];
 	if (verbose) printf("Received type: %i\n",type);
 
-	if (type==1) { //disconnect
-		stopCam();
+	if (type==MSG_AUTH) {
+		authViewer(v, buf, len, bufout, bufout_len);
+		return;
+	}
+	if (auth_len && v->auth != AUTH_DONE) {
+		if (verbose) printf("Viewer %i isn't authenticated, closing\n", (int)(v - viewers));
+		closeViewer(v);
+		return;
+	}
+
+	if (type==MSG_STOP) { //disconnect
+		stopViewer(v);
+		return;
+	}
+
+	if (type==MSG_DVR) {
+		dumpDvr();
+		return;
+	}
+
+	if (type==MSG_PING) {
+		v->pings = 1;
+		tmp = htonl(5);
+		memcpy(bufout, &tmp, 4);
+		bufout[4] = MSG_PING;
+		*bufout_len = 5;
+		return;
+	}
+
+	if (type==MSG_KEYFRAME) {
+		if (!v->active || !cameras[v->camera].active) return;
+		if (relay_host) key_wanted = 1;
+		else layers[v->want].key_request = 1;
+		return;
+	}
+
+	if (type==MSG_SNAPSHOT) {
+		if (!v->active) return;
+		v->snap_wait = 1;
+		nextSnapshot();
 		return;
 	}
 
+	if (type==MSG_TELEMETRY) {
+		if (len < 5 || !v->active || v->rtsp) return;
+		memcpy(&tmp, buf + 1, 4);
+		v->telem_port = ntohl(tmp) & 0xffff;
+		if (verbose) printf("Viewer %i: telemetry %s%i\n", (int)(v - viewers), v->telem_port ? "to port " : "off", v->telem_port ? v->telem_port : 0);
+		return;
+	}
+
+	if (type==MSG_ROI) {
+		if (len < 9 || !v->active) return;
+		setRoi(&cameras[v->camera], buf + 1, len - 1);
+		return;
+	}
+
+	if (type==MSG_LAYER) {
+		if (len < 2 || !v->active) return;
+		tmp = cameras[v->camera].nlayers;
+		v->want = v->camera * MAX_LAYERS + (buf[1] < tmp ? buf[1] : tmp - 1);
+		if (verbose) printf("Viewer %i switching to layer %i\n", (int)(v - viewers), v->want % MAX_LAYERS);
+		if (v->mcast) {
+			updateGroups();
+			*bufout_len = groupMsg(v, bufout);
+		}
+		return;
+	}
+
+	if (len < 9) return;
 	memcpy(ip,buf+1,4);
 
 	memcpy(&tmp,buf+5,4);
 	port = ntohl(tmp);
 
-	startCam(ip,port);
+	if (len > 11 && buf[11] >= ncameras) {
+		if (verbose) printf("Viewer %i asked for camera %i, there are %i\n", (int)(v - viewers), buf[11], ncameras);
+		return;
+	}
+	if (!v->active) {
+		v->tcp = len > 10 && buf[10] == 1;
+		v->channel = -1;
+	}
+	startViewer(v, ip, port, len > 11 ? buf[11] : 0, len > 9 ? buf[9] : 0);
+	if (v->tcp && !v->out_sock) connectViewer(v);
+	if (v->mcast) *bufout_len = groupMsg(v, bufout);
+}
+
+//Sends an RTSP response; extra holds additional header lines. Over TCP it's queued with the control messages
+//and goes out from the main loop, after the interleaved packet being written.
+void rtspReply(struct viewer *v, struct rtsp_req *r, int status, const char *reason, const char *extra, const char *body) {
+	char out[2 * BUF_SIZE];
+	int n;
+
+	n = snprintf(out, sizeof(out), "RTSP/1.0 %i %s\r\nCSeq: %i\r\nServer: camera_server\r\n", status, reason, r->cseq);
+	if (v->session[0]) n += snprintf(out + n, sizeof(out) - n, "Session: %s;timeout=60\r\n", v->session);
+	n += snprintf(out + n, sizeof(out) - n, "%sContent-Length: %i\r\n\r\n%s", extra, (int)strlen(body), body);
+	controlSend(v, (unsigned char *)out, n);
+}
+
+//The camera named by the first part of the URL's path, the first camera if none is
+int urlCamera(const char *url) {
+	const char *p = strstr(url, "://");
+	int n;
+
+	p = strchr(p ? p + 3 : url, '/');
+	if (!p) return 0;
+	p++;
+	n = strcspn(p, "/");
+	for (int i = 0; i < ncameras; i++)
+		if ((int)strlen(cameras[i].name) == n && !strncmp(p, cameras[i].name, n)) return i;
+	return 0;
+}
+
+void rtspRequest(struct viewer *v, struct rtsp_req *r) {
+	char extra[BUF_SIZE], body[BUF_SIZE];
+	struct sockaddr_in a;
+	socklen_t alen = sizeof(a);
+	unsigned char ip[4];
+	int p1, p2;
+	struct camera *c = &cameras[urlCamera(r->url)];
+	struct layer *l;
+
+	if (verbose) printf("RTSP %s %s\n", r->method, r->url);
+	extra[0] = body[0] = 0;
+
+	if (!strcmp(r->method, "OPTIONS")) {
+		sprintf(extra, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n");
+	} else if (!strcmp(r->method, "DESCRIBE")) {
+		l = &layers[(c - cameras) * MAX_LAYERS + (strstr(r->url, "/low") && c->nlayers > 1 ? 1 : 0)];
+		getsockname(v->sock, (struct sockaddr *)&a, &alen);
+		if (c->active) rtsp_sdp(body, sizeof(body), inet_ntoa(a.sin_addr), l->sps, l->sps_len, l->pps, l->pps_len);
+		else rtsp_sdp(body, sizeof(body), inet_ntoa(a.sin_addr), NULL, 0, NULL, 0); //parameter sets come in-band
+		snprintf(extra, sizeof(extra), "Content-Base: %s%s\r\nContent-Type: application/sdp\r\n", r->url, r->url[strlen(r->url) - 1] == '/' ? "" : "/");
+	} else if (!strcmp(r->method, "SETUP")) {
+		if (v->active) return rtspReply(v, r, 455, "Method Not Valid in This State", extra, body);
+		if (strstr(r->transport, "RTP/AVP/TCP")) {
+			if (!rtsp_transport(r->transport, "interleaved", &p1, &p2)) { p1 = 0; p2 = 1; }
+			v->tcp = 1;
+			v->out_sock = v->sock;
+			v->channel = p1;
+			sprintf(extra, "Transport: RTP/AVP/TCP;unicast;interleaved=%i-%i\r\n", p1, p2);
+		} else if (rtsp_transport(r->transport, "client_port", &p1, &p2)) {
+			v->tcp = 0;
+			v->rtsp_port = p1;
+			sprintf(extra, "Transport: RTP/AVP;unicast;client_port=%i-%i;server_port=%i-%i\r\n", p1, p2, udp_port, udp_port + 1);
+		} else return rtspReply(v, r, 461, "Unsupported Transport", extra, body);
+		if (!v->session[0]) {
+			unsigned int id[2];
+			if (RAND_bytes((unsigned char *)id, sizeof(id)) != 1) return rtspReply(v, r, 500, "Internal Server Error", extra, body);
+			sprintf(v->session, "%08x%08x", id[0], id[1]);
+		}
+		v->rtsp_camera = c - cameras;
+		v->rtsp_layer = strstr(r->url, "/low") ? 1 : 0;
+	} else if (!strcmp(r->method, "PLAY")) {
+		if (!v->session[0] || strcmp(r->session, v->session)) return rtspReply(v, r, 454, "Session Not Found", extra, body);
+		getpeername(v->sock, (struct sockaddr *)&a, &alen);
+		memcpy(ip, &a.sin_addr.s_addr, 4);
+		startViewer(v, ip, v->rtsp_port, v->rtsp_camera, v->rtsp_layer);
+		sprintf(extra, "Range: npt=now-\r\n");
+	} else if (!strcmp(r->method, "TEARDOWN")) {
+		stopViewer(v);
+		rtspReply(v, r, 200, "OK", extra, body);
+		v->session[0] = 0;
+		v->tcp = 0;
+		v->out_sock = 0;
+		return;
+	} else if (strcmp(r->method, "GET_PARAMETER") && strcmp(r->method, "SET_PARAMETER")) { //those are keep-alives
+		return rtspReply(v, r, 501, "Not Implemented", extra, body);
+	}
+	rtspReply(v, r, 200, "OK", extra, body);
+}
+
+//RTSP requests, and interleaved RTCP from the client which isn't used
+void processRtsp(struct viewer *v) {
+	struct rtsp_req r;
+	int n;
+
+	while (v->sock && v->buf_c) {
+		if (v->buf[0] == '$') {
+			if (v->buf_c < 4) break;
+			n = 4 + (v->buf[2] << 8 | v->buf[3]);
+			if (n > BUF_SIZE) n = -1;
+			else if (v->buf_c < n) break;
+		} else {
+			n = rtsp_parse((char *)v->buf, v->buf_c, &r);
+			if (!n && v->buf_c == BUF_SIZE) n = -1;
+			if (!n) break;
+		}
+		if (n < 0) {
+			if (verbose) printf("Invalid RTSP request, dropping client.\n");
+			closeViewer(v);
+			return;
+		}
+		if (v->buf[0] != '$') rtspRequest(v, &r);
+		memmove(v->buf, v->buf + n, v->buf_c - n);
+		v->buf_c -= n;
+	}
+}
+
+void closeViewer(struct viewer *v) {
+	stopViewer(v);
+	if (v->out_sock && v->out_sock != v->sock) close(v->out_sock); //interleaved RTSP writes to the control socket
+	v->out_sock = 0;
+	v->connecting = 0;
+	v->blocked = 0;
+	v->tcp = 0;
+	close(v->sock);
+	v->sock = 0;
+	free(v->ctl_out);
+	v->ctl_out = NULL;
+	v->ctl_len = v->ctl_sent = 0;
+	v->snap_wait = 0;
+	if (v->auth == AUTH_DONE) srtp_free(&v->srtp);
+	v->auth = AUTH_NONE;
+}
+
+//ICMP errors for our UDP destinations: a port nobody listens on anymore, a host that's gone
+void readUdpErrors() {
+	unsigned char buf[64], control[256];
+	struct sockaddr_in from;
+	struct iovec iov = { buf, sizeof(buf) };
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	int err;
+	socklen_t len = sizeof(err);
 
-/*
-	ret = htonl(ret);
-	memcpy(bufout,&ret,4);
-	*bufout_len = 4;
-*/
+	while (recv(udp_sock, buf, sizeof(buf), MSG_DONTWAIT) >= 0); //nothing is expected
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &from; //where the packet that caused it went
+		msg.msg_namelen = sizeof(from);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(udp_sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level != IPPROTO_IP || cm->cmsg_type != IP_RECVERR) continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_ICMP) continue;
+			if (ee->ee_errno != ECONNREFUSED && ee->ee_errno != EHOSTUNREACH && ee->ee_errno != ENETUNREACH) continue;
+			for (int i = 0; i < MAX_VIEWERS; i++) {
+				struct viewer *v = &viewers[i];
+				if (!v->active || v->tcp || v->mcast || v->dest.sin_addr.s_addr != from.sin_addr.s_addr || v->dest.sin_port != from.sin_port) continue;
+				if (!v->unreachable++) gettimeofday(&v->unreachable_since, NULL);
+			}
+		}
+	}
+	getsockopt(udp_sock, SOL_SOCKET, SO_ERROR, &err, &len); //or select() keeps waking up for it
+}
+
+//A viewer whose heartbeats stopped, or whose destination kept answering with ICMP errors, is gone
+void checkLiveness(struct viewer *v) {
+	long silent = usSince(&v->heard);
+	const char *why;
+
+	if (!live_timeout) return;
+	if (v->pings && silent >= live_timeout * 1000000L) why = "stopped sending heartbeats";
+	else if (v->unreachable && usSince(&v->unreachable_since) >= live_timeout * 1000000L) why = "is unreachable";
+	else return;
+	pruned++;
+	if (verbose) printf("Viewer %i %s: dropped %.1f s after it was last heard, %i ICMP errors, %lu KB sent to it meanwhile (%.0f kbit/s)\n",
+		(int)(v - viewers), why, silent / 1000000.0, v->unreachable, (v->q.total_bytes - v->heard_bytes) / 1024,
+		(v->q.total_bytes - v->heard_bytes) * 8000.0 / silent);
+	closeViewer(v);
+}
+
+void readViewer(struct viewer *v) {
+	unsigned char bufout[BUF_SIZE];
+	int ret;
+
+	ret = read(v->sock , v->buf+v->buf_c, BUF_SIZE - v->buf_c); 
+	if (ret < 0) {
+		perror("Reading error");
+		closeViewer(v);
+		return;
+	}	
+	else if (ret == 0) {	//client disconnected
+		if (verbose) printf("Client disconnected.\n");
+		closeViewer(v);
+		return;
+	} else v->buf_c += ret;
+	gettimeofday(&v->heard, NULL);
+	v->heard_bytes = v->q.total_bytes;
+	v->unreachable = 0;
+
+	if (v->rtsp) {
+		processRtsp(v);
+		return;
+	}
+	
+	while (v->sock) {
+		if (v->buf_c>=4 && !v->msgSize) v->msgSize = getMsgSize(v->buf);
+		if (v->msgSize && (v->msgSize < 5 || v->msgSize > BUF_SIZE)) {
+			if (verbose) printf("Invalid message size, dropping client.\n");
+			closeViewer(v);
+			return;
+		}
+		if (!v->msgSize || v->buf_c<v->msgSize) break;
+		//full message received
+		processMsg(v,v->buf+4,v->msgSize-4,bufout,&ret);
+		memmove(v->buf, v->buf + v->msgSize, v->buf_c - v->msgSize);
+		v->buf_c -= v->msgSize;
+		v->msgSize = 0;
+		if (ret) controlSend(v, bufout, ret);
+	}
+}
+
+void acceptViewer(int listener, int rtsp) {
+	int i, t = accept(listener, 0, 0);
+
+	if (t<0) {
+		perror("accept");
+		return;
+	}
+	for (i = 0; i < MAX_VIEWERS && viewers[i].sock; i++);
+	if (i == MAX_VIEWERS) {
+		if (verbose) printf("Too many clients, refusing connection.\n");
+		close(t);
+		return;
+	}
+	viewers[i].sock = t;
+	viewers[i].buf_c = 0;
+	viewers[i].msgSize = 0;
+	viewers[i].rtsp = rtsp;
+	viewers[i].session[0] = 0;
+	viewers[i].tcp = 0;
+	viewers[i].out_sock = 0;
+	viewers[i].connecting = 0;
+	viewers[i].blocked = 0;
+	gettimeofday(&viewers[i].heard, NULL);
+	viewers[i].pings = 0;
+	viewers[i].unreachable = 0;
+	viewers[i].auth = AUTH_NONE;
+}
+
+int readSecret(const char *path) {
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	auth_len = fread(auth_secret, 1, sizeof(auth_secret), f);
+	fclose(f);
+	while (auth_len && (auth_secret[auth_len - 1] == '\n' || auth_secret[auth_len - 1] == '\r')) auth_len--;
+	if (auth_len < 8) {
+		fprintf(stderr, "%s: the secret needs 8 characters or more\n", path);
+		return -1;
+	}
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	int sock,client,max_fd;
-	int msgSize = 0;
-	int ret;
+	int sock,max_fd;
+	int i, status;
 	struct sockaddr_in address;
-	unsigned char bufin[BUF_SIZE];
-	unsigned short buf_c = 0; //counter
-	unsigned char bufout[BUF_SIZE];
-	struct timeval timeout;
-	fd_set readfds;
+	struct timeval timeout, before;
+	fd_set readfds, writefds;
+	long wait, w;
 
 	int option;
 
-	while ((option = getopt(argc, argv,"dp:")) != -1) {
+	char *colon;
+	struct camera *cam = &cameras[0]; //the one -s to -i set
+
+	while ((option = getopt(argc, argv,"dp:C:s:e:E:w:h:f:b:g:n:iL:D:m:S:K:o:q:l:r:FB:M:T:I:R:P:H:x:X:Z:G:Y:A:kt:")) != -1) {
 		switch (option)  {
 			case 'd': background = 1; verbose=0; break;
 			case 'p': portno = atoi(optarg);  break;
+			case 'C':
+				if (ncameras == MAX_CAMERAS || !*optarg || strlen(optarg) >= sizeof(cam->name) || strchr(optarg, '/')) {
+					print_usage();
+					return -1;
+				}
+				for (i = 0; i < ncameras; i++) {
+					if (strcmp(cameras[i].name, optarg)) continue;
+					fprintf(stderr, "There is already a camera named %s\n", optarg);
+					return -1;
+				}
+				cameras[ncameras] = *cam;
+				cam = &cameras[ncameras++];
+				strcpy(cam->name, optarg);
+				break;
+			case 's': cam->source = optarg;  break;
+			case 'E': cam->encoder_dev = optarg;  break;
+			case 'w': cam->width = atoi(optarg);  break;
+			case 'h': cam->height = atoi(optarg);  break;
+			case 'f': cam->fps = atoi(optarg);  break;
+			case 'b': cam->bitrate = atoi(optarg);  break;
+			case 'g': cam->gop = atoi(optarg);  break;
+			case 'n': cam->slices = atoi(optarg);  break;
+			case 'i': cam->refresh = 1;  break;
+			case 'L':
+				if (sscanf(optarg, "%ix%i:%i", &cam->low_width, &cam->low_height, &cam->low_bitrate) != 3) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'D': dvr_seconds = atoi(optarg);  break;
+			case 'm': dvr_bytes = atoi(optarg);  break;
+			case 'S': rec_seconds = atoi(optarg);  break;
+			case 'K': rec_keep = atoi(optarg);  break;
+			case 'o': record_dir = optarg;  break;
+			case 'e': cam_cmd = optarg;  break;
+			case 'q': queue_budget = atoi(optarg);  break;
+			case 'l': queue_deadline = atoi(optarg);  break;
+			case 'r': link_rate = atoi(optarg);  break;
+			case 'F': queue_fifo = 1;  break;
+			case 'B': tcp_sndbuf = atoi(optarg);  break;
+			case 't': live_timeout = atoi(optarg);  break;
+			case 'M':
+				colon = strchr(optarg, ':');
+				if (colon) *colon = 0;
+				if (!colon || !inet_aton(optarg, &mcast_group) || !IN_MULTICAST(ntohl(mcast_group.s_addr)) || (mcast_port = atoi(colon + 1)) <= 0) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'T': mcast_ttl = atoi(optarg);  break;
+			case 'P': rtsp_port = atoi(optarg);  break;
+			case 'H':
+				if (sscanf(optarg, "%d:%d:%d", &hls_port, &hls_part_ms, &hls_segment_ms) < 1 || hls_port <= 0) { //%i would take 08080 as octal
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'x':
+				colon = strchr(optarg, ':');
+				if (colon) {
+					*colon = 0;
+					shm_bytes = atol(colon + 1);
+				}
+				shm_name = optarg;
+				if (!*shm_name || strchr(shm_name, '/') || strlen(shm_name) > 40 || shm_bytes < AU_SIZE) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'X':
+				if (sscanf(optarg, "%ix%i", &raw_width, &raw_height) != 2 || raw_width <= 0 || raw_height <= 0 ||
+					raw_width % 2 || raw_height % 2 || raw_width * raw_height * 3 / 2 > RAW_MAX) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'R':
+				colon = strrchr(optarg, ':');
+				if (!colon || (relay_port = atoi(colon + 1)) <= 0) {
+					print_usage();
+					return -1;
+				}
+				*colon = 0;
+				relay_host = optarg;
+				break;
+			case 'I':
+				if (!inet_aton(optarg, &mcast_if)) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'Z':
+				if (!strncmp(optarg, "server:", 7)) i = rt_parse(&loop_sched, optarg + 7);
+				else if (!strncmp(optarg, "camera:", 7)) i = rt_parse(&cam->sched, optarg + 7);
+				else i = -1;
+				if (i < 0) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'G':
+				cam->motion_threshold = MOTION_THRESHOLD;
+				cam->static_fps = 1;
+				cam->static_bitrate = 0;
+				if (*optarg && *optarg != ':') cam->motion_threshold = atof(optarg);
+				colon = strchr(optarg, ':');
+				if (colon) sscanf(colon + 1, "%i:%i", &cam->static_fps, &cam->static_bitrate);
+				if (cam->motion_threshold <= 0 || cam->static_fps <= 0 || cam->static_bitrate < 0) {
+					print_usage();
+					return -1;
+				}
+				break;
+			case 'Y': telem_path = optarg;  break;
+			case 'A':
+				if (readSecret(optarg) < 0) return -1;
+				break;
+			case 'k': lock_memory = 1;  break;
 			default:
 				  print_usage();
 				  return -1;
 		}
 	}
 
+	if (relay_host && (recording() || hls_port || shm_name)) { //the recorders work on the encoder's NALs, a relay only sees packets
+		fprintf(stderr, "-D, -S, -H and -x need a camera, they don't work with -R\n");
+		return -1;
+	}
+	if (auth_len && (rtsp_port || mcast_port || hls_port)) { //anyone could get the stream from those
+		fprintf(stderr, "-P, -M and -H have no way to authenticate viewers, they don't work with -A\n");
+		return -1;
+	}
+	if (hls_port && (hls_part_ms < 1000 / cameras[0].fps || hls_segment_ms < hls_part_ms ||
+		hls_segment_ms / hls_part_ms >= HLS_PARTS / HLS_SEGMENTS)) { //after getopt, -f may come after -H
+		fprintf(stderr, "-H needs parts of at least a frame (%i ms) and segments of 1 to %i parts\n", 1000 / cameras[0].fps,
+			HLS_PARTS / HLS_SEGMENTS - 1);
+		return -1;
+	}
+	if (relay_host && ncameras > 1) {
+		fprintf(stderr, "-R relays a single stream, it doesn't work with -C\n");
+		return -1;
+	}
+	for (i = 0; i < ncameras; i++) {
+		struct camera *c = &cameras[i];
+		//the layers, raw frames and intra refresh come from the camera_streamer.sh pipelines
+		if (v4l2Source(c) && (c->low_width || (raw_width && !i) || c->refresh || c->sched.set)) {
+			fprintf(stderr, "-L, -X, -i and -Z camera don't work with a V4L2 source, it's captured in the server\n");
+			return -1;
+		}
+		//the camera_streamer.sh encoders can't be told to skip a frame or change bitrate while they run
+		if (c->motion_threshold > 0 && (!v4l2Source(c) || !c->encoder_dev)) {
+			fprintf(stderr, "-G needs a raw V4L2 source and its encoder, -s [device] -E [device]\n");
+			return -1;
+		}
+		if (!strcmp(c->source, "rpi") && c->slices > 1) { //else the RTP marker would wait for slices that never come
+			fprintf(stderr, "raspivid can't encode multiple slices, using one per frame\n");
+			c->slices = 1;
+		}
+		if (c->motion_threshold > 0 && !c->static_bitrate) c->static_bitrate = (long)c->bitrate * c->static_fps / c->fps;
+		if (c->static_fps > c->fps) c->static_fps = c->fps;
+		c->nlayers = 1; //until it's started
+	}
+	if (raw_width && (!shm_name || shm_bytes < 4L * raw_width * raw_height * 3 / 2)) {
+		fprintf(stderr, "-X needs -x with room for a few raw frames\n");
+		return -1;
+	}
+
 	signal(SIGTERM, catch_signal);
 	signal(SIGINT, catch_signal);
+	signal(SIGCHLD, catch_child);
+	prctl(PR_SET_CHILD_SUBREAPER, 1); //what's left of a camera pipeline whose first process exited stays ours to reap
 
-	buf_c = 0;
-	client = 0;
+	memset(viewers, 0, sizeof(viewers));
+	for (i = 0; i < MAX_SENDERS; i++) viewers[i].layer = -1;
 
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
@@ -140,6 +2235,30 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp_sock < 0) {
+		perror("opening udp socket");
+		exit(1);
+	}
+	bzero((char *) &address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	socklen_t alen = sizeof(address);
+	if (bind(udp_sock, (struct sockaddr *) &address, sizeof(address)) < 0 || getsockname(udp_sock, (struct sockaddr *) &address, &alen) < 0) {
+		perror("binding udp socket");
+		exit(1);
+	}
+	udp_port = ntohs(address.sin_port);
+	i = 1;
+	setsockopt(udp_sock, IPPROTO_IP, IP_RECVERR, &i, sizeof(i)); //ICMP errors are queued, with the destination they concern
+	if (mcast_port) {
+		unsigned char ttl = mcast_ttl;
+		if (setsockopt(udp_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+			setsockopt(udp_sock, IPPROTO_IP, IP_MULTICAST_IF, &mcast_if, sizeof(mcast_if)) < 0) {
+			perror("multicast options");
+			exit(1);
+		}
+	}
 
 	/* Create name. */
 	bzero((char *) &address, sizeof(address));
@@ -153,11 +2272,46 @@ int main(int argc, char **argv)
 	}
 	if (verbose) printf("Socket created on port %i\n", portno);
 
-	if (listen(sock,1) < 0) {
+	if (listen(sock,MAX_VIEWERS) < 0) {
 		perror("listen");
 		stop=1;
 	}
 
+	if (rtsp_port) {
+		rtsp_sock = socket(AF_INET, SOCK_STREAM, 0);
+		address.sin_addr.s_addr = INADDR_ANY;
+		address.sin_port = htons(rtsp_port);
+		if (rtsp_sock < 0 || bind(rtsp_sock, (struct sockaddr *) &address, sizeof(address)) || listen(rtsp_sock, MAX_VIEWERS) < 0) {
+			perror("RTSP socket");
+			exit(1);
+		}
+		if (verbose) printf("RTSP on port %i\n", rtsp_port);
+	}
+
+	if (hls_port) {
+		if (hls_init(&hls, hls_port, hls_part_ms, hls_segment_ms, camWidth(&cameras[0]), camHeight(&cameras[0])) < 0) {
+			perror("HLS socket");
+			exit(1);
+		}
+		if (verbose) printf("HLS on port %i\n", hls_port);
+	}
+
+	if (telem_path) {
+		if (openTelemetry() < 0) {
+			perror(telem_path);
+			exit(1);
+		}
+		if (verbose) printf("Telemetry from %s\n", telem_path);
+	}
+
+	if (shm_name) {
+		if (shm_init(&shm, shm_name, shm_bytes, raw_width, raw_height) < 0) {
+			perror("shared memory");
+			exit(1);
+		}
+		if (verbose) printf("Shared memory ring /dev/shm/%s, %li bytes\n", shm_name, shm_bytes);
+	}
+
 	if (background) {
 		if (daemon(0,1) < 0) { 
 			perror("daemon");
@@ -166,69 +2320,180 @@ int main(int argc, char **argv)
 		if (verbose) printf("Running in the background\n");
 	}
 
+	//after daemon(), neither is inherited; the camera processes, the segment writer and DVR dumps don't get the loop's policy either
+	if (rt_apply(&loop_sched, 0, 1) < 0 || (lock_memory && rt_lock_memory() < 0)) exit(1);
+
+
+	if (dvr_seconds) dvr_init(&dvr, dvr_bytes, dvr_seconds);
+	if (rec_seconds && rec_init(&rec, record_dir, rec_seconds, rec_keep, rec_queue, (long)cameras[0].bitrate / 8 * rec_seconds * 5 / 4) < 0)
+		rec_seconds = 0;
+	if (recording()) startCam(&cameras[0]);
 
 	if (verbose) printf("Starting main loop\n");
 	while (!stop) {
 		FD_ZERO(&readfds);
-		max_fd = 0;
-		if (client) {
-			FD_SET(client, &readfds);
-			FD_SET(sock, &readfds);
-			max_fd = sock>client?sock:client;
-		} else {
-			FD_SET(sock, &readfds);
-			max_fd = sock;
+		FD_ZERO(&writefds);
+		FD_SET(sock, &readfds);
+		max_fd = sock;
+		FD_SET(udp_sock, &readfds); //ICMP errors
+		if (udp_sock > max_fd) max_fd = udp_sock;
+		if (rtsp_sock >= 0) {
+			FD_SET(rtsp_sock, &readfds);
+			if (rtsp_sock > max_fd) max_fd = rtsp_sock;
+		}
+		if (hls_port) hls_fds(&hls, &readfds, &writefds, &max_fd);
+		if (shm_name) shm_fds(&shm, &readfds, &max_fd);
+		for (i = 0; i < MAX_VIEWERS; i++) {
+			if (!viewers[i].sock) continue;
+			FD_SET(viewers[i].sock, &readfds);
+			if (viewers[i].ctl_len) FD_SET(viewers[i].sock, &writefds);
+			if (viewers[i].sock > max_fd) max_fd = viewers[i].sock;
+		}
+		if (snap.running) snap_fds(&snap, &readfds, &max_fd);
+		if (telem_sock >= 0) {
+			FD_SET(telem_sock, &readfds);
+			if (telem_sock > max_fd) max_fd = telem_sock;
 		}
 
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 1000*1000L; //every sec 
-		int sel = select( max_fd + 1 , &readfds , NULL , NULL , &timeout);
-		if ((sel<0) && (errno!=EINTR)) {
-			perror("select");
-			stop=1;
+		wait = 1000*1000L; //every sec
+		reapCams();
+		for (i = 0; i < ncameras; i++) {
+			w = watchCam(&cameras[i]);
+			if (w < wait) wait = w;
+			w = applyRoi(&cameras[i]);
+			if (w < wait) wait = w;
 		}
-		//If something happened on the master socket , then its an incoming connection
-		if (!stop && FD_ISSET(sock, &readfds)) {
-			int t = accept(sock, 0, 0);
-			if (t<0) {
-				perror("accept");
+		w = checkSnapshot(NULL);
+		if (w < wait) wait = w;
+		if (cameras[0].active && relay_host) {
+			FD_SET(up_sock, &readfds);
+			FD_SET(up_udp, &readfds);
+			if (up_sock > max_fd) max_fd = up_sock;
+			if (up_udp > max_fd) max_fd = up_udp;
+			if (key_pending) wait = KEY_RETRY_US;
+		} else for (int c = 0; c < ncameras; c++) {
+			struct camera *cm = &cameras[c];
+			if (!cm->active) continue;
+			if (v4l2Source(cm)) {
+				vcap_fds(&cm->vcap, &readfds, &writefds, &max_fd);
 				continue;
 			}
-			client = t;
-			buf_c = 0;
-			msgSize = 0;
-		} 
-
-		if (!stop && FD_ISSET(client, &readfds)) {
-			ret = read(client , bufin+buf_c, BUF_SIZE - buf_c); 
-			if (ret < 0) {
-				perror("Reading error");
-				close(client);
-				client = 0;
-			}	
-			else if (ret == 0) {	//client disconnected
-				if (verbose) printf("Client disconnected.\n");
-				close(client);
-				client = 0;
-				stopCam();	
-			} else buf_c += ret;
-			
-			if (buf_c>=4 && !msgSize) msgSize = getMsgSize(bufin);
-			if (msgSize && buf_c>=msgSize) { //full message received
-				processMsg(bufin+4,buf_c-4,bufout,&ret);
-				msgSize = 0;
-				buf_c = 0;
-				/*
-				if (verbose) printf("Sending response...\n");
-				if (ret) ret = send(client, bufout, ret, MSG_NOSIGNAL );
-				if (ret == -1) {
-					if (verbose) printf("Lost connection to client.\n");
-					close(client);
-					client = 0;
+			for (i = c * MAX_LAYERS; i < c * MAX_LAYERS + cm->nlayers; i++) {
+				FD_SET(layers[i].fd, &readfds);
+				if (layers[i].fd > max_fd) max_fd = layers[i].fd;
+				if (nal_scanner_pending(&layers[i].scanner)) wait = NAL_FLUSH_US;
+			}
+		}
+		if (raw_partial) wait = RAW_POLL_US; //the rest comes soon, select() would keep waking up meanwhile
+		else if (raw_fd >= 0) {
+			FD_SET(raw_fd, &readfds);
+			if (raw_fd > max_fd) max_fd = raw_fd;
+		}
+		if (send_blocked) {
+			FD_SET(udp_sock, &writefds);
+			if (udp_sock > max_fd) max_fd = udp_sock;
+		}
+		for (i = 0; i < MAX_SENDERS; i++) {
+			if (!viewers[i].active) continue;
+			if (viewers[i].tcp && !viewers[i].rtsp && viewers[i].out_sock) { //told when it's connected, or lost
+				FD_SET(viewers[i].out_sock, &readfds);
+				if (viewers[i].out_sock > max_fd) max_fd = viewers[i].out_sock;
+			}
+			if (viewers[i].blocked || viewers[i].connecting) { //a stream socket of its own
+				FD_SET(viewers[i].out_sock, &writefds);
+				continue;
+			}
+			if (send_blocked && !viewers[i].tcp) continue;
+			w = sendq_wait(&viewers[i].q);
+			if (w >= 0 && w < wait) wait = w;
+		}
+
+		timeout.tv_sec = wait / 1000000L;
+		timeout.tv_usec = wait % 1000000L;
+		gettimeofday(&before, NULL);
+		int sel = select( max_fd + 1 , &readfds , &writefds , NULL , &timeout);
+		if (sel<0) {
+			if (errno!=EINTR) {
+				perror("select");
+				stop=1;
+			}
+			continue;
+		}
+		if (!sel) {
+			w = usSince(&before) - wait;
+			if (w < 0) w = 0;
+			loop_wakeups++;
+			loop_late_us += w;
+			if (w > loop_late_max_us) loop_late_max_us = w;
+		}
+
+		if (telem_sock >= 0 && FD_ISSET(telem_sock, &readfds)) readTelemetry(); //first, it's the most urgent
+		if (cameras[0].active && relay_host) {
+			if (FD_ISSET(up_udp, &readfds)) readRelay();
+			if (FD_ISSET(up_sock, &readfds)) readUpstream();
+			if (cameras[0].active) relayKeyframe();
+			if (cameras[0].active) updateStats(&layers[0]);
+		} else for (int c = 0; c < ncameras; c++) {
+			struct camera *cm = &cameras[c];
+			struct vcap *vc = &cm->vcap;
+			if (!cm->active) continue;
+			if (v4l2Source(cm)) {
+				if ((FD_ISSET(vc->fd, &readfds) || (vc->enc >= 0 && (FD_ISSET(vc->enc, &readfds) || FD_ISSET(vc->enc, &writefds)))) &&
+					vcap_handle(vc, onNal, &layers[c * MAX_LAYERS]) < 0) {
+					perror("Capture");
+					camFailed(cm, "capture failed");
 				}
-				*/
+				if (cm->active) updateStats(&layers[c * MAX_LAYERS]);
+				continue;
+			}
+			for (i = c * MAX_LAYERS; cm->active && i < c * MAX_LAYERS + cm->nlayers; i++) {
+				struct layer *l = &layers[i];
+				if (FD_ISSET(l->fd, &readfds)) readCam(l);
+				if (!cm->active) break;
+				updateStats(l);
+				//the encoder went quiet: the last slice of the frame is complete, don't wait for the next frame
+				if (nal_scanner_pending(&l->scanner) && usSince(&l->last_read) >= NAL_FLUSH_US)
+					nal_scanner_flush(&l->scanner, onNal, l);
 			}
 		}
+		if (raw_fd >= 0 && (raw_partial || FD_ISSET(raw_fd, &readfds))) readRaw(FD_ISSET(raw_fd, &readfds));
+		send_blocked = 0;
+		for (i = 0; i < MAX_SENDERS; i++) {
+			struct viewer *v = &viewers[i];
+			if (!v->active) continue;
+			if (v->tcp && !v->rtsp && v->out_sock) checkConnection(v, &readfds, &writefds);
+			if (v->tcp && !v->out_sock && usSince(&v->retry) >= CONNECT_RETRY_US) connectViewer(v);
+			if (v->tcp) {
+				if (v->rtsp && v->ctl_len) flushControl(v);
+				v->q.pause = v->rtsp && v->ctl_len; //the media waits for a reply that couldn't go out whole
+				if (v->out_sock && !v->connecting) v->blocked = sendq_flush_tcp(&v->q, v->out_sock, v->channel);
+			} else if (sendq_flush(&v->q, udp_sock, &v->dest)) send_blocked = 1;
+		}
+
+		//If something happened on the master socket , then its an incoming connection
+		if (!stop && FD_ISSET(sock, &readfds)) acceptViewer(sock, 0);
+		if (!stop && rtsp_sock >= 0 && FD_ISSET(rtsp_sock, &readfds)) acceptViewer(rtsp_sock, 1);
+		if (!stop && hls_port) {
+			if (hls_handle(&hls, &readfds, &writefds) && !cameras[0].active) startCam(&cameras[0]);
+			else if (cameras[0].active && !wanted(&cameras[0])) stopCam(&cameras[0]);
+		}
+		if (!stop && shm_name && shm_handle(&shm, &readfds)) {
+			if (verbose) printf("%i shared memory consumers\n", shm_consumers(&shm));
+			if (!cameras[0].active && shm_consumers(&shm)) startCam(&cameras[0]);
+			else if (cameras[0].active && !wanted(&cameras[0])) stopCam(&cameras[0]);
+		}
+
+		for (i = 0; !stop && i < MAX_VIEWERS; i++)
+			if (viewers[i].sock && FD_ISSET(viewers[i].sock, &readfds)) readViewer(&viewers[i]);
+		for (i = 0; !stop && i < MAX_VIEWERS; i++)
+			if (viewers[i].sock && viewers[i].ctl_len && FD_ISSET(viewers[i].sock, &writefds)) flushControl(&viewers[i]);
+		if (!stop && snap.running) checkSnapshot(&readfds);
+		if (!stop && FD_ISSET(udp_sock, &readfds)) readUdpErrors();
+		for (i = 0; !stop && i < MAX_VIEWERS; i++)
+			if (viewers[i].sock) checkLiveness(&viewers[i]);
+
+		if (dvr_seconds && dvr_reap(&dvr, &status) && verbose)
+			printf("Recorder dump %s\n", WIFEXITED(status) && !WEXITSTATUS(status) ? "written" : "failed");
 	}
 
 	if (verbose) {
@@ -236,11 +2501,22 @@ int main(int argc, char **argv)
 		fflush(NULL);
 	}
 
-	stopCam();
+	for (i = 0; i < MAX_VIEWERS; i++)
+		if (viewers[i].sock) closeViewer(&viewers[i]);
+	for (i = 0; i < ncameras; i++) stopCam(&cameras[i]);
+	if (dvr_seconds) dvr_free(&dvr);
+	if (rec_seconds) rec_free(&rec);
+	if (hls_port) hls_free(&hls);
+	if (snap.running) snap_free(&snap);
+	if (telem_sock >= 0) {
+		close(telem_sock);
+		unlink(telem_path);
+	}
+	if (shm_name) shm_free(&shm);
 
 	sleep(1);
 
-	if (client) close(client);
+	close(udp_sock);
 	close(sock);
+	if (rtsp_sock >= 0) close(rtsp_sock);
 }
-
@@ -1,9 +1,108 @@
 #!/bin/sh
-if [ "$1" != "start" ]; then
+# camera_streamer.sh capture <source> <width> <height> <fps> <bitrate> <gop> <slices> <refresh> <low width> <low height> <low bitrate> <raw width> <raw height> <roi>
+# Writes an H.264 byte-stream to stdout, camera_server packetizes and sends it.
+# With a low width, a second, low resolution layer from the same capture is written to fd 3.
+# With a raw width, unencoded I420 frames of that size are written to fd 4, dropped rather than held up.
+# roi: x,y,width,height of the camera's view in 1/10000, cropped before it's scaled to <width>x<height>
+# source: rpi  - raspivid (Pi camera), raspividyuv + omxh264enc for two layers
+#         test - videotestsrc + x264enc, software stand-in for testing off the Pi
+# refresh: idr    - an IDR every <gop> frames
+#          cyclic - one IDR at start, then cyclic intra refresh over <gop> frames
+if [ "$1" = "stop" ]; then
 	echo "stoping"
-	killall raspivid
-else
-	raspivid -t 0 -b 500000 -h 480 -w 640 -fps 20 -g 20 -n -o - | gst-launch-1.0 fdsrc ! h264parse ! rtph264pay config-interval=1 pt=96 ! gdppay ! udpsink port=$3 host=$2 &
-	echo "starting;"
+	killall raspivid raspividyuv
+	exit 0
 fi
 
+if [ "$1" != "capture" ]; then
+	echo "usage: $0 capture <source> <width> <height> <fps> <bitrate> <gop> <slices> <refresh> <low width> <low height> <low bitrate> <raw width> <raw height> <roi>" >&2
+	exit 1
+fi
+
+SOURCE=$2
+WIDTH=$3
+HEIGHT=$4
+FPS=$5
+BITRATE=$6
+GOP=$7
+SLICES=$8
+REFRESH=$9
+LOW_WIDTH=${10:-0}
+LOW_HEIGHT=${11:-0}
+LOW_BITRATE=${12:-0}
+RAW_WIDTH=${13:-0}
+RAW_HEIGHT=${14:-0}
+ROI=${15:-0,0,10000,10000}
+
+IFS=, read ROI_X ROI_Y ROI_W ROI_H <<EOF
+$ROI
+EOF
+# raspivid takes fractions
+frac() {
+	echo "$(($1/10000)).$(printf %04d $(($1%10000)))"
+}
+RASPI_ROI="-roi $(frac $ROI_X),$(frac $ROI_Y),$(frac $ROI_W),$(frac $ROI_H)"
+# the test pattern is drawn as a sensor with more pixels would see it, the region then fills the frame
+TEST_WIDTH=$(($WIDTH*10000/$ROI_W/2*2))
+TEST_HEIGHT=$(($HEIGHT*10000/$ROI_H/2*2))
+TEST_LEFT=$(($ROI_X*$TEST_WIDTH/10000))
+TEST_TOP=$(($ROI_Y*$TEST_HEIGHT/10000))
+[ $(($TEST_LEFT+$WIDTH)) -gt $TEST_WIDTH ] && TEST_LEFT=$(($TEST_WIDTH-$WIDTH))
+[ $(($TEST_TOP+$HEIGHT)) -gt $TEST_HEIGHT ] && TEST_TOP=$(($TEST_HEIGHT-$HEIGHT))
+TEST_CROP="videocrop left=$TEST_LEFT top=$TEST_TOP right=$(($TEST_WIDTH-$TEST_LEFT-$WIDTH)) bottom=$(($TEST_HEIGHT-$TEST_TOP-$HEIGHT))"
+
+RASPIVID_GOP="-g $GOP"
+X264_REFRESH=""
+if [ "$REFRESH" = "cyclic" ]; then
+	# -g 0: only the first frame is an IDR, the refresh period is fixed by the firmware
+	RASPIVID_GOP="-g 0 -if cyclic"
+	X264_REFRESH="intra-refresh=true"
+fi
+
+X264="x264enc tune=zerolatency speed-preset=ultrafast key-int-max=$GOP $X264_REFRESH byte-stream=true option-string=slices=$SLICES"
+OMX="omxh264enc control-rate=variable periodicty-idr=$GOP"
+H264_OUT="video/x-h264,stream-format=byte-stream"
+LOW_SCALE="videoscale ! video/x-raw,width=$LOW_WIDTH,height=$LOW_HEIGHT"
+RAW=""
+if [ "$RAW_WIDTH" -gt 0 ]; then
+	RAW="t. ! queue leaky=downstream max-size-buffers=2 ! videoscale ! videoconvert ! \
+		video/x-raw,format=I420,width=$RAW_WIDTH,height=$RAW_HEIGHT ! fdsink fd=4"
+fi
+
+case "$SOURCE" in
+	rpi)
+		if [ "$SLICES" -gt 1 ]; then
+			echo "raspivid can't encode multiple slices, using one per frame" >&2
+		fi
+		if [ "$LOW_WIDTH" -eq 0 ] && [ "$RAW_WIDTH" -eq 0 ]; then
+			exec raspivid -t 0 -b $BITRATE -w $WIDTH -h $HEIGHT -fps $FPS $RASPI_ROI $RASPIVID_GOP -ih -n -o -
+		fi
+		# raspivid has a single encoder output, encode the layers from the raw frames instead
+		if [ "$REFRESH" = "cyclic" ]; then
+			echo "omxh264enc has no intra refresh, using IDRs" >&2
+		fi
+		LOW=""
+		if [ "$LOW_WIDTH" -gt 0 ]; then
+			LOW="t. ! queue ! $LOW_SCALE ! $OMX target-bitrate=$LOW_BITRATE ! h264parse config-interval=1 ! $H264_OUT ! fdsink fd=3"
+		fi
+		# one read per frame: fdsrc's buffers are then whole frames videoparse passes on instead of reassembling
+		raspividyuv -t 0 -w $WIDTH -h $HEIGHT -fps $FPS $RASPI_ROI -n -o - | gst-launch-1.0 -q fdsrc blocksize=$(($WIDTH*$HEIGHT*3/2)) ! \
+			videoparse format=i420 width=$WIDTH height=$HEIGHT framerate=$FPS/1 ! tee name=t \
+			t. ! queue ! $OMX target-bitrate=$BITRATE ! h264parse config-interval=1 ! $H264_OUT ! fdsink fd=1 \
+			$LOW $RAW
+		;;
+	test)
+		LOW=""
+		if [ "$LOW_WIDTH" -gt 0 ]; then
+			LOW="t. ! queue ! $LOW_SCALE ! $X264 bitrate=$(($LOW_BITRATE/1000)) ! $H264_OUT ! fdsink fd=3"
+		fi
+		exec gst-launch-1.0 -q videotestsrc is-live=true pattern=ball ! \
+			video/x-raw,width=$TEST_WIDTH,height=$TEST_HEIGHT,framerate=$FPS/1 ! $TEST_CROP ! tee name=t \
+			t. ! queue ! $X264 bitrate=$(($BITRATE/1000)) ! $H264_OUT ! fdsink fd=1 \
+			$LOW $RAW
+		;;
+	*)
+		echo "unknown source: $SOURCE" >&2
+		exit 1
+		;;
+esac
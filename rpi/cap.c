@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cap.h"
+
+#define HDR 7 //of each packet
+
+int cap_create(struct cap *c, const char *path, const unsigned short *ports, int flows) {
+	unsigned char hdr[5 + CAP_FLOWS * 2];
+
+	memset(c, 0, sizeof(*c));
+	c->f = fopen(path, "wb");
+	if (!c->f) {
+		perror(path);
+		return -1;
+	}
+	c->flows = flows;
+	memcpy(hdr, CAP_MAGIC, 4);
+	hdr[4] = flows;
+	for (int i = 0; i < flows; i++) {
+		c->ports[i] = ports[i];
+		hdr[5 + i * 2] = ports[i] >> 8;
+		hdr[6 + i * 2] = ports[i];
+	}
+	if (fwrite(hdr, 5 + flows * 2, 1, c->f) != 1) {
+		perror(path);
+		fclose(c->f);
+		return -1;
+	}
+	return 0;
+}
+
+int cap_write(struct cap *c, unsigned long long t_us, int flow, const unsigned char *data, int len) {
+	unsigned char hdr[HDR];
+	unsigned long long d;
+
+	if (!c->packets) c->first_us = c->last_us = t_us;
+	d = t_us > c->last_us ? t_us - c->last_us : 0; //a clock step back counts as no time
+	if (d > 0xffffffffULL) d = 0xffffffffULL; //over an hour of silence is cut to one
+	c->last_us = t_us;
+	hdr[0] = d >> 24;
+	hdr[1] = d >> 16;
+	hdr[2] = d >> 8;
+	hdr[3] = d;
+	hdr[4] = flow;
+	hdr[5] = len >> 8;
+	hdr[6] = len;
+	if (fwrite(hdr, HDR, 1, c->f) != 1 || fwrite(data, len, 1, c->f) != 1) return -1;
+	c->packets++;
+	return 0;
+}
+
+int cap_open(struct cap *c, const char *path) {
+	unsigned char hdr[5 + CAP_FLOWS * 2];
+
+	memset(c, 0, sizeof(*c));
+	c->f = fopen(path, "rb");
+	if (!c->f) {
+		perror(path);
+		return -1;
+	}
+	if (fread(hdr, 5, 1, c->f) != 1 || memcmp(hdr, CAP_MAGIC, 4) || !hdr[4] || hdr[4] > CAP_FLOWS ||
+		fread(hdr + 5, hdr[4] * 2, 1, c->f) != 1) {
+		fprintf(stderr, "%s: not a capture\n", path);
+		fclose(c->f);
+		return -1;
+	}
+	c->flows = hdr[4];
+	for (int i = 0; i < c->flows; i++) c->ports[i] = hdr[5 + i * 2] << 8 | hdr[6 + i * 2];
+	return 0;
+}
+
+int cap_read(struct cap *c, unsigned long long *t_us, int *flow, unsigned char *data) {
+	unsigned char hdr[HDR];
+	int len;
+
+	if (fread(hdr, HDR, 1, c->f) != 1) return feof(c->f) ? 0 : -1;
+	len = hdr[5] << 8 | hdr[6];
+	if (hdr[4] >= c->flows || fread(data, len, 1, c->f) != 1) return -1;
+	if (c->packets++) c->t_us += (unsigned long long)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3]; //the first is at 0
+	*t_us = c->t_us;
+	*flow = hdr[4];
+	return len;
+}
+
+void cap_rewind(struct cap *c) {
+	fseek(c->f, 5 + c->flows * 2, SEEK_SET);
+	c->t_us = 0;
+	c->packets = 0;
+}
+
+void cap_close(struct cap *c) {
+	if (c->f) fclose(c->f);
+	c->f = NULL;
+}
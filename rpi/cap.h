@@ -0,0 +1,38 @@
+#ifndef CAP_H
+#define CAP_H
+
+#include <stdio.h>
+
+//Packet captures for replay: the UDP payloads a client got and when, per flow (a port of the client).
+//File: "SCP1", flows 1, their ports 2 each, then per packet [microseconds since the last one 4][flow 1][length 2][payload],
+//numbers big endian.
+
+#define CAP_MAGIC "SCP1"
+#define CAP_FLOWS 4
+#define CAP_MAX 65535 //largest payload
+
+struct cap {
+	FILE *f;
+	int flows;
+	unsigned short ports[CAP_FLOWS];
+	unsigned long long first_us, last_us; //when writing: the first packet's time, the last one's
+	unsigned long long t_us; //when reading: time of the last packet read, from the first
+	unsigned long packets;
+};
+
+//New capture at path for packets arriving on those ports; -1 with a message if it can't be written
+int cap_create(struct cap *c, const char *path, const unsigned short *ports, int flows);
+//A packet that arrived at t_us, on any clock as long as it's always the same one
+int cap_write(struct cap *c, unsigned long long t_us, int flow, const unsigned char *data, int len);
+
+//-1 with a message if it isn't a capture
+int cap_open(struct cap *c, const char *path);
+//Next packet into data, CAP_MAX bytes; *t_us is its time from the first packet. Returns its length, 0 at the end
+//and -1 if the file is cut short.
+int cap_read(struct cap *c, unsigned long long *t_us, int *flow, unsigned char *data);
+//Back to the first packet
+void cap_rewind(struct cap *c);
+
+void cap_close(struct cap *c);
+
+#endif
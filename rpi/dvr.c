@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "dvr.h"
+#include "h264.h"
+
+//stored in the ring in front of every access unit
+struct dvr_hdr {
+	int len;
+	int key; //AU_IDR or AU_RECOVERY for access units a decoder can start at
+	struct timeval t;
+};
+
+#define REC_SIZE(len) ((sizeof(struct dvr_hdr) + (len) + 7) & ~7)
+
+void dvr_init(struct dvr *d, int bytes, int seconds) {
+	memset(d, 0, sizeof(*d));
+	d->size = bytes & ~7;
+	d->ring = (unsigned char *)malloc(d->size);
+	memset(d->ring, 0, d->size); //fault the pages in now, not while streaming
+	d->wrap = -1;
+	d->window = seconds * 1000000L;
+	d->dump_pid = -1;
+}
+
+void dvr_free(struct dvr *d) {
+	free(d->ring);
+	d->ring = NULL;
+}
+
+static struct dvr_hdr *oldest(struct dvr *d) {
+	return (struct dvr_hdr *)(d->ring + d->tail);
+}
+
+static void evict(struct dvr *d) {
+	d->tail += REC_SIZE(oldest(d)->len);
+	d->count--;
+	if (d->wrap >= 0 && d->tail >= d->wrap) {
+		d->tail = 0;
+		d->wrap = -1;
+	}
+	if (!d->count) d->head = d->tail = 0;
+}
+
+//Makes room for n contiguous bytes at head
+static int fits(struct dvr *d, int n) {
+	if (!d->count) {
+		d->head = d->tail = 0;
+		d->wrap = -1;
+		return n <= d->size;
+	}
+	if (d->wrap < 0) { //data in [tail, head)
+		if (d->size - d->head >= n) return 1;
+		if (d->tail >= n) {
+			d->wrap = d->head;
+			d->head = 0;
+			return 1;
+		}
+		return 0;
+	}
+	return d->tail - d->head >= n; //data in [tail, wrap) and [0, head)
+}
+
+static long age(struct timeval *t, struct timeval *now) {
+	return (now->tv_sec - t->tv_sec) * 1000000L + (now->tv_usec - t->tv_usec);
+}
+
+void dvr_add(struct dvr *d, const unsigned char *au, int len, int key, struct timeval *t) {
+	struct timespec t0, t1;
+	struct dvr_hdr *h;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (!d->count && !key) goto done; //the ring starts at a keyframe
+
+	n = REC_SIZE(len);
+	if (n > d->size / 4) goto done; //a keyframe bigger than that couldn't be kept for long anyway
+	while (!fits(d, n)) evict(d);
+	while (d->window && d->count && age(&oldest(d)->t, t) > d->window) evict(d);
+	while (d->count && !oldest(d)->key) evict(d); //keep the ring keyframe aligned
+	if (!d->count && !key) goto done;
+	if (!fits(d, n)) goto done; //can't happen, eviction only frees space
+
+	h = (struct dvr_hdr *)(d->ring + d->head);
+	h->len = len;
+	h->key = key;
+	h->t = *t;
+	memcpy(d->ring + d->head + sizeof(*h), au, len);
+	d->head += n;
+	d->count++;
+
+done:
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	d->commits++;
+	d->commit_us += (t1.tv_sec - t0.tv_sec) * 1000000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000.0;
+}
+
+static int write_all(int fd, const unsigned char *b, int len) {
+	int ret;
+	while (len > 0) {
+		ret = write(fd, b, len);
+		if (ret < 0) return -1;
+		b += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+pid_t dvr_dump(struct dvr *d, const char *path) {
+	struct dvr_hdr *h;
+	int fd, pos, i;
+
+	if (d->dump_pid > 0) return -1; //one at a time
+	if (!d->count) return -1;
+
+	d->dump_pid = fork();
+	if (d->dump_pid != 0) return d->dump_pid;
+
+	//child: works on a copy-on-write snapshot of the ring
+	if (nice(10) < 0) {} //best effort, don't compete with the live stream
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) _exit(1);
+	for (i = 0, pos = d->tail; i < d->count; i++) {
+		if (d->wrap >= 0 && pos >= d->wrap) pos = 0;
+		h = (struct dvr_hdr *)(d->ring + pos);
+		if (write_all(fd, d->ring + pos + sizeof(*h), h->len) < 0) _exit(1);
+		pos += REC_SIZE(h->len);
+	}
+	_exit(close(fd) < 0 ? 1 : 0);
+}
+
+int dvr_used(struct dvr *d) {
+	if (!d->count) return 0;
+	if (d->wrap < 0) return d->head - d->tail;
+	return d->wrap - d->tail + d->head;
+}
+
+int dvr_reap(struct dvr *d, int *status) {
+	if (d->dump_pid <= 0) return 0;
+	if (waitpid(d->dump_pid, status, WNOHANG) != d->dump_pid) return 0;
+	d->dump_pid = -1;
+	return 1;
+}
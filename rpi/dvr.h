@@ -0,0 +1,40 @@
+#ifndef DVR_H
+#define DVR_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+//Pre-event recorder: the last seconds of the encoded stream in a fixed,
+//preallocated ring. It always starts at a keyframe, so a dump is playable.
+struct dvr {
+	unsigned char *ring;
+	int size;
+	int head; //where the next access unit goes
+	int tail; //oldest access unit
+	int wrap; //end of the data before head wrapped to 0, -1 if it didn't
+	int count; //access units held
+	long window; //us to keep
+
+	pid_t dump_pid;
+
+	unsigned long commits;
+	double commit_us; //time spent keeping the ring up to date
+};
+
+void dvr_init(struct dvr *d, int bytes, int seconds);
+void dvr_free(struct dvr *d);
+
+//Stores an access unit (start-coded NALs); key is AU_IDR or AU_RECOVERY if a decoder can start at it,
+//such access units must carry their own SPS/PPS (and recovery point)
+void dvr_add(struct dvr *d, const unsigned char *au, int len, int key, struct timeval *t);
+
+//Writes the ring as an H.264 byte-stream from a forked child, the live stream isn't touched.
+//Returns the child's pid or -1.
+pid_t dvr_dump(struct dvr *d, const char *path);
+
+int dvr_used(struct dvr *d);
+
+//Reaps a finished dump, returns 1 if one completed
+int dvr_reap(struct dvr *d, int *status);
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+//Stands in for camera_streamer.sh, camera_server -e fake_cam, with the same arguments:
+//capture [source] [width] [height] [fps] [bitrate] [gop] [slices] [idr|cyclic] [low width] [low height] [low bitrate]
+//[raw width] [raw height] [roi]
+//It writes H.264 byte-streams as the encoders would: SPS, PPS and an IDR every gop frames (or a recovery point SEI
+//with cyclic), P frames otherwise, the bitrate spread over them, each frame in its slices. The NALs aren't real
+//H.264, enough of their headers is for camera_server, and each slice says when its frame was captured so
+//loop_bench can tell how long it took to arrive, and its frame_num (reference frames since the IDR, as H.264's) so
+//it can tell one went missing. Raw frames, if asked for, are flat grey.
+//From the environment:
+//FAKE_CAM_ENCODE_MS how long encoding a frame takes, its slices come out spread over it (defaults to 0)
+//FAKE_CAM_IDR how many times a P frame an IDR is (defaults to 6)
+//FAKE_CAM_NONREF every that many P frames one is a non-reference frame (defaults to 0, none)
+//FAKE_CAM_LOG file each start, exit, stall and hang is added to, with the CLOCK_MONOTONIC time in us
+//FAKE_CAM_FAULTS what each start does, one entry per start, the last repeats: ok, die@[frames] (exits with 1, a
+//child keeping its pipes open),
+//stall@[frames] (stops writing, SIGTERM ends it), hang@[frames] (stops writing and ignores SIGTERM), fail (exits
+//with 1 before a frame)
+
+#define STAMP 15 //bytes after the NAL header: first_mb_in_slice and layer, then the capture time, frame number and frame_num
+
+static const char *log_path;
+
+static long long now_us() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+static void event(const char *what, long long us, int frames) {
+	FILE *f;
+
+	if (!log_path || !(f = fopen(log_path, "a"))) return;
+	fprintf(f, "%s %lld %i\n", what, us, frames);
+	fclose(f);
+}
+
+//Starts before this one, from the log
+static int starts() {
+	char line[128];
+	FILE *f;
+	int n = 0;
+
+	if (!log_path || !(f = fopen(log_path, "r"))) return 0;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, "start ", 6)) n++;
+	fclose(f);
+	return n;
+}
+
+//This start's entry of FAKE_CAM_FAULTS into fault, and the frames it happens after
+static void fault(int run, char *fault, int *frames) {
+	const char *s = getenv("FAKE_CAM_FAULTS"), *e;
+	int i;
+
+	strcpy(fault, "ok");
+	*frames = 0;
+	if (!s || !*s) return;
+	for (i = 0; i < run && (e = strchr(s, ',')); i++) s = e + 1;
+	e = strchr(s, ',');
+	i = e ? e - s : (int)strlen(s);
+	if (i > 15) i = 15;
+	memcpy(fault, s, i);
+	fault[i] = 0;
+	if ((e = strchr(fault, '@'))) {
+		*frames = atoi(e + 1);
+		fault[e - fault] = 0;
+	}
+}
+
+static void sleep_until(long long us) {
+	struct timespec t = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL));
+}
+
+static void out(int fd, const unsigned char *b, int len) {
+	while (len > 0) {
+		int ret = write(fd, b, len);
+		if (ret <= 0) exit(0); //camera_server closed the pipe
+		b += ret;
+		len -= ret;
+	}
+}
+
+//A NAL with its start code; the stamp's bytes have their top bit set and the filler is never 0, so no start code
+//turns up inside
+static int nal(unsigned char *b, int type, int first, int layer, long long captured, int frame, int frame_num, int size,
+	const unsigned char *filler) {
+	int n = 0;
+
+	b[n++] = 0;
+	b[n++] = 0;
+	b[n++] = 0;
+	b[n++] = 1;
+	b[n++] = type;
+	if (type == 0x65 || type == 0x41 || type == 0x01) {
+		b[n++] = first ? 0x80 : 0x40; //first_mb_in_slice 0, or 1
+		b[n++] = 0x80 | layer;
+		for (int i = 0; i < 7; i++) b[n++] = 0x80 | ((captured >> (7 * i)) & 0x7f);
+		for (int i = 0; i < 4; i++) b[n++] = 0x80 | ((frame >> (7 * i)) & 0x7f);
+		for (int i = 0; i < 2; i++) b[n++] = 0x80 | ((frame_num >> (7 * i)) & 0x7f);
+	}
+	if (size > n) {
+		memcpy(b + n, filler, size - n);
+		n = size;
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	static const unsigned char sei[] = { 0, 0, 0, 1, 0x06, 0x06, 0x01, 0xc4, 0x80 }; //recovery point, recovery_frame_cnt 0
+	char what[16];
+	unsigned char *filler, *buf, *raw = NULL;
+	int width, height, fps, bitrate, gop, slices, cyclic, low_width, low_bitrate, raw_size = 0, layers;
+	int encode_us, idr, nonref, run, at, bytes[2], key, type, frame_num = 0, size, n;
+	long long start, captured;
+
+	if (argc < 16 || strcmp(argv[1], "capture")) {
+		fprintf(stderr, "fake_cam capture [source] [width] [height] [fps] [bitrate] [gop] [slices] [idr|cyclic] [low width]"
+			" [low height] [low bitrate] [raw width] [raw height] [roi]\n");
+		return 1;
+	}
+	width = atoi(argv[3]);
+	height = atoi(argv[4]);
+	fps = atoi(argv[5]);
+	bitrate = atoi(argv[6]);
+	gop = atoi(argv[7]);
+	slices = atoi(argv[8]);
+	cyclic = !strcmp(argv[9], "cyclic");
+	low_width = atoi(argv[10]);
+	low_bitrate = atoi(argv[12]);
+	if (atoi(argv[13]) > 0) raw_size = atoi(argv[13]) * atoi(argv[14]) * 3 / 2;
+	if (fps < 1 || gop < 1 || slices < 1 || width < 1 || height < 1) return 1;
+	layers = low_width ? 2 : 1;
+	encode_us = getenv("FAKE_CAM_ENCODE_MS") ? atoi(getenv("FAKE_CAM_ENCODE_MS")) * 1000 : 0;
+	idr = getenv("FAKE_CAM_IDR") ? atoi(getenv("FAKE_CAM_IDR")) : 6;
+	if (idr < 1) idr = 1;
+	nonref = getenv("FAKE_CAM_NONREF") ? atoi(getenv("FAKE_CAM_NONREF")) : 0;
+	log_path = getenv("FAKE_CAM_LOG");
+
+	run = starts();
+	start = now_us();
+	event("start", start, 0);
+	fault(run, what, &at);
+	if (!strcmp(what, "fail")) {
+		event("exit", now_us(), 0);
+		return 1;
+	}
+
+	//the bytes of a P frame, the GOP adding up to the bitrate
+	bytes[0] = (long long)bitrate / 8 * gop / fps / (cyclic ? gop : gop - 1 + idr);
+	bytes[1] = (long long)low_bitrate / 8 * gop / fps / (cyclic ? gop : gop - 1 + idr);
+	filler = (unsigned char *)malloc(idr * bytes[0] + 64);
+	buf = (unsigned char *)malloc(idr * bytes[0] + 256);
+	srand(run + 1);
+	for (int i = 0; i < idr * bytes[0] + 64; i++) filler[i] = 1 + rand() % 255;
+	if (raw_size) {
+		raw = (unsigned char *)malloc(raw_size);
+		memset(raw, 128, raw_size);
+		fcntl(4, F_SETFL, O_NONBLOCK);
+	}
+
+	for (int f = 0; ; f++) {
+		if (at && f == at && strcmp(what, "ok")) {
+			if (!strcmp(what, "die")) {
+				//as a script whose pipeline outlives it: the pipes stay open, only SIGCHLD says it's gone; stopCam()
+				//ends the group
+				if (!fork()) {
+					alarm(60);
+					for (;;) pause();
+				}
+				event("exit", now_us(), f);
+				return 1;
+			}
+			if (!strcmp(what, "hang")) signal(SIGTERM, SIG_IGN);
+			event(what, now_us(), f);
+			for (;;) pause();
+		}
+		captured = start + (long long)f * 1000000 / fps;
+		sleep_until(captured);
+		key = f % gop == 0;
+		if (f == 0 || (key && !cyclic)) type = 0x65;
+		else type = nonref > 0 && !key && f % nonref == 0 ? 0x01 : 0x41;
+		if (type == 0x65) frame_num = 0;
+		for (int l = 0; l < layers; l++) {
+			int fd = l ? 3 : 1;
+			n = 0;
+			if (key || f == 0) {
+				unsigned char sps[] = { 0, 0, 0, 1, 0x67, 0x42, 0x00, 0x1e, (unsigned char)(0x80 | l), 0x11, 0x11, 0x11, 0x11 };
+				unsigned char pps[] = { 0, 0, 0, 1, 0x68, 0xce, 0x22, 0x22 };
+				if (!cyclic || f == 0) {
+					memcpy(buf, sps, sizeof(sps));
+					memcpy(buf + sizeof(sps), pps, sizeof(pps));
+					n = sizeof(sps) + sizeof(pps);
+				} else {
+					memcpy(buf, sei, sizeof(sei));
+					n = sizeof(sei);
+				}
+			}
+			size = (f == 0 || (key && !cyclic) ? idr : 1) * bytes[l] / slices;
+			for (int s = 0; s < slices; s++) {
+				//the slices come out while the frame is being encoded, the last one when it's done
+				if (encode_us && l == 0) sleep_until(captured + (long long)encode_us * (s + 1) / slices);
+				n += nal(buf + n, type, s == 0, l, captured, f, frame_num, size, filler);
+				out(fd, buf, n);
+				n = 0;
+			}
+		}
+		if (type != 0x01) frame_num = (frame_num + 1) & 0x3fff;
+		if (raw && write(4, raw, raw_size) < 0) {} //the pipe full, the frame is skipped
+	}
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "h264.h"
+
+void nal_scanner_init(struct nal_scanner *s, int size) {
+	s->buf = (unsigned char *)malloc(size);
+	s->size = size;
+	s->len = 0;
+	s->nal = -1;
+	s->scanned = 0;
+	s->in = s->moved = 0;
+}
+
+void nal_scanner_free(struct nal_scanner *s) {
+	free(s->buf);
+	s->buf = NULL;
+	s->size = s->len = s->scanned = 0;
+	s->nal = -1;
+}
+
+int nal_scanner_pending(struct nal_scanner *s) {
+	return s->nal >= 0 && s->len > s->nal;
+}
+
+//Offset of the first start code at or after from, -1 if there's none in len bytes.
+//Coded data has few 0x01 bytes, memchr() skips to them many bytes at a time.
+static int find_start(const unsigned char *buf, int from, int len) {
+	const unsigned char *p;
+	int i = from + 2;
+
+	while (i < len) {
+		p = (const unsigned char *)memchr(buf + i, 1, len - i);
+		if (!p) return -1;
+		i = p - buf;
+		if (!buf[i-1] && !buf[i-2]) return i - 2;
+		i++;
+	}
+	return -1;
+}
+
+static void emit(struct nal_scanner *s, int end, nal_cb cb, void *arg) {
+	//zeros in front of the next start code are trailing_zero_8bits, not NAL data
+	while (end > s->nal && s->buf[end-1] == 0) end--;
+	if (end > s->nal) cb(s->buf + s->nal, end - s->nal, arg);
+}
+
+static void parse(struct nal_scanner *s, nal_cb cb, void *arg) {
+	int i, from = s->scanned;
+
+	if (s->nal >= 0 && from < s->nal) from = s->nal;
+	while ((i = find_start(s->buf, from, s->len)) >= 0) {
+		if (s->nal >= 0) emit(s, i, cb, arg);
+		s->nal = i + 3;
+		from = s->nal;
+	}
+	s->scanned = s->len > 2 ? s->len - 2 : 0; //a start code may end in the next read
+}
+
+//Drops what was delivered only once the buffer runs low, so the pending NAL isn't moved after every read
+static void make_room(struct nal_scanner *s) {
+	int dead = s->nal >= 0 ? s->nal : (s->len > 2 ? s->len - 2 : 0);
+
+	if (s->size - s->len >= s->size / 4) return;
+	if (dead > 0) {
+		memmove(s->buf, s->buf + dead, s->len - dead);
+		s->moved += s->len - dead;
+		s->len -= dead;
+		s->scanned = s->scanned > dead ? s->scanned - dead : 0;
+		if (s->nal >= 0) s->nal -= dead;
+	}
+	if (s->size - s->len < s->size / 4) { //a single NAL filling most of the buffer
+		s->size *= 2;
+		s->buf = (unsigned char *)realloc(s->buf, s->size);
+	}
+}
+
+int nal_scanner_read(struct nal_scanner *s, int fd, nal_cb cb, void *arg) {
+	int ret;
+
+	make_room(s);
+	ret = read(fd, s->buf + s->len, s->size - s->len);
+	if (ret <= 0) return ret;
+	s->len += ret;
+	s->in += ret;
+	parse(s, cb, arg);
+	return ret;
+}
+
+void nal_scanner_flush(struct nal_scanner *s, nal_cb cb, void *arg) {
+	if (nal_scanner_pending(s)) emit(s, s->len, cb, arg);
+	//anything before the next start code belongs to the NAL we just gave away
+	s->len = 0;
+	s->nal = -1;
+	s->scanned = 0;
+}
+
+void h264_split(const unsigned char *buf, int len, nal_cb cb, void *arg) {
+	int i, nal = -1, end;
+
+	while ((i = find_start(buf, nal < 0 ? 0 : nal, len)) >= 0) {
+		if (nal >= 0) {
+			for (end = i; end > nal && !buf[end-1]; end--);
+			if (end > nal) cb(buf + nal, end - nal, arg);
+		}
+		nal = i + 3;
+	}
+	if (nal < 0) return;
+	for (end = len; end > nal && !buf[end-1]; end--); //padding, NALs never end in a zero byte
+	if (end > nal) cb(buf + nal, end - nal, arg);
+}
+
+int h264_sei_recovery(const unsigned char *nal, int len) {
+	int i = 1;
+	int type = 0, size = 0;
+
+	if (NAL_TYPE(nal) != NAL_SEI) return 0;
+	while (i < len && nal[i] != 0x80) { //rbsp_trailing_bits
+		type = size = 0;
+		while (i < len && nal[i] == 0xff) type += nal[i++];
+		if (i >= len) return 0;
+		type += nal[i++];
+		while (i < len && nal[i] == 0xff) size += nal[i++];
+		if (i >= len) return 0;
+		size += nal[i++];
+		if (type == SEI_RECOVERY_POINT) return 1;
+		i += size; //emulation prevention bytes are ignored, good enough to walk the messages
+	}
+	return 0;
+}
+
+struct bitwriter {
+	unsigned char *p;
+	int bits;
+};
+
+static void put_bit(struct bitwriter *w, int b) {
+	if (!(w->bits & 7)) w->p[w->bits >> 3] = 0;
+	if (b) w->p[w->bits >> 3] |= 0x80 >> (w->bits & 7);
+	w->bits++;
+}
+
+static void put_ue(struct bitwriter *w, unsigned int v) {
+	int n = 0;
+	v++;
+	while ((v >> n) > 1) n++;
+	for (int i = 0; i < n; i++) put_bit(w, 0);
+	for (int i = n; i >= 0; i--) put_bit(w, (v >> i) & 1);
+}
+
+int h264_make_recovery_sei(unsigned char *out, int recovery_frames) {
+	unsigned char payload[16];
+	struct bitwriter w = { payload, 0 };
+	int i, len, n = 0;
+
+	put_ue(&w, recovery_frames); //recovery_frame_cnt
+	put_bit(&w, 0); //exact_match_flag
+	put_bit(&w, 0); //broken_link_flag
+	put_bit(&w, 0); put_bit(&w, 0); //changing_slice_group_idc
+	if (w.bits & 7) { //sei payload alignment
+		put_bit(&w, 1);
+		while (w.bits & 7) put_bit(&w, 0);
+	}
+	len = w.bits >> 3;
+
+	out[n++] = NAL_SEI;
+	out[n++] = SEI_RECOVERY_POINT;
+	out[n++] = len;
+	for (i = 0; i < len; i++) {
+		if (n >= 3 && !out[n-1] && !out[n-2] && payload[i] <= 3) out[n++] = 3; //emulation prevention
+		out[n++] = payload[i];
+	}
+	out[n++] = 0x80; //rbsp_trailing_bits
+	return n;
+}
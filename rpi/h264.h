@@ -0,0 +1,55 @@
+#ifndef H264_H
+#define H264_H
+
+#define NAL_SLICE 1
+#define NAL_IDR 5
+#define NAL_SEI 6
+#define NAL_SPS 7
+#define NAL_PPS 8
+#define NAL_AUD 9
+
+#define SEI_RECOVERY_POINT 6
+
+//access units a decoder can start at
+#define AU_IDR 1
+#define AU_RECOVERY 2
+
+#define NAL_TYPE(n) ((n)[0] & 0x1f)
+#define NAL_REF_IDC(n) (((n)[0] >> 5) & 0x03)
+#define NAL_IS_SLICE(t) ((t)==NAL_SLICE || (t)==NAL_IDR)
+//first_mb_in_slice is ue(v), so a leading '1' bit means the slice starts a new picture
+#define NAL_FIRST_MB_ZERO(n) ((n)[1] & 0x80)
+
+typedef void (*nal_cb)(const unsigned char *nal, int len, void *arg);
+
+//Splits an Annex B byte-stream (as written by raspivid/x264) into NAL units
+struct nal_scanner {
+	unsigned char *buf;
+	int size; //allocated bytes
+	int len; //bytes held
+	int nal; //offset of the pending NAL (after its start code), -1 if none
+	int scanned; //bytes already searched for a start code
+	unsigned long in, moved; //bytes read, and bytes moved again to make room
+};
+
+void nal_scanner_init(struct nal_scanner *s, int size);
+void nal_scanner_free(struct nal_scanner *s);
+
+//Reads once from fd into the scanner and emits every complete NAL; returns read()'s result
+int nal_scanner_read(struct nal_scanner *s, int fd, nal_cb cb, void *arg);
+
+//Emits the pending NAL as complete (used once the producer went idle)
+void nal_scanner_flush(struct nal_scanner *s, nal_cb cb, void *arg);
+
+int nal_scanner_pending(struct nal_scanner *s);
+
+//Emits every NAL of a buffer that holds whole NALs, like an encoder's output buffer, in place
+void h264_split(const unsigned char *buf, int len, nal_cb cb, void *arg);
+
+//Returns 1 if the SEI NAL carries a recovery point (what intra refresh encoders use instead of IDRs)
+int h264_sei_recovery(const unsigned char *nal, int len);
+
+//Writes a recovery point SEI NAL (without start code) into out, returns its length
+int h264_make_recovery_sei(unsigned char *out, int recovery_frames);
+
+#endif
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "hls.h"
+
+#define REQ_PLAYLIST 0
+#define REQ_INIT 1
+#define REQ_SEGMENT 2
+#define REQ_PART 3
+#define REQ_UNKNOWN 4
+#define REQ_BAD 5
+
+#define PLAYLIST_TYPE "application/vnd.apple.mpegurl"
+
+static long age(struct timeval *t, struct timeval *now) {
+	return (now->tv_sec - t->tv_sec) * 1000000L + (now->tv_usec - t->tv_usec);
+}
+
+//MP4_TIMESCALE units from a to b
+static long ticks(struct timeval *a, struct timeval *b) {
+	return age(a, b) * 9 / 100;
+}
+
+static double secs(long t) {
+	return (double)t / MP4_TIMESCALE;
+}
+
+static struct hls_part *part(struct hls *h, long n) {
+	return &h->parts[n % HLS_PARTS];
+}
+
+static struct hls_segment *segment(struct hls *h, int msn) {
+	return &h->segments[msn % HLS_SEGMENTS];
+}
+
+int hls_init(struct hls *h, int port, int part_ms, int segment_ms, int width, int height) {
+	struct sockaddr_in a;
+
+	memset(h, 0, sizeof(*h));
+	h->part_target = part_ms * (MP4_TIMESCALE / 1000L);
+	h->segment_target = segment_ms * (MP4_TIMESCALE / 1000L);
+	h->width = width;
+	h->height = height;
+	h->msn = -1;
+	h->restart = 1;
+
+	h->sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (h->sock < 0) return -1;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = INADDR_ANY;
+	a.sin_port = htons(port);
+	if (bind(h->sock, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(h->sock, HLS_CLIENTS) < 0) {
+		close(h->sock);
+		return -1;
+	}
+	return 0;
+}
+
+void hls_free(struct hls *h) {
+	int i;
+
+	for (i = 0; i < HLS_CLIENTS; i++) {
+		if (h->clients[i].sock) close(h->clients[i].sock);
+		free(h->clients[i].out);
+	}
+	for (i = 0; i < HLS_PARTS; i++) free(h->parts[i].data);
+	for (i = 0; i < HLS_SEGMENTS; i++) free(h->init[i]);
+	free(h->stage);
+	free(h->text);
+	close(h->sock);
+}
+
+static void close_client(struct hls_client *c) {
+	close(c->sock);
+	c->sock = 0;
+	c->req_len = 0;
+	c->waiting = 0;
+	c->out_len = c->out_pos = 0;
+}
+
+static void flush(struct hls_client *c) {
+	int ret;
+
+	while (c->out_pos < c->out_len) {
+		ret = send(c->sock, c->out + c->out_pos, c->out_len - c->out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) close_client(c);
+			return;
+		}
+		c->out_pos += ret;
+	}
+	c->out_len = c->out_pos = 0;
+}
+
+//Writes the response head, returns where the len bytes of body go
+static unsigned char *reply(struct hls_client *c, int status, const char *type, int len) {
+	char head[256];
+	const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found" :
+		status == 501 ? "Not Implemented" : "Service Unavailable";
+	int n = snprintf(head, sizeof(head), "HTTP/1.1 %i %s\r\nContent-Type: %s\r\nContent-Length: %i\r\n"
+		"Cache-Control: %s\r\nAccess-Control-Allow-Origin: *\r\n\r\n",
+		status, reason, type, len, status == 200 && strcmp(type, PLAYLIST_TYPE) ? "max-age=60" : "no-cache");
+
+	if (c->out_size < n + len) {
+		c->out_size = n + len;
+		c->out = (unsigned char *)realloc(c->out, c->out_size);
+	}
+	memcpy(c->out, head, n);
+	c->out_len = n + len;
+	c->out_pos = 0;
+	return c->out + n;
+}
+
+static void send_playlist(struct hls *h, struct hls_client *c) {
+	struct hls_segment *s;
+	struct hls_part *p;
+	long target = h->segment_target;
+	int msn, i, n, size = 512 + (h->next_part - h->first_part + 2 * HLS_SEGMENTS) * 100;
+
+	if (h->text_size < size) {
+		h->text_size = size;
+		h->text = (char *)realloc(h->text, size);
+	}
+	for (msn = h->first_msn; msn < h->msn; msn++)
+		if (segment(h, msn)->duration > target) target = segment(h, msn)->duration; //segments end at keyframes
+	n = snprintf(h->text, size, "#EXTM3U\n#EXT-X-VERSION:9\n#EXT-X-TARGETDURATION:%li\n#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+		"#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n#EXT-X-MEDIA-SEQUENCE:%i\n#EXT-X-DISCONTINUITY-SEQUENCE:%i\n",
+		(target + MP4_TIMESCALE - 1) / MP4_TIMESCALE, secs(h->part_target), 3 * secs(h->part_target), h->first_msn,
+		segment(h, h->first_msn)->init - 1); //a discontinuity comes with every init segment after the first
+	for (msn = h->first_msn; msn <= h->msn; msn++) {
+		s = segment(h, msn);
+		if (msn == h->first_msn || s->init != segment(h, msn - 1)->init)
+			n += snprintf(h->text + n, size - n, "%s#EXT-X-MAP:URI=\"init-%i.mp4\"\n", msn == h->first_msn ? "" : "#EXT-X-DISCONTINUITY\n", s->init);
+		for (i = 0; msn >= h->msn - 2 && i < s->parts; i++) { //parts only near the live edge
+			p = part(h, s->part + i);
+			n += snprintf(h->text + n, size - n, "#EXT-X-PART:DURATION=%.3f,URI=\"part%i.%i.m4s\"%s\n",
+				secs(p->duration), msn, i, p->independent ? ",INDEPENDENT=YES" : "");
+		}
+		if (msn < h->msn) n += snprintf(h->text + n, size - n, "#EXTINF:%.3f,\nseg%i.m4s\n", secs(s->duration), msn);
+	}
+	n += snprintf(h->text + n, size - n, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part%i.%i.m4s\"\n", h->msn, segment(h, h->msn)->parts);
+	memcpy(reply(c, 200, PLAYLIST_TYPE, n), h->text, n);
+}
+
+//HTTP status for the request, 0 if it must wait
+static int status(struct hls *h, struct hls_client *c) {
+	struct hls_segment *s;
+
+	switch (c->what) {
+		case REQ_BAD: return 501;
+		case REQ_UNKNOWN: return 404;
+		case REQ_INIT:
+			if (!h->init_n) return 0; //camera is starting
+			return c->msn > 0 && c->msn <= h->init_n && c->msn > h->init_n - HLS_SEGMENTS ? 200 : 404;
+	}
+	if (h->next_part == h->first_part) return 0; //camera is starting
+	if (c->what == REQ_PLAYLIST) {
+		if (c->msn < 0) return 200;
+		if (c->msn > h->msn + 2) return 400; //too far ahead to block for
+		if (c->msn != h->msn) return c->msn < h->msn ? 200 : 0;
+		return c->part >= 0 && c->part < segment(h, h->msn)->parts ? 200 : 0;
+	}
+	if (c->msn < h->first_msn || c->msn > h->msn + 1) return 404;
+	if (c->msn == h->msn + 1) return c->what == REQ_PART && !c->part ? 0 : 404; //a preload hint past the segment's end
+	s = segment(h, c->msn);
+	if (c->what == REQ_SEGMENT) return c->msn < h->msn ? 200 : 0;
+	if (c->part < s->parts) return 200;
+	return c->msn == h->msn && c->part <= s->parts + 1 ? 0 : 404;
+}
+
+//Responds if the request can be served, or has waited too long
+static void answer(struct hls *h, struct hls_client *c) {
+	struct timeval now;
+	struct hls_segment *s;
+	struct hls_part *p;
+	unsigned char *b;
+	int st = status(h, c), i, len;
+
+	gettimeofday(&now, NULL);
+	if (!st) {
+		if (age(&c->since, &now) < 3 * h->segment_target * 100 / 9) return;
+		st = 503;
+	}
+	c->waiting = 0;
+	if (st != 200) reply(c, st, "text/plain", 0);
+	else if (c->what == REQ_PLAYLIST) send_playlist(h, c);
+	else if (c->what == REQ_INIT) {
+		i = c->msn % HLS_SEGMENTS;
+		memcpy(reply(c, 200, "video/mp4", h->init_len[i]), h->init[i], h->init_len[i]);
+	}
+	else if (c->what == REQ_PART) {
+		p = part(h, segment(h, c->msn)->part + c->part);
+		memcpy(reply(c, 200, "video/mp4", p->len), p->data, p->len);
+		h->served_parts++;
+		h->latency_ms += age(&p->first, &now) / 1000.0;
+	} else {
+		s = segment(h, c->msn);
+		for (i = 0, len = 0; i < s->parts; i++) len += part(h, s->part + i)->len;
+		b = reply(c, 200, "video/mp4", len);
+		for (i = 0; i < s->parts; i++) {
+			p = part(h, s->part + i);
+			memcpy(b, p->data, p->len);
+			b += p->len;
+		}
+	}
+	flush(c);
+}
+
+//Takes the requests that came in, one at a time; returns how many
+static int process(struct hls *h, struct hls_client *c) {
+	char method[8], uri[HLS_REQUEST], *q, *end;
+	int n, k = 0, got = 0;
+
+	while (c->sock && !c->waiting && !c->out_len) {
+		c->req[c->req_len] = 0;
+		end = strstr(c->req, "\r\n\r\n");
+		if (!end) {
+			if (c->req_len == HLS_REQUEST) close_client(c);
+			break;
+		}
+		got++;
+		h->requests++;
+		gettimeofday(&h->last_request, NULL);
+		c->since = h->last_request;
+		c->waiting = 1;
+		c->msn = c->part = -1;
+		if (sscanf(c->req, "%7s %1023s", method, uri) != 2 || strcmp(method, "GET")) c->what = REQ_BAD;
+		else {
+			if ((q = strchr(uri, '?'))) *q++ = 0;
+			if (!strcmp(uri, "/stream.m3u8")) {
+				c->what = REQ_PLAYLIST;
+				if (q && (end = strstr(q, "_HLS_msn="))) c->msn = atoi(end + 9);
+				if (q && (end = strstr(q, "_HLS_part="))) c->part = atoi(end + 10);
+			} else if (sscanf(uri, "/init-%d.mp4%n", &c->msn, &k) == 1 && k && !uri[k]) c->what = REQ_INIT;
+			else if (sscanf(uri, "/seg%d.m4s%n", &c->msn, &k) == 1 && k && !uri[k]) c->what = REQ_SEGMENT;
+			else if (sscanf(uri, "/part%d.%d.m4s%n", &c->msn, &c->part, &k) == 2 && k && !uri[k]) c->what = REQ_PART;
+			else c->what = REQ_UNKNOWN;
+		}
+		n = strstr(c->req, "\r\n\r\n") + 4 - c->req;
+		memmove(c->req, c->req + n, c->req_len - n);
+		c->req_len -= n;
+		if (!status(h, c)) h->held++;
+		answer(h, c);
+	}
+	return got;
+}
+
+//Something new is available, answers the requests waiting for it
+static void wake(struct hls *h) {
+	for (int i = 0; i < HLS_CLIENTS; i++) {
+		struct hls_client *c = &h->clients[i];
+		if (!c->sock || !c->waiting) continue;
+		answer(h, c);
+		if (c->sock) process(h, c);
+	}
+}
+
+static void drop_segment(struct hls *h) {
+	h->first_msn++;
+	h->first_part = segment(h, h->first_msn)->part;
+}
+
+static void new_segment(struct hls *h) {
+	struct hls_segment *s;
+
+	h->msn++;
+	if (h->msn - h->first_msn >= HLS_SEGMENTS) drop_segment(h);
+	s = segment(h, h->msn);
+	s->part = h->next_part;
+	s->parts = 0;
+	s->duration = 0;
+	s->init = h->init_n;
+}
+
+//Turns the staged frames into a part; last is the duration of the last one
+static void flush_part(struct hls *h, long last) {
+	struct hls_segment *s = segment(h, h->msn);
+	struct hls_part *p;
+	long duration = 0;
+	int i, need;
+
+	if (!h->nsamples) return;
+	for (i = 0; i < h->nsamples; i++) {
+		h->samples[i].duration = i + 1 < h->nsamples ? ticks(&h->times[i], &h->times[i + 1]) : last;
+		duration += h->samples[i].duration;
+	}
+	if (h->next_part - h->first_part == HLS_PARTS) drop_segment(h); //segments are cut before the current one could be the oldest
+	p = part(h, h->next_part);
+	need = MP4_FRAGMENT_SIZE(h->nsamples, h->stage_len);
+	if (p->size < need) {
+		p->size = need;
+		p->data = (unsigned char *)realloc(p->data, need);
+	}
+	p->len = mp4_fragment(p->data, h->next_part + 1, h->dts, h->samples, h->nsamples, h->stage, h->stage_len);
+	p->msn = h->msn;
+	p->index = s->parts;
+	p->independent = h->samples[0].key;
+	p->duration = duration;
+	p->first = h->times[0];
+
+	h->next_part++;
+	s->parts++;
+	s->duration += duration;
+	h->dts += duration;
+	h->last_duration = last;
+	h->nsamples = 0;
+	h->stage_len = 0;
+	wake(h);
+}
+
+void hls_add(struct hls *h, const unsigned char *au, int len, int key, struct timeval *t) {
+	const unsigned char *sps, *pps;
+	int sps_len, pps_len, n, cut, changed, at = h->stage_len, i;
+	long d, frame;
+
+	if (h->restart && !key) return;
+	if (h->stage_size < h->stage_len + MP4_SAMPLE_SIZE(len)) {
+		h->stage_size = 2 * (h->stage_len + MP4_SAMPLE_SIZE(len));
+		h->stage = (unsigned char *)realloc(h->stage, h->stage_size);
+	}
+	n = mp4_sample(h->stage + at, au, len, &sps, &sps_len, &pps, &pps_len);
+	changed = key && sps_len && pps_len && sps_len <= HLS_PARAM && pps_len <= HLS_PARAM && (h->resized ||
+		sps_len != h->sps_len || pps_len != h->pps_len || memcmp(sps, h->sps, sps_len) || memcmp(pps, h->pps, pps_len));
+
+	if (h->nsamples) {
+		d = ticks(&h->times[0], t); //the part so far
+		frame = ticks(&h->times[h->nsamples - 1], t); //its last frame
+		//segments start at keyframes, and are cut anyway before they'd hold more than their share of the parts;
+		//a new init segment always starts one
+		cut = changed || (key && segment(h, h->msn)->duration + d >= h->segment_target * 9 / 10) ||
+			segment(h, h->msn)->parts >= HLS_PARTS / HLS_SEGMENTS - 1;
+		if (cut || d + frame > h->part_target || h->nsamples == HLS_SAMPLES) flush_part(h, frame);
+		if (cut) new_segment(h);
+	} else if (changed && !h->restart && segment(h, h->msn)->parts) new_segment(h);
+	if (h->restart) {
+		new_segment(h);
+		h->restart = 0;
+	}
+	if (h->stage_len != at) memmove(h->stage + h->stage_len, h->stage + at, n); //the part it was staged after was sent
+
+	if (changed) { //the segment just started holds no parts yet, the slot reused was for segments already dropped
+		memcpy(h->sps, sps, sps_len);
+		memcpy(h->pps, pps, pps_len);
+		h->sps_len = sps_len;
+		h->pps_len = pps_len;
+		h->resized = 0;
+		i = ++h->init_n % HLS_SEGMENTS;
+		h->init[i] = (unsigned char *)realloc(h->init[i], MP4_INIT_SIZE(sps_len, pps_len));
+		h->init_len[i] = mp4_init(h->init[i], sps, sps_len, pps, pps_len, h->width, h->height);
+		segment(h, h->msn)->init = h->init_n;
+		wake(h);
+	}
+	if (!n) return;
+	h->samples[h->nsamples].size = n;
+	h->samples[h->nsamples].key = key;
+	h->times[h->nsamples] = *t;
+	h->nsamples++;
+	h->stage_len += n;
+}
+
+void hls_size(struct hls *h, int width, int height) {
+	if (width == h->width && height == h->height) return;
+	h->width = width;
+	h->height = height;
+	h->resized = 1;
+}
+
+void hls_stop(struct hls *h) {
+	flush_part(h, h->last_duration ? h->last_duration : MP4_TIMESCALE / 25); //a guess if there was only one frame
+	h->restart = 1;
+}
+
+void hls_fds(struct hls *h, fd_set *readfds, fd_set *writefds, int *max_fd) {
+	FD_SET(h->sock, readfds);
+	if (h->sock > *max_fd) *max_fd = h->sock;
+	for (int i = 0; i < HLS_CLIENTS; i++) {
+		struct hls_client *c = &h->clients[i];
+		if (!c->sock) continue;
+		if (c->out_len) FD_SET(c->sock, writefds);
+		else if (c->req_len < HLS_REQUEST) FD_SET(c->sock, readfds); //also tells when a waiting client goes away
+		if (c->sock > *max_fd) *max_fd = c->sock;
+	}
+}
+
+int hls_handle(struct hls *h, fd_set *readfds, fd_set *writefds) {
+	struct hls_client *c;
+	int i, ret, got = 0;
+
+	if (FD_ISSET(h->sock, readfds)) {
+		ret = accept(h->sock, 0, 0);
+		for (i = 0; ret >= 0 && i < HLS_CLIENTS && h->clients[i].sock; i++);
+		if (ret < 0) perror("accept");
+		else if (i == HLS_CLIENTS) close(ret); //too many
+		else {
+			c = &h->clients[i];
+			c->sock = ret;
+			c->req_len = c->out_len = c->out_pos = 0;
+			c->waiting = 0;
+		}
+	}
+
+	for (i = 0; i < HLS_CLIENTS; i++) {
+		c = &h->clients[i];
+		if (!c->sock) continue;
+		if (FD_ISSET(c->sock, writefds)) flush(c);
+		if (c->sock && FD_ISSET(c->sock, readfds)) {
+			ret = recv(c->sock, c->req + c->req_len, HLS_REQUEST - c->req_len, MSG_DONTWAIT);
+			if (ret > 0) c->req_len += ret;
+			else if (!ret || (errno != EAGAIN && errno != EINTR)) close_client(c);
+		}
+		if (c->sock && c->waiting) answer(h, c); //or time it out
+		if (c->sock) got += process(h, c);
+	}
+	return got;
+}
+
+long hls_idle(struct hls *h) {
+	struct timeval now;
+
+	if (!h->requests) return LONG_MAX;
+	gettimeofday(&now, NULL);
+	return age(&h->last_request, &now);
+}
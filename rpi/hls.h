@@ -0,0 +1,105 @@
+#ifndef HLS_H
+#define HLS_H
+
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "mp4.h"
+
+#define HLS_PARTS 512 //parts held
+#define HLS_SEGMENTS 8 //segments held, the last one is being built
+#define HLS_SAMPLES 64 //frames in a part at most
+#define HLS_CLIENTS 32
+#define HLS_REQUEST 1024 //longest request head
+#define HLS_PARAM 256 //max SPS/PPS size
+
+//A CMAF part, a moof/mdat pair
+struct hls_part {
+	int msn, index; //segment it belongs to, and its number in there
+	int independent; //starts with a keyframe
+	long duration; //MP4_TIMESCALE units
+	struct timeval first; //when its first frame came from the encoder
+	unsigned char *data;
+	int len, size;
+};
+
+struct hls_segment {
+	long part; //number of its first part
+	int parts;
+	long duration;
+	int init; //init segment its parts go with
+};
+
+struct hls_client {
+	int sock; //0 if the slot is free
+	char req[HLS_REQUEST + 1];
+	int req_len;
+	int waiting; //for what to become available, a blocking request
+	int what;
+	int msn, part;
+	struct timeval since;
+	unsigned char *out; //response being sent
+	int out_len, out_pos, out_size;
+};
+
+//Low-latency HLS: packages access units into CMAF parts, keeps the last segments in memory
+//and serves them, with blocking playlist reloads, from its own small HTTP server
+struct hls {
+	int sock;
+	int width, height;
+	long part_target, segment_target; //MP4_TIMESCALE units
+
+	unsigned char sps[HLS_PARAM], pps[HLS_PARAM];
+	int sps_len, pps_len;
+	unsigned char *init[HLS_SEGMENTS]; //ring, init segment n is in init[n % HLS_SEGMENTS]
+	int init_len[HLS_SEGMENTS];
+	int init_n; //newest init segment, 0 before the first; each one starts a segment, after a discontinuity
+	int resized; //the next keyframe gets a new init segment, for the new picture size
+
+	struct hls_part parts[HLS_PARTS]; //ring, part n is in parts[n % HLS_PARTS]
+	long first_part, next_part;
+	struct hls_segment segments[HLS_SEGMENTS]; //ring, by msn
+	int first_msn, msn; //oldest segment held, segment being built (-1 before the first)
+	int restart; //the next keyframe starts a new segment, nothing before it is kept
+
+	//frames of the part being built, as length-prefixed NALs
+	unsigned char *stage;
+	int stage_len, stage_size;
+	struct mp4_sample samples[HLS_SAMPLES];
+	struct timeval times[HLS_SAMPLES];
+	int nsamples;
+	long last_duration;
+	unsigned long long dts; //of the first staged frame
+
+	struct hls_client clients[HLS_CLIENTS];
+	char *text; //playlist being written
+	int text_size;
+	struct timeval last_request;
+
+	unsigned long requests, held, served_parts;
+	double latency_ms; //sum over served parts: age of their first frame when sent
+};
+
+//Listens on port; part and segment are target durations in ms. Returns -1 on failure.
+int hls_init(struct hls *h, int port, int part_ms, int segment_ms, int width, int height);
+void hls_free(struct hls *h);
+
+//Adds an access unit (start-coded NALs); key is nonzero for keyframes, which must carry SPS/PPS
+void hls_add(struct hls *h, const unsigned char *au, int len, int key, struct timeval *t);
+
+//The picture size the encoder is (re)started with; a new one takes effect at the next keyframe
+void hls_size(struct hls *h, int width, int height);
+
+//The encoder stopped: finishes the part being built, the next keyframe starts a new segment
+void hls_stop(struct hls *h);
+
+//Adds the server's sockets to the sets
+void hls_fds(struct hls *h, fd_set *readfds, fd_set *writefds, int *max_fd);
+
+//Serves whatever the sets say is ready, returns the number of requests received
+int hls_handle(struct hls *h, fd_set *readfds, fd_set *writefds);
+
+//Microseconds since the last request
+long hls_idle(struct hls *h);
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "motion.h"
+
+int motion_init(struct motion *m, int width, int height) {
+	memset(m, 0, sizeof(*m));
+	m->width = width / MOTION_SCALE & ~15; //whole vectors
+	m->height = height / MOTION_SCALE;
+	m->cur = (unsigned char *)malloc(m->width * m->height);
+	m->ref = (unsigned char *)malloc(m->width * m->height);
+	if (!m->cur || !m->ref) {
+		motion_free(m);
+		return -1;
+	}
+	return 0;
+}
+
+void motion_free(struct motion *m) {
+	free(m->cur);
+	free(m->ref);
+	m->cur = m->ref = NULL;
+}
+
+//A thumbnail row: each 8 source pixels averaged into one
+static void shrink_row(unsigned char *dst, const unsigned char *src, int width) {
+	int x = 0;
+#if defined(__SSE2__)
+	for (; x + 2 <= width; x += 2) { //sums of the two 8 byte halves
+		__m128i s = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(src + x * 8)), _mm_setzero_si128());
+		dst[x] = _mm_cvtsi128_si32(s) >> 3;
+		dst[x + 1] = _mm_cvtsi128_si32(_mm_srli_si128(s, 8)) >> 3;
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 2 <= width; x += 2) {
+		uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vld1q_u8(src + x * 8))));
+		dst[x] = vgetq_lane_u64(s, 0) >> 3;
+		dst[x + 1] = vgetq_lane_u64(s, 1) >> 3;
+	}
+#endif
+	for (; x < width; x++) {
+		unsigned int sum = 0;
+		for (int i = 0; i < 8; i++) sum += src[x * 8 + i];
+		dst[x] = sum >> 3;
+	}
+}
+
+unsigned int motion_sad(const unsigned char *a, const unsigned char *b, int n) {
+	unsigned int sad = 0;
+	int i = 0;
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+	sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+	for (; i + 16 <= n; i += 16) //the byte differences widened and added pairwise, 16 bits can't overflow in one step
+		acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+	uint64x2_t s = vpaddlq_u32(acc);
+	sad = vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1);
+#endif
+	for (; i < n; i++) sad += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return sad;
+}
+
+double motion_compare(struct motion *m, const unsigned char *luma, int stride) {
+	int n = m->width * m->height;
+
+	for (int y = 0; y < m->height; y++) //the middle row of each band
+		shrink_row(m->cur + y * m->width, luma + (y * MOTION_SCALE + MOTION_SCALE / 2) * stride, m->width);
+	if (!m->have_ref || !n) return 255;
+	return (double)motion_sad(m->cur, m->ref, n) / n;
+}
+
+void motion_keep(struct motion *m) {
+	unsigned char *t = m->ref;
+
+	m->ref = m->cur;
+	m->cur = t;
+	m->have_ref = 1;
+}
@@ -0,0 +1,26 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#define MOTION_SCALE 8 //thumbnails are 1/8 of the frame each way
+
+//How much a scene changes, from thumbnails of the luma plane: every 8th row, 8 pixels averaged into one.
+//The frame is compared with a reference the caller keeps, the last one it encoded, so slow changes add up.
+struct motion {
+	int width, height; //of the thumbnails
+	unsigned char *cur, *ref;
+	int have_ref;
+};
+
+int motion_init(struct motion *m, int width, int height); //of the frames, -1 if out of memory
+void motion_free(struct motion *m);
+
+//Thumbnail of the frame and its mean absolute difference to the reference, in luma levels; 255 without one
+double motion_compare(struct motion *m, const unsigned char *luma, int stride);
+
+//The frame last compared becomes the reference
+void motion_keep(struct motion *m);
+
+//Sum of absolute differences of n bytes, SSE2 or NEON where there is one
+unsigned int motion_sad(const unsigned char *a, const unsigned char *b, int n);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "motion.h"
+
+//Checks motion_sad and motion_compare against plain C on every length and alignment, then times them
+//and runs the -G gate over a made up minute of 640x480 at 30 fps: 20 s of a still scene with sensor
+//noise, 10 s of a moving block, 30 s still again.
+
+#define THRESHOLD 3.0 //-G's default
+#define STATIC_FPS 1
+
+//What the SIMD versions must match; the compiler would vectorize it otherwise
+__attribute__((noinline, optimize("no-tree-vectorize")))
+static unsigned int plain_sad(const unsigned char *a, const unsigned char *b, int n) {
+	unsigned int sad = 0;
+	for (int i = 0; i < n; i++) sad += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return sad;
+}
+
+//A thumbnail as motion.h describes it
+static void plain_thumb(unsigned char *dst, const unsigned char *luma, int stride, int width, int height) {
+	for (int y = 0; y < height; y++) {
+		const unsigned char *row = luma + (y * MOTION_SCALE + MOTION_SCALE / 2) * stride;
+		for (int x = 0; x < width; x++) {
+			unsigned int sum = 0;
+			for (int i = 0; i < MOTION_SCALE; i++) sum += row[x * MOTION_SCALE + i];
+			dst[y * width + x] = sum / MOTION_SCALE;
+		}
+	}
+}
+
+static unsigned char pixel() {
+	int r = rand() % 8;
+	return r == 0 ? 0 : r == 1 ? 255 : rand(); //the extremes, where a wrong saturation shows
+}
+
+static int noise() {
+	return rand() % 7 - 3;
+}
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int check() {
+	unsigned char a[512 + 16], b[512 + 16];
+	int errors = 0;
+
+	for (int i = 0; i < (int)sizeof(a); i++) {
+		a[i] = pixel();
+		b[i] = pixel();
+	}
+	for (int n = 0; n <= 512; n++) //whole vectors and the rest, from every alignment
+		for (int off = 0; off < 16; off++)
+			if (motion_sad(a + off, b + 15 - off, n) != plain_sad(a + off, b + 15 - off, n)) {
+				if (errors++ < 10) fprintf(stderr, "motion_sad of %i bytes at offsets %i, %i: %u, should be %u\n",
+					n, off, 15 - off, motion_sad(a + off, b + 15 - off, n), plain_sad(a + off, b + 15 - off, n));
+			}
+
+	//frame sizes that aren't multiples of the thumbnail's vectors, with padded strides
+	static const int sizes[][3] = { { 640, 480, 640 }, { 1000, 600, 1024 }, { 1920, 1080, 1920 }, { 136, 24, 160 } };
+	for (int s = 0; s < 4; s++) {
+		int w = sizes[s][0], h = sizes[s][1], stride = sizes[s][2];
+		unsigned char *f1 = (unsigned char *)malloc(stride * h), *f2 = (unsigned char *)malloc(stride * h);
+		struct motion m;
+		for (int i = 0; i < stride * h; i++) {
+			f1[i] = pixel();
+			f2[i] = pixel();
+		}
+		motion_init(&m, w, h);
+		int n = m.width * m.height;
+		unsigned char *t1 = (unsigned char *)malloc(n + 1), *t2 = (unsigned char *)malloc(n + 1);
+		plain_thumb(t1, f1, stride, m.width, m.height);
+		plain_thumb(t2, f2, stride, m.width, m.height);
+		double want = n ? (double)plain_sad(t2, t1, n) / n : 255;
+		motion_compare(&m, f1, stride);
+		motion_keep(&m);
+		double got = motion_compare(&m, f2, stride);
+		if (memcmp(m.ref, t1, n) || memcmp(m.cur, t2, n) || got != want) {
+			errors++;
+			fprintf(stderr, "motion_compare of %ix%i (stride %i): %.3f, should be %.3f\n", w, h, stride, got, want);
+		}
+		motion_free(&m);
+		free(t1);
+		free(t2);
+		free(f1);
+		free(f2);
+	}
+	printf("Checked motion_sad on 0-512 bytes at 16 alignments and motion_compare on 4 frame sizes: %i errors\n", errors);
+	return errors;
+}
+
+static void bench(int iterations) {
+	int n = 1920 / MOTION_SCALE * (1080 / MOTION_SCALE), w = 1920, h = 1080;
+	unsigned char *a = (unsigned char *)malloc(n), *b = (unsigned char *)malloc(n), *f = (unsigned char *)malloc(w * h);
+	volatile unsigned int sink = 0;
+	struct motion m;
+	double t;
+
+	for (int i = 0; i < n; i++) {
+		a[i] = rand();
+		b[i] = rand();
+	}
+	t = now();
+	for (int k = 0; k < iterations; k++) sink += motion_sad(a, b, n);
+	t = now() - t;
+	printf("motion_sad on a 1080p thumbnail: %.1f GB/s, %.2f us\n", (double)n * iterations / t / 1e9, t / iterations * 1e6);
+	t = now();
+	for (int k = 0; k < iterations; k++) sink += plain_sad(a, b, n);
+	t = now() - t;
+	printf("The same in plain C: %.1f GB/s, %.2f us\n", (double)n * iterations / t / 1e9, t / iterations * 1e6);
+
+	for (int i = 0; i < w * h; i++) f[i] = 128 + noise();
+	motion_init(&m, w, h);
+	motion_compare(&m, f, w);
+	motion_keep(&m);
+	t = now();
+	for (int k = 0; k < iterations / 10; k++) sink += (unsigned int)motion_compare(&m, f, w);
+	t = now() - t;
+	printf("motion_compare on a 1080p frame: %.1f us\n", t / (iterations / 10) * 1e6);
+	motion_free(&m);
+	free(a);
+	free(b);
+	free(f);
+}
+
+//The gate as the V4L2 path runs it: after a second below the threshold only STATIC_FPS frames a second
+//are encoded, the first one above it opens the gate again
+static void gate() {
+	int w = 640, h = 480, fps = 30, frames = 60 * fps, moving_from = 20 * fps, moving_to = 30 * fps;
+	int still = 0, gated = 0, encoded = 0, last = -fps, reacted = -1;
+	unsigned char *bg = (unsigned char *)malloc(w * h), *f = (unsigned char *)malloc(w * h);
+	struct motion m;
+
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++) bg[y * w + x] = (x * 7 + y * 3) & 255;
+	motion_init(&m, w, h);
+	for (int fr = 0; fr < frames; fr++) {
+		for (int i = 0; i < w * h; i++) {
+			int v = bg[i] + noise();
+			f[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+		}
+		if (fr >= moving_from && fr < moving_to) {
+			int bx = fr * 8 % (w - 80);
+			for (int y = 200; y < 280; y++) memset(f + y * w + bx, 250, 80);
+		}
+		if (motion_compare(&m, f, w) >= THRESHOLD) {
+			still = 0;
+			if (gated && reacted < 0) reacted = fr - moving_from;
+			gated = 0;
+		} else if (!gated && ++still >= fps) gated = 1;
+		if (gated && fr - last < fps / STATIC_FPS) continue;
+		last = fr;
+		encoded++;
+		motion_keep(&m);
+	}
+	printf("Gate over a minute at %ix%i, %i fps: %i of %i frames encoded (%.0f%%), motion picked up %i frames after it started\n",
+		w, h, fps, encoded, frames, 100.0 * encoded / frames, reacted);
+	motion_free(&m);
+	free(bg);
+	free(f);
+}
+
+void print_usage() {
+	printf("motion_bench [options]\n");
+	printf("-c only check the results, don't time anything\n");
+	printf("-n [iterations] of the SAD timing (defaults to 20000)\n");
+}
+
+int main(int argc, char **argv) {
+	int option, check_only = 0, iterations = 20000;
+
+	while ((option = getopt(argc, argv, "cn:")) != -1) {
+		switch (option) {
+			case 'c': check_only = 1; break;
+			case 'n': iterations = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (iterations < 10) {
+		print_usage();
+		return 1;
+	}
+	srand(1);
+	if (check()) return 1;
+	if (check_only) return 0;
+	bench(iterations);
+	gate();
+	return 0;
+}
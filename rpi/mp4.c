@@ -0,0 +1,237 @@
+#include <string.h>
+
+#include "mp4.h"
+#include "h264.h"
+
+static void put8(unsigned char **p, unsigned int v) {
+	*(*p)++ = v;
+}
+
+static void put16(unsigned char **p, unsigned int v) {
+	put8(p, v >> 8);
+	put8(p, v);
+}
+
+static void put32(unsigned char **p, unsigned int v) {
+	put16(p, v >> 16);
+	put16(p, v);
+}
+
+static void put64(unsigned char **p, unsigned long long v) {
+	put32(p, v >> 32);
+	put32(p, v);
+}
+
+static void zeros(unsigned char **p, int n) {
+	memset(*p, 0, n);
+	*p += n;
+}
+
+//Starts a box, its size is filled in by end()
+static unsigned char *box(unsigned char **p, const char *type) {
+	unsigned char *b = *p;
+	put32(p, 0);
+	memcpy(*p, type, 4);
+	*p += 4;
+	return b;
+}
+
+static unsigned char *full_box(unsigned char **p, const char *type, int version, int flags) {
+	unsigned char *b = box(p, type);
+	put32(p, version << 24 | flags);
+	return b;
+}
+
+static void end(unsigned char **p, unsigned char *b) {
+	put32(&b, *p - b);
+}
+
+static void matrix(unsigned char **p) {
+	static const unsigned int unity[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+	for (int i = 0; i < 9; i++) put32(p, unity[i]);
+}
+
+int mp4_sample(unsigned char *out, const unsigned char *au, int len,
+	const unsigned char **sps, int *sps_len, const unsigned char **pps, int *pps_len) {
+	int i = 0, start, end, n = 0;
+
+	*sps_len = *pps_len = 0;
+	while (i + 3 <= len && !(au[i] == 0 && au[i + 1] == 0 && au[i + 2] == 1)) i++;
+	for (start = i + 3; start < len; start = end + 3) {
+		for (end = start; end + 3 <= len && !(au[end] == 0 && au[end + 1] == 0 && au[end + 2] == 1); end++);
+		if (end + 3 > len) end = len;
+		i = end;
+		while (i > start && !au[i - 1]) i--; //trailing zeros belong to the next start code
+		switch (NAL_TYPE(au + start)) {
+			case NAL_AUD: continue;
+			case NAL_SPS: *sps = au + start; *sps_len = i - start; continue;
+			case NAL_PPS: *pps = au + start; *pps_len = i - start; continue;
+		}
+		unsigned char *p = out + n;
+		put32(&p, i - start);
+		memcpy(p, au + start, i - start);
+		n += 4 + i - start;
+	}
+	return n;
+}
+
+int mp4_init(unsigned char *out, const unsigned char *sps, int sps_len, const unsigned char *pps, int pps_len, int width, int height) {
+	unsigned char *p = out, *moov, *trak, *mdia, *minf, *stbl, *b, *avc1, *avcc;
+
+	b = box(&p, "ftyp");
+	memcpy(p, "iso6\0\0\0\0iso6cmfcavc1", 20); //major brand, version, compatible brands
+	p += 20;
+	end(&p, b);
+
+	moov = box(&p, "moov");
+	b = full_box(&p, "mvhd", 0, 0);
+	zeros(&p, 8); //creation and modification time
+	put32(&p, MP4_TIMESCALE);
+	put32(&p, 0); //duration, unknown
+	put32(&p, 0x10000); //rate
+	put16(&p, 0x100); //volume
+	zeros(&p, 10);
+	matrix(&p);
+	zeros(&p, 24);
+	put32(&p, 2); //next track id
+	end(&p, b);
+
+	trak = box(&p, "trak");
+	b = full_box(&p, "tkhd", 0, 3); //enabled, in movie
+	zeros(&p, 8);
+	put32(&p, 1); //track id
+	zeros(&p, 4);
+	put32(&p, 0); //duration
+	zeros(&p, 16); //reserved, layer, alternate group, volume, reserved
+	matrix(&p);
+	put32(&p, width << 16);
+	put32(&p, height << 16);
+	end(&p, b);
+
+	mdia = box(&p, "mdia");
+	b = full_box(&p, "mdhd", 0, 0);
+	zeros(&p, 8);
+	put32(&p, MP4_TIMESCALE);
+	put32(&p, 0);
+	put16(&p, 0x55c4); //"und"
+	put16(&p, 0);
+	end(&p, b);
+	b = full_box(&p, "hdlr", 0, 0);
+	put32(&p, 0);
+	memcpy(p, "vide", 4);
+	p += 4;
+	zeros(&p, 12);
+	memcpy(p, "camera_server", 14);
+	p += 14;
+	end(&p, b);
+
+	minf = box(&p, "minf");
+	b = full_box(&p, "vmhd", 0, 1);
+	zeros(&p, 8); //graphics mode and opcolor
+	end(&p, b);
+	b = box(&p, "dinf");
+	unsigned char *dref = full_box(&p, "dref", 0, 0);
+	put32(&p, 1);
+	unsigned char *url = full_box(&p, "url ", 0, 1); //data is in this file
+	end(&p, url);
+	end(&p, dref);
+	end(&p, b);
+
+	stbl = box(&p, "stbl");
+	b = full_box(&p, "stsd", 0, 0);
+	put32(&p, 1);
+	avc1 = box(&p, "avc1");
+	zeros(&p, 6);
+	put16(&p, 1); //data reference index
+	zeros(&p, 16);
+	put16(&p, width);
+	put16(&p, height);
+	put32(&p, 0x480000); //72 dpi
+	put32(&p, 0x480000);
+	put32(&p, 0);
+	put16(&p, 1); //frame count
+	zeros(&p, 32); //compressor name
+	put16(&p, 0x18); //depth
+	put16(&p, 0xffff);
+	avcc = box(&p, "avcC");
+	put8(&p, 1);
+	put8(&p, sps_len > 3 ? sps[1] : 0); //profile, compatibility, level
+	put8(&p, sps_len > 3 ? sps[2] : 0);
+	put8(&p, sps_len > 3 ? sps[3] : 0);
+	put8(&p, 0xff); //4 byte NAL lengths
+	put8(&p, 0xe1); //one SPS
+	put16(&p, sps_len);
+	memcpy(p, sps, sps_len);
+	p += sps_len;
+	put8(&p, 1); //one PPS
+	put16(&p, pps_len);
+	memcpy(p, pps, pps_len);
+	p += pps_len;
+	end(&p, avcc);
+	end(&p, avc1);
+	end(&p, b);
+	//no samples here, they are all in fragments
+	b = full_box(&p, "stts", 0, 0);
+	put32(&p, 0);
+	end(&p, b);
+	b = full_box(&p, "stsc", 0, 0);
+	put32(&p, 0);
+	end(&p, b);
+	b = full_box(&p, "stsz", 0, 0);
+	put32(&p, 0);
+	put32(&p, 0);
+	end(&p, b);
+	b = full_box(&p, "stco", 0, 0);
+	put32(&p, 0);
+	end(&p, b);
+	end(&p, stbl);
+	end(&p, minf);
+	end(&p, mdia);
+	end(&p, trak);
+
+	b = box(&p, "mvex");
+	unsigned char *trex = full_box(&p, "trex", 0, 0);
+	put32(&p, 1); //track id
+	put32(&p, 1); //sample description
+	zeros(&p, 12); //default duration, size, flags; every fragment has its own
+	end(&p, trex);
+	end(&p, b);
+	end(&p, moov);
+	return p - out;
+}
+
+int mp4_fragment(unsigned char *out, unsigned int seq, unsigned long long dts, const struct mp4_sample *s, int n,
+	const unsigned char *data, int data_len) {
+	unsigned char *p = out, *moof, *traf, *b, *offset;
+
+	moof = box(&p, "moof");
+	b = full_box(&p, "mfhd", 0, 0);
+	put32(&p, seq);
+	end(&p, b);
+	traf = box(&p, "traf");
+	b = full_box(&p, "tfhd", 0, 0x020000); //offsets are from the moof
+	put32(&p, 1);
+	end(&p, b);
+	b = full_box(&p, "tfdt", 1, 0);
+	put64(&p, dts);
+	end(&p, b);
+	b = full_box(&p, "trun", 0, 0x000701); //data offset, per sample duration, size and flags
+	put32(&p, n);
+	offset = p;
+	put32(&p, 0);
+	for (int i = 0; i < n; i++) {
+		put32(&p, s[i].duration);
+		put32(&p, s[i].size);
+		put32(&p, s[i].key ? 0x02000000 : 0x01010000); //depends on nothing; depends on others, not a sync sample
+	}
+	end(&p, b);
+	end(&p, traf);
+	end(&p, moof);
+	put32(&offset, p - moof + 8);
+
+	put32(&p, 8 + data_len);
+	memcpy(p, "mdat", 4);
+	p += 4;
+	memcpy(p, data, data_len);
+	return p - out + data_len;
+}
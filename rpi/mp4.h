@@ -0,0 +1,34 @@
+#ifndef MP4_H
+#define MP4_H
+
+#define MP4_TIMESCALE 90000
+
+//Minimal fragmented MP4 (CMAF) muxer: one H.264 track, an init segment, then moof/mdat fragments
+struct mp4_sample {
+	int size;
+	int duration; //MP4_TIMESCALE units
+	int key; //a decoder can start here
+};
+
+//Most bytes mp4_sample() writes for an access unit of len bytes
+#define MP4_SAMPLE_SIZE(len) ((len) + (len) / 4 + 4)
+
+//Converts an access unit from start-coded to length-prefixed NALs, returns the length.
+//AUDs and parameter sets are left out, the parameter sets are returned in sps/pps (length 0 if absent).
+int mp4_sample(unsigned char *out, const unsigned char *au, int len,
+	const unsigned char **sps, int *sps_len, const unsigned char **pps, int *pps_len);
+
+//Most bytes mp4_init() writes
+#define MP4_INIT_SIZE(sps_len, pps_len) (1024 + (sps_len) + (pps_len))
+
+//Writes the init segment (ftyp and moov with the avcC) into out, returns the length
+int mp4_init(unsigned char *out, const unsigned char *sps, int sps_len, const unsigned char *pps, int pps_len, int width, int height);
+
+//Most bytes mp4_fragment() writes for n samples holding data_len bytes
+#define MP4_FRAGMENT_SIZE(n, data_len) (128 + 12 * (n) + (data_len))
+
+//Writes a moof/mdat pair with n samples, their data back to back in data; dts is the first sample's
+int mp4_fragment(unsigned char *out, unsigned int seq, unsigned long long dts, const struct mp4_sample *s, int n,
+	const unsigned char *data, int data_len);
+
+#endif
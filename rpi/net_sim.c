@@ -0,0 +1,469 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rt.h"
+
+//A UDP proxy that impairs what goes through: camera_server sends to it, it passes the packets on to a client with
+//loss, bursts of loss, delay, jitter, reordering and a rate limited link, changing over time as a profile or a
+//bandwidth trace says. Every random decision comes from one seeded generator in packet order, so the same
+//packets meet the same fate on every run.
+
+#define FLOWS 4
+#define MAX_PHASES 64
+#define MAX_TRACE 100000
+#define MAX_HELD 65536 //packets on their way
+#define MAX_PACKET 65536
+#define SPIN_US 200 //the last of each wait is spun
+
+struct impair {
+	double loss; //% of packets, independently
+	double ge_p, ge_r; //Gilbert-Elliott: % chance per packet of going from good to bad, and back
+	double ge_bad, ge_good; //% lost in each state
+	double delay_ms, jitter_ms; //each packet delay +- up to jitter, uniformly
+	int ordered; //jitter doesn't reorder
+	double reorder, reorder_ms; //% of packets held back that long, the ones after overtake them
+	double rate_kbps; //of the link, 0 = unlimited
+	double queue_ms; //what the link's queue holds at its rate, beyond that packets are dropped
+};
+
+struct phase {
+	unsigned long long at_us; //from the first packet
+	struct impair im;
+};
+
+struct rate {
+	unsigned long long at_us;
+	double kbps;
+};
+
+struct held {
+	unsigned long long release, arrival;
+	unsigned long index; //in arrival order
+	int flow, len;
+	unsigned char *data;
+};
+
+struct stats {
+	unsigned long in, sent, bytes, lost, burst_lost, queue_lost, reordered, runs;
+	double delay_us, delay_max_us, late_us, late_max_us;
+};
+
+volatile sig_atomic_t stop = 0;
+
+struct phase phases[MAX_PHASES];
+int nphases = 1;
+struct rate *trace = NULL;
+int ntrace = 0;
+
+struct held heap[MAX_HELD];
+int nheld = 0;
+
+unsigned long long rng; //xorshift64*, the same on every libc
+int ge_bad_state = 0;
+unsigned long long link_free = 0, last_release = 0;
+
+FILE *log_file = NULL;
+
+void print_usage() {
+	printf("net_sim [options] [client]:[port]\n");
+	printf("-p [port] take packets on that UDP port, up to %i of them, the others go as far from the client's port as\n", FLOWS);
+	printf("   they are from the first (default 8888)\n");
+	printf("-S [seed] of the random decisions (default 1)\n");
+	printf("-l [%%] packets lost at random\n");
+	printf("-g [p],[r][,[bad]][,[good]] Gilbert-Elliott bursts: %% chance per packet to go bad and back to good, %% lost when bad\n");
+	printf("   (default 100) and good (default 0)\n");
+	printf("-D [ms] delay\n");
+	printf("-J [ms] jitter, the delay varies that much either way\n");
+	printf("-O jitter doesn't reorder\n");
+	printf("-R [%%][,[ms]] packets held back that long (default 5 ms), those after overtake them\n");
+	printf("-B [kbit/s] link rate\n");
+	printf("-Q [ms] the link's queue, packets that would wait longer are dropped (default 100)\n");
+	printf("-T [file] link rate over time, lines of [ms] [kbit/s] from the first packet; the last line's time is the\n");
+	printf("   trace's length, it starts over then\n");
+	printf("-F [file] profile: lines of [seconds] and the options above that change then, e.g. \"10 -g 5,30 -B 2000\"\n");
+	printf("-o [file] what happened to each packet: its number, arrival us, flow, length, fate (sent, lost, burst, queue), delay us, late us\n");
+	printf("-P [policy]:[priority][:cpus] scheduling, e.g. fifo:50:3\n");
+}
+
+void onSignal(int sig) {
+	stop = 1;
+}
+
+unsigned long long monotonicUs() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+//Uniform in [0, 100)
+double percent() {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 2685821657736338717ULL) >> 11) * (100.0 / 9007199254740992.0);
+}
+
+int parseAddr(const char *arg, struct sockaddr_in *a) {
+	char host[256];
+	int port;
+	struct hostent *h;
+
+	if (sscanf(arg, "%255[^:]:%i", host, &port) != 2 || port <= 0 || port > 65535) return -1;
+	h = gethostbyname(host);
+	if (!h) return -1;
+	memset(a, 0, sizeof(*a));
+	a->sin_family = AF_INET;
+	memcpy(&a->sin_addr, h->h_addr, 4);
+	a->sin_port = htons(port);
+	return 0;
+}
+
+//One impairment option, from the command line or a profile line; -1 if it's malformed
+int parseImpair(struct impair *im, int option, const char *arg) {
+	int n;
+
+	switch (option) {
+		case 'l': return sscanf(arg, "%lf", &im->loss) == 1 ? 0 : -1;
+		case 'g':
+			im->ge_bad = 100;
+			im->ge_good = 0;
+			n = sscanf(arg, "%lf,%lf,%lf,%lf", &im->ge_p, &im->ge_r, &im->ge_bad, &im->ge_good);
+			return n >= 2 && im->ge_r > 0 ? 0 : -1;
+		case 'D': return sscanf(arg, "%lf", &im->delay_ms) == 1 ? 0 : -1;
+		case 'J': return sscanf(arg, "%lf", &im->jitter_ms) == 1 ? 0 : -1;
+		case 'O': im->ordered = 1; return 0;
+		case 'R':
+			im->reorder_ms = 5;
+			return sscanf(arg, "%lf,%lf", &im->reorder, &im->reorder_ms) >= 1 ? 0 : -1;
+		case 'B': return sscanf(arg, "%lf", &im->rate_kbps) == 1 ? 0 : -1;
+		case 'Q': return sscanf(arg, "%lf", &im->queue_ms) == 1 ? 0 : -1;
+	}
+	return -1;
+}
+
+//Each line starts from the phase before it
+int loadProfile(const char *path) {
+	char line[512], *tok, *save;
+	double at;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || !(tok = strtok_r(line, " \t\r\n", &save))) continue;
+		if (nphases == MAX_PHASES || sscanf(tok, "%lf", &at) != 1 || at * 1000000 < phases[nphases - 1].at_us) goto bad;
+		phases[nphases].at_us = at * 1000000;
+		phases[nphases].im = phases[nphases - 1].im;
+		while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+			if (tok[0] != '-' || !tok[1]) goto bad;
+			int option = tok[1];
+			const char *arg = option == 'O' ? "" : strtok_r(NULL, " \t\r\n", &save);
+			if (!arg || parseImpair(&phases[nphases].im, option, arg) < 0) goto bad;
+		}
+		nphases++;
+	}
+	fclose(f);
+	return 0;
+bad:
+	fprintf(stderr, "%s: bad line %s\n", path, line);
+	fclose(f);
+	return -1;
+}
+
+int loadTrace(const char *path) {
+	double ms, kbps;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	trace = (struct rate *)malloc(MAX_TRACE * sizeof(*trace));
+	while (ntrace < MAX_TRACE && fscanf(f, "%lf %lf", &ms, &kbps) == 2) {
+		trace[ntrace].at_us = ms * 1000;
+		trace[ntrace].kbps = kbps;
+		if (ntrace && trace[ntrace].at_us < trace[ntrace - 1].at_us) break;
+		ntrace++;
+	}
+	fclose(f);
+	if (ntrace < 2) {
+		fprintf(stderr, "%s: a trace needs 2 lines or more of [ms] [kbit/s]\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+struct impair *impairAt(unsigned long long t) {
+	int i = nphases - 1;
+	while (i && phases[i].at_us > t) i--;
+	return &phases[i].im;
+}
+
+double traceRate(unsigned long long t) {
+	static int i = 0; //packets come in time order, the search goes on from the last
+	unsigned long long length = trace[ntrace - 1].at_us;
+
+	t = length ? t % length : 0;
+	if (t < trace[i].at_us) i = 0;
+	while (i + 1 < ntrace - 1 && trace[i + 1].at_us <= t) i++;
+	return trace[i].kbps;
+}
+
+//Same release, arrival order
+int before(struct held *a, struct held *b) {
+	return a->release < b->release || (a->release == b->release && a->index < b->index);
+}
+
+void heapPush(struct held *h) {
+	int i = nheld++;
+	while (i && before(h, &heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = *h;
+}
+
+void heapPop() {
+	struct held last = heap[--nheld];
+	int i = 0, c;
+
+	while ((c = i * 2 + 1) < nheld) {
+		if (c + 1 < nheld && before(&heap[c + 1], &heap[c])) c++;
+		if (!before(&heap[c], &last)) break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+}
+
+void logPacket(unsigned long index, unsigned long long arrival, int flow, int len, const char *fate, double delay_us, double late_us) {
+	if (log_file) fprintf(log_file, "%lu %llu %i %i %s %.0f %.0f\n", index, arrival, flow, len, fate, delay_us, late_us);
+}
+
+//Decides what happens to a packet that just arrived: always the same draws in the same order
+void impair(struct stats *s, unsigned long long t0, unsigned long long now, unsigned long index, int flow,
+	unsigned char *data, int len, int *losing) {
+	struct impair *im = impairAt(now - t0);
+	struct held h;
+	double kbps, r_ge = percent(), r_loss = percent(), r_burst = percent(), r_jitter = percent(), r_reorder = percent();
+	const char *fate = NULL;
+	unsigned long long out = now;
+
+	s->in++;
+	if (im->ge_p > 0) {
+		if (ge_bad_state ? r_ge < im->ge_r : r_ge < im->ge_p) ge_bad_state = !ge_bad_state;
+		if (r_burst < (ge_bad_state ? im->ge_bad : im->ge_good)) fate = "burst";
+	} else ge_bad_state = 0;
+	if (!fate && r_loss < im->loss) fate = "lost";
+
+	kbps = trace ? traceRate(now - t0) : im->rate_kbps;
+	if (!fate && kbps > 0) { //serialized onto the link behind what's queued
+		unsigned long long start = link_free > now ? link_free : now;
+		if (start - now > (im->queue_ms > 0 ? im->queue_ms : 100) * 1000) fate = "queue";
+		else out = link_free = start + (unsigned long long)(len * 8000.0 / kbps);
+	}
+	if (!fate && nheld == MAX_HELD) fate = "queue";
+
+	if (fate) {
+		if (fate[0] == 'b') s->burst_lost++;
+		else if (fate[0] == 'l') s->lost++;
+		else s->queue_lost++;
+		if (!*losing) s->runs++;
+		*losing = 1;
+		logPacket(index, now, flow, len, fate, 0, 0);
+		return;
+	}
+	*losing = 0;
+
+	double d = im->delay_ms * 1000 + (r_jitter / 50 - 1) * im->jitter_ms * 1000;
+	out += d > 0 ? (unsigned long long)d : 0;
+	if (im->ordered && out < last_release) out = last_release;
+	if (r_reorder < im->reorder) out += im->reorder_ms * 1000;
+	else last_release = out; //the held back one doesn't hold up the rest
+
+	h.release = out;
+	h.arrival = now;
+	h.index = index;
+	h.flow = flow;
+	h.len = len;
+	h.data = (unsigned char *)malloc(len);
+	memcpy(h.data, data, len);
+	heapPush(&h);
+}
+
+void printStats(struct stats *s, const char *what) {
+	unsigned long dropped = s->lost + s->burst_lost + s->queue_lost;
+	printf("%s%lu in, %lu sent, %lu lost at random, %lu in bursts, %lu queue drops (%.2f%% in %lu runs, %.1f long), %lu reordered, "
+		"%.0f KB; delay %.2f ms, %.2f at most; sent %.1f us late, %.0f at most\n", what,
+		s->in, s->sent, s->lost, s->burst_lost, s->queue_lost, s->in ? dropped * 100.0 / s->in : 0, s->runs,
+		s->runs ? (double)dropped / s->runs : 0, s->reordered, s->bytes / 1024.0,
+		s->sent ? s->delay_us / s->sent / 1000 : 0, s->delay_max_us / 1000, s->sent ? s->late_us / s->sent : 0, s->late_max_us);
+	fflush(stdout);
+}
+
+void addStats(struct stats *total, struct stats *s) {
+	total->in += s->in;
+	total->sent += s->sent;
+	total->bytes += s->bytes;
+	total->lost += s->lost;
+	total->burst_lost += s->burst_lost;
+	total->queue_lost += s->queue_lost;
+	total->reordered += s->reordered;
+	total->runs += s->runs;
+	total->delay_us += s->delay_us;
+	total->late_us += s->late_us;
+	if (s->delay_max_us > total->delay_max_us) total->delay_max_us = s->delay_max_us;
+	if (s->late_max_us > total->late_max_us) total->late_max_us = s->late_max_us;
+}
+
+int main(int argc, char **argv) {
+	struct rt_sched sched;
+	const char *profile = NULL;
+	struct sockaddr_in client, to, a;
+	struct pollfd fds[FLOWS];
+	struct stats s, total;
+	struct timespec wait;
+	unsigned short ports[FLOWS];
+	unsigned char buf[MAX_PACKET];
+	unsigned long long now, t0 = 0, last, seed = 1;
+	unsigned long index = 0, sent_max = 0;
+	int option, flows = 0, n, losing = 0, big = 4 * 1024 * 1024, any_sent = 0;
+
+	memset(&sched, 0, sizeof(sched));
+	memset(phases, 0, sizeof(phases));
+	while ((option = getopt(argc, argv, "p:S:l:g:D:J:OR:B:Q:T:F:o:P:")) != -1) {
+		switch (option) {
+			case 'p':
+				if (flows == FLOWS || atoi(optarg) <= 0 || atoi(optarg) > 65535) {
+					print_usage();
+					return 1;
+				}
+				ports[flows++] = atoi(optarg);
+				break;
+			case 'S': seed = strtoull(optarg, NULL, 0); break;
+			case 'T':
+				if (loadTrace(optarg) < 0) return 1;
+				break;
+			case 'F': profile = optarg; break;
+			case 'o':
+				log_file = fopen(optarg, "w");
+				if (!log_file) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			case 'P':
+				if (rt_parse(&sched, optarg) < 0) {
+					fprintf(stderr, "Bad scheduling %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				if (parseImpair(&phases[0].im, option, optarg) < 0) {
+					print_usage();
+					return 1;
+				}
+		}
+	}
+	if (optind >= argc || parseAddr(argv[optind], &client) < 0) {
+		print_usage();
+		return 1;
+	}
+	if (profile && loadProfile(profile) < 0) return 1; //its lines start from the options
+	if (!flows) ports[flows++] = 8888;
+	rng = seed ? seed : 1;
+
+	for (int i = 0; i < flows; i++) {
+		fds[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+		fds[i].events = POLLIN;
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_port = htons(ports[i]);
+		setsockopt(fds[i].fd, SOL_SOCKET, SO_RCVBUF, &big, sizeof(big));
+		setsockopt(fds[i].fd, SOL_SOCKET, SO_SNDBUF, &big, sizeof(big));
+		fcntl(fds[i].fd, F_SETFL, O_NONBLOCK);
+		if (bind(fds[i].fd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+			perror("bind");
+			return 1;
+		}
+	}
+	if (rt_apply(&sched, 0, 0) < 0) return 1;
+	prctl(PR_SET_TIMERSLACK, 1);
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	memset(&s, 0, sizeof(s));
+	memset(&total, 0, sizeof(total));
+	last = monotonicUs();
+	while (!stop) {
+		now = monotonicUs();
+		if (nheld && heap[0].release <= now + SPIN_US) wait.tv_sec = wait.tv_nsec = 0;
+		else {
+			unsigned long long us = nheld ? heap[0].release - now - SPIN_US : 100000;
+			if (us > 100000) us = 100000;
+			wait.tv_sec = 0;
+			wait.tv_nsec = us * 1000;
+		}
+		if (ppoll(fds, flows, &wait, NULL) < 0) continue; //interrupted
+
+		for (int i = 0; i < flows; i++) {
+			if (!(fds[i].revents & POLLIN)) continue;
+			while ((n = recv(fds[i].fd, buf, sizeof(buf), 0)) >= 0) {
+				now = monotonicUs();
+				if (!index) t0 = now; //profiles and traces start with the first packet
+				impair(&s, t0, now, index++, i, buf, n, &losing);
+			}
+		}
+
+		//what's due, spinning for what's due very soon
+		while (nheld && heap[0].release <= (now = monotonicUs()) + SPIN_US) {
+			while (now < heap[0].release) now = monotonicUs();
+			struct held h = heap[0];
+			heapPop();
+			to = client;
+			to.sin_port = htons(ntohs(client.sin_port) + ports[h.flow] - ports[0]);
+			if (sendto(fds[h.flow].fd, h.data, h.len, 0, (struct sockaddr *)&to, sizeof(to)) == h.len) {
+				double delay = h.release - h.arrival, late = now - h.release;
+				s.sent++;
+				s.bytes += h.len;
+				s.delay_us += delay;
+				s.late_us += late;
+				if (delay > s.delay_max_us) s.delay_max_us = delay;
+				if (late > s.late_max_us) s.late_max_us = late;
+				if (any_sent && h.index < sent_max) s.reordered++;
+				if (!any_sent || h.index > sent_max) sent_max = h.index;
+				any_sent = 1;
+				logPacket(h.index, h.arrival, h.flow, h.len, "sent", delay, late);
+			} else {
+				s.queue_lost++; //the socket's buffer is full, as good as a queue drop
+				logPacket(h.index, h.arrival, h.flow, h.len, "queue", 0, 0);
+			}
+			free(h.data);
+		}
+
+		if (now - last >= 1000000) {
+			if (s.in || nheld) printStats(&s, "");
+			addStats(&total, &s);
+			memset(&s, 0, sizeof(s));
+			last = now;
+		}
+	}
+	addStats(&total, &s);
+	printStats(&total, "Total: ");
+	if (log_file) fclose(log_file);
+	return 0;
+}
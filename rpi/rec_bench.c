@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "h264.h"
+#include "record.h"
+
+//Checks the segment recorder over a disk that can't keep up: record.o is linked with --wrap=write, so every write()
+//it makes sleeps as long as a card of -k KB/s would take. rec_add(), what the streaming side calls, must not wait
+//for it; frames that don't fit are dropped up to the next keyframe and recording goes on once the disk catches up.
+//Also that segments started in the same second don't overwrite each other. Then times rec_add() and the writer.
+
+#define FPS 30
+#define GOP 30
+
+static int disk_kbyte_s; //0 = as fast as it goes
+
+extern "C" ssize_t __real_write(int fd, const void *buf, size_t len);
+extern "C" ssize_t __wrap_write(int fd, const void *buf, size_t len) {
+	if (disk_kbyte_s) usleep(len * 1000000L / 1024 / disk_kbyte_s);
+	return __real_write(fd, buf, len);
+}
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int segments(const char *dir, int remove) {
+	char path[512];
+	struct dirent *e;
+	DIR *d = opendir(dir);
+	int n = 0;
+
+	if (!d) return -1;
+	while ((e = readdir(d)))
+		if (!strncmp(e->d_name, "rec-", 4)) {
+			n++;
+			snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+			if (remove) unlink(path);
+		}
+	closedir(d);
+	return n;
+}
+
+//An access unit with an IDR or a P slice, the rest filler
+static void au(unsigned char *b, int len, int key) {
+	memset(b, 0x55, len);
+	b[0] = b[1] = b[2] = 0;
+	b[3] = 1;
+	b[4] = key ? 0x65 : 0x41;
+}
+
+//Waits for the writer to empty the queue, adding up the statistics until then
+static void drain(struct recorder *r, struct rec_stats *total) {
+	struct rec_stats s;
+
+	memset(total, 0, sizeof(*total));
+	do {
+		usleep(10000);
+		rec_stats(r, &s);
+		total->frames += s.frames;
+		total->dropped += s.dropped;
+		total->segments += s.segments;
+		total->errors += s.errors;
+		if (s.write_max_us > total->write_max_us) total->write_max_us = s.write_max_us;
+		if (s.disk_kbyte_s) total->disk_kbyte_s = s.disk_kbyte_s;
+		if (s.write_us) total->write_us = s.write_us;
+	} while (s.queued);
+}
+
+//Segments a keyframe apart, all in one second, with no limit on how many are kept
+static int same_second(const char *dir) {
+	struct recorder r;
+	struct timeval t = { 1700000000, 0 };
+	unsigned char b[4096];
+	int n, errors = 0;
+
+	au(b, sizeof(b), 1);
+	if (rec_init(&r, dir, 0, 0, 1 << 20, 0) < 0) return 1;
+	for (int i = 0; i < 5; i++) {
+		t.tv_usec = i * 100000;
+		rec_add(&r, b, sizeof(b), AU_IDR, &t);
+	}
+	rec_free(&r);
+	if ((n = segments(dir, 1)) != 5) {
+		fprintf(stderr, "5 segments in one second left %i files\n", n);
+		errors++;
+	}
+	printf("Segments started in the same second: %i errors\n", errors);
+	return errors;
+}
+
+//Frames at FPS, a keyframe every GOP, for seconds, over a disk of kbyte_s; returns the longest rec_add() in ms
+static double stream(struct recorder *r, int seconds, int frame_bytes, int kbyte_s, int *added) {
+	unsigned char *b = (unsigned char *)malloc(frame_bytes);
+	struct timeval t;
+	double start = now(), t0, worst = 0;
+
+	disk_kbyte_s = kbyte_s;
+	for (int i = 0; i < seconds * FPS; i++) {
+		while (now() < start + (double)i / FPS) usleep(1000);
+		au(b, frame_bytes, i % GOP == 0);
+		gettimeofday(&t, NULL);
+		t0 = now();
+		rec_add(r, b, frame_bytes, i % GOP == 0 ? AU_IDR : 0, &t);
+		if (now() - t0 > worst) worst = now() - t0;
+		(*added)++;
+	}
+	free(b);
+	return worst * 1000;
+}
+
+static int throttled(const char *dir, int kbyte_s) {
+	struct recorder r;
+	struct rec_stats slow, fast;
+	int frame_bytes = 8 * 1024, added = 0, after = 0, errors = 0;
+	double worst, worst_after;
+
+	//a queue of a second, filled at 240 KB/s
+	if (rec_init(&r, dir, 1, 4, frame_bytes * FPS * 5 / 4, 0) < 0) return 1;
+	worst = stream(&r, 2, frame_bytes, kbyte_s, &added);
+	rec_stats(&r, &slow);
+	//the slow writes already under way finish at the old speed
+	worst_after = stream(&r, 2, frame_bytes, 0, &after);
+	drain(&r, &fast);
+	rec_free(&r);
+	printf("Over %i KB/s: %i frames, %lu dropped, longest rec_add %.2f ms; then %i more, %lu dropped, %lu written in all\n",
+		kbyte_s, added, slow.dropped, worst, after, fast.dropped, slow.frames + fast.frames);
+	if (worst > 5 || worst_after > 5) {
+		fprintf(stderr, "rec_add waited %.1f ms\n", worst > worst_after ? worst : worst_after);
+		errors++;
+	}
+	if (!slow.dropped || slow.frames + fast.frames + slow.dropped + fast.dropped != (unsigned long)(added + after)) {
+		fprintf(stderr, "%i frames added, %lu written and %lu dropped\n", added + after, slow.frames + fast.frames,
+			slow.dropped + fast.dropped);
+		errors++;
+	}
+	if (fast.frames < (unsigned long)after / 2) { //it caught up and went on recording
+		fprintf(stderr, "Only %lu frames written once the disk was fast again\n", fast.frames);
+		errors++;
+	}
+	if (segments(dir, 1) < 2) {
+		fprintf(stderr, "No segments\n");
+		errors++;
+	}
+	printf("Recording over a slow disk: %i errors\n", errors);
+	return errors;
+}
+
+static void bench(const char *dir, int seconds) {
+	static const int sizes[] = { 4 * 1024, 32 * 1024, 128 * 1024 };
+	struct recorder r;
+	struct rec_stats s;
+	int added;
+	double worst;
+
+	for (int i = 0; i < 3; i++) {
+		added = 0;
+		if (rec_init(&r, dir, 1, 4, sizes[i] * FPS * 5 / 4, 0) < 0) return;
+		worst = stream(&r, seconds, sizes[i], 0, &added);
+		drain(&r, &s);
+		rec_free(&r);
+		printf("%3i KB frames at %i fps: longest rec_add %.2f ms, write %.2f ms avg %.2f ms max, disk %.0f KB/s, %lu dropped\n",
+			sizes[i] / 1024, FPS, worst, s.write_us / 1000, s.write_max_us / 1000, s.disk_kbyte_s, s.dropped);
+		segments(dir, 1);
+	}
+}
+
+void print_usage() {
+	printf("rec_bench [options]\n");
+	printf("-c only check the results, don't time anything\n");
+	printf("-d [dir] to record to, the rec-* files in it are removed (defaults to a new one in /tmp)\n");
+	printf("-k [KB/s] of the slow disk (defaults to 100)\n");
+	printf("-n [seconds] of each size timed (defaults to 3)\n");
+}
+
+int main(int argc, char **argv) {
+	char tmp[] = "/tmp/rec_bench.XXXXXX";
+	const char *dir = NULL;
+	int option, check_only = 0, kbyte_s = 100, seconds = 3, errors;
+
+	while ((option = getopt(argc, argv, "cd:k:n:")) != -1) {
+		switch (option) {
+			case 'c': check_only = 1; break;
+			case 'd': dir = optarg; break;
+			case 'k': kbyte_s = atoi(optarg); break;
+			case 'n': seconds = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (kbyte_s < 1 || seconds < 1) {
+		print_usage();
+		return 1;
+	}
+	if (!dir && !(dir = mkdtemp(tmp))) {
+		perror(tmp);
+		return 1;
+	}
+	errors = same_second(dir) + throttled(dir, kbyte_s);
+	if (!errors && !check_only) bench(dir, seconds);
+	if (dir == tmp) rmdir(tmp);
+	return errors ? 1 : 0;
+}
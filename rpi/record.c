@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "record.h"
+
+#define REC_BATCH 256*1024 //queued bytes taken per write
+
+//stored in the queue in front of every access unit
+struct rec_hdr {
+	int len;
+	int key;
+	int segment; //starts a new segment
+	struct timeval t;
+};
+
+#define REC_SIZE(len) ((sizeof(struct rec_hdr) + (len) + 7) & ~7)
+
+static long age(struct timeval *t, struct timeval *now) {
+	return (now->tv_sec - t->tv_sec) * 1000000L + (now->tv_usec - t->tv_usec);
+}
+
+static double elapsed_us(struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1000000.0 + (t1.tv_nsec - t0->tv_nsec) / 1000.0;
+}
+
+static int write_all(int fd, const unsigned char *b, int len) {
+	int ret;
+	while (len > 0) {
+		ret = write(fd, b, len);
+		if (ret < 0) return -1;
+		b += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void flush(struct recorder *r) {
+	struct timespec t0;
+	double us;
+
+	if (!r->out_len) return;
+	if (r->fd >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (write_all(r->fd, r->out, r->out_len) < 0) r->pending.errors++;
+		else {
+			r->seg_bytes += r->out_len;
+			r->pending.bytes += r->out_len;
+		}
+		us = elapsed_us(&t0);
+		r->pending.writes++;
+		r->pending.write_us += us;
+		if (us > r->pending.write_max_us) r->pending.write_max_us = us;
+	}
+	r->out_len = 0;
+}
+
+static void close_segment(struct recorder *r) {
+	if (r->fd < 0) return;
+	if (ftruncate(r->fd, r->seg_bytes) < 0) r->pending.errors++; //give back what was preallocated but not used
+	close(r->fd);
+	r->fd = -1;
+}
+
+static void open_segment(struct recorder *r, struct timeval *t) {
+	char path[256];
+	time_t sec = t->tv_sec;
+	int n;
+
+	close_segment(r);
+	if (r->keep && r->nnames == r->keep) { //rolling: the oldest goes
+		unlink(r->names[0]);
+		memmove(r->names, r->names + 1, (r->nnames - 1) * sizeof(r->names[0]));
+		r->nnames--;
+	}
+	n = snprintf(path, 192, "%s/", r->dir);
+	if (n > 191) n = 191; //a dir that long is cut short
+	n += strftime(path + n, 32, "rec-%Y%m%d-%H%M%S", localtime(&sec));
+	strcpy(path + n, ".ts");
+	//never over an older segment: two in the same second, or one from before a restart, get -1, -2...
+	for (int i = 1; (r->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0 && errno == EEXIST && i < 1000; i++)
+		sprintf(path + n, "-%i.ts", i);
+	if (r->fd < 0) {
+		perror(path);
+		r->pending.errors++;
+		return;
+	}
+	//reserve the blocks now, so the card doesn't allocate them piecemeal while writing
+	if (r->prealloc && posix_fallocate(r->fd, 0, r->prealloc)) {} //best effort, not every filesystem can
+	if (r->keep) strcpy(r->names[r->nnames++], path);
+	r->seg_bytes = 0;
+	ts_init(&r->ts);
+	r->pending.segments++;
+}
+
+static void frame(struct recorder *r, struct rec_hdr *h, const unsigned char *au) {
+	unsigned long long pts = h->t.tv_sec * 90000ULL + h->t.tv_usec * 9 / 100;
+	int need = ts_au_size(h->len) + (h->key ? TS_TABLES : 0);
+
+	if (h->segment) {
+		flush(r);
+		open_segment(r, &h->t);
+	}
+	if (r->fd < 0) return;
+	if (r->out_len + need > r->out_size) flush(r);
+	if (need > r->out_size) {
+		r->out_size = need;
+		r->out = (unsigned char *)realloc(r->out, r->out_size);
+	}
+	if (h->key) r->out_len += ts_tables(&r->ts, r->out + r->out_len); //players may start at any keyframe
+	r->out_len += ts_au(&r->ts, r->out + r->out_len, au, h->len, pts, h->key);
+	r->pending.frames++;
+}
+
+static void merge(struct rec_counts *to, struct rec_counts *from) {
+	to->frames += from->frames;
+	to->segments += from->segments;
+	to->errors += from->errors;
+	to->writes += from->writes;
+	to->bytes += from->bytes;
+	to->write_us += from->write_us;
+	if (from->write_max_us > to->write_max_us) to->write_max_us = from->write_max_us;
+	memset(from, 0, sizeof(*from));
+}
+
+static void *writer(void *arg) {
+	struct recorder *r = (struct recorder *)arg;
+	struct rec_hdr *h;
+	int start, end, pos;
+
+	pthread_mutex_lock(&r->lock);
+	while (1) {
+		if (r->wrap >= 0 && r->tail == r->wrap) {
+			r->tail = 0;
+			r->wrap = -1;
+		}
+		end = r->wrap >= 0 ? r->wrap : r->head;
+		if (r->tail == end) {
+			if (r->stop) break;
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+
+		//rec_add() doesn't touch [tail, end) until tail moves, work on it unlocked
+		start = r->tail;
+		pthread_mutex_unlock(&r->lock);
+		for (pos = start; pos < end && pos - start < REC_BATCH; pos += REC_SIZE(h->len)) {
+			h = (struct rec_hdr *)(r->queue + pos);
+			frame(r, h, r->queue + pos + sizeof(*h));
+		}
+		flush(r);
+		pthread_mutex_lock(&r->lock);
+		r->tail = pos;
+		merge(&r->stats, &r->pending);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	close_segment(r);
+	return NULL;
+}
+
+int rec_init(struct recorder *r, const char *dir, int seconds, int keep, int queue_bytes, long prealloc) {
+	sigset_t all, old;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	r->size = queue_bytes & ~7;
+	r->queue = (unsigned char *)malloc(r->size);
+	memset(r->queue, 0, r->size); //fault the pages in now, not while streaming
+	r->wrap = -1;
+	r->dropping = 1; //segments start at a keyframe
+	r->dir = dir;
+	r->segment = seconds * 1000000L;
+	r->keep = keep;
+	r->prealloc = prealloc;
+	r->fd = -1;
+	if (keep) r->names = (char (*)[256])malloc(keep * sizeof(r->names[0]));
+	r->out_size = REC_BATCH + REC_BATCH / 8; //TS overhead
+	r->out = (unsigned char *)malloc(r->out_size);
+	gettimeofday(&r->stat_start, NULL);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+
+	//signals are for the main loop
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&r->thread, NULL, writer, r);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		fprintf(stderr, "Starting the recorder: %s\n", strerror(ret));
+		rec_free(r);
+		return -1;
+	}
+	r->running = 1;
+	return 0;
+}
+
+void rec_free(struct recorder *r) {
+	if (r->running) {
+		pthread_mutex_lock(&r->lock);
+		r->stop = 1;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, NULL);
+		r->running = 0;
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r->queue);
+	free(r->names);
+	free(r->out);
+	r->queue = r->out = NULL;
+	r->names = NULL;
+}
+
+//Makes room for n contiguous bytes at head, never waiting for the writer
+static int fits(struct recorder *r, int n) {
+	if (r->wrap < 0) { //data in [tail, head)
+		if (r->head == r->tail) r->head = r->tail = 0;
+		if (r->size - r->head >= n) return 1;
+		if (r->tail > n) {
+			r->wrap = r->head;
+			r->head = 0;
+			return 1;
+		}
+		return 0;
+	}
+	return r->tail - r->head > n; //data in [tail, wrap) and [0, head)
+}
+
+void rec_add(struct recorder *r, const unsigned char *au, int len, int key, struct timeval *t) {
+	struct rec_hdr *h;
+	int n = REC_SIZE(len);
+
+	pthread_mutex_lock(&r->lock);
+	if ((r->dropping && !key) || !fits(r, n)) {
+		r->dropping = 1; //what follows can't be decoded without the lost frame
+		r->stats.dropped++;
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+	r->dropping = 0;
+
+	h = (struct rec_hdr *)(r->queue + r->head);
+	h->len = len;
+	h->key = key;
+	h->segment = key && (!r->seg_open || age(&r->seg_start, t) >= r->segment);
+	h->t = *t;
+	if (h->segment) {
+		r->seg_start = *t;
+		r->seg_open = 1;
+	}
+	memcpy(r->queue + r->head + sizeof(*h), au, len);
+	r->head += n;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void rec_stats(struct recorder *r, struct rec_stats *s) {
+	struct timeval now;
+	double secs;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&r->lock);
+	secs = age(&r->stat_start, &now) / 1000000.0;
+	s->frames = r->stats.frames;
+	s->dropped = r->stats.dropped;
+	s->segments = r->stats.segments;
+	s->errors = r->stats.errors;
+	s->kbyte_s = secs > 0 ? r->stats.bytes / 1024 / secs : 0;
+	s->disk_kbyte_s = r->stats.write_us > 0 ? r->stats.bytes / 1024 / (r->stats.write_us / 1000000.0) : 0;
+	s->write_us = r->stats.writes ? r->stats.write_us / r->stats.writes : 0;
+	s->write_max_us = r->stats.write_max_us;
+	if (r->wrap < 0) s->queued = r->head - r->tail;
+	else s->queued = r->wrap - r->tail + r->head;
+	memset(&r->stats, 0, sizeof(r->stats));
+	r->stat_start = now;
+	pthread_mutex_unlock(&r->lock);
+}
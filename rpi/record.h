@@ -0,0 +1,75 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "ts.h"
+
+struct rec_counts {
+	unsigned long frames; //written
+	unsigned long dropped; //didn't fit in the queue
+	unsigned long segments;
+	unsigned long errors;
+	unsigned long writes;
+	double bytes;
+	double write_us, write_max_us;
+};
+
+//Rolling MPEG-TS segments written by a thread of their own. The streaming side
+//only copies access units into a preallocated queue and never waits for the
+//disk: when the queue is full frames are dropped up to the next keyframe.
+struct recorder {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+
+	//queue, filled by rec_add(), emptied by the writer
+	unsigned char *queue;
+	int size;
+	int head, tail;
+	int wrap; //end of the data before head wrapped to 0, -1 if it didn't
+	int dropping; //skip until the next keyframe
+	struct timeval seg_start; //first access unit of the current segment
+	int seg_open;
+
+	const char *dir;
+	long segment; //us per segment
+	int keep; //segments kept on disk, 0 = all
+	long prealloc; //bytes reserved for each segment file
+
+	//writer side
+	struct ts ts;
+	int fd;
+	long seg_bytes;
+	char (*names)[256]; //segments on disk, oldest first
+	int nnames;
+	unsigned char *out; //TS packets waiting to be written
+	int out_size, out_len;
+
+	struct rec_counts pending; //the writer's, added to stats under the lock
+	struct rec_counts stats; //since the last rec_stats()
+	struct timeval stat_start;
+};
+
+struct rec_stats {
+	unsigned long frames, dropped, segments, errors;
+	double kbyte_s; //written per second
+	double disk_kbyte_s; //written per second spent in write(), what the card sustains
+	double write_us, write_max_us; //per write() call
+	int queued; //bytes waiting
+};
+
+//Starts the writer thread; returns -1 if it couldn't
+int rec_init(struct recorder *r, const char *dir, int seconds, int keep, int queue_bytes, long prealloc);
+//Writes out what's queued and stops the writer
+void rec_free(struct recorder *r);
+
+//Queues an access unit (start-coded NALs); key is AU_IDR or AU_RECOVERY if a decoder can start at it
+void rec_add(struct recorder *r, const unsigned char *au, int len, int key, struct timeval *t);
+
+void rec_stats(struct recorder *r, struct rec_stats *s);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+static const struct {
+	const char *name;
+	int policy;
+} policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+};
+
+int rt_parse(struct rt_sched *s, const char *arg) {
+	char name[8], *p;
+	int n = 0, i, first, last;
+
+	memset(s, 0, sizeof(*s));
+	if (sscanf(arg, "%7[a-z]:%i%n", name, &s->prio, &n) != 2) return -1;
+	s->policy = -1;
+	for (i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+		if (!strcmp(name, policies[i].name)) s->policy = policies[i].policy;
+	if (s->policy < 0) return -1;
+	if (s->prio < sched_get_priority_min(s->policy) || s->prio > sched_get_priority_max(s->policy)) return -1;
+
+	CPU_ZERO(&s->cpus);
+	p = (char *)arg + n;
+	if (*p == ':') {
+		do {
+			first = strtol(p + 1, &p, 10);
+			last = *p == '-' ? strtol(p + 1, &p, 10) : first;
+			if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+			for (i = first; i <= last; i++) CPU_SET(i, &s->cpus);
+		} while (*p == ',');
+	}
+	if (*p) return -1;
+	s->set = 1;
+	return 0;
+}
+
+int rt_apply(const struct rt_sched *s, pid_t pid, int reset) {
+	struct sched_param param;
+
+	if (!s->set) return 0;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = s->prio;
+	if (sched_setscheduler(pid, s->policy | (reset ? SCHED_RESET_ON_FORK : 0), &param) < 0) {
+		perror("sched_setscheduler");
+		return -1;
+	}
+	if (CPU_COUNT(&s->cpus) && sched_setaffinity(pid, sizeof(s->cpus), &s->cpus) < 0) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+	return 0;
+}
+
+int rt_lock_memory() {
+	unsigned char stack[RT_STACK_PREFAULT];
+	volatile unsigned char *p = stack;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		return -1;
+	}
+	for (int i = 0; i < RT_STACK_PREFAULT; i += 4096) p[i] = 0; //the deepest calls don't fault either
+	return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef RT_H
+#define RT_H
+
+#include <sched.h>
+#include <sys/types.h>
+
+#define RT_STACK_PREFAULT 256*1024 //stack touched once its pages are locked
+
+//How a streaming stage is scheduled: policy, priority and the CPUs it may run on
+struct rt_sched {
+	int set; //0 = left as it was started
+	int policy; //SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO or SCHED_RR
+	int prio; //1-99 for fifo and rr, 0 for the others
+	cpu_set_t cpus; //empty = any
+};
+
+//Parses [policy]:[priority][:cpus], policy being other, batch, idle, fifo or rr and cpus a list like 2,3 or 1-3.
+//Returns -1 if it's malformed.
+int rt_parse(struct rt_sched *s, const char *arg);
+
+//Applies s to process pid, 0 = the caller. With reset, processes and threads it starts later get the default
+//policy back instead of inheriting a real-time one. Returns -1 with a message on failure.
+int rt_apply(const struct rt_sched *s, pid_t pid, int reset);
+
+//Locks our pages, current and future, so the stream never waits for a page fault. Returns -1 with a message on failure.
+int rt_lock_memory();
+
+#endif
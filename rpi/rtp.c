@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+
+#include "rtp.h"
+
+void rtp_init(struct rtp_stream *r) {
+	//RFC 3550 wants both unpredictable, against known plaintext under SRTP; rand() is shared and seedable
+	if (RAND_bytes((unsigned char *)&r->ssrc, sizeof(r->ssrc)) != 1 || RAND_bytes((unsigned char *)&r->seq, sizeof(r->seq)) != 1) {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		r->ssrc = t.tv_nsec ^ getpid();
+		r->seq = t.tv_sec;
+	}
+}
+
+unsigned int rtp_timestamp() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned int)(t.tv_sec * RTP_CLOCK + (long long)t.tv_nsec * RTP_CLOCK / 1000000000LL);
+}
+
+unsigned int rtp_timestamp_us(unsigned long long us) {
+	return (unsigned int)(us / 1000000 * RTP_CLOCK + us % 1000000 * RTP_CLOCK / 1000000);
+}
+
+static void header(struct rtp_stream *r, unsigned char *p, int pt, unsigned int ts, int marker) {
+	p[0] = 0x80; //V=2
+	p[1] = (marker ? 0x80 : 0) | pt;
+	p[2] = r->seq >> 8;
+	p[3] = r->seq & 0xff;
+	p[4] = ts >> 24;
+	p[5] = ts >> 16;
+	p[6] = ts >> 8;
+	p[7] = ts;
+	p[8] = r->ssrc >> 24;
+	p[9] = r->ssrc >> 16;
+	p[10] = r->ssrc >> 8;
+	p[11] = r->ssrc;
+	r->seq++;
+}
+
+void rtp_send_nal(struct rtp_stream *r, const unsigned char *nal, int len, unsigned int ts, int marker, rtp_out out, void *arg) {
+	unsigned char pkt[RTP_MTU];
+	int max = RTP_MTU - RTP_HDR;
+	int n;
+
+	if (len <= max) {
+		header(r, pkt, RTP_PT, ts, marker);
+		memcpy(pkt + RTP_HDR, nal, len);
+		out(pkt, RTP_HDR + len, arg);
+		return;
+	}
+
+	//FU-A: the NAL header is split into FU indicator and FU header
+	max -= 2;
+	unsigned char hdr = nal[0];
+	nal++; len--;
+	int first = 1;
+	while (len > 0) {
+		n = len > max ? max : len;
+		header(r, pkt, RTP_PT, ts, marker && n == len);
+		pkt[RTP_HDR] = (hdr & 0xe0) | 28;
+		pkt[RTP_HDR+1] = (hdr & 0x1f) | (first ? 0x80 : 0) | (n == len ? 0x40 : 0);
+		memcpy(pkt + RTP_HDR + 2, nal, n);
+		out(pkt, RTP_HDR + 2 + n, arg);
+		nal += n; len -= n;
+		first = 0;
+	}
+}
+
+int rtp_packet(struct rtp_stream *r, unsigned char *pkt, int pt, unsigned int ts, const unsigned char *payload, int len) {
+	header(r, pkt, pt, ts, 1);
+	memcpy(pkt + RTP_HDR, payload, len);
+	return RTP_HDR + len;
+}
+
+int rtp_parse(const unsigned char *pkt, int len, unsigned char *nal, int *start) {
+	int off = RTP_HDR;
+
+	if (len <= RTP_HDR || (pkt[0] >> 6) != 2) return -1;
+	off += (pkt[0] & 0x0f) * 4; //CSRCs
+	if (pkt[0] & 0x10) { //header extension
+		if (len < off + 4) return -1;
+		off += 4 + ((pkt[off+2] << 8) | pkt[off+3]) * 4;
+	}
+	if (len <= off) return -1;
+
+	*nal = pkt[off];
+	*start = 1;
+	if ((pkt[off] & 0x1f) == 28) { //FU-A
+		if (len < off + 2) return -1;
+		*nal = (pkt[off] & 0xe0) | (pkt[off+1] & 0x1f);
+		*start = (pkt[off+1] & 0x80) != 0;
+	}
+	return off;
+}
@@ -0,0 +1,32 @@
+#ifndef RTP_H
+#define RTP_H
+
+#define RTP_PT 96 //matches the client caps (payload=96)
+#define RTP_CLOCK 90000
+#define RTP_HDR 12
+#define RTP_MTU 1400 //max RTP packet size, keeps us below the Wi-Fi MTU
+
+struct rtp_stream {
+	unsigned int ssrc;
+	unsigned short seq;
+};
+
+typedef void (*rtp_out)(const unsigned char *pkt, int len, void *arg);
+
+void rtp_init(struct rtp_stream *r);
+
+//RFC 6184 packetization: single NAL unit packets, FU-A when the NAL exceeds the MTU
+void rtp_send_nal(struct rtp_stream *r, const unsigned char *nal, int len, unsigned int ts, int marker, rtp_out out, void *arg);
+
+unsigned int rtp_timestamp();
+//The same clock at a CLOCK_MONOTONIC time in microseconds, for what was stamped before it got here
+unsigned int rtp_timestamp_us(unsigned long long us);
+
+//A packet of another payload type in one piece, returns its length
+int rtp_packet(struct rtp_stream *r, unsigned char *pkt, int pt, unsigned int ts, const unsigned char *payload, int len);
+
+//Finds the H.264 payload of a received packet: *nal gets the header of the NAL it carries (rebuilt for FU-A),
+//*start whether the packet begins that NAL. Returns the payload offset, -1 if it isn't usable RTP.
+int rtp_parse(const unsigned char *pkt, int len, unsigned char *nal, int *start);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "rtsp.h"
+#include "rtp.h"
+
+//Copies the value of header name (case-insensitive) from the head, returns 1 if present
+static int header(const char *head, int len, const char *name, char *out, int size) {
+	int n = strlen(name);
+	const char *p = head, *end = head + len, *eol;
+
+	while (p < end) {
+		eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol) break;
+		if (eol - p > n && p[n] == ':' && !strncasecmp(p, name, n)) {
+			p += n + 1;
+			while (p < eol && *p == ' ') p++;
+			n = eol - p;
+			if (n > 0 && p[n-1] == '\r') n--;
+			if (n >= size) n = size - 1;
+			memcpy(out, p, n);
+			out[n] = 0;
+			return 1;
+		}
+		p = eol + 1;
+	}
+	return 0;
+}
+
+int rtsp_parse(const char *buf, int len, struct rtsp_req *r) {
+	char version[16], tmp[32];
+	const char *end = NULL;
+	char *semi;
+	int head;
+
+	for (int i = 0; i + 3 < len; i++)
+		if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n') {
+			end = buf + i + 4;
+			break;
+		}
+	if (!end) return 0;
+	head = end - buf;
+
+	memset(r, 0, sizeof(*r));
+	if (sscanf(buf, "%15s %255s %15s", r->method, r->url, version) != 3 || strncmp(version, "RTSP/", 5)) return -1;
+	if (header(buf, head, "CSeq", tmp, sizeof(tmp))) r->cseq = atoi(tmp);
+	if (header(buf, head, "Content-Length", tmp, sizeof(tmp))) r->content_len = atoi(tmp);
+	header(buf, head, "Transport", r->transport, sizeof(r->transport));
+	header(buf, head, "Session", r->session, sizeof(r->session));
+	if ((semi = strchr(r->session, ';'))) *semi = 0; //";timeout="
+	if (r->content_len < 0) return -1;
+	if (head + r->content_len > len) return 0;
+	return head + r->content_len;
+}
+
+int rtsp_transport(const char *transport, const char *name, int *a, int *b) {
+	const char *p = transport;
+	int n = strlen(name);
+
+	while ((p = strstr(p, name))) {
+		if ((p == transport || p[-1] == ';') && p[n] == '=') {
+			*b = -1;
+			if (sscanf(p + n + 1, "%i-%i", a, b) < 1) return 0;
+			if (*b < 0) *b = *a + 1;
+			return 1;
+		}
+		p += n;
+	}
+	return 0;
+}
+
+static int base64(char *out, const unsigned char *in, int len) {
+	static const char *enc = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int n = 0;
+
+	for (int i = 0; i < len; i += 3) {
+		unsigned int v = in[i] << 16 | (i + 1 < len ? in[i+1] << 8 : 0) | (i + 2 < len ? in[i+2] : 0);
+		out[n++] = enc[v >> 18];
+		out[n++] = enc[(v >> 12) & 0x3f];
+		out[n++] = i + 1 < len ? enc[(v >> 6) & 0x3f] : '=';
+		out[n++] = i + 2 < len ? enc[v & 0x3f] : '=';
+	}
+	out[n] = 0;
+	return n;
+}
+
+int rtsp_sdp(char *out, int size, const char *addr, const unsigned char *sps, int sps_len, const unsigned char *pps, int pps_len) {
+	char params[1024] = "";
+	int n;
+
+	if (sps_len >= 4 && pps_len && (sps_len + pps_len) * 4 / 3 + 128 < (int)sizeof(params)) {
+		n = sprintf(params, ";profile-level-id=%02x%02x%02x;sprop-parameter-sets=", sps[1], sps[2], sps[3]);
+		n += base64(params + n, sps, sps_len);
+		params[n++] = ',';
+		base64(params + n, pps, pps_len);
+	}
+	return snprintf(out, size,
+		"v=0\r\n"
+		"o=- 0 0 IN IP4 %s\r\n"
+		"s=camera_server\r\n"
+		"c=IN IP4 0.0.0.0\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"m=video 0 RTP/AVP %i\r\n"
+		"a=rtpmap:%i H264/%i\r\n"
+		"a=fmtp:%i packetization-mode=1%s\r\n"
+		"a=control:trackID=0\r\n",
+		addr, RTP_PT, RTP_PT, RTP_CLOCK, RTP_PT, params);
+}
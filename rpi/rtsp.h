@@ -0,0 +1,25 @@
+#ifndef RTSP_H
+#define RTSP_H
+
+#define RTSP_LINE 256
+
+//What camera_server needs from an RTSP request
+struct rtsp_req {
+	char method[16];
+	char url[RTSP_LINE];
+	int cseq;
+	char transport[RTSP_LINE];
+	char session[32];
+	int content_len; //body following the head, skipped
+};
+
+//Parses the request head at buf; returns the length of head and body, 0 if incomplete, -1 if it isn't RTSP
+int rtsp_parse(const char *buf, int len, struct rtsp_req *r);
+
+//Value of a Transport parameter such as "client_port" or "interleaved" as two numbers ("a-b"), returns 1 if found
+int rtsp_transport(const char *transport, const char *name, int *a, int *b);
+
+//Session description of the H.264 stream; SPS/PPS go in sprop-parameter-sets when known
+int rtsp_sdp(char *out, int size, const char *addr, const unsigned char *sps, int sps_len, const unsigned char *pps, int pps_len);
+
+#endif
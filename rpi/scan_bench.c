@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "h264.h"
+
+//Throughput of the NAL scanner the camera pipes go through: an H.264 byte-stream is written into a pipe
+//by a child process and scanned as camera_server scans it, then split in memory as V4L2 buffers are.
+//Without -f it's a stream made up here, shaped like a 30 fps one: an IDR of 40 KB every 30 frames,
+//4 slices of 2 KB in the others, 1800 frames in all (16 MB).
+
+#define BUF_SIZE 256*1024 //camera_server's CAM_BUF_SIZE
+#define FRAMES 1800
+#define GOP 30
+
+struct result {
+	unsigned long nals, frames, sum;
+};
+
+static unsigned long long seed = 1;
+
+static unsigned int rnd() { //xorshift64*, the stream is the same every run
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (seed * 2685821657736338717ULL) >> 32;
+}
+
+//Coded data: random with a run of zeros now and then, emulation prevented as an encoder writes it
+static int payload(unsigned char *out, int n) {
+	int i, o = 0, zeros = 0;
+	unsigned char b;
+
+	for (i = 0; i < n; i++) {
+		b = rnd() % 500 < 3 ? 0 : rnd();
+		if (i == n - 1 && !b) b = 0x80; //rbsp_trailing_bits
+		if (zeros >= 2 && b <= 3) {
+			out[o++] = 3;
+			zeros = 0;
+		}
+		out[o++] = b;
+		zeros = b ? 0 : zeros + 1;
+	}
+	return o;
+}
+
+static int nal(unsigned char *out, const unsigned char *hdr, int hdr_len, int n) {
+	static const unsigned char start[] = { 0, 0, 0, 1 };
+
+	memcpy(out, start, 4);
+	memcpy(out + 4, hdr, hdr_len);
+	return 4 + hdr_len + payload(out + 4 + hdr_len, n);
+}
+
+static unsigned char *make_stream(int *len) {
+	static const unsigned char aud[] = { 0x09 }, sps[] = { 0x67, 0x64, 0x00, 0x28 }, pps[] = { 0x68 };
+	unsigned char idr[] = { 0x65, 0x80 }, slice[] = { 0x41, 0x80 };
+	unsigned char *buf = (unsigned char *)malloc(FRAMES * 48000), *p = buf;
+
+	for (int f = 0; f < FRAMES; f++) {
+		p += nal(p, aud, sizeof(aud), 1);
+		if (f % GOP == 0) {
+			p += nal(p, sps, sizeof(sps), 12);
+			p += nal(p, pps, sizeof(pps), 4);
+			p += nal(p, idr, sizeof(idr), 40000);
+			continue;
+		}
+		for (int i = 0; i < 4; i++) {
+			slice[1] = i ? 0x40 : 0x80; //first_mb_in_slice 0 starts the picture
+			p += nal(p, slice, sizeof(slice), 2000);
+		}
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static void count(const unsigned char *nal, int len, void *arg) {
+	struct result *r = (struct result *)arg;
+
+	r->nals++;
+	if (NAL_IS_SLICE(NAL_TYPE(nal)) && NAL_FIRST_MB_ZERO(nal)) r->frames++;
+	r->sum = r->sum * 31 + len + nal[len - 1];
+}
+
+static double since(struct timeval *t) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec - t->tv_sec + (now.tv_usec - t->tv_usec) / 1e6;
+}
+
+void print_usage() {
+	printf("scan_bench [options]\n");
+	printf("-f [file] scan an H.264 byte-stream from file instead of the one made up\n");
+	printf("-r [times] write the stream into the pipe that many times over (defaults to 3)\n");
+	printf("-w [bytes] bytes per write into the pipe, like an encoder writing a slice at a time (defaults to 64 KB)\n");
+}
+
+int main(int argc, char **argv) {
+	struct nal_scanner s;
+	struct result piped, split;
+	struct timeval start;
+	unsigned char *stream;
+	const char *file = NULL;
+	int option, repeat = 3, chunk = 65536, len, fd[2], status;
+	double t;
+	pid_t pid;
+
+	while ((option = getopt(argc, argv, "f:r:w:")) != -1) {
+		switch (option) {
+			case 'f': file = optarg; break;
+			case 'r': repeat = atoi(optarg); break;
+			case 'w': chunk = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (repeat < 1 || chunk < 1) {
+		print_usage();
+		return 1;
+	}
+	if (file) {
+		FILE *f = fopen(file, "rb");
+		if (!f) {
+			perror(file);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		rewind(f);
+		stream = (unsigned char *)malloc(len);
+		if (fread(stream, 1, len, f) != (size_t)len) {
+			perror(file);
+			return 1;
+		}
+		fclose(f);
+	} else stream = make_stream(&len);
+	printf("%.1f MB stream, %i times through a pipe in %i byte writes\n", len / 1e6, repeat, chunk);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(fd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!pid) { //the encoder
+		close(fd[0]);
+		for (int i = 0; i < repeat; i++)
+			for (int off = 0; off < len; ) {
+				int n = write(fd[1], stream + off, len - off < chunk ? len - off : chunk);
+				if (n <= 0) _exit(1);
+				off += n;
+			}
+		_exit(0);
+	}
+	close(fd[1]);
+
+	memset(&piped, 0, sizeof(piped));
+	nal_scanner_init(&s, BUF_SIZE);
+	gettimeofday(&start, NULL);
+	while (nal_scanner_read(&s, fd[0], count, &piped) > 0);
+	nal_scanner_flush(&s, count, &piped);
+	t = since(&start);
+	waitpid(pid, &status, 0);
+	printf("Pipe: %lu NALs, %lu frames, %.0f MB/s, moved %.1f%% of the input again, buffer %i KB\n",
+		piped.nals, piped.frames, s.in / t / 1e6, 100.0 * s.moved / s.in, s.size / 1024);
+	nal_scanner_free(&s);
+
+	memset(&split, 0, sizeof(split));
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < repeat; i++) h264_split(stream, len, count, &split);
+	t = since(&start);
+	printf("Memory: %lu NALs, %lu frames, %.0f MB/s\n", split.nals, split.frames, (double)len * repeat / t / 1e6);
+
+	free(stream);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) || piped.nals != split.nals || piped.sum != split.sum) {
+		fprintf(stderr, "The pipe and memory scans don't agree\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "sendq.h"
+
+#define STREAM_POLL_US 10000 //how often a held stream socket is looked at again
+#define ICMP_TRIES 4 //sends failing with an ICMP error each before the packet is given up
+
+static struct pkt_buf *free_bufs;
+
+struct pkt_buf *pkt_alloc() {
+	struct pkt_buf *b = free_bufs;
+	if (b) free_bufs = b->next;
+	else b = (struct pkt_buf *)malloc(sizeof(*b)); //the pool grows to what the queues' budgets hold
+	b->refs = 1;
+	b->len = 0;
+	return b;
+}
+
+void pkt_unref(struct pkt_buf *b) {
+	if (--b->refs) return;
+	b->next = free_bufs;
+	free_bufs = b;
+}
+
+static long age(struct timeval *t, struct timeval *now) {
+	return (now->tv_sec - t->tv_sec) * 1000000L + (now->tv_usec - t->tv_usec);
+}
+
+void sendq_init(struct sendq *q, int budget, long deadline, long rate, int fifo, int frames) {
+	int i, n = budget / 512 + 64; //packets are mostly full size, small ones are SPS/PPS/SEI
+
+	memset(q, 0, sizeof(*q));
+	q->budget = budget;
+	q->deadline = deadline;
+	q->rate = rate;
+	q->fifo = fifo;
+	q->frames = frames;
+	q->drop_nal = (unsigned int)-1;
+	gettimeofday(&q->refill, NULL);
+
+	q->mem = (struct packet *)malloc(n * sizeof(struct packet));
+	for (i = 0; i < n; i++) {
+		q->mem[i].next = q->pool;
+		q->pool = &q->mem[i];
+	}
+}
+
+void sendq_free(struct sendq *q) {
+	struct packet *p;
+	for (p = q->head; p; p = p->next) pkt_unref(p->buf);
+	free(q->mem);
+	q->mem = NULL;
+	q->head = q->tail = q->pool = q->busy = NULL;
+	q->bytes = 0;
+}
+
+static void release(struct sendq *q, struct packet *p) {
+	q->bytes -= p->len;
+	pkt_unref(p->buf);
+	p->next = q->pool;
+	q->pool = p;
+}
+
+//Removes every queued fragment of the NAL, counting it as dropped; returns 0 if none was queued
+static int drop_nal(struct sendq *q, unsigned int nal, int expired) {
+	struct packet **pp = &q->head, *p;
+	int counted = 0;
+
+	q->tail = NULL;
+	while ((p = *pp)) {
+		if (p->nal != nal || p == q->busy) {
+			q->tail = p;
+			pp = &p->next;
+			continue;
+		}
+		*pp = p->next;
+		if (!counted) {
+			if (expired) q->expired++;
+			else q->dropped[p->prio]++;
+			counted = 1;
+		}
+		release(q, p);
+	}
+	return counted;
+}
+
+static void expire(struct sendq *q) {
+	struct timeval now;
+	struct packet *p;
+
+	if (!q->deadline) return;
+	gettimeofday(&now, NULL);
+	p = q->head;
+	while (p && age(&p->queued, &now) > q->deadline) { //the rest is younger
+		if (p->prio == PRIO_PARAMS || p == q->busy) { //tiny, and nothing decodes without them; or half sent
+			p = p->next;
+			continue;
+		}
+		drop_nal(q, p->nal, 1);
+		p = q->head; //restart, the list changed
+	}
+}
+
+//A stream transport can't lose a late NAL here and there like UDP does, every picture after it would
+//decode broken. Past the deadline non-reference frames go first; if that isn't enough, everything up to
+//the newest queued keyframe, or if there is none, up to the next one.
+//backlog is how long what the socket holds takes to go out.
+static void expire_frames(struct sendq *q, long backlog) {
+	struct timeval now;
+	struct packet *p, *prev, *key = NULL;
+
+	if (!q->deadline) return;
+	gettimeofday(&now, NULL);
+	p = q->busy ? q->head->next : q->head;
+	if (!p || age(&p->queued, &now) + backlog <= q->deadline) return;
+
+	for (p = q->head; p; ) {
+		if (p->prio == PRIO_DISPOSABLE && p != q->busy) {
+			drop_nal(q, p->nal, 1);
+			p = q->head; //restart, the list changed
+		} else p = p->next;
+	}
+	p = q->busy ? q->head->next : q->head;
+	if (!p || age(&p->queued, &now) + backlog <= q->deadline) return;
+
+	for (prev = NULL, p = q->head; p; prev = p, p = p->next) //keyframes start with their parameter sets
+		if (p->prio == PRIO_PARAMS && p != q->busy && (!prev || prev->prio != PRIO_PARAMS)) key = p;
+	while ((p = q->busy ? q->head->next : q->head) && p != key) drop_nal(q, p->nal, 1);
+	if (!key) q->skip = 1;
+	q->skips++;
+}
+
+//Least important queued NAL, the oldest one among equals
+static struct packet *victim(struct sendq *q, unsigned int nal) {
+	struct packet *p, *v = NULL;
+	for (p = q->head; p; p = p->next)
+		if (p->nal != nal && p != q->busy && (!v || p->prio > v->prio)) v = p;
+	return v;
+}
+
+void sendq_push(struct sendq *q, struct pkt_buf *b, int prio, unsigned int nal) {
+	struct packet *p, *v;
+	int len = b->len;
+
+	if (nal == q->drop_nal) return; //rest of a NAL we already gave up on
+	if (q->skip && prio != PRIO_PARAMS) { //waiting for a keyframe
+		q->drop_nal = nal;
+		q->expired++;
+		return;
+	}
+	q->skip = 0;
+
+	while (q->bytes + len > q->budget || !q->pool) {
+		v = q->fifo ? NULL : victim(q, nal);
+		if (!v || v->prio < prio) { //everything queued matters more, lose the new NAL
+			q->drop_nal = nal;
+			if (!drop_nal(q, nal, 0)) q->dropped[prio]++;
+			return;
+		}
+		drop_nal(q, v->nal, 0);
+	}
+
+	p = q->pool;
+	q->pool = p->next;
+	p->next = NULL;
+	p->prio = prio;
+	p->nal = nal;
+	p->len = len;
+	p->buf = b;
+	b->refs++;
+	gettimeofday(&p->queued, NULL);
+	q->bytes += len;
+	if (q->tail) q->tail->next = p;
+	else q->head = p;
+	q->tail = p;
+}
+
+static void refill(struct sendq *q) {
+	struct timeval now;
+	double burst = q->rate / 100 > 2 * RTP_MTU ? q->rate / 100 : 2 * RTP_MTU; //10ms worth
+
+	gettimeofday(&now, NULL);
+	q->tokens += age(&q->refill, &now) * (double)q->rate / 1000000.0;
+	if (q->tokens > burst) q->tokens = burst;
+	q->refill = now;
+}
+
+//What goes on the wire for the packet: itself, or encrypted into q->sealed; NULL if it can't be encrypted
+static unsigned char *seal(struct sendq *q, struct packet *p, int *len) {
+	*len = p->len;
+	if (!q->srtp) return p->buf->data;
+	q->sealed_len = srtp_protect(q->srtp, p->buf->data, p->len, q->sealed);
+	*len = q->sealed_len;
+	return q->sealed_len > 0 ? q->sealed : NULL;
+}
+
+int sendq_sendto(int sock, const unsigned char *data, int len, struct sockaddr_in *dest) {
+	int ret, tries = 0;
+
+	do ret = sendto(sock, data, len, MSG_DONTWAIT, (struct sockaddr *)dest, sizeof(*dest));
+	while (ret < 0 && (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH || errno == EHOSTDOWN) &&
+		++tries < ICMP_TRIES);
+	return ret;
+}
+
+int sendq_flush(struct sendq *q, int sock, struct sockaddr_in *dest) {
+	struct packet *p;
+	unsigned char *data;
+	int len;
+
+	expire(q);
+	if (q->rate) refill(q);
+	while ((p = q->head)) {
+		if (q->rate && q->tokens < p->len) return 0;
+		data = seal(q, p, &len); //again after a full socket: same packet, same IV, the same bytes
+		if (data && sendq_sendto(sock, data, len, dest) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return 1;
+			//an ICMP error every try or a destination without a route, dropped rather than holding up the loop
+		} else if (data) {
+			q->sent++;
+			q->sent_bytes += p->len;
+			q->total_bytes += p->len;
+		}
+		if (q->rate) q->tokens -= p->len;
+		q->head = p->next;
+		if (!q->head) q->tail = NULL;
+		release(q, p);
+	}
+	return 0;
+}
+
+//Microseconds the socket's unacknowledged bytes take to drain at the rate acknowledgements were
+//seen to come in while it was never empty; 0 until that's known
+static long backlog(struct sendq *q, int sock) {
+	struct timeval now;
+	int outq;
+	long us;
+
+	if (ioctl(sock, SIOCOUTQ, &outq) < 0) return 0;
+	gettimeofday(&now, NULL);
+	if (!outq || !q->outq) { //the link isn't the bottleneck, start measuring again
+		q->drained = 0;
+		q->drain_start = now;
+	} else if (q->outq > outq) q->drained += q->outq - outq;
+	q->outq = outq;
+	us = age(&q->drain_start, &now);
+	if (us >= 100000 && q->drained) {
+		long rate = q->drained * 1000000.0 / us;
+		q->drain = q->drain ? (3 * q->drain + rate) / 4 : rate;
+		q->drained = 0;
+		q->drain_start = now;
+	}
+	return q->drain ? (long)(outq * 1000000.0 / q->drain) : 0;
+}
+
+int sendq_flush_tcp(struct sendq *q, int sock, int channel) {
+	struct packet *p;
+	unsigned char frame[4], *data;
+	struct iovec iov[2];
+	struct msghdr m;
+	int ret, skip, len, n = channel < 0 ? 2 : 4;
+	long held = 0;
+
+	q->hold = 0;
+	if (q->frames) expire_frames(q, held = backlog(q, sock));
+	else expire(q);
+	if (q->rate) refill(q);
+	while ((p = q->head)) {
+		if (!q->busy && q->pause) return 0;
+		if (!q->busy && q->rate && q->tokens < p->len) return 0;
+		if (!q->busy && q->frames && held > q->deadline / 2) { //in the socket it can't be dropped any more
+			q->hold = 1;
+			return 0;
+		}
+		if (q->busy) { //what was started is finished as it was
+			data = q->srtp ? q->sealed : p->buf->data;
+			len = q->srtp ? q->sealed_len : p->len;
+		} else if (!(data = seal(q, p, &len))) {
+			q->head = p->next;
+			if (!q->head) q->tail = NULL;
+			release(q, p);
+			continue;
+		}
+		frame[0] = '$';
+		frame[1] = channel;
+		frame[n - 2] = len >> 8;
+		frame[n - 1] = len & 0xff;
+		skip = q->busy ? q->offset : 0;
+		memset(&m, 0, sizeof(m));
+		m.msg_iov = iov;
+		if (skip < n) {
+			iov[0].iov_base = frame + skip;
+			iov[0].iov_len = n - skip;
+			iov[1].iov_base = data;
+			iov[1].iov_len = len;
+			m.msg_iovlen = 2;
+		} else {
+			iov[0].iov_base = data + skip - n;
+			iov[0].iov_len = len - (skip - n);
+			m.msg_iovlen = 1;
+		}
+		ret = sendmsg(sock, &m, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		if (ret > 0) {
+			q->outq += ret;
+			if (q->drain) held += (long)(ret * 1000000.0 / q->drain);
+		}
+		if (ret >= 0 && skip + ret < n + len) { //the rest when the socket has room
+			q->busy = p;
+			q->offset = skip + ret;
+			return 1;
+		}
+		if (ret >= 0) {
+			q->sent++;
+			q->sent_bytes += p->len;
+			q->total_bytes += p->len;
+		} //else the connection is gone, reading it will tell
+		q->busy = NULL;
+		if (q->rate) q->tokens -= p->len;
+		q->head = p->next;
+		if (!q->head) q->tail = NULL;
+		release(q, p);
+	}
+	return 0;
+}
+
+long sendq_wait(struct sendq *q) {
+	if (!q->head) return -1;
+	if (q->busy) return 0;
+	if (q->pause) return -1; //the socket becoming writable says when
+	if (q->hold) return STREAM_POLL_US;
+	if (!q->rate || q->tokens >= q->head->len) return 0;
+	return (long)((q->head->len - q->tokens) * 1000000.0 / q->rate) + 1;
+}
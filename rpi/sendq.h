@@ -0,0 +1,94 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "rtp.h"
+#include "srtp.h"
+
+//NAL priorities, lower is more important
+#define PRIO_PARAMS 0 //SPS/PPS and recovery points, the rest is useless without them
+#define PRIO_IDR 1
+#define PRIO_REF 2 //slices later frames predict from
+#define PRIO_DISPOSABLE 3 //nal_ref_idc 0, nothing depends on them
+#define PRIO_LEVELS 4
+
+//An RTP packet, shared by reference between every queue it's on
+struct pkt_buf {
+	struct pkt_buf *next; //free list
+	int refs;
+	int len;
+	unsigned char data[RTP_MTU];
+};
+
+struct packet {
+	struct packet *next;
+	int prio;
+	unsigned int nal; //fragments of one NAL share the id and are dropped together
+	struct timeval queued;
+	int len;
+	struct pkt_buf *buf;
+};
+
+//Send queue between the packetizer and the socket. When it holds more than
+//budget bytes the least important NAL goes first (or the newest with fifo),
+//packets older than the deadline are dropped rather than sent late.
+struct sendq {
+	struct packet *head, *tail;
+	struct packet *mem; //preallocated packets
+	struct packet *pool; //free packets
+	int bytes;
+	int budget;
+	long deadline; //us, 0 = none
+	long rate; //bytes/s the link is paced to, 0 = as fast as the socket takes them
+	int fifo; //plain tail drop, for comparison
+	int frames; //stream transport: drops whole frames past the deadline instead of single NALs
+	int skip; //dropping everything up to the next keyframe
+	int hold; //the socket holds as much as may go in, waiting for it to drain
+	int outq; //bytes the socket held after the last flush
+	long drain; //bytes/s the socket was seen to drain at, 0 until known
+	long drained; //since drain_start
+	struct timeval drain_start;
+	double tokens;
+	struct timeval refill;
+	unsigned int drop_nal; //NAL whose first fragment didn't fit
+	struct packet *busy; //partly written to a stream socket, must be finished
+	int offset; //bytes of busy written, including its framing
+	int pause; //something else goes on the stream socket next: stop once busy is finished
+	struct srtp *srtp; //packets are encrypted as they go out, NULL = plain RTP
+	unsigned char sealed[RTP_MTU + SRTP_TAG]; //the one going out, encrypted
+	int sealed_len;
+	unsigned long sent;
+	unsigned long sent_bytes;
+	unsigned long total_bytes; //since init, sent_bytes is reset by the statistics
+	unsigned long dropped[PRIO_LEVELS];
+	unsigned long expired;
+	unsigned long skips; //times it fell so far behind it skipped to a keyframe
+};
+
+//Buffers come from a free list shared by all queues, a new one holds one reference
+struct pkt_buf *pkt_alloc();
+void pkt_unref(struct pkt_buf *b);
+
+void sendq_init(struct sendq *q, int budget, long deadline, long rate, int fifo, int frames);
+void sendq_free(struct sendq *q);
+
+//Queues a reference to the packet, the data isn't copied
+void sendq_push(struct sendq *q, struct pkt_buf *b, int prio, unsigned int nal);
+
+//sendto() that goes through the ICMP errors of a socket with IP_RECVERR: one that came back for any of
+//its destinations makes the next send fail without sending, so it's tried again
+int sendq_sendto(int sock, const unsigned char *data, int len, struct sockaddr_in *dest);
+
+//Sends as much as pacing and the socket allow; returns 1 if the socket is full
+int sendq_flush(struct sendq *q, int sock, struct sockaddr_in *dest);
+
+//Same over a stream socket, each packet framed as RTSP interleaved data on the channel,
+//or with just its length (RFC 4571) if channel is -1
+int sendq_flush_tcp(struct sendq *q, int sock, int channel);
+
+//Microseconds until the next packet may be sent, -1 if the queue is empty
+long sendq_wait(struct sendq *q);
+
+#endif
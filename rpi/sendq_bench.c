@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "sendq.h"
+
+//Checks the send queue over a link slower than the stream: a GOP of an IDR, reference and non-reference frames
+//at FPS goes through sendq_push() and out, over UDP paced to -k KB/s, and over a stream socket whose reader only
+//takes -k KB/s. What arrives is taken apart again to see which NALs came whole and which frames decode.
+//With priorities, parameter sets and IDRs must all arrive, non-reference NALs go before reference ones and more
+//frames decode than with plain FIFO, run the same way. Over the stream socket, past the deadline, nothing may arrive
+//that doesn't decode, and nothing later than the deadline. Then the order expire_frames() drops in, step by step.
+
+#define FPS 30
+#define GOP 30
+#define FRAMES (2 * FPS) //two seconds, each case
+#define MAX_NALS 4
+
+//In front of every packet's payload
+struct tag {
+	int frame;
+	int nal; //of the frame
+	int frag, frags;
+};
+
+struct nal {
+	int prio, frags, got;
+};
+
+struct frame {
+	int nals;
+	struct nal nal[MAX_NALS];
+	double queued, arrived; //s, when it went into the queue and when its last packet came
+};
+
+struct result {
+	int nals[PRIO_LEVELS], whole[PRIO_LEVELS]; //sent and arrived whole
+	int partial; //NALs some of whose packets arrived
+	int frames, decodable, broken; //broken: arrived whole but something it predicts from didn't
+	double worst; //s, longest a decodable frame took
+	unsigned long dropped[PRIO_LEVELS], expired, skips;
+};
+
+static struct frame frames[FRAMES];
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//IDR with its SPS and PPS, then reference and non-reference P frames by turns, in full size packets
+static void gop() {
+	for (int i = 0; i < FRAMES; i++) {
+		struct frame *f = &frames[i];
+		memset(f, 0, sizeof(*f));
+		if (i % GOP == 0) {
+			f->nals = 3;
+			f->nal[0].prio = f->nal[1].prio = PRIO_PARAMS;
+			f->nal[0].frags = f->nal[1].frags = 1;
+			f->nal[2].prio = PRIO_IDR;
+			f->nal[2].frags = 20;
+		} else {
+			f->nals = 1;
+			f->nal[0].prio = i % 2 ? PRIO_DISPOSABLE : PRIO_REF;
+			f->nal[0].frags = i % 2 ? 3 : 6;
+		}
+	}
+}
+
+static void push(struct sendq *q, int i) {
+	struct frame *f = &frames[i];
+
+	f->queued = now();
+	for (int n = 0; n < f->nals; n++)
+		for (int k = 0; k < f->nal[n].frags; k++) {
+			struct pkt_buf *b = pkt_alloc();
+			struct tag *t = (struct tag *)b->data;
+			t->frame = i;
+			t->nal = n;
+			t->frag = k;
+			t->frags = f->nal[n].frags;
+			b->len = f->nal[n].prio == PRIO_PARAMS ? 32 : RTP_MTU;
+			sendq_push(q, b, f->nal[n].prio, i * MAX_NALS + n);
+			pkt_unref(b);
+		}
+}
+
+static void arrived(const unsigned char *data) {
+	struct tag t;
+
+	memcpy(&t, data, sizeof(t));
+	if (t.frame < 0 || t.frame >= FRAMES || t.nal < 0 || t.nal >= frames[t.frame].nals) return;
+	frames[t.frame].nal[t.nal].got++;
+	frames[t.frame].arrived = now();
+}
+
+//Which frames decode: whole, and whatever they predict from decoded, back to the last IDR
+static void tally(struct sendq *q, struct result *r) {
+	int chain = 0; //the last reference frame decoded
+
+	memset(r, 0, sizeof(*r));
+	for (int i = 0; i < FRAMES; i++) {
+		struct frame *f = &frames[i];
+		int whole = 1;
+		for (int n = 0; n < f->nals; n++) {
+			struct nal *l = &f->nal[n];
+			r->nals[l->prio]++;
+			if (l->got == l->frags) r->whole[l->prio]++;
+			else {
+				whole = 0;
+				if (l->got) r->partial++;
+			}
+		}
+		r->frames++;
+		if (i % GOP == 0) chain = whole;
+		if (whole && chain) {
+			r->decodable++;
+			if (f->arrived - f->queued > r->worst) r->worst = f->arrived - f->queued;
+		} else if (whole) r->broken++;
+		if (i % GOP && i % 2 == 0) chain = chain && whole; //a reference frame, the next ones predict from it
+	}
+	memcpy(r->dropped, q->dropped, sizeof(r->dropped));
+	r->expired = q->expired;
+	r->skips = q->skips;
+}
+
+//Over UDP, the queue paces to kbyte_s; the receiving socket takes all of it
+static int udp(struct result *r, int fifo, int kbyte_s) {
+	struct sockaddr_in a;
+	socklen_t alen = sizeof(a);
+	struct sendq q;
+	unsigned char buf[2048];
+	int rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0), size = 4 << 20;
+	double start = now(), next;
+	long wait;
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (rx < 0 || tx < 0 || bind(rx, (struct sockaddr *)&a, sizeof(a)) < 0 || getsockname(rx, (struct sockaddr *)&a, &alen) < 0) {
+		perror("UDP sockets");
+		return -1;
+	}
+	fcntl(rx, F_SETFL, O_NONBLOCK);
+	gop();
+	sendq_init(&q, 64 * 1024, 0, kbyte_s * 1024L, fifo, 0);
+	for (int i = 0; i < FRAMES || (q.head && now() < start + (FRAMES + FPS) / (double)FPS); ) {
+		next = start + (double)i / FPS;
+		if (i < FRAMES && now() >= next) push(&q, i++);
+		sendq_flush(&q, tx, &a);
+		while (recv(rx, buf, sizeof(buf), 0) > 0) arrived(buf);
+		wait = sendq_wait(&q);
+		if (wait < 0 || wait > 1000) wait = 1000;
+		usleep(wait);
+	}
+	while (recv(rx, buf, sizeof(buf), 0) > 0) arrived(buf);
+	tally(&q, r);
+	sendq_free(&q);
+	close(rx);
+	close(tx);
+	return 0;
+}
+
+//Over a stream socket whose reader takes kbyte_s, with the deadline camera_server gives TCP viewers
+static int stream(struct result *r, long deadline, int kbyte_s) {
+	struct sendq q;
+	unsigned char buf[64 * 1024];
+	int sv[2], size = 16 * 1024, have = 0, len, ret;
+	double start = now(), next, allowed = 0, last = start;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	gop();
+	sendq_init(&q, 1 << 20, deadline, 0, 0, 1); //a budget that never fills, the deadline decides
+	for (int i = 0; i < FRAMES || ((q.head || have) && now() < start + (FRAMES + 2 * FPS) / (double)FPS); ) {
+		next = start + (double)i / FPS;
+		if (i < FRAMES && now() >= next) push(&q, i++);
+		sendq_flush_tcp(&q, sv[0], -1);
+		allowed += (now() - last) * kbyte_s * 1024; //the slow reader, never more than 20 ms at once
+		last = now();
+		if (allowed > kbyte_s * 1024 / 50) allowed = kbyte_s * 1024 / 50;
+		if (allowed > (int)sizeof(buf) - have) allowed = sizeof(buf) - have;
+		if (allowed >= 1 && (ret = recv(sv[1], buf + have, (int)allowed, 0)) > 0) {
+			allowed -= ret;
+			have += ret;
+		}
+		while (have >= 2 && have >= 2 + (len = buf[0] << 8 | buf[1])) { //RFC 4571 framing
+			arrived(buf + 2);
+			memmove(buf, buf + 2 + len, have - 2 - len);
+			have -= 2 + len;
+		}
+		usleep(1000);
+	}
+	tally(&q, r);
+	sendq_free(&q);
+	close(sv[0]);
+	close(sv[1]);
+	return 0;
+}
+
+//The NAL ids still queued, in order, into ids; returns how many
+static int queued(struct sendq *q, int *ids) {
+	int n = 0;
+	for (struct packet *p = q->head; p; p = p->next)
+		if (!n || ids[n - 1] != (int)p->nal) ids[n++] = p->nal;
+	return n;
+}
+
+static int same(const char *what, struct sendq *q, const int *want, int n) {
+	int ids[16], got = queued(q, ids);
+
+	if (got == n && !memcmp(ids, want, n * sizeof(int))) return 0;
+	fprintf(stderr, "%s: NALs", what);
+	for (int i = 0; i < got; i++) fprintf(stderr, " %i", ids[i]);
+	fprintf(stderr, " left, should be");
+	for (int i = 0; i < n; i++) fprintf(stderr, " %i", want[i]);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static void one(struct sendq *q, int prio, int nal) {
+	struct pkt_buf *b = pkt_alloc();
+	b->len = RTP_MTU;
+	sendq_push(q, b, prio, nal);
+	pkt_unref(b);
+}
+
+//expire_frames() on its own, over a stream socket too full to take anything: when the oldest is late, the
+//non-reference NALs go first, then if that isn't enough everything before the newest keyframe, or if none is queued,
+//everything until the next one comes
+static int expiry() {
+	struct sendq q;
+	unsigned char fill[4096];
+	int sv[2], errors = 0;
+	static const int later[] = { 2 }, key[] = { 4, 5, 6 }, none[] = { 10 };
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return 1;
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	memset(fill, 0, sizeof(fill));
+	while (send(sv[0], fill, sizeof(fill), 0) > 0);
+	sendq_init(&q, 1 << 20, 100000, 0, 0, 1);
+
+	//a late non-reference frame in front: it and the other non-reference one go, the reference frame is in time
+	one(&q, PRIO_DISPOSABLE, 1);
+	usleep(150000);
+	one(&q, PRIO_REF, 2);
+	one(&q, PRIO_DISPOSABLE, 3);
+	sendq_flush_tcp(&q, sv[0], -1);
+	errors += same("Late non-reference frame", &q, later, 1);
+
+	//a late reference frame in front: up to the keyframe behind it, which stays even once it's late itself
+	usleep(150000);
+	one(&q, PRIO_PARAMS, 4);
+	one(&q, PRIO_IDR, 5);
+	one(&q, PRIO_REF, 6);
+	sendq_flush_tcp(&q, sv[0], -1);
+	errors += same("Late reference frame, a keyframe behind it", &q, key, 3);
+	usleep(150000);
+	sendq_flush_tcp(&q, sv[0], -1);
+	errors += same("Late keyframe", &q, key, 3);
+	sendq_free(&q);
+
+	//late, and no keyframe queued: nothing until the next one comes
+	sendq_init(&q, 1 << 20, 100000, 0, 0, 1);
+	one(&q, PRIO_REF, 7);
+	usleep(150000);
+	sendq_flush_tcp(&q, sv[0], -1);
+	one(&q, PRIO_REF, 8);
+	one(&q, PRIO_DISPOSABLE, 9);
+	one(&q, PRIO_PARAMS, 10);
+	errors += same("Late, no keyframe queued", &q, none, 1);
+	if (q.skips != 1 || q.expired != 3) {
+		fprintf(stderr, "Late, no keyframe queued: %lu skips, %lu NALs expired, should be 1 and 3\n", q.skips, q.expired);
+		errors++;
+	}
+	sendq_free(&q);
+	close(sv[0]);
+	close(sv[1]);
+	return errors;
+}
+
+static void print(const char *what, struct result *r) {
+	printf("%s: NALs whole, params %i/%i, IDR %i/%i, reference %i/%i, non-reference %i/%i, %i cut; "
+		"frames decodable %i/%i, %i whole but broken, slowest %.0f ms; dropped %lu/%lu/%lu/%lu, expired %lu, skips %lu\n",
+		what, r->whole[PRIO_PARAMS], r->nals[PRIO_PARAMS], r->whole[PRIO_IDR], r->nals[PRIO_IDR], r->whole[PRIO_REF], r->nals[PRIO_REF],
+		r->whole[PRIO_DISPOSABLE], r->nals[PRIO_DISPOSABLE], r->partial, r->decodable, r->frames, r->broken, r->worst * 1000,
+		r->dropped[PRIO_PARAMS], r->dropped[PRIO_IDR], r->dropped[PRIO_REF], r->dropped[PRIO_DISPOSABLE], r->expired, r->skips);
+}
+
+//the share of NALs of that priority lost
+static double lost(struct result *r, int prio) {
+	return 1 - (double)r->whole[prio] / r->nals[prio];
+}
+
+static int check(int kbyte_s, int verbose) {
+	struct result prio, fifo, tcp;
+	long deadline = 250000; //camera_server's default
+	int errors = 0;
+
+	if (udp(&prio, 0, kbyte_s) < 0 || udp(&fifo, 1, kbyte_s) < 0 || stream(&tcp, deadline, kbyte_s) < 0) return 1;
+	if (verbose) {
+		print("UDP, priorities", &prio);
+		print("UDP, FIFO", &fifo);
+		print("Stream socket", &tcp);
+	}
+	if (prio.whole[PRIO_PARAMS] != prio.nals[PRIO_PARAMS] || prio.whole[PRIO_IDR] != prio.nals[PRIO_IDR]) {
+		fprintf(stderr, "Priorities: parameter sets or IDRs lost\n");
+		errors++;
+	}
+	if (!prio.dropped[PRIO_DISPOSABLE] || lost(&prio, PRIO_DISPOSABLE) <= lost(&prio, PRIO_REF)) {
+		fprintf(stderr, "Priorities: %.0f%% of non-reference NALs lost, %.0f%% of reference ones\n",
+			lost(&prio, PRIO_DISPOSABLE) * 100, lost(&prio, PRIO_REF) * 100);
+		errors++;
+	}
+	if (prio.decodable <= fifo.decodable) {
+		fprintf(stderr, "Priorities: %i frames decodable, FIFO %i\n", prio.decodable, fifo.decodable);
+		errors++;
+	}
+	if (!tcp.expired || tcp.broken || tcp.worst * 1000000 > deadline + 100000) { //and what the socket holds
+		fprintf(stderr, "Stream socket: %lu expired, %i frames whole but broken, the slowest took %.0f ms\n",
+			tcp.expired, tcp.broken, tcp.worst * 1000);
+		errors++;
+	}
+	errors += expiry();
+	printf("Send queue over %i KB/s: priorities against FIFO over UDP, the deadline over a stream socket, %i errors\n", kbyte_s, errors);
+	return errors;
+}
+
+void print_usage() {
+	printf("sendq_bench [options]\n");
+	printf("-c only check the results, don't print what went through\n");
+	printf("-k [KB/s] the link takes (defaults to 160, the stream is 200)\n");
+}
+
+int main(int argc, char **argv) {
+	int option, check_only = 0, kbyte_s = 160;
+
+	while ((option = getopt(argc, argv, "ck:")) != -1) {
+		switch (option) {
+			case 'c': check_only = 1; break;
+			case 'k': kbyte_s = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (kbyte_s < 1) {
+		print_usage();
+		return 1;
+	}
+	return check(kbyte_s, !check_only) ? 1 : 0;
+}
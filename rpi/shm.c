@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "shm.h"
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+//Abstract socket, nothing to clean up after a crash
+static socklen_t sock_addr(struct sockaddr_un *a, const char *name) {
+	memset(a, 0, sizeof(*a));
+	a->sun_family = AF_UNIX;
+	int len = snprintf(a->sun_path + 1, sizeof(a->sun_path) - 1, "camera_server.%s", name);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+//Consumer i's page
+static struct shm_consumer *consumer(struct shm *s, int i) {
+	return (struct shm_consumer *)((unsigned char *)s->h + s->consumers + i * s->page);
+}
+
+int shm_init(struct shm *s, const char *name, long size, int width, int height) {
+	struct sockaddr_un a;
+	char path[80];
+	long page = sysconf(_SC_PAGESIZE), data;
+
+	memset(s, 0, sizeof(*s));
+	s->page = page;
+	s->consumers = (sizeof(struct shm_header) + page - 1) / page * page;
+	data = s->consumers + SHM_CONSUMERS * page;
+	s->size = size;
+	s->map_size = data + size;
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	snprintf(path, sizeof(path), "/%s", name);
+	shm_unlink(path); //left by a previous run
+	s->fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (s->fd < 0) return -1;
+	if (ftruncate(s->fd, s->map_size) < 0) goto fail;
+	s->h = (struct shm_header *)mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->h == MAP_FAILED) goto fail;
+	s->data = (unsigned char *)s->h + data;
+	s->h->magic = SHM_MAGIC;
+	s->h->slots = SHM_SLOTS;
+	s->h->size = size;
+	s->h->data = data;
+	s->h->width = width;
+	s->h->height = height;
+	s->h->page = page;
+	s->h->consumers = s->consumers;
+	for (int i = 0; i < SHM_SLOTS; i++) s->h->slot[i].seq = ~0ULL;
+
+	s->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s->sock < 0) goto unmap;
+	if (bind(s->sock, (struct sockaddr *)&a, sock_addr(&a, name)) < 0 || listen(s->sock, SHM_CONSUMERS) < 0) {
+		close(s->sock);
+		goto unmap;
+	}
+	return 0;
+unmap:
+	munmap(s->h, s->map_size);
+fail:
+	close(s->fd);
+	shm_unlink(path);
+	return -1;
+}
+
+static void drop_consumer(struct shm *s, int i) {
+	close(s->conn[i]);
+	close(s->efd[i]);
+	s->conn[i] = 0;
+	STORE(&s->h->pid[i], 0);
+}
+
+void shm_free(struct shm *s) {
+	char path[80];
+
+	for (int i = 0; i < SHM_CONSUMERS; i++)
+		if (s->conn[i]) drop_consumer(s, i);
+	close(s->sock);
+	munmap(s->h, s->map_size);
+	close(s->fd);
+	snprintf(path, sizeof(path), "/%s", s->name);
+	shm_unlink(path);
+}
+
+unsigned char *shm_reserve(struct shm *s, int len) {
+	uint64_t pos = s->data_head;
+
+	if ((uint64_t)len > s->size) return NULL;
+	if (pos % s->size + len > s->size) pos += s->size - pos % s->size; //entries don't wrap around
+	if (pos + len > s->size && pos + len - s->size > s->data_tail) {
+		s->data_tail = pos + len - s->size;
+		STORE(&s->h->data_tail, s->data_tail);
+		__atomic_thread_fence(__ATOMIC_RELEASE); //readers see the old data is gone before it changes
+	}
+	s->pos = pos;
+	return s->data + pos % s->size;
+}
+
+void shm_commit(struct shm *s, int type, int key, int len, struct timeval *t) {
+	struct shm_header *h = s->h;
+	uint64_t n = s->head;
+	struct shm_slot *slot = &h->slot[n % SHM_SLOTS];
+	static const uint64_t one = 1;
+
+	STORE(&slot->seq, ~0ULL);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->type = type;
+	slot->key = key;
+	slot->pos = s->pos;
+	slot->len = len;
+	slot->time_us = t->tv_sec * 1000000LL + t->tv_usec;
+	STORE(&slot->seq, n);
+	s->data_head = s->pos + len;
+	s->head = n + 1;
+	STORE(&h->data_head, s->data_head);
+	STORE(&h->head, s->head);
+	s->entries++;
+	s->bytes += len;
+
+	for (int i = 0; i < SHM_CONSUMERS; i++) //never blocks, the counter just grows
+		if (s->conn[i] && write(s->efd[i], &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd");
+}
+
+void shm_put(struct shm *s, int type, int key, const unsigned char *b, int len, struct timeval *t) {
+	unsigned char *p = shm_reserve(s, len);
+	if (!p) return;
+	memcpy(p, b, len);
+	shm_commit(s, type, key, len, t);
+}
+
+int shm_consumers(struct shm *s) {
+	int n = 0;
+	for (int i = 0; i < SHM_CONSUMERS; i++)
+		if (s->conn[i]) n++;
+	return n;
+}
+
+int shm_lag(struct shm *s, int i, uint64_t *lag, uint64_t *overruns) {
+	if (!s->conn[i]) return -1;
+	*lag = s->head - LOAD(&consumer(s, i)->next); //whatever the consumer wrote, it's only a number
+	*overruns = LOAD(&consumer(s, i)->overruns);
+	return 0;
+}
+
+void shm_fds(struct shm *s, fd_set *readfds, int *max_fd) {
+	FD_SET(s->sock, readfds);
+	if (s->sock > *max_fd) *max_fd = s->sock;
+	for (int i = 0; i < SHM_CONSUMERS; i++) {
+		if (!s->conn[i]) continue;
+		FD_SET(s->conn[i], readfds);
+		if (s->conn[i] > *max_fd) *max_fd = s->conn[i];
+	}
+}
+
+//Hands the ring and an eventfd to a new consumer, [index 4] with both fds attached
+static int add_consumer(struct shm *s, int sock) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int i, fds[2];
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} c;
+	struct iovec iov;
+	struct msghdr m;
+
+	for (i = 0; i < SHM_CONSUMERS && s->conn[i]; i++);
+	if (i == SHM_CONSUMERS) return -1;
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return -1;
+	if (cred.uid && cred.uid != getuid()) return -1; //abstract sockets have no permissions of their own
+	fds[0] = s->fd;
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[1] < 0) return -1;
+
+	memset(&m, 0, sizeof(m));
+	memset(&c, 0, sizeof(c));
+	iov.iov_base = &i;
+	iov.iov_len = sizeof(i);
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = c.buf;
+	m.msg_controllen = sizeof(c.buf);
+	c.h.cmsg_level = SOL_SOCKET;
+	c.h.cmsg_type = SCM_RIGHTS;
+	c.h.cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(&c.h), fds, sizeof(fds));
+
+	struct shm_consumer *con = consumer(s, i);
+	con->overruns = 0;
+	STORE(&con->next, s->head);
+	STORE(&s->h->pid[i], cred.pid);
+	if (sendmsg(sock, &m, MSG_NOSIGNAL) != sizeof(i)) {
+		STORE(&s->h->pid[i], 0);
+		close(fds[1]);
+		return -1;
+	}
+	s->conn[i] = sock;
+	s->efd[i] = fds[1];
+	return i;
+}
+
+int shm_handle(struct shm *s, fd_set *readfds) {
+	int i, ret, changed = 0;
+	char c;
+
+	if (FD_ISSET(s->sock, readfds)) {
+		ret = accept4(s->sock, 0, 0, SOCK_CLOEXEC);
+		if (ret < 0) perror("accept");
+		else if (add_consumer(s, ret) < 0) close(ret);
+		else changed = 1;
+	}
+	for (i = 0; i < SHM_CONSUMERS; i++) {
+		if (!s->conn[i] || !FD_ISSET(s->conn[i], readfds)) continue;
+		ret = recv(s->conn[i], &c, 1, MSG_DONTWAIT); //consumers don't talk, this is them leaving
+		if (ret > 0 || (ret < 0 && (errno == EAGAIN || errno == EINTR))) continue;
+		drop_consumer(s, i);
+		changed = 1;
+	}
+	return changed;
+}
+
+int shm_attach(struct shm_reader *r, const char *name) {
+	struct sockaddr_un a;
+	int fds[2];
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} c;
+	struct iovec iov;
+	struct msghdr m;
+	struct cmsghdr *h;
+	struct stat st;
+
+	memset(r, 0, sizeof(*r));
+	r->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (r->sock < 0) return -1;
+	if (connect(r->sock, (struct sockaddr *)&a, sock_addr(&a, name)) < 0) goto fail;
+
+	memset(&m, 0, sizeof(m));
+	iov.iov_base = &r->index;
+	iov.iov_len = sizeof(r->index);
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = c.buf;
+	m.msg_controllen = sizeof(c.buf);
+	if (recvmsg(r->sock, &m, MSG_CMSG_CLOEXEC) != sizeof(r->index)) goto fail;
+	h = CMSG_FIRSTHDR(&m);
+	if (!h || h->cmsg_type != SCM_RIGHTS || h->cmsg_len != CMSG_LEN(sizeof(fds))) goto fail;
+	memcpy(fds, CMSG_DATA(h), sizeof(fds));
+	r->efd = fds[1];
+
+	if (fstat(fds[0], &st) < 0) goto fds;
+	r->map_size = st.st_size;
+	r->h = (struct shm_header *)mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fds[0], 0);
+	if (r->h == MAP_FAILED) goto fds;
+	if (r->h->magic != SHM_MAGIC || r->h->data + r->h->size > (uint64_t)r->map_size || !r->h->size ||
+		r->index < 0 || r->index >= SHM_CONSUMERS || r->h->consumers + (r->index + 1) * (uint64_t)r->h->page > r->h->data) goto unmap;
+	r->page = r->h->page;
+	r->me = (struct shm_consumer *)mmap(NULL, r->page, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], r->h->consumers + r->index * r->page);
+	if (r->me == MAP_FAILED) goto unmap;
+	close(fds[0]);
+	r->data = (unsigned char *)r->h + r->h->data;
+	r->next = LOAD(&r->me->next);
+	return 0;
+unmap:
+	munmap(r->h, r->map_size);
+fds:
+	close(fds[0]);
+	close(r->efd);
+fail:
+	close(r->sock);
+	return -1;
+}
+
+void shm_detach(struct shm_reader *r) {
+	munmap(r->me, r->page);
+	munmap(r->h, r->map_size);
+	close(r->efd);
+	close(r->sock); //the server frees our entry
+}
+
+//Copies the slot of entry n, 0 if it was overwritten
+static int get_entry(struct shm_reader *r, uint64_t n, struct shm_entry *e) {
+	struct shm_slot *slot = &r->h->slot[n % r->h->slots];
+
+	if (LOAD(&slot->seq) != n) return 0;
+	e->seq = n;
+	e->type = slot->type;
+	e->key = slot->key;
+	e->len = slot->len;
+	e->pos = slot->pos;
+	e->time_us = slot->time_us;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (LOAD(&slot->seq) != n || e->pos + e->len > LOAD(&r->h->data_head)) return 0;
+	e->data = r->data + e->pos % r->h->size;
+	return shm_valid(r, e);
+}
+
+int shm_read(struct shm_reader *r, struct shm_entry *e, int timeout_ms) {
+	struct shm_header *h = r->h;
+	struct shm_consumer *con = r->me;
+	struct pollfd p[2] = { { r->efd, POLLIN, 0 }, { r->sock, POLLIN, 0 } };
+	uint64_t head, count;
+	int waited = 0;
+
+	e->lost = 0;
+	for (;;) {
+		head = LOAD(&h->head);
+		if (r->next < head) {
+			if (head - r->next > h->slots) { //lapped
+				e->lost += head - h->slots - r->next;
+				r->next = head - h->slots;
+			}
+			if (get_entry(r, r->next++, e)) break;
+			e->lost++;
+			continue;
+		}
+		if (waited) return 0;
+		if (poll(p, 2, timeout_ms) <= 0) return 0;
+		if (p[1].revents) return -1; //the server never writes, it closed the connection
+		if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) return 0;
+		waited = 1;
+	}
+	if (e->lost) STORE(&con->overruns, con->overruns + 1);
+	STORE(&con->next, r->next);
+	return 1;
+}
+
+int shm_valid(struct shm_reader *r, struct shm_entry *e) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE); //the data was read before the tail is
+	return e->pos >= LOAD(&r->h->data_tail);
+}
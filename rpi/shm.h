@@ -0,0 +1,122 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+//Shared memory output for local consumers: camera_server writes entries into a ring in
+///dev/shm/<name> and never waits for anyone; consumers read them in place. A consumer connects
+//to the abstract unix socket "camera_server.<name>" and gets the ring's fd and an eventfd that
+//counts new entries. A consumer that falls a whole ring behind is overrun, which it can tell.
+//Fields shared with consumers that change are accessed with __atomic builtins. Consumers map the ring
+//read-only but for a page of their own where they tell how far they got; camera_server never takes
+//anything from the ring it doesn't keep itself.
+
+#define SHM_MAGIC 0x324d5343 //"CSM2"
+#define SHM_SLOTS 256 //entries described at once
+#define SHM_CONSUMERS 16
+
+#define SHM_AU 0 //access unit of the main layer, start-coded NALs
+#define SHM_RAW 1 //raw I420 frame, width x height from the header
+
+struct shm_slot {
+	uint64_t seq; //entry in the slot, written last; ~0 while it changes
+	uint32_t type;
+	uint32_t key; //AU_IDR or AU_RECOVERY for access units a decoder can start at
+	uint64_t pos; //of the data, counted from the ring's start, it's at data + pos % size
+	uint32_t len;
+	uint32_t pad;
+	int64_t time_us; //when the frame came from the encoder (CLOCK_REALTIME)
+};
+
+//Written by the consumer alone, in its own page
+struct shm_consumer {
+	uint64_t next; //entry the consumer reads next
+	uint64_t overruns; //times it lost entries
+};
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t slots;
+	uint64_t size; //ring bytes
+	uint32_t data; //offset of the ring from the header
+	uint32_t width, height; //of raw frames, 0 if there are none
+	uint32_t page; //consumer i's struct shm_consumer is at consumers + i * page from the header
+	uint32_t consumers;
+	uint32_t pad;
+	uint64_t head; //next entry; head - slots .. head - 1 may still be valid
+	uint64_t data_head; //where the next entry's data goes
+	uint64_t data_tail; //data before this has been overwritten
+	struct shm_slot slot[SHM_SLOTS];
+	int32_t pid[SHM_CONSUMERS]; //of consumer i, 0 if the entry is free
+};
+
+//Producer
+struct shm {
+	struct shm_header *h;
+	unsigned char *data;
+	int fd;
+	int sock; //where consumers connect
+	char name[64];
+	int conn[SHM_CONSUMERS]; //consumers' connections, 0 if the entry is free
+	int efd[SHM_CONSUMERS];
+	uint64_t pos; //reserved by shm_reserve()
+	uint64_t size, head, data_head, data_tail; //the header only gets copies, consumers can write to it
+	long page, consumers, map_size;
+	unsigned long entries, bytes;
+};
+
+//Creates the ring of size bytes; raw frames are width x height, 0 without. Returns -1 on failure.
+int shm_init(struct shm *s, const char *name, long size, int width, int height);
+void shm_free(struct shm *s);
+
+//Space for an entry of len bytes, NULL if it's bigger than the ring can hold;
+//filled by the caller, it becomes visible with shm_commit()
+unsigned char *shm_reserve(struct shm *s, int len);
+void shm_commit(struct shm *s, int type, int key, int len, struct timeval *t);
+
+//Copies an entry in
+void shm_put(struct shm *s, int type, int key, const unsigned char *b, int len, struct timeval *t);
+
+int shm_consumers(struct shm *s);
+
+//How many entries consumer i is behind and how often it lost some, -1 if there's no consumer i
+int shm_lag(struct shm *s, int i, uint64_t *lag, uint64_t *overruns);
+
+//Adds the listening socket and the consumers' connections to the set
+void shm_fds(struct shm *s, fd_set *readfds, int *max_fd);
+
+//Takes new consumers and notices the ones that left, returns 1 if the number changed
+int shm_handle(struct shm *s, fd_set *readfds);
+
+//Consumer
+struct shm_reader {
+	struct shm_header *h; //read-only
+	unsigned char *data;
+	struct shm_consumer *me; //our page, writable
+	int sock, efd, index;
+	uint64_t next;
+	long map_size, page;
+};
+
+struct shm_entry {
+	uint64_t seq;
+	int type, key, len;
+	int64_t time_us;
+	const unsigned char *data; //in the ring, valid until shm_valid() says otherwise
+	uint64_t pos;
+	uint64_t lost; //entries skipped before this one because they were overwritten
+};
+
+//Returns -1 on failure; reading starts with the next entry
+int shm_attach(struct shm_reader *r, const char *name);
+void shm_detach(struct shm_reader *r);
+
+//Next entry, waiting up to timeout_ms for it; returns 1, 0 if none came, -1 if the server is gone
+int shm_read(struct shm_reader *r, struct shm_entry *e, int timeout_ms);
+
+//After the data was used in place: 1 if it wasn't overwritten meanwhile
+int shm_valid(struct shm_reader *r, struct shm_entry *e);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "shm.h"
+
+//Reads camera_server's shared memory ring: prints what arrives each second and can save the
+//access units as an H.264 byte-stream. -s makes it a slow consumer, to see overruns.
+
+void print_usage() {
+	printf("shm_view [options] [name]\n");
+	printf("-o [file] write the access units to file, from the first keyframe\n");
+	printf("-s [ms] time taken with each entry, in place\n");
+	printf("-n [seconds] stop after that long (defaults to running until the ring goes away)\n");
+}
+
+int main(int argc, char **argv) {
+	struct shm_reader r;
+	struct shm_entry e;
+	struct timeval now, start, last;
+	FILE *out = NULL;
+	const char *name;
+	int option, slow_ms = 0, seconds = 0, started = 0, ret;
+	unsigned long aus = 0, raws = 0, keys = 0, lost = 0, invalid = 0, bytes = 0;
+	double delay = 0, delay_max = 0, d;
+
+	while ((option = getopt(argc, argv, "o:s:n:")) != -1) {
+		switch (option) {
+			case 'o':
+				out = fopen(optarg, "wb");
+				if (!out) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			case 's': slow_ms = atoi(optarg); break;
+			case 'n': seconds = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	name = optind < argc ? argv[optind] : "camera";
+	if (shm_attach(&r, name) < 0) {
+		fprintf(stderr, "Can't attach to %s\n", name);
+		return 1;
+	}
+	printf("Consumer %i of a %lu byte ring, raw frames %ux%u\n", r.index, (unsigned long)r.h->size, r.h->width, r.h->height);
+
+	gettimeofday(&start, NULL);
+	last = start;
+	for (;;) {
+		ret = shm_read(&r, &e, 1000);
+		if (ret < 0) break;
+		gettimeofday(&now, NULL);
+		if (ret) {
+			lost += e.lost;
+			d = (now.tv_sec * 1000000LL + now.tv_usec - e.time_us) / 1000.0; //encoder to us
+			delay += d;
+			if (d > delay_max) delay_max = d;
+			if (e.type == SHM_RAW) raws++;
+			else aus++;
+			if (e.key) keys++;
+			bytes += e.len;
+			if (out && e.type == SHM_AU && (started || e.key)) {
+				started = 1;
+				fwrite(e.data, 1, e.len, out);
+			}
+			if (slow_ms) usleep(slow_ms * 1000);
+			if (!shm_valid(&r, &e)) { //what was used may be garbage
+				invalid++;
+				if (out) started = 0; //start again at a keyframe
+			}
+		}
+
+		if (now.tv_sec - last.tv_sec >= 1) {
+			printf("%lu access units (%lu keyframes), %lu raw frames, %.0f KB, %.1f ms after capture (max %.1f), "
+				"%lu lost, %lu overwritten in use, %llu behind\n", aus, keys, raws, bytes / 1024.0,
+				aus + raws ? delay / (aus + raws) : 0, delay_max, lost, invalid,
+				(unsigned long long)(r.h->head - r.next));
+			fflush(stdout);
+			aus = raws = keys = lost = invalid = bytes = 0;
+			delay = delay_max = 0;
+			last = now;
+		}
+		if (seconds && now.tv_sec - start.tv_sec >= seconds) break;
+	}
+	if (out) fclose(out);
+	shm_detach(&r);
+	return 0;
+}
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/time.h>
+#include <jpeglib.h>
+
+#include "snap.h"
+
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+//libjpeg's own would exit() the whole server
+static void error_exit(j_common_ptr cinfo) {
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((struct jpeg_error *)cinfo->err)->jump, 1);
+}
+
+//The planes go in as they are, libjpeg neither converts colours nor subsamples
+static unsigned char *encode(struct snap *s, unsigned long *len) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error jerr;
+	JSAMPROW rows[3][16];
+	JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+	unsigned char *out = NULL, *y = s->frame, *u = y + s->stride * s->height, *v = u + s->stride / 2 * (s->height / 2);
+	int cs = s->stride / 2, ch = s->height / 2;
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = error_exit;
+	*len = 0;
+	if (setjmp(jerr.jump)) { //out is only changed by libjpeg, through its address
+		jpeg_destroy_compress(&cinfo);
+		free(out);
+		return NULL;
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &out, len);
+	cinfo.image_width = s->width;
+	cinfo.image_height = s->height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, s->quality, TRUE);
+	cinfo.raw_data_in = TRUE;
+	cinfo.comp_info[0].h_samp_factor = cinfo.comp_info[0].v_samp_factor = 2;
+	cinfo.comp_info[1].h_samp_factor = cinfo.comp_info[1].v_samp_factor = 1;
+	cinfo.comp_info[2].h_samp_factor = cinfo.comp_info[2].v_samp_factor = 1;
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) { //16 luma rows, 8 of each chroma plane; the last rows repeat at the bottom
+		for (int i = 0; i < 16; i++) {
+			int r = cinfo.next_scanline + i < (unsigned int)s->height ? cinfo.next_scanline + i : s->height - 1;
+			rows[0][i] = y + r * s->stride;
+		}
+		for (int i = 0; i < 8; i++) {
+			int r = cinfo.next_scanline / 2 + i < (unsigned int)ch ? cinfo.next_scanline / 2 + i : ch - 1;
+			rows[1][i] = u + r * cs;
+			rows[2][i] = v + r * cs;
+		}
+		jpeg_write_raw_data(&cinfo, planes, 16);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return out;
+}
+
+static void *encoder(void *arg) {
+	struct snap *s = (struct snap *)arg;
+	struct timeval t0, t1;
+	unsigned long len;
+	unsigned char *jpeg, one = 1;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop) {
+		if (!s->busy || s->jpeg || s->jpeg_len) {
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&s->lock);
+		gettimeofday(&t0, NULL);
+		jpeg = encode(s, &len);
+		gettimeofday(&t1, NULL);
+		pthread_mutex_lock(&s->lock);
+		s->jpeg = jpeg;
+		s->jpeg_len = jpeg ? len : 1; //1 without a JPEG: done, but failed
+		s->encode_ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0;
+		if (write(s->done[1], &one, 1) < 0) perror("snapshot");
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+int snap_init(struct snap *s, int quality) {
+	sigset_t all, old;
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	s->quality = quality;
+	if (pipe(s->done) < 0) {
+		perror("snapshot pipe");
+		return -1;
+	}
+	fcntl(s->done[0], F_SETFL, O_NONBLOCK);
+	fcntl(s->done[0], F_SETFD, FD_CLOEXEC);
+	fcntl(s->done[1], F_SETFD, FD_CLOEXEC);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	//signals are for the main loop
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&s->thread, NULL, encoder, s);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		fprintf(stderr, "Starting the snapshot encoder: %s\n", strerror(ret));
+		snap_free(s);
+		return -1;
+	}
+	s->running = 1;
+	return 0;
+}
+
+void snap_free(struct snap *s) {
+	if (s->running) {
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+		s->running = 0;
+	}
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	close(s->done[0]);
+	close(s->done[1]);
+	free(s->frame);
+	free(s->jpeg);
+	s->frame = s->jpeg = NULL;
+}
+
+//Pads a row of len samples out to stride with its last one
+static void pad(unsigned char *row, int len, int stride) {
+	memset(row + len, row[len - 1], stride - len);
+}
+
+int snap_frame(struct snap *s, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width, int height,
+	int ystride, int cstride, int cstep) {
+	int stride = (width + 15) & ~15, cs = stride / 2, cw = width / 2; //libjpeg reads whole 16 pixel wide MCUs
+	int size = stride * height + cs * (height / 2) * 2;
+	unsigned char *p, *q;
+
+	if (s->busy || width < 2 || height < 2) return -1; //no chroma to pad from
+	if (size > s->size) { //only grows, the next snapshot is usually the same size
+		free(s->frame);
+		s->frame = (unsigned char *)malloc(size);
+		s->size = s->frame ? size : 0;
+		if (!s->frame) return -1;
+	}
+	s->width = width;
+	s->height = height;
+	s->stride = stride;
+	for (int r = 0; r < height; r++) {
+		memcpy(s->frame + r * stride, y + r * ystride, width);
+		pad(s->frame + r * stride, width, stride);
+	}
+	p = s->frame + stride * height;
+	q = p + cs * (height / 2);
+	for (int r = 0; r < height / 2; r++, p += cs, q += cs) {
+		if (cstep == 1) {
+			memcpy(p, u + r * cstride, cw);
+			memcpy(q, v + r * cstride, cw);
+		} else for (int i = 0; i < cw; i++) {
+			p[i] = u[r * cstride + i * cstep];
+			q[i] = v[r * cstride + i * cstep];
+		}
+		pad(p, cw, cs);
+		pad(q, cw, cs);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->busy = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+void snap_fds(struct snap *s, fd_set *readfds, int *max_fd) {
+	if (!s->busy) return;
+	FD_SET(s->done[0], readfds);
+	if (s->done[0] > *max_fd) *max_fd = s->done[0];
+}
+
+int snap_take(struct snap *s, fd_set *readfds, unsigned char **jpeg, unsigned long *len) {
+	unsigned char b;
+
+	if (!s->busy || !FD_ISSET(s->done[0], readfds) || read(s->done[0], &b, 1) != 1) return 0;
+	pthread_mutex_lock(&s->lock);
+	*jpeg = s->jpeg;
+	*len = s->jpeg ? s->jpeg_len : 0;
+	s->jpeg = NULL;
+	s->jpeg_len = 0;
+	s->busy = 0;
+	pthread_mutex_unlock(&s->lock);
+	return 1;
+}
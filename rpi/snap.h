@@ -0,0 +1,41 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <pthread.h>
+#include <sys/select.h>
+
+//Stills from the live stream: the streaming side copies one raw frame when a snapshot was asked for, a thread of
+//its own encodes it as JPEG and tells the loop through a pipe. Idle otherwise, the stream never waits for it.
+struct snap {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+	int quality;
+	int done[2]; //pipe, a byte per finished JPEG
+
+	int busy; //a frame is with the encoder, until snap_take() returned it
+	unsigned char *frame; //I420, rows padded to stride (luma) and stride / 2 (chroma)
+	int size, width, height, stride;
+
+	//encoder side, read once done
+	unsigned char *jpeg; //malloc'd, NULL if it failed
+	unsigned long jpeg_len;
+	double encode_ms;
+};
+
+//Starts the encoder thread; returns -1 if it couldn't
+int snap_init(struct snap *s, int quality);
+void snap_free(struct snap *s);
+
+//Copies a YUV 4:2:0 frame for the encoder: planes u and v are cstep apart per pixel, 2 for interleaved NV12 chroma.
+//Returns -1 if the last one isn't done yet or there's no memory.
+int snap_frame(struct snap *s, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width, int height,
+	int ystride, int cstride, int cstep);
+
+void snap_fds(struct snap *s, fd_set *readfds, int *max_fd);
+//1 once the frame is encoded: *jpeg is then the caller's to free, NULL if encoding failed
+int snap_take(struct snap *s, fd_set *readfds, unsigned char **jpeg, unsigned long *len);
+
+#endif
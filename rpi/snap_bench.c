@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <jpeglib.h>
+
+#include "snap.h"
+
+//Checks the snapshot encoder as camera_server runs it, on its own thread: frames whose width isn't a multiple of 16,
+//from I420 and NV12, must decode back to what went in; a frame libjpeg refuses must come back as a failed snapshot,
+//not end the process, and the encoder must go on working after it. Then times snapshots at the usual sizes.
+
+static unsigned char *image(int width, int height) {
+	unsigned char *f = (unsigned char *)malloc(width * height * 3 / 2), *u = f + width * height, *v = u + width * height / 4;
+
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++) f[y * width + x] = 128 + 100 * sin(x * 0.05) * cos(y * 0.03);
+	for (int y = 0; y < height / 2; y++)
+		for (int x = 0; x < width / 2; x++) {
+			u[y * (width / 2) + x] = 128 + x * 100 / width;
+			v[y * (width / 2) + x] = 128 - y * 100 / height;
+		}
+	return f;
+}
+
+//Encodes an I420 frame, or NV12 (interleaved chroma, as the raw frames come) made from it; returns the JPEG or NULL
+//if it failed, -1 in *len if it never came back
+static unsigned char *take(struct snap *s, const unsigned char *f, int width, int height, int nv12, unsigned long *len) {
+	const unsigned char *u = f + width * height, *v = u + width * height / 4;
+	unsigned char *jpeg = NULL, *uv = NULL;
+	struct timeval t;
+	fd_set readfds;
+	int max_fd = 0, ret;
+
+	*len = -1;
+	if (nv12) {
+		uv = (unsigned char *)malloc(width * height / 2);
+		for (int i = 0; i < width * height / 4; i++) {
+			uv[i * 2] = u[i];
+			uv[i * 2 + 1] = v[i];
+		}
+		ret = snap_frame(s, f, uv, uv + 1, width, height, width, width, 2);
+	} else ret = snap_frame(s, f, u, v, width, height, width, width / 2, 1);
+	free(uv);
+	if (ret < 0) return NULL;
+	for (;;) {
+		FD_ZERO(&readfds);
+		snap_fds(s, &readfds, &max_fd);
+		t.tv_sec = 5;
+		t.tv_usec = 0;
+		if (select(max_fd + 1, &readfds, NULL, NULL, &t) <= 0) return NULL;
+		if (snap_take(s, &readfds, &jpeg, len)) return jpeg;
+	}
+}
+
+//PSNR of a decoded JPEG against the frame, over all three planes at chroma resolution for U and V
+static double psnr(const unsigned char *jpeg, unsigned long len, const unsigned char *f, int width, int height) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	const unsigned char *u = f + width * height, *v = u + width * height / 4;
+	unsigned char *row;
+	double sum = 0;
+	long n = 0;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *)jpeg, len);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_YCbCr;
+	jpeg_start_decompress(&cinfo);
+	if ((int)cinfo.output_width != width || (int)cinfo.output_height != height) {
+		jpeg_destroy_decompress(&cinfo);
+		return 0;
+	}
+	row = (unsigned char *)malloc(width * 3);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int y = cinfo.output_scanline;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		for (int x = 0; x < width; x++) {
+			double d = row[x * 3] - f[y * width + x];
+			sum += d * d;
+			n++;
+			if (x % 2 || y % 2) continue;
+			d = row[x * 3 + 1] - u[y / 2 * (width / 2) + x / 2];
+			sum += d * d;
+			d = row[x * 3 + 2] - v[y / 2 * (width / 2) + x / 2];
+			sum += d * d;
+			n += 2;
+		}
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(row);
+	return sum ? 10 * log10(255.0 * 255 * n / sum) : 99;
+}
+
+static int check(struct snap *s) {
+	unsigned char *f, *jpeg;
+	unsigned long len;
+	int errors = 0;
+
+	//libjpeg reads rows in whole 16 pixel wide MCUs, past an 854 or 850 wide row and past the end of the frame unless
+	//they're padded; first, while the frame is no bigger than it has to be
+	for (int i = 0; i < 4; i++) {
+		int w = i < 2 ? 854 : 850, h = i < 2 ? 480 : 478, nv12 = i % 2;
+		double q;
+		f = image(w, h);
+		jpeg = take(s, f, w, h, nv12, &len);
+		q = jpeg ? psnr(jpeg, len, f, w, h) : 0;
+		if (q < 35 || s->stride % 16 || s->stride < w) {
+			fprintf(stderr, "%ix%i from %s: PSNR %.1f dB, rows of %i\n", w, h, nv12 ? "NV12" : "I420", q, s->stride);
+			errors++;
+		}
+		free(jpeg);
+		free(f);
+	}
+	//taller than JPEG_MAX_DIMENSION
+	f = image(16, 70000);
+	jpeg = take(s, f, 16, 70000, 0, &len);
+	if (jpeg || len) {
+		fprintf(stderr, "A frame libjpeg can't encode gave %s\n", jpeg ? "a JPEG" : "no answer");
+		errors++;
+	}
+	free(jpeg);
+	free(f);
+	f = image(640, 480);
+	jpeg = take(s, f, 640, 480, 0, &len);
+	if (!jpeg || len < 1000) {
+		fprintf(stderr, "No snapshot after the failed one\n");
+		errors++;
+	}
+	free(jpeg);
+	free(f);
+	printf("Snapshot encoder: widths that aren't a multiple of 16, a frame libjpeg refuses and one after it, %i errors\n", errors);
+	return errors;
+}
+
+static void bench(struct snap *s, int repeat) {
+	static const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+	struct timeval t0, t1;
+	unsigned long len = 0;
+	double ms, encode = 0;
+
+	for (int i = 0; i < 3; i++) {
+		int w = sizes[i][0], h = sizes[i][1];
+		unsigned char *f = image(w, h);
+		gettimeofday(&t0, NULL);
+		for (int k = 0; k < repeat; k++) {
+			free(take(s, f, w, h, 0, &len));
+			encode += s->encode_ms;
+		}
+		gettimeofday(&t1, NULL);
+		ms = ((t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0) / repeat;
+		printf("%ix%i: %.1f ms a snapshot (%.1f ms encoding), %lu KB\n", w, h, ms, encode / repeat, len / 1024);
+		encode = 0;
+		free(f);
+	}
+}
+
+void print_usage() {
+	printf("snap_bench [options]\n");
+	printf("-c only check the results, don't time anything\n");
+	printf("-n [snapshots] of each size timed (defaults to 20)\n");
+	printf("-q [quality] JPEG quality (defaults to 90, as camera_server's)\n");
+}
+
+int main(int argc, char **argv) {
+	struct snap s;
+	int option, check_only = 0, repeat = 20, quality = 90, errors; //camera_server's SNAP_QUALITY
+
+	while ((option = getopt(argc, argv, "cn:q:")) != -1) {
+		switch (option) {
+			case 'c': check_only = 1; break;
+			case 'n': repeat = atoi(optarg); break;
+			case 'q': quality = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (repeat < 1 || quality < 1 || quality > 100) {
+		print_usage();
+		return 1;
+	}
+	if (snap_init(&s, quality) < 0) return 1;
+	errors = check(&s);
+	if (!errors && !check_only) bench(&s, repeat);
+	snap_free(&s);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/hmac.h>
+
+#include "rtp.h"
+#include "srtp.h"
+
+//AES-CM keyed with the master key, the counter the master salt (padded to 112 bits) with the label in byte 7
+int srtp_derive(const unsigned char *key, const unsigned char *salt, int salt_len, int label, unsigned char *out, int len) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	unsigned char block[16], stream[16];
+	int n, ret = -1;
+
+	if (!ctx || !EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL)) goto out;
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+	for (int i = 0; i * 16 < len; i++) {
+		memset(block, 0, sizeof(block));
+		memcpy(block, salt, salt_len);
+		block[7] ^= label;
+		block[14] = i >> 8;
+		block[15] = i;
+		if (!EVP_EncryptUpdate(ctx, stream, &n, block, 16)) goto out;
+		memcpy(out + i * 16, stream, len - i * 16 < 16 ? len - i * 16 : 16);
+	}
+	ret = 0;
+out:
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
+
+int srtp_init(struct srtp *s, const unsigned char *master) {
+	unsigned char key[SRTP_KEY], salt[SRTP_SALT];
+	int ret = -1;
+
+	memset(s, 0, sizeof(*s));
+	if (srtp_derive(master, master + SRTP_KEY, SRTP_SALT, SRTP_LABEL_KEY, key, SRTP_KEY) == 0 &&
+		srtp_derive(master, master + SRTP_KEY, SRTP_SALT, SRTP_LABEL_SALT, salt, SRTP_SALT) == 0) ret = srtp_keys(s, key, salt);
+	OPENSSL_cleanse(key, sizeof(key));
+	OPENSSL_cleanse(salt, sizeof(salt));
+	return ret;
+}
+
+int srtp_keys(struct srtp *s, const unsigned char *key, const unsigned char *salt) {
+	memset(s, 0, sizeof(*s));
+	memcpy(s->key, key, SRTP_KEY);
+	memcpy(s->salt, salt, SRTP_SALT);
+	s->ctx = EVP_CIPHER_CTX_new();
+	//the key schedule once, each packet only sets its IV
+	if (!s->ctx || !EVP_CipherInit_ex(s->ctx, EVP_aes_128_gcm(), NULL, s->key, NULL, 1)) {
+		srtp_free(s);
+		return -1;
+	}
+	return 0;
+}
+
+void srtp_free(struct srtp *s) {
+	if (s->ctx) EVP_CIPHER_CTX_free(s->ctx);
+	s->ctx = NULL;
+	memset(s->key, 0, sizeof(s->key));
+}
+
+//The stream of ssrc, NULL if it isn't tracked
+static struct srtp_ssrc *find(struct srtp *s, unsigned int ssrc) {
+	for (int i = 0; i < SRTP_STREAMS; i++)
+		if (s->streams[i].used && s->streams[i].ssrc == ssrc) return &s->streams[i];
+	return NULL;
+}
+
+//A slot for a new SSRC: a free one, else the streams are replaced in turn
+static struct srtp_ssrc *claim(struct srtp *s, unsigned int ssrc) {
+	struct srtp_ssrc *st = NULL;
+
+	for (int i = 0; i < SRTP_STREAMS && !st; i++)
+		if (!s->streams[i].used) st = &s->streams[i];
+	if (!st) {
+		st = &s->streams[s->next];
+		s->next = (s->next + 1) % SRTP_STREAMS;
+	}
+	memset(st, 0, sizeof(*st));
+	st->ssrc = ssrc;
+	return st;
+}
+
+//Header length with CSRCs and extension, -1 if it isn't RTP
+static int header(const unsigned char *pkt, int len) {
+	int n = RTP_HDR + (pkt[0] & 0x0f) * 4;
+
+	if (len < RTP_HDR || (pkt[0] & 0xc0) != 0x80 || len < n) return -1;
+	if (pkt[0] & 0x10) {
+		if (len < n + 4) return -1;
+		n += 4 + (pkt[n + 2] << 8 | pkt[n + 3]) * 4;
+	}
+	return n <= len ? n : -1;
+}
+
+//RFC 7714 8.1: 00 00, SSRC, ROC, sequence number, XOR the salt
+static void iv(struct srtp *s, const unsigned char *pkt, unsigned int roc, unsigned char *out) {
+	memset(out, 0, 2);
+	memcpy(out + 2, pkt + 8, 4);
+	out[6] = roc >> 24;
+	out[7] = roc >> 16;
+	out[8] = roc >> 8;
+	out[9] = roc;
+	memcpy(out + 10, pkt + 2, 2);
+	for (int i = 0; i < SRTP_SALT; i++) out[i] ^= s->salt[i];
+}
+
+int srtp_protect(struct srtp *s, const unsigned char *pkt, int len, unsigned char *out) {
+	unsigned char nonce[SRTP_SALT];
+	struct srtp_ssrc *st;
+	unsigned short seq;
+	unsigned int ssrc;
+	int h = header(pkt, len), n;
+
+	if (h < 0) return -1;
+	ssrc = pkt[8] << 24 | pkt[9] << 16 | pkt[10] << 8 | pkt[11];
+	if (!(st = find(s, ssrc))) st = claim(s, ssrc);
+	seq = pkt[2] << 8 | pkt[3];
+	if (!st->used) st->used = 1;
+	else if (seq < st->seq && st->seq - seq > 0x8000) st->roc++; //wrapped, packets go out in order
+	st->seq = seq;
+
+	iv(s, pkt, st->roc, nonce);
+	memcpy(out, pkt, h);
+	if (!EVP_EncryptInit_ex(s->ctx, NULL, NULL, NULL, nonce) ||
+		!EVP_EncryptUpdate(s->ctx, NULL, &n, pkt, h) || //the header is authenticated, not encrypted
+		!EVP_EncryptUpdate(s->ctx, out + h, &n, pkt + h, len - h) ||
+		!EVP_EncryptFinal_ex(s->ctx, out + h + n, &n) ||
+		!EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_GCM_GET_TAG, SRTP_TAG, out + len)) {
+		s->failed++;
+		return -1;
+	}
+	s->packets++;
+	return len + SRTP_TAG;
+}
+
+int srtp_unprotect(struct srtp *s, const unsigned char *pkt, int len, unsigned char *out) {
+	unsigned char nonce[SRTP_SALT], tag[SRTP_TAG];
+	struct srtp_ssrc *st, fresh;
+	unsigned short seq;
+	unsigned int roc, ssrc;
+	int h = header(pkt, len - SRTP_TAG), n;
+
+	if (h < 0) return -1;
+	ssrc = pkt[8] << 24 | pkt[9] << 16 | pkt[10] << 8 | pkt[11];
+	if (!(st = find(s, ssrc))) { //a slot only once it's authentic, forged SSRCs mustn't push out the real ones
+		memset(&fresh, 0, sizeof(fresh));
+		st = &fresh;
+	}
+	seq = pkt[2] << 8 | pkt[3];
+	roc = st->roc; //RFC 3711 3.3.1: the ROC that puts the packet closest to the last one
+	if (st->used && st->roc > 0 && st->seq < 0x8000 && seq - st->seq > 0x8000) roc--; //nothing came before ROC 0
+	else if (st->used && st->seq >= 0x8000 && st->seq - 0x8000 > seq) roc++;
+
+	iv(s, pkt, roc, nonce);
+	memcpy(tag, pkt + len - SRTP_TAG, SRTP_TAG);
+	memcpy(out, pkt, h);
+	if (!EVP_DecryptInit_ex(s->ctx, NULL, NULL, NULL, nonce) ||
+		!EVP_DecryptUpdate(s->ctx, NULL, &n, pkt, h) ||
+		!EVP_DecryptUpdate(s->ctx, out + h, &n, pkt + h, len - SRTP_TAG - h) ||
+		!EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_GCM_SET_TAG, SRTP_TAG, tag) ||
+		EVP_DecryptFinal_ex(s->ctx, out + h + n, &n) <= 0) {
+		s->failed++;
+		return -1;
+	}
+	if (st == &fresh) st = claim(s, ssrc);
+	if (!st->used || roc > st->roc || (roc == st->roc && seq > st->seq)) { //only an authentic packet moves it on
+		st->roc = roc;
+		st->seq = seq;
+		st->used = 1;
+	}
+	s->packets++;
+	return len - SRTP_TAG;
+}
+
+void srtp_prove(const unsigned char *secret, int secret_len, const char *label, const unsigned char *client_nonce,
+	const unsigned char *server_nonce, unsigned char *out) {
+	unsigned char msg[64 + 2 * SRTP_NONCE];
+	unsigned int n = SRTP_PROOF;
+	int l = strlen(label) < 64 ? strlen(label) : 64;
+
+	memcpy(msg, label, l);
+	memcpy(msg + l, client_nonce, SRTP_NONCE);
+	memcpy(msg + l + SRTP_NONCE, server_nonce, SRTP_NONCE);
+	HMAC(EVP_sha256(), secret, secret_len, msg, l + 2 * SRTP_NONCE, out, &n);
+}
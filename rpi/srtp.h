@@ -0,0 +1,56 @@
+#ifndef SRTP_H
+#define SRTP_H
+
+#include <openssl/evp.h>
+
+//SRTP with AEAD_AES_128_GCM (RFC 7714), through OpenSSL's EVP so it runs on AES-NI or the ARMv8 crypto
+//extensions where there are some. Session keys come from the master key and salt as in RFC 3711, so any SRTP
+//stack (libsrtp, GStreamer's srtpdec) given the same 28 bytes decrypts it. No SRTCP, no MKI.
+
+#define SRTP_KEY 16
+#define SRTP_SALT 12
+#define SRTP_MASTER (SRTP_KEY + SRTP_SALT)
+#define SRTP_TAG 16 //added to each packet
+#define SRTP_STREAMS 8 //SSRCs tracked at once, the layers and telemetry
+#define SRTP_NONCE 16 //of each side in the handshake
+#define SRTP_PROOF 32 //HMAC-SHA256
+#define SRTP_LABEL_KEY 0 //what srtp_derive() makes
+#define SRTP_LABEL_SALT 2
+
+struct srtp_ssrc {
+	unsigned int ssrc;
+	unsigned int roc; //times the sequence number wrapped
+	unsigned short seq; //highest seen
+	int used;
+};
+
+struct srtp {
+	EVP_CIPHER_CTX *ctx;
+	unsigned char key[SRTP_KEY], salt[SRTP_SALT]; //session ones
+	struct srtp_ssrc streams[SRTP_STREAMS];
+	int next; //stream replaced when a new SSRC comes along and all are used
+	unsigned long packets, failed;
+};
+
+//Session keys from the master key and salt; -1 if the cipher isn't there
+int srtp_init(struct srtp *s, const unsigned char *master);
+//The same with the session key and salt given, as RFC 7714's test vectors do
+int srtp_keys(struct srtp *s, const unsigned char *key, const unsigned char *salt);
+void srtp_free(struct srtp *s);
+
+//A session key or salt (by label) from a master key and salt_len bytes of master salt, RFC 3711 4.3.3 with a
+//key derivation rate of 0; 12 byte salts are padded with zeros, as libsrtp does for RFC 7714. -1 on failure.
+int srtp_derive(const unsigned char *key, const unsigned char *salt, int salt_len, int label, unsigned char *out, int len);
+
+//Encrypts an RTP packet into out, which takes len + SRTP_TAG bytes. Returns the length, -1 if it isn't RTP.
+int srtp_protect(struct srtp *s, const unsigned char *pkt, int len, unsigned char *out);
+//Decrypts and checks an SRTP packet into out, which takes len bytes. Returns the RTP length, -1 if it isn't
+//authentic. Packets replayed aren't detected.
+int srtp_unprotect(struct srtp *s, const unsigned char *pkt, int len, unsigned char *out);
+
+//HMAC-SHA256 of label and both nonces with the shared secret: each side's proof in the handshake, and the
+//master key and salt (the first SRTP_MASTER bytes with label "srtp")
+void srtp_prove(const unsigned char *secret, int secret_len, const char *label, const unsigned char *client_nonce,
+	const unsigned char *server_nonce, unsigned char *out);
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "rtp.h"
+#include "srtp.h"
+
+//Checks the SRTP that viewers who authenticate get: the key derivation against RFC 3711's test vector, a packet
+//against RFC 7714's, then packets through srtp_protect and srtp_unprotect on several SSRCs across sequence number
+//wraps, some arriving out of order, some tampered with. Then times both on packets of the sizes the stream sends.
+
+#define SSRCS 3
+#define PACKETS 60000 //per SSRC, starting close enough to a wrap that each wraps once
+
+static unsigned char *hex(const char *s, int *len) {
+	static unsigned char out[256];
+	int n = 0;
+
+	for (; s[0] && s[1] && n < (int)sizeof(out); s += 2) sscanf(s, "%2hhx", &out[n++]);
+	if (len) *len = n;
+	return out;
+}
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int same(const char *what, const unsigned char *got, const char *want) {
+	int n;
+	unsigned char *w = hex(want, &n);
+
+	if (!memcmp(got, w, n)) return 0;
+	fprintf(stderr, "%s: ", what);
+	for (int i = 0; i < n; i++) fprintf(stderr, "%02x", got[i]);
+	fprintf(stderr, ", should be %s\n", want);
+	return 1;
+}
+
+//RFC 3711 B.3
+static int known_derive() {
+	unsigned char key[SRTP_KEY], salt[14], master_key[SRTP_KEY], master_salt[14];
+	int errors = 0;
+
+	memcpy(master_key, hex("e1f97a0d3e018be0d64fa32c06de4139", NULL), SRTP_KEY);
+	memcpy(master_salt, hex("0ec675ad498afeebb6960b3aabe6", NULL), 14);
+	if (srtp_derive(master_key, master_salt, 14, SRTP_LABEL_KEY, key, SRTP_KEY) < 0 ||
+		srtp_derive(master_key, master_salt, 14, SRTP_LABEL_SALT, salt, 14) < 0) {
+		fprintf(stderr, "srtp_derive failed\n");
+		return 1;
+	}
+	errors += same("Session key", key, "c61e7a93744f39ee10734afe3ff7a087");
+	errors += same("Session salt", salt, "30cbbc08863d8c85d49db34a9ae1");
+	return errors;
+}
+
+//RFC 7714 16.1.1
+static int known_packet() {
+	unsigned char key[SRTP_KEY], salt[SRTP_SALT], pkt[64], out[64 + SRTP_TAG], back[64 + SRTP_TAG];
+	const char *want = "8040f17b8041f8d35501a0b2f24de3a3fb34de6cacba861c9d7e4bcabe633bd50d294e6f42a5f47a51c7d19b36de3adf8833"
+		"899d7f27beb16a9152cf765ee4390cce";
+	struct srtp tx, rx;
+	int len, n, errors = 0;
+
+	memcpy(key, hex("000102030405060708090a0b0c0d0e0f", NULL), SRTP_KEY);
+	memcpy(salt, hex("517569642070726f2071756f", NULL), SRTP_SALT);
+	memcpy(pkt, hex("8040f17b8041f8d35501a0b247616c6c696120657374206f6d6e69732064697669736120696e207061727465732074726573", &len), 50);
+	if (srtp_keys(&tx, key, salt) < 0 || srtp_keys(&rx, key, salt) < 0) {
+		fprintf(stderr, "No AES-GCM\n");
+		return 1;
+	}
+	n = srtp_protect(&tx, pkt, len, out);
+	if (n != len + SRTP_TAG) {
+		fprintf(stderr, "srtp_protect of the RFC 7714 packet: %i bytes, should be %i\n", n, len + SRTP_TAG);
+		errors++;
+	} else errors += same("RFC 7714 packet", out, want);
+	if (srtp_unprotect(&rx, hex(want, &n), n, back) != len || memcmp(back, pkt, len)) {
+		fprintf(stderr, "srtp_unprotect of the RFC 7714 packet failed\n");
+		errors++;
+	}
+	srtp_free(&tx);
+	srtp_free(&rx);
+	return errors;
+}
+
+//The same packet after a wrap, against AES-GCM with the IV laid out by hand: 00 00, SSRC, ROC, sequence number,
+//XOR the salt. The RFC's packets all have a ROC of 0.
+static int known_rollover() {
+	unsigned char key[SRTP_KEY], salt[SRTP_SALT], pkt[64], out[64 + SRTP_TAG], want[64 + SRTP_TAG], nonce[SRTP_SALT];
+	static const unsigned char ivs[SRTP_SALT] = { 0, 0, 0x55, 0x01, 0xa0, 0xb2, 0, 0, 0, 1, 0x00, 0x05 };
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	struct srtp tx;
+	int len, n, errors = 0;
+
+	memcpy(key, hex("000102030405060708090a0b0c0d0e0f", NULL), SRTP_KEY);
+	memcpy(salt, hex("517569642070726f2071756f", NULL), SRTP_SALT);
+	memcpy(pkt, hex("8040f17b8041f8d35501a0b247616c6c696120657374206f6d6e69732064697669736120696e207061727465732074726573", &len), 50);
+	for (int i = 0; i < SRTP_SALT; i++) nonce[i] = ivs[i] ^ salt[i];
+	memcpy(want, pkt, RTP_HDR);
+	want[2] = 0x00;
+	want[3] = 0x05;
+	if (!ctx || srtp_keys(&tx, key, salt) < 0 ||
+		!EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, nonce) ||
+		!EVP_EncryptUpdate(ctx, NULL, &n, want, RTP_HDR) ||
+		!EVP_EncryptUpdate(ctx, want + RTP_HDR, &n, pkt + RTP_HDR, len - RTP_HDR) ||
+		!EVP_EncryptFinal_ex(ctx, want + RTP_HDR + n, &n) ||
+		!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SRTP_TAG, want + len)) {
+		fprintf(stderr, "No AES-GCM\n");
+		EVP_CIPHER_CTX_free(ctx);
+		return 1;
+	}
+	pkt[2] = 0xff; //the last before the wrap
+	pkt[3] = 0xff;
+	srtp_protect(&tx, pkt, len, out);
+	pkt[2] = 0x00;
+	pkt[3] = 0x05;
+	if (srtp_protect(&tx, pkt, len, out) != len + SRTP_TAG || memcmp(out, want, len + SRTP_TAG)) {
+		fprintf(stderr, "srtp_protect after a wrap doesn't match AES-GCM with a ROC of 1\n");
+		errors++;
+	}
+	srtp_free(&tx);
+	EVP_CIPHER_CTX_free(ctx);
+	return errors;
+}
+
+//Half the sequence space ahead of the first packets reads as from before the ROC 0 they came with: it must still be
+//tried with ROC 0, not 0xffffffff
+static int before_start() {
+	unsigned char master[SRTP_MASTER], payload[100], pkt[RTP_MTU], sent[RTP_MTU + SRTP_TAG], out[RTP_MTU + SRTP_TAG];
+	struct rtp_stream r = { 0x4321, 10 };
+	struct srtp tx, rx;
+	int len, errors = 0;
+
+	for (int i = 0; i < SRTP_MASTER; i++) master[i] = rand();
+	memset(payload, 0x5a, sizeof(payload));
+	srtp_init(&tx, master);
+	srtp_init(&rx, master);
+	len = rtp_packet(&r, pkt, RTP_PT, 0, payload, sizeof(payload));
+	srtp_protect(&tx, pkt, len, sent);
+	if (srtp_unprotect(&rx, sent, len + SRTP_TAG, out) != len) errors++;
+	r.seq = 10 + 0x9000;
+	len = rtp_packet(&r, pkt, RTP_PT, 0, payload, sizeof(payload));
+	srtp_protect(&tx, pkt, len, sent);
+	if (srtp_unprotect(&rx, sent, len + SRTP_TAG, out) != len || rx.streams[0].roc != 0) {
+		fprintf(stderr, "A packet 0x9000 ahead at ROC 0 didn't come back, ROC %u\n", rx.streams[0].roc);
+		errors++;
+	}
+	srtp_free(&tx);
+	srtp_free(&rx);
+	return errors;
+}
+
+//Protected packets of SSRCS streams, two at a time from each in turn; now and then, and across each wrap,
+//the two arrive the other way round
+static int round_trip() {
+	unsigned char master[SRTP_MASTER], payload[RTP_MTU], pkt[2][RTP_MTU], sent[2][RTP_MTU + SRTP_TAG];
+	unsigned char bad[RTP_MTU + SRTP_TAG], out[RTP_MTU + SRTP_TAG];
+	struct rtp_stream r[SSRCS];
+	struct srtp tx, rx;
+	int len[2], n, errors = 0, tampered = 0, order;
+
+	for (int i = 0; i < SRTP_MASTER; i++) master[i] = rand();
+	if (srtp_init(&tx, master) < 0 || srtp_init(&rx, master) < 0) {
+		fprintf(stderr, "No AES-GCM\n");
+		return 1;
+	}
+	for (int s = 0; s < SSRCS; s++) {
+		r[s].ssrc = 0x1000 * (s + 1);
+		r[s].seq = 65536 - 1000 * (s + 1);
+	}
+	for (int i = 0; i < PACKETS * SSRCS; i += 2) {
+		for (int k = 0; k < 2; k++) {
+			int size = rand() % (RTP_MTU - RTP_HDR) + 1;
+			for (int j = 0; j < size; j++) payload[j] = rand();
+			len[k] = rtp_packet(&r[i / 2 % SSRCS], pkt[k], RTP_PT, i, payload, size);
+			if (srtp_protect(&tx, pkt[k], len[k], sent[k]) != len[k] + SRTP_TAG) errors++;
+		}
+		order = i % 100 == 0 || (pkt[0][2] == 0xff && pkt[0][3] == 0xff);
+		for (int k = 0; k < 2; k++) {
+			int m = order ? 1 - k : k;
+			if (i % 1000 == 0) { //a bit flipped anywhere must fail, and not move the stream on
+				memcpy(bad, sent[m], len[m] + SRTP_TAG);
+				bad[rand() % (len[m] + SRTP_TAG)] ^= 1 << rand() % 8;
+				if (srtp_unprotect(&rx, bad, len[m] + SRTP_TAG, out) >= 0) errors++;
+				tampered++;
+			}
+			n = srtp_unprotect(&rx, sent[m], len[m] + SRTP_TAG, out);
+			if (n != len[m] || memcmp(out, pkt[m], n)) {
+				if (errors++ < 10) fprintf(stderr, "Packet %i didn't come back\n", i + m);
+			}
+		}
+	}
+	for (int s = 0; s < SSRCS; s++)
+		if (tx.streams[s].roc != 1 || rx.streams[s].roc != 1) {
+			fprintf(stderr, "SSRC %x: rollover counters %u and %u, should be 1\n", tx.streams[s].ssrc, tx.streams[s].roc, rx.streams[s].roc);
+			errors++;
+		}
+	printf("Round trip of %i packets on %i SSRCs across a wrap, %i tampered with: %i errors\n", PACKETS * SSRCS, SSRCS, tampered, errors);
+	srtp_free(&tx);
+	srtp_free(&rx);
+	return errors;
+}
+
+static int check() {
+	int errors = known_derive() + known_packet() + known_rollover() + before_start();
+
+	printf("RFC 3711 key derivation, RFC 7714 packet, the same after a wrap and before ROC 0: %i errors\n", errors);
+	return errors + round_trip();
+}
+
+static void bench(int packets) {
+	static const int sizes[] = { 100, 500, 1200, RTP_MTU };
+	unsigned char master[SRTP_MASTER], payload[RTP_MTU], pkt[RTP_MTU], sent[RTP_MTU + SRTP_TAG], out[RTP_MTU + SRTP_TAG];
+	struct rtp_stream r = { 0x1234, 0 };
+	struct srtp tx, rx;
+	double t, u;
+	int len;
+
+	for (int i = 0; i < SRTP_MASTER; i++) master[i] = rand();
+	for (int i = 0; i < RTP_MTU; i++) payload[i] = rand();
+	srtp_init(&tx, master);
+	srtp_init(&rx, master);
+	for (int s = 0; s < 4; s++) {
+		len = rtp_packet(&r, pkt, RTP_PT, 0, payload, sizes[s] - RTP_HDR);
+		t = now();
+		for (int i = 0; i < packets; i++) {
+			pkt[2] = i >> 8; //its own nonce each time
+			pkt[3] = i;
+			srtp_protect(&tx, pkt, len, sent);
+		}
+		t = now() - t;
+		u = now();
+		for (int i = 0; i < packets; i++) srtp_unprotect(&rx, sent, len + SRTP_TAG, out);
+		u = now() - u;
+		printf("%4i byte packets: srtp_protect %.2f us (%.0f MB/s), srtp_unprotect %.2f us (%.0f MB/s)\n",
+			len, t / packets * 1e6, (double)len * packets / t / 1e6, u / packets * 1e6, (double)len * packets / u / 1e6);
+	}
+	srtp_free(&tx);
+	srtp_free(&rx);
+}
+
+void print_usage() {
+	printf("srtp_bench [options]\n");
+	printf("-c only check the results, don't time anything\n");
+	printf("-n [packets] of each size timed (defaults to 200000)\n");
+}
+
+int main(int argc, char **argv) {
+	int option, check_only = 0, packets = 200000;
+
+	while ((option = getopt(argc, argv, "cn:")) != -1) {
+		switch (option) {
+			case 'c': check_only = 1; break;
+			case 'n': packets = atoi(optarg); break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (packets < 1) {
+		print_usage();
+		return 1;
+	}
+	srand(1);
+	if (check()) return 1;
+	if (check_only) return 0;
+	bench(packets);
+	return 0;
+}
@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cap.h"
+#include "rt.h"
+
+//Records the UDP packets a client gets, with their arrival times, and plays them back to a client at the same
+//timing, scaled, or as fast as it goes: client benchmarks without a Pi or Wi-Fi in the loop.
+
+#define SPIN_US 200 //the last of each wait is spun, sleeps wake up that late
+
+volatile sig_atomic_t stop = 0;
+
+void print_usage() {
+	printf("stream_cap [options]\n");
+	printf("recording:\n");
+	printf("-o [file] write the packets to the capture file\n");
+	printf("-p [port] receive on that UDP port, up to %i of them (default 8888)\n", CAP_FLOWS);
+	printf("-c [pi]:[port] ask camera_server there for the stream, to the first port, instead of waiting for one\n");
+	printf("-l [layer] the layer asked for with -c (default 0)\n");
+	printf("-n [seconds] stop after that long (defaults to running until interrupted)\n");
+	printf("replay:\n");
+	printf("-r [file] send the packets of the capture file\n");
+	printf("-d [host]:[port] to that address, the first flow to the port and the others as far from it as they were (default 127.0.0.1:8888)\n");
+	printf("-s [speed] 1 is the recorded timing, 2 twice as fast, 0 as fast as it goes (default 1)\n");
+	printf("-L [times] play it that often, 0 until interrupted (default 1)\n");
+	printf("-P [policy]:[priority][:cpus] scheduling while replaying, e.g. fifo:50:3\n");
+}
+
+void onSignal(int sig) {
+	stop = 1;
+}
+
+unsigned long long monotonicUs() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+int parseAddr(const char *arg, struct sockaddr_in *a) {
+	char host[256];
+	int port;
+	struct hostent *h;
+
+	if (sscanf(arg, "%255[^:]:%i", host, &port) != 2 || port <= 0 || port > 65535) return -1;
+	h = gethostbyname(host);
+	if (!h) return -1;
+	memset(a, 0, sizeof(*a));
+	a->sin_family = AF_INET;
+	memcpy(&a->sin_addr, h->h_addr, 4);
+	a->sin_port = htons(port);
+	return 0;
+}
+
+//MSG_START with our address on the connection, as the app does
+int startStream(struct sockaddr_in *pi, int port, int layer) {
+	struct sockaddr_in me;
+	socklen_t len = sizeof(me);
+	unsigned char msg[15] = { 0, 0, 0, 15, 0 };
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *)pi, sizeof(*pi)) < 0 || getsockname(fd, (struct sockaddr *)&me, &len) < 0) {
+		perror("camera_server");
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	memcpy(msg + 5, &me.sin_addr, 4);
+	msg[9] = port >> 24;
+	msg[10] = port >> 16;
+	msg[11] = port >> 8;
+	msg[12] = port;
+	msg[13] = layer;
+	msg[14] = 0; //UDP
+	if (write(fd, msg, sizeof(msg)) != sizeof(msg)) {
+		perror("camera_server");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void sendControl(int fd, int type) {
+	unsigned char msg[5] = { 0, 0, 0, 5, (unsigned char)type };
+	if (write(fd, msg, sizeof(msg)) != sizeof(msg)) perror("camera_server");
+}
+
+//Arrival times are the kernel's, so a busy recorder doesn't smear them
+int record(const char *path, unsigned short *ports, int flows, const char *server, int layer, int seconds) {
+	struct cap c;
+	struct pollfd fds[CAP_FLOWS + 1];
+	struct sockaddr_in a;
+	unsigned char buf[CAP_MAX], ctl[CMSG_SPACE(sizeof(struct timespec))], drain[4096];
+	unsigned long long t_us, start = monotonicUs(), last = start, now;
+	unsigned long packets[CAP_FLOWS] = { 0 }, bytes = 0, gaps[CAP_FLOWS] = { 0 };
+	int seq[CAP_FLOWS], control = -1, one = 1, big = 4 * 1024 * 1024, n;
+
+	for (int i = 0; i < flows; i++) {
+		seq[i] = -1;
+		fds[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+		fds[i].events = POLLIN;
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_port = htons(ports[i]);
+		setsockopt(fds[i].fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+		setsockopt(fds[i].fd, SOL_SOCKET, SO_RCVBUF, &big, sizeof(big)); //a frame's burst waits while we write
+		if (bind(fds[i].fd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+			perror("bind");
+			return 1;
+		}
+	}
+	if (cap_create(&c, path, ports, flows) < 0) return 1;
+	if (server) {
+		if (parseAddr(server, &a) < 0) {
+			fprintf(stderr, "Bad address %s\n", server);
+			return 1;
+		}
+		if ((control = startStream(&a, ports[0], layer)) < 0) return 1;
+		fds[flows].fd = control;
+		fds[flows].events = POLLIN;
+	}
+
+	while (!stop) {
+		if (poll(fds, flows + (control >= 0), 100) < 0) continue; //interrupted
+		for (int i = 0; i < flows; i++) {
+			struct iovec iov = { buf, sizeof(buf) };
+			struct msghdr m;
+			struct cmsghdr *cm;
+
+			if (!(fds[i].revents & POLLIN)) continue;
+			memset(&m, 0, sizeof(m));
+			m.msg_iov = &iov;
+			m.msg_iovlen = 1;
+			m.msg_control = ctl;
+			m.msg_controllen = sizeof(ctl);
+			n = recvmsg(fds[i].fd, &m, 0);
+			if (n < 0) continue;
+			t_us = 0;
+			for (cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm))
+				if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPNS) {
+					struct timespec ts;
+					memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+					t_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+				}
+			if (!t_us) { //no kernel stamp
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				t_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+			}
+			if (cap_write(&c, t_us, i, buf, n) < 0) {
+				perror(path);
+				stop = 1;
+			}
+			if (n >= 12 && (buf[0] & 0xc0) == 0x80) { //RTP: sequence gaps are packets the recording misses
+				int s = buf[2] << 8 | buf[3];
+				if (seq[i] >= 0 && s != ((seq[i] + 1) & 0xffff)) gaps[i]++;
+				seq[i] = s;
+			}
+			packets[i]++;
+			bytes += n;
+		}
+		if (control >= 0 && (fds[flows].revents & POLLIN)) { //replies aren't recorded
+			if (read(control, drain, sizeof(drain)) <= 0) {
+				fprintf(stderr, "camera_server closed the connection\n");
+				stop = 1;
+			}
+		}
+
+		now = monotonicUs();
+		if (now - last >= 1000000) {
+			printf("%lu packets so far", c.packets);
+			for (int i = 0; i < flows; i++) printf(", port %i: %lu (%lu RTP gaps)", ports[i], packets[i], gaps[i]);
+			printf(", %.0f KB\n", bytes / 1024.0);
+			fflush(stdout);
+			memset(packets, 0, sizeof(packets));
+			memset(gaps, 0, sizeof(gaps));
+			bytes = 0;
+			if (control >= 0) sendControl(control, 7); //MSG_PING, or the server drops us
+			last = now;
+		}
+		if (seconds && now - start >= seconds * 1000000ULL) break;
+	}
+	if (control >= 0) {
+		sendControl(control, 1); //MSG_STOP
+		close(control);
+	}
+	printf("Recorded %lu packets, %.1f s\n", c.packets, (c.last_us - c.first_us) / 1000000.0);
+	cap_close(&c);
+	return 0;
+}
+
+//Each packet is sent when it's due from the start, so a late one doesn't push back the rest
+int replay(const char *path, const char *dest, double speed, int loops, struct rt_sched *sched) {
+	struct cap c;
+	struct sockaddr_in a, to;
+	struct timespec due;
+	unsigned char buf[CAP_MAX];
+	unsigned long long t_us, start, at, now, last, late, late_sum = 0, late_max = 0;
+	unsigned long sent = 0, bytes = 0, total = 0, failed = 0;
+	int fd, flow, n, loop = 0;
+
+	if (parseAddr(dest, &a) < 0) {
+		fprintf(stderr, "Bad address %s\n", dest);
+		return 1;
+	}
+	if (cap_open(&c, path) < 0) return 1;
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rt_apply(sched, 0, 0) < 0) return 1;
+	prctl(PR_SET_TIMERSLACK, 1); //wake up on time, not when it suits the kernel
+
+	start = last = monotonicUs();
+	while (!stop) {
+		n = cap_read(&c, &t_us, &flow, buf);
+		if (n <= 0) {
+			if (n < 0) fprintf(stderr, "%s is cut short\n", path);
+			if (++loop == loops || n < 0 || !c.packets) break;
+			start += speed > 0 ? (unsigned long long)(c.t_us / speed) : 0; //the next round starts where this one ended
+			cap_rewind(&c);
+			continue;
+		}
+		now = monotonicUs();
+		if (speed > 0) {
+			at = start + (unsigned long long)(t_us / speed);
+			if (at > now + SPIN_US) {
+				due.tv_sec = (at - SPIN_US) / 1000000;
+				due.tv_nsec = (at - SPIN_US) % 1000000 * 1000;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) && !stop);
+			}
+			while ((now = monotonicUs()) < at);
+			late = now - at;
+			late_sum += late;
+			if (late > late_max) late_max = late;
+		}
+		to = a;
+		to.sin_port = htons(ntohs(a.sin_port) + c.ports[flow] - c.ports[0]);
+		if (sendto(fd, buf, n, 0, (struct sockaddr *)&to, sizeof(to)) == n) {
+			sent++;
+			bytes += n;
+		} else failed++;
+		total++;
+
+		if (now - last >= 1000000) {
+			printf("%lu packets, %.0f KB", sent, bytes / 1024.0);
+			if (speed > 0) printf(", %.1f us late on average, %llu at most", sent ? (double)late_sum / sent : 0, late_max);
+			printf(", %lu failed\n", failed);
+			fflush(stdout);
+			sent = bytes = failed = 0;
+			late_sum = late_max = 0;
+			last = now;
+		}
+	}
+	now = monotonicUs();
+	printf("Replayed %lu packets in %.2f s\n", total, (now - start) / 1000000.0);
+	cap_close(&c);
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct rt_sched sched;
+	const char *out = NULL, *in = NULL, *server = NULL, *dest = "127.0.0.1:8888";
+	unsigned short ports[CAP_FLOWS];
+	int option, flows = 0, layer = 0, seconds = 0, loops = 1;
+	double speed = 1;
+
+	memset(&sched, 0, sizeof(sched));
+	while ((option = getopt(argc, argv, "o:p:c:l:n:r:d:s:L:P:")) != -1) {
+		switch (option) {
+			case 'o': out = optarg; break;
+			case 'p':
+				if (flows == CAP_FLOWS || atoi(optarg) <= 0 || atoi(optarg) > 65535) {
+					print_usage();
+					return 1;
+				}
+				ports[flows++] = atoi(optarg);
+				break;
+			case 'c': server = optarg; break;
+			case 'l': layer = atoi(optarg); break;
+			case 'n': seconds = atoi(optarg); break;
+			case 'r': in = optarg; break;
+			case 'd': dest = optarg; break;
+			case 's': speed = atof(optarg); break;
+			case 'L': loops = atoi(optarg); break;
+			case 'P':
+				if (rt_parse(&sched, optarg) < 0) {
+					fprintf(stderr, "Bad scheduling %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if (!out == !in || speed < 0) {
+		print_usage();
+		return 1;
+	}
+	if (!flows) ports[flows++] = 8888;
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	signal(SIGPIPE, SIG_IGN);
+	if (out) return record(out, ports, flows, server, layer, seconds);
+	return replay(in, dest, speed, loops, &sched);
+}
@@ -0,0 +1,135 @@
+#include <string.h>
+
+#include "ts.h"
+
+#define PID_PMT 0x1000
+#define PID_VIDEO 0x100
+#define STREAM_H264 0x1b
+#define PCR_DELAY 9000 //PCR runs 100ms behind the PTS, the decoder's buffering
+#define TS_MASK ((1ULL << 33) - 1)
+
+//pes header, PTS only, and an access unit delimiter (required in front of every H.264 access unit in TS)
+#define PES_HDR 14
+#define AUD_SIZE 6
+static const unsigned char aud[AUD_SIZE] = { 0, 0, 0, 1, 9, 0xf0 };
+
+static unsigned int crc32(const unsigned char *b, int len) {
+	unsigned int crc = 0xffffffff;
+	while (len--) {
+		crc ^= (unsigned int)*b++ << 24;
+		for (int i = 0; i < 8; i++) crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+void ts_init(struct ts *t) {
+	memset(t, 0, sizeof(*t));
+}
+
+static int header(unsigned char *p, int pid, int start, int adaptation, unsigned char *cc) {
+	p[0] = 0x47;
+	p[1] = (start ? 0x40 : 0) | (pid >> 8);
+	p[2] = pid & 0xff;
+	p[3] = (adaptation ? 0x30 : 0x10) | (*cc & 0x0f);
+	*cc = (*cc + 1) & 0x0f;
+	return 4;
+}
+
+static void section(unsigned char *p, const unsigned char *s, int len) {
+	unsigned int crc = crc32(s, len);
+	p[4] = 0; //pointer_field
+	memcpy(p + 5, s, len);
+	p[5 + len] = crc >> 24;
+	p[6 + len] = crc >> 16;
+	p[7 + len] = crc >> 8;
+	p[8 + len] = crc;
+	memset(p + 9 + len, 0xff, TS_PACKET - 9 - len);
+}
+
+int ts_tables(struct ts *t, unsigned char *out) {
+	static const unsigned char pat[] = {
+		0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00, //table 0, section length, ts id 1, version 0
+		0x00, 0x01, 0xe0 | (PID_PMT >> 8), PID_PMT & 0xff, //program 1
+	};
+	static const unsigned char pmt[] = {
+		0x02, 0xb0, 18, 0x00, 0x01, 0xc1, 0x00, 0x00, //table 2, section length, program 1, version 0
+		0xe0 | (PID_VIDEO >> 8), PID_VIDEO & 0xff, 0xf0, 0x00, //PCR pid, no program info
+		STREAM_H264, 0xe0 | (PID_VIDEO >> 8), PID_VIDEO & 0xff, 0xf0, 0x00,
+	};
+
+	header(out, 0, 1, 0, &t->cc_pat);
+	section(out, pat, sizeof(pat));
+	header(out + TS_PACKET, PID_PMT, 1, 0, &t->cc_pmt);
+	section(out + TS_PACKET, pmt, sizeof(pmt));
+	return TS_TABLES;
+}
+
+int ts_au_size(int len) {
+	return ((PES_HDR + AUD_SIZE + len) / 176 + 1) * TS_PACKET; //first packet carries 8 bytes of PCR
+}
+
+static void put_pts(unsigned char *p, unsigned long long pts) {
+	p[0] = 0x21 | ((pts >> 29) & 0x0e);
+	p[1] = pts >> 22;
+	p[2] = ((pts >> 14) & 0xfe) | 1;
+	p[3] = pts >> 7;
+	p[4] = ((pts << 1) & 0xfe) | 1;
+}
+
+static void put_pcr(unsigned char *p, unsigned long long pcr) {
+	p[0] = pcr >> 25;
+	p[1] = pcr >> 17;
+	p[2] = pcr >> 9;
+	p[3] = pcr >> 1;
+	p[4] = ((pcr & 1) << 7) | 0x7e;
+	p[5] = 0; //extension
+}
+
+int ts_au(struct ts *t, unsigned char *out, const unsigned char *au, int len, unsigned long long pts, int key) {
+	unsigned char pes[PES_HDR + AUD_SIZE] = { 0, 0, 1, 0xe0, 0, 0, 0x80, 0x80, 5 }; //unbounded length, PTS only
+	int pes_len = sizeof(pes), pes_pos = 0, au_pos = 0;
+	int n = 0, first = 1;
+
+	pts &= TS_MASK;
+	put_pts(pes + 9, pts);
+	memcpy(pes + PES_HDR, aud, AUD_SIZE);
+
+	while (pes_pos < pes_len || au_pos < len) {
+		unsigned char *p = out + n;
+		int left = pes_len - pes_pos + len - au_pos;
+		int af = first ? 8 : 0; //adaptation field: length, flags, PCR
+		int room = 184 - af;
+		int stuffing = left < room ? room - left : 0;
+		int i = header(p, PID_VIDEO, first, af || stuffing, &t->cc_video);
+
+		if (af || stuffing) {
+			int af_len = af + stuffing; //including its length byte
+			p[i++] = af_len - 1;
+			if (af_len > 1) {
+				p[i++] = first ? 0x10 | (key ? 0x40 : 0) : 0; //PCR, random access
+				if (first) {
+					put_pcr(p + i, (pts - PCR_DELAY) & TS_MASK);
+					i += 6;
+				}
+				memset(p + i, 0xff, af_len - (first ? 8 : 2));
+				i += af_len - (first ? 8 : 2);
+			}
+		}
+		while (i < TS_PACKET) {
+			int chunk;
+			if (pes_pos < pes_len) {
+				chunk = pes_len - pes_pos < TS_PACKET - i ? pes_len - pes_pos : TS_PACKET - i;
+				memcpy(p + i, pes + pes_pos, chunk);
+				pes_pos += chunk;
+			} else {
+				chunk = len - au_pos < TS_PACKET - i ? len - au_pos : TS_PACKET - i;
+				memcpy(p + i, au + au_pos, chunk);
+				au_pos += chunk;
+			}
+			i += chunk;
+		}
+		n += TS_PACKET;
+		first = 0;
+	}
+	return n;
+}
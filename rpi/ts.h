@@ -0,0 +1,24 @@
+#ifndef TS_H
+#define TS_H
+
+#define TS_PACKET 188
+#define TS_TABLES (2 * TS_PACKET) //PAT and PMT
+
+//Minimal MPEG-TS muxer: one program with one H.264 stream, an access unit per PES packet
+struct ts {
+	unsigned char cc_pat, cc_pmt, cc_video; //continuity counters
+};
+
+void ts_init(struct ts *t);
+
+//Writes PAT and PMT into out (TS_TABLES bytes), returns the length
+int ts_tables(struct ts *t, unsigned char *out);
+
+//Most bytes ts_au() writes for an access unit of len bytes
+int ts_au_size(int len);
+
+//Writes an access unit (start-coded NALs) as TS packets into out, returns the length.
+//pts is in 90 kHz units; key marks IDRs and recovery points as random access points.
+int ts_au(struct ts *t, unsigned char *out, const unsigned char *au, int len, unsigned long long pts, int key);
+
+#endif
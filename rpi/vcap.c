@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "vcap.h"
+
+#define RAW_TYPE V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE //encoder side the raw frames go in
+#define CODED_TYPE V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE //and the H.264 comes out
+
+static int xioctl(int fd, unsigned long req, void *arg) {
+	int ret;
+	do ret = ioctl(fd, req, arg);
+	while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static int fail(const char *what, const char *dev) {
+	fprintf(stderr, "%s: %s: %s\n", dev, what, strerror(errno));
+	return -1;
+}
+
+//Best effort, encoders differ in what they support
+static void set_ctrl(int fd, unsigned int id, int value) {
+	struct v4l2_control ctrl;
+	ctrl.id = id;
+	ctrl.value = value;
+	xioctl(fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+static void set_fps(int fd, unsigned int type, int fps) {
+	struct v4l2_streamparm parm;
+	memset(&parm, 0, sizeof(parm));
+	parm.type = type;
+	parm.parm.capture.timeperframe.numerator = 1; //same place for output
+	parm.parm.capture.timeperframe.denominator = fps;
+	xioctl(fd, VIDIOC_S_PARM, &parm);
+}
+
+static int open_device(const char *dev, unsigned int caps) {
+	struct v4l2_capability cap;
+	int fd = open(dev, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) return fail("open", dev);
+	if (xioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		close(fd);
+		return fail("VIDIOC_QUERYCAP", dev);
+	}
+	if (cap.capabilities & V4L2_CAP_DEVICE_CAPS) cap.capabilities = cap.device_caps;
+	if ((cap.capabilities & caps) != caps) {
+		fprintf(stderr, "%s: not a %s streaming device\n", dev, caps & V4L2_CAP_VIDEO_M2M_MPLANE ? "memory-to-memory" : "capture");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//The camera: H.264 if nothing encodes after it, else the raw format it prefers near YUV420
+static int setup_capture(struct vcap *c, const char *dev, int fps) {
+	struct v4l2_format fmt;
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer b;
+	struct v4l2_exportbuffer exp;
+	int i;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = c->width;
+	fmt.fmt.pix.height = c->height;
+	fmt.fmt.pix.pixelformat = c->enc < 0 ? V4L2_PIX_FMT_H264 : V4L2_PIX_FMT_YUV420;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (xioctl(c->fd, VIDIOC_S_FMT, &fmt) < 0) return fail("VIDIOC_S_FMT", dev);
+	if (c->enc < 0 && fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_H264) {
+		fprintf(stderr, "%s: doesn't give H.264, it needs an encoder (-E)\n", dev);
+		return -1;
+	}
+	c->format = fmt.fmt.pix.pixelformat;
+	c->width = fmt.fmt.pix.width;
+	c->height = fmt.fmt.pix.height;
+	c->stride = fmt.fmt.pix.bytesperline;
+	set_fps(c->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, fps);
+
+	memset(&req, 0, sizeof(req));
+	req.count = VCAP_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(c->fd, VIDIOC_REQBUFS, &req) < 0) return fail("VIDIOC_REQBUFS", dev);
+	c->ncap = req.count < VCAP_BUFFERS ? req.count : VCAP_BUFFERS;
+	for (i = 0; i < c->ncap; i++) {
+		memset(&b, 0, sizeof(b));
+		b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		b.memory = V4L2_MEMORY_MMAP;
+		b.index = i;
+		if (xioctl(c->fd, VIDIOC_QUERYBUF, &b) < 0) return fail("VIDIOC_QUERYBUF", dev);
+		c->cap[i].length = b.length;
+		c->monotonic = (b.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		if (c->enc >= 0) { //handed on as it is, the gate only looks at a few rows
+			memset(&exp, 0, sizeof(exp));
+			exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			exp.index = i;
+			exp.flags = O_RDONLY | O_CLOEXEC;
+			if (xioctl(c->fd, VIDIOC_EXPBUF, &exp) < 0) return fail("VIDIOC_EXPBUF", dev);
+			c->cap[i].dmabuf = exp.fd;
+		}
+		c->cap[i].start = (unsigned char *)mmap(NULL, b.length, PROT_READ, MAP_SHARED, c->fd, b.m.offset);
+		if (c->cap[i].start == MAP_FAILED) {
+			c->cap[i].start = NULL;
+			return fail("mmap", dev);
+		}
+		if (xioctl(c->fd, VIDIOC_QBUF, &b) < 0) return fail("VIDIOC_QBUF", dev);
+	}
+	return 0;
+}
+
+static int setup_encoder(struct vcap *c, const char *dev, int fps, int bitrate, int gop, int slices, unsigned int bytesperline, unsigned int sizeimage) {
+	struct v4l2_format fmt;
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer b;
+	struct v4l2_plane plane;
+	int i;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = RAW_TYPE;
+	fmt.fmt.pix_mp.width = c->width;
+	fmt.fmt.pix_mp.height = c->height;
+	fmt.fmt.pix_mp.pixelformat = c->format;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = bytesperline;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = sizeimage;
+	if (xioctl(c->enc, VIDIOC_S_FMT, &fmt) < 0) return fail("VIDIOC_S_FMT", dev);
+	if (fmt.fmt.pix_mp.pixelformat != c->format || fmt.fmt.pix_mp.plane_fmt[0].bytesperline != bytesperline) {
+		fprintf(stderr, "%s: can't take the camera's frames as they are\n", dev); //the DMABUFs would need converting
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = CODED_TYPE;
+	fmt.fmt.pix_mp.width = c->width;
+	fmt.fmt.pix_mp.height = c->height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = VCAP_CODED_SIZE;
+	if (xioctl(c->enc, VIDIOC_S_FMT, &fmt) < 0) return fail("VIDIOC_S_FMT", dev);
+
+	set_fps(c->enc, RAW_TYPE, fps);
+	set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_BITRATE, bitrate);
+	set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, gop);
+	set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1); //SPS/PPS with every IDR, what -ih does for raspivid
+	if (slices > 1) {
+		set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB);
+		set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, ((c->width + 15) / 16) * ((c->height + 15) / 16) / slices);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.count = c->ncap;
+	req.type = RAW_TYPE;
+	req.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(c->enc, VIDIOC_REQBUFS, &req) < 0) return fail("VIDIOC_REQBUFS", dev);
+	if ((int)req.count < c->ncap) {
+		fprintf(stderr, "%s: takes only %u frames at once\n", dev, req.count);
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.count = VCAP_BUFFERS;
+	req.type = CODED_TYPE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(c->enc, VIDIOC_REQBUFS, &req) < 0) return fail("VIDIOC_REQBUFS", dev);
+	c->ncoded = req.count < VCAP_BUFFERS ? req.count : VCAP_BUFFERS;
+	for (i = 0; i < c->ncoded; i++) {
+		memset(&b, 0, sizeof(b));
+		memset(&plane, 0, sizeof(plane));
+		b.type = CODED_TYPE;
+		b.memory = V4L2_MEMORY_MMAP;
+		b.index = i;
+		b.m.planes = &plane;
+		b.length = 1;
+		if (xioctl(c->enc, VIDIOC_QUERYBUF, &b) < 0) return fail("VIDIOC_QUERYBUF", dev);
+		c->coded[i].length = plane.length;
+		c->coded[i].start = (unsigned char *)mmap(NULL, plane.length, PROT_READ, MAP_SHARED, c->enc, plane.m.mem_offset);
+		if (c->coded[i].start == MAP_FAILED) {
+			c->coded[i].start = NULL;
+			return fail("mmap", dev);
+		}
+		if (xioctl(c->enc, VIDIOC_QBUF, &b) < 0) return fail("VIDIOC_QBUF", dev);
+	}
+	return 0;
+}
+
+static int stream(int fd, unsigned int type, int on) {
+	return xioctl(fd, on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
+}
+
+int vcap_open(struct vcap *c, const char *dev, const char *enc, int width, int height, int fps, int bitrate, int gop, int slices) {
+	struct v4l2_format fmt;
+
+	memset(c, 0, sizeof(*c));
+	c->enc = -1;
+	c->width = width;
+	c->height = height;
+	for (int i = 0; i < VCAP_BUFFERS; i++) c->cap[i].dmabuf = c->coded[i].dmabuf = -1;
+
+	c->fd = open_device(dev, V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING);
+	if (c->fd < 0) return -1;
+	if (enc && (c->enc = open_device(enc, V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING)) < 0) goto fail;
+	if (setup_capture(c, dev, fps) < 0) goto fail;
+	if (c->enc >= 0) {
+		memset(&fmt, 0, sizeof(fmt));
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (xioctl(c->fd, VIDIOC_G_FMT, &fmt) < 0) {
+			fail("VIDIOC_G_FMT", dev);
+			goto fail;
+		}
+		if (setup_encoder(c, enc, fps, bitrate, gop, slices, fmt.fmt.pix.bytesperline, fmt.fmt.pix.sizeimage) < 0) goto fail;
+		if (stream(c->enc, RAW_TYPE, 1) < 0 || stream(c->enc, CODED_TYPE, 1) < 0) {
+			fail("VIDIOC_STREAMON", enc);
+			goto fail;
+		}
+	}
+	if (stream(c->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, 1) < 0) {
+		fail("VIDIOC_STREAMON", dev);
+		goto fail;
+	}
+	return 0;
+fail:
+	vcap_close(c);
+	return -1;
+}
+
+void vcap_close(struct vcap *c) {
+	int i;
+
+	stream(c->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, 0);
+	if (c->enc >= 0) {
+		stream(c->enc, RAW_TYPE, 0);
+		stream(c->enc, CODED_TYPE, 0);
+	}
+	for (i = 0; i < VCAP_BUFFERS; i++) {
+		if (c->cap[i].start) munmap(c->cap[i].start, c->cap[i].length);
+		if (c->cap[i].dmabuf >= 0) close(c->cap[i].dmabuf);
+		if (c->coded[i].start) munmap(c->coded[i].start, c->coded[i].length);
+		c->cap[i].start = c->coded[i].start = NULL;
+		c->cap[i].dmabuf = -1;
+	}
+	if (c->enc >= 0) close(c->enc);
+	close(c->fd);
+	c->fd = c->enc = -1;
+}
+
+void vcap_set_bitrate(struct vcap *c, int bitrate) {
+	if (c->enc >= 0) set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_BITRATE, bitrate);
+}
+
+void vcap_force_keyframe(struct vcap *c) {
+	if (c->enc >= 0) set_ctrl(c->enc, V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1);
+}
+
+void vcap_fds(struct vcap *c, fd_set *readfds, fd_set *writefds, int *max_fd) {
+	FD_SET(c->fd, readfds);
+	if (c->fd > *max_fd) *max_fd = c->fd;
+	if (c->enc < 0) return;
+	FD_SET(c->enc, readfds); //coded frames
+	if (c->encoding) FD_SET(c->enc, writefds); //raw frames done with; polling an empty queue is an error
+	if (c->enc > *max_fd) *max_fd = c->enc;
+}
+
+//Dequeues a buffer, returns 0 if none is ready
+static int dequeue(int fd, struct v4l2_buffer *b, unsigned int type, unsigned int memory, struct v4l2_plane *plane) {
+	memset(b, 0, sizeof(*b));
+	b->type = type;
+	b->memory = memory;
+	if (plane) {
+		memset(plane, 0, sizeof(*plane));
+		b->m.planes = plane;
+		b->length = 1;
+	}
+	if (xioctl(fd, VIDIOC_DQBUF, b) == 0) return 1;
+	return errno == EAGAIN ? 0 : -1;
+}
+
+//The luma plane comes first
+static int planar(unsigned int format) {
+	return format == V4L2_PIX_FMT_YUV420 || format == V4L2_PIX_FMT_YVU420 || format == V4L2_PIX_FMT_NV12 || format == V4L2_PIX_FMT_NV21;
+}
+
+static void tap_frame(struct vcap *c, const unsigned char *frame) {
+	const unsigned char *y = frame, *chroma = frame + c->stride * c->height;
+	int cplane = c->stride / 2 * c->height / 2;
+	void (*tap)(const unsigned char *, const unsigned char *, const unsigned char *, int, int, int, void *) = c->tap;
+
+	c->tap = NULL;
+	if (c->format == V4L2_PIX_FMT_YUV420) tap(y, chroma, chroma + cplane, c->stride, c->stride / 2, 1, c->tap_arg);
+	else if (c->format == V4L2_PIX_FMT_YVU420) tap(y, chroma + cplane, chroma, c->stride, c->stride / 2, 1, c->tap_arg);
+	else if (c->format == V4L2_PIX_FMT_NV12) tap(y, chroma, chroma + 1, c->stride, c->stride, 2, c->tap_arg);
+	else tap(y, chroma + 1, chroma, c->stride, c->stride, 2, c->tap_arg);
+}
+
+int vcap_handle(struct vcap *c, nal_cb cb, void *arg) {
+	struct v4l2_buffer b, q;
+	struct v4l2_plane plane, qplane;
+	int ret;
+
+	if (c->enc < 0) { //the camera's own H.264
+		while ((ret = dequeue(c->fd, &b, V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_MEMORY_MMAP, NULL)) > 0) {
+			if (!(b.flags & V4L2_BUF_FLAG_ERROR)) {
+				c->stamp = b.timestamp;
+				h264_split(c->cap[b.index].start, b.bytesused, cb, arg);
+				c->frames++;
+				c->bytes += b.bytesused;
+			}
+			if (xioctl(c->fd, VIDIOC_QBUF, &b) < 0) return -1;
+		}
+		return ret;
+	}
+
+	//frames the encoder is done with go back to the camera
+	while ((ret = dequeue(c->enc, &b, RAW_TYPE, V4L2_MEMORY_DMABUF, &plane)) > 0) {
+		c->encoding--;
+		memset(&q, 0, sizeof(q));
+		q.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		q.memory = V4L2_MEMORY_MMAP;
+		q.index = b.index;
+		if (xioctl(c->fd, VIDIOC_QBUF, &q) < 0) return -1;
+	}
+	if (ret < 0) return -1;
+
+	while ((ret = dequeue(c->enc, &b, CODED_TYPE, V4L2_MEMORY_MMAP, &plane)) > 0) {
+		if (!(b.flags & V4L2_BUF_FLAG_ERROR) && plane.bytesused > plane.data_offset) {
+			c->stamp = b.timestamp; //the encoder copies it from the raw frame
+			h264_split(c->coded[b.index].start + plane.data_offset, plane.bytesused - plane.data_offset, cb, arg);
+			c->frames++;
+			c->bytes += plane.bytesused - plane.data_offset;
+		}
+		if (xioctl(c->enc, VIDIOC_QBUF, &b) < 0) return -1;
+	}
+	if (ret < 0) return -1;
+
+	//new frames from the camera go to the encoder, the same buffer under the same index
+	while ((ret = dequeue(c->fd, &b, V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_MEMORY_MMAP, NULL)) > 0) {
+		if (c->tap && planar(c->format) && !(b.flags & V4L2_BUF_FLAG_ERROR)) tap_frame(c, c->cap[b.index].start);
+		if (c->gate && planar(c->format) && !(b.flags & V4L2_BUF_FLAG_ERROR) && !c->gate(c->cap[b.index].start, c->gate_arg)) {
+			c->skipped++;
+			if (xioctl(c->fd, VIDIOC_QBUF, &b) < 0) return -1;
+			continue;
+		}
+		memset(&q, 0, sizeof(q));
+		memset(&qplane, 0, sizeof(qplane));
+		q.type = RAW_TYPE;
+		q.memory = V4L2_MEMORY_DMABUF;
+		q.index = b.index;
+		q.m.planes = &qplane;
+		q.length = 1;
+		q.timestamp = b.timestamp;
+		qplane.m.fd = c->cap[b.index].dmabuf;
+		qplane.bytesused = b.bytesused;
+		qplane.length = c->cap[b.index].length;
+		if (xioctl(c->enc, VIDIOC_QBUF, &q) < 0) return -1;
+		c->encoding++;
+	}
+	return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef VCAP_H
+#define VCAP_H
+
+#include <sys/select.h>
+
+#include "h264.h"
+
+#define VCAP_BUFFERS 4 //per queue
+#define VCAP_CODED_SIZE 1024*1024 //encoder output buffer, holds one access unit
+
+//A V4L2 buffer we mapped
+struct vcap_buf {
+	unsigned char *start;
+	unsigned int length;
+	int dmabuf; //exported for the encoder, -1 if not
+};
+
+//Captures H.264 from a V4L2 device without copies: either the device encodes itself (a UVC H.264
+//camera, v4l2loopback fed an H.264 stream) and its mmap'd buffers are parsed in place, or it gives
+//raw frames that go to a memory-to-memory encoder (the Pi's /dev/video11) as DMABUFs
+struct vcap {
+	int fd; //capture device
+	int enc; //encoder, -1 if the device gives H.264
+	unsigned int format; //of the capture device
+	int width, height;
+	unsigned int stride; //bytes per row of the raw frames
+	struct vcap_buf cap[VCAP_BUFFERS], coded[VCAP_BUFFERS];
+	int ncap, ncoded;
+	int encoding; //raw frames queued on the encoder
+	unsigned long frames, bytes;
+	int monotonic; //the camera stamps its frames with CLOCK_MONOTONIC
+	struct timeval stamp; //capture time of the frame being split, if it's monotonic
+
+	//sees the luma plane of each raw frame before it's encoded, frames it returns 0 for are skipped
+	int (*gate)(const unsigned char *luma, void *arg);
+	void *gate_arg;
+	unsigned long skipped;
+
+	//sees the planes of the next raw frame once, cleared before it's called; u and v are cstep apart per pixel
+	void (*tap)(const unsigned char *y, const unsigned char *u, const unsigned char *v, int ystride, int cstride, int cstep, void *arg);
+	void *tap_arg;
+};
+
+//Opens and starts dev, with enc as the encoder if it's not NULL. Returns -1 on failure, with a message.
+int vcap_open(struct vcap *c, const char *dev, const char *enc, int width, int height, int fps, int bitrate, int gop, int slices);
+void vcap_close(struct vcap *c);
+
+//Changes the encoder's target bitrate while it runs
+void vcap_set_bitrate(struct vcap *c, int bitrate);
+
+//The next frame the encoder gets is coded as an IDR
+void vcap_force_keyframe(struct vcap *c);
+
+//Adds the devices to the sets
+void vcap_fds(struct vcap *c, fd_set *readfds, fd_set *writefds, int *max_fd);
+
+//Takes whatever buffers are ready and emits their NALs; returns -1 if the device failed
+int vcap_handle(struct vcap *c, nal_cb cb, void *arg);
+
+#endif